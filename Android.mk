@@ -41,8 +41,21 @@ endif
 
 LOCAL_CFLAGS += -DDEBUGLEVEL_$(CFG_TEE_CLIENT_LOG_LEVEL)
 LOCAL_CFLAGS += -DBINARY_PREFIX=\"TEEC\"
+LOCAL_CFLAGS += -DTEEC_FREC_DIR=\"$(CFG_TEE_FLIGHT_REC_DIR)\"
+LOCAL_CFLAGS += -DTEEC_SHM_HUGE_THRESHOLD=$(CFG_TEE_SHM_HUGE_THRESHOLD)
+
+ifeq ($(CFG_TEE_CLIENT_LOG_ASYNC),y)
+LOCAL_CFLAGS += -DCFG_TEE_CLIENT_LOG_ASYNC
+endif
+
+ifeq ($(CFG_SEL4_CORR_ID),y)
+LOCAL_CFLAGS += -DCFG_SEL4_CORR_ID
+endif
 
 LOCAL_SRC_FILES := libteec/src/tee_client_api.c \
+                   libteec/src/teec_broker.c \
+                   libteec/src/teec_flight_rec.c \
+                   libteec/src/teec_io.c \
                    libteec/src/teec_trace.c
 ifeq ($(CFG_TEE_BENCHMARK),y)
 LOCAL_CFLAGS += -DCFG_TEE_BENCHMARK
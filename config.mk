@@ -29,6 +29,32 @@ CFG_TEE_FS_PARENT_PATH ?= /data/tee
 #   The location of the client log file when logging to file is enabled.
 CFG_TEE_CLIENT_LOG_FILE ?= $(CFG_TEE_FS_PARENT_PATH)/teec.log
 
+# CFG_TEE_CLIENT_LOG_ASYNC
+#   Enable (y) or disable (n) writing log messages from a background thread
+#   so that logging never blocks the caller. Messages are dropped, and the
+#   number of dropped messages reported, if a thread logs faster than the
+#   writer can keep up.
+CFG_TEE_CLIENT_LOG_ASYNC ?= y
+
+# CFG_TEE_FLIGHT_REC_DIR
+#   Where the private directory holding the per-process flight recorder
+#   rings and their SIGUSR2 dumps is created when XDG_RUNTIME_DIR isn't set.
+#   Recording is only enabled by setting TEEC_FLIGHT_REC in the environment.
+CFG_TEE_FLIGHT_REC_DIR ?= /tmp
+
+# CFG_TEE_SHM_HUGE_THRESHOLD
+#   Shared memory allocations of at least this many bytes are backed by huge
+#   pages and prefaulted, 0 disables it. Can be overridden at runtime with
+#   the TEEC_SHM_HUGE_THRESHOLD environment variable.
+CFG_TEE_SHM_HUGE_THRESHOLD ?= 2097152
+
+# CFG_SEL4_CORR_ID
+#   Enable (y) or disable (n) appending the correlation ID of each client
+#   call to the serialized seL4 frames, for the TEE to pass on with the
+#   tee-supplicant RPCs it makes for that call. Needs a TEE which accepts
+#   the extra parameter.
+CFG_SEL4_CORR_ID ?= n
+
 # CFG_TEE_CLIENT_LOAD_PATH
 #   The location of the client library file.
 CFG_TEE_CLIENT_LOAD_PATH ?= /lib
@@ -41,6 +67,17 @@ CFG_TEE_SUPP_PLUGINS ?= y
 #   The location of the user plugins
 CFG_TEE_PLUGIN_LOAD_PATH ?= /usr/lib/tee-supplicant/plugins/
 
+# CFG_TEE_SUPP_IO_URING
+#   Do secure storage reads and writes of tee-supplicant through
+#   io_uring, completing the RPCs asynchronously. Needs Linux 5.6 or
+#   later, the supplicant falls back to synchronous I/O otherwise.
+CFG_TEE_SUPP_IO_URING ?= n
+
+# CFG_TEE_SUPP_READDIR_BATCH
+#   Serve OPTEE_MRF_READDIR_BATCH, listing a directory in one RPC. Upstream
+#   OP-TEE OS doesn't send it, enable only with an OP-TEE OS that does.
+CFG_TEE_SUPP_READDIR_BATCH ?= n
+
 # CFG_TA_TEST_PATH
 #   Enable the tee test path.  When enabled, the supplicant will try
 #   loading from a debug path before the regular path.  This allows test
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <tee_client_api.h>
+#include <tee_client_api_extensions.h>
 #include <teec_trace.h>
 #include <unistd.h>
 
@@ -114,6 +115,14 @@ void ckteec_free_shm(TEEC_SharedMemory *shm)
 	free(shm);
 }
 
+size_t ckteec_output_size_hint(unsigned long cmd, unsigned int idx)
+{
+	if (!ta_ctx.initiated)
+		return 0;
+
+	return TEEC_GetOutputSizeHint(&ta_ctx.session, (uint32_t)cmd, idx);
+}
+
 static bool is_output_shm(TEEC_SharedMemory *shm)
 {
 	return shm && (shm->flags & TEEC_MEM_OUTPUT);
@@ -129,6 +138,7 @@ CK_RV ckteec_invoke_ta(unsigned long cmd, TEEC_SharedMemory *ctrl,
 	uint32_t origin = 0;
 	TEEC_Result res = TEEC_ERROR_GENERIC;
 	uint32_t ta_rc = PKCS11_CKR_GENERAL_ERROR;
+	uint64_t corr_prev = 0;
 
 	if ((is_output_shm(io2) && !out2_size) ||
 	    (is_output_shm(io3) && !out3_size))
@@ -170,9 +180,15 @@ CK_RV ckteec_invoke_ta(unsigned long cmd, TEEC_SharedMemory *ctrl,
 		op.params[3].memref.parent = io3;
 	}
 
+	corr_prev = teec_corr_enter();
+	FREC(CK_INVOKE_ENTRY, command, 0, 0);
+
 	res = TEEC_InvokeCommand(&ta_ctx.session, command, &op, &origin);
 	IMSG("res: 0x%x", res);
 
+	FREC(CK_INVOKE_EXIT, command, res, origin);
+	teec_corr_leave(corr_prev);
+
 	switch (res) {
 	case TEEC_SUCCESS:
 		/* Get PKCS11 TA return value from ctrl buffer */
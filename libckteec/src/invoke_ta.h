@@ -62,6 +62,16 @@ CK_RV ckteec_invoke_ta(unsigned long cmd, TEEC_SharedMemory *ctrl,
 		       TEEC_SharedMemory *io2, size_t *out2_size,
 		       TEEC_SharedMemory *io3, size_t *out3_size);
 
+/**
+ * ckteec_output_size_hint - Size last returned in an output buffer of a command
+ *
+ * @cmd - PKCS11 TA command ID
+ * @idx - Index of the memory buffer argument, 2 for @io2 or 3 for @io3
+ *
+ * Return the size in bytes or 0 if unknown or if size hints are disabled
+ */
+size_t ckteec_output_size_hint(unsigned long cmd, unsigned int idx);
+
 static inline CK_RV ckteec_invoke_ctrl(unsigned long cmd,
 				       TEEC_SharedMemory *ctrl)
 {
@@ -6,6 +6,8 @@
 #include <ck_debug.h>
 #include <pkcs11.h>
 #include <pkcs11_ta.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -269,6 +271,113 @@ out:
 	return rv;
 }
 
+/*
+ * C_GetMechanismList() is usually called twice, first without a list to get
+ * the number of mechanisms and then with a list of that size. When the size
+ * is known from an earlier call, the first call fetches the whole list and
+ * keeps it for the second one, which then doesn't need to invoke the TA.
+ * The list is kept for a slot and the token in it: C_InitToken() and
+ * C_Finalize() move on the token generation, which drops it.
+ */
+static pthread_mutex_t mecha_ids_mu = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int mecha_ids_token_gen;
+static struct {
+	bool valid;
+	uint32_t slot_id;
+	unsigned int token_gen;
+	size_t count;
+	uint32_t *ids;
+} mecha_ids_memo;
+
+static unsigned int mecha_ids_token(void)
+{
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&mecha_ids_mu);
+	gen = mecha_ids_token_gen;
+	pthread_mutex_unlock(&mecha_ids_mu);
+
+	return gen;
+}
+
+/* Drops the kept list, also one being fetched from the TA now */
+static void mecha_ids_memo_drop(void)
+{
+	pthread_mutex_lock(&mecha_ids_mu);
+	mecha_ids_token_gen++;
+	free(mecha_ids_memo.ids);
+	memset(&mecha_ids_memo, 0, sizeof(mecha_ids_memo));
+	pthread_mutex_unlock(&mecha_ids_mu);
+}
+
+/* @token_gen is the generation read before the TA was asked for @ids */
+static void mecha_ids_memo_put(uint32_t slot_id, unsigned int token_gen,
+			       const uint32_t *ids, size_t count)
+{
+	uint32_t *copy = malloc(count * sizeof(*ids));
+
+	if (!copy)
+		return;
+	memcpy(copy, ids, count * sizeof(*ids));
+
+	pthread_mutex_lock(&mecha_ids_mu);
+	if (token_gen != mecha_ids_token_gen) {
+		pthread_mutex_unlock(&mecha_ids_mu);
+		free(copy);
+		return;
+	}
+	free(mecha_ids_memo.ids);
+	mecha_ids_memo.ids = copy;
+	mecha_ids_memo.count = count;
+	mecha_ids_memo.slot_id = slot_id;
+	mecha_ids_memo.token_gen = token_gen;
+	mecha_ids_memo.valid = true;
+	pthread_mutex_unlock(&mecha_ids_mu);
+}
+
+static bool mecha_ids_memo_take(uint32_t slot_id,
+				CK_MECHANISM_TYPE_PTR mechanisms,
+				CK_ULONG_PTR count, CK_RV *rv)
+{
+	bool found = false;
+	size_t n = 0;
+
+	pthread_mutex_lock(&mecha_ids_mu);
+
+	if (!mecha_ids_memo.valid || mecha_ids_memo.slot_id != slot_id ||
+	    mecha_ids_memo.token_gen != mecha_ids_token_gen)
+		goto out;
+
+	found = true;
+
+	if (*count < mecha_ids_memo.count) {
+		*count = mecha_ids_memo.count;
+		*rv = CKR_BUFFER_TOO_SMALL;
+		goto out;
+	}
+
+	for (n = 0; n < mecha_ids_memo.count; n++)
+		mechanisms[n] = mecha_ids_memo.ids[n];
+	*count = mecha_ids_memo.count;
+	*rv = CKR_OK;
+
+	/* Served once, the next query goes to the TA again */
+	free(mecha_ids_memo.ids);
+	memset(&mecha_ids_memo, 0, sizeof(mecha_ids_memo));
+out:
+	pthread_mutex_unlock(&mecha_ids_mu);
+
+	return found;
+}
+
+/**
+ * ck_token_forget - Drop what is kept of the tokens, on C_Finalize
+ */
+void ck_token_forget(void)
+{
+	mecha_ids_memo_drop();
+}
+
 /**
  * ck_token_mechanism_ids - Wrap C_GetMechanismList
  */
@@ -281,6 +390,7 @@ CK_RV ck_token_mechanism_ids(CK_SLOT_ID slot,
 	TEEC_SharedMemory *out = NULL;
 	uint32_t slot_id = slot;
 	uint32_t *mecha_ids = NULL;
+	unsigned int token_gen = 0;
 	size_t out_size = 0;
 	size_t n = 0;
 
@@ -291,8 +401,14 @@ CK_RV ck_token_mechanism_ids(CK_SLOT_ID slot,
 	 * As per spec, if @mechanism is NULL, "The contents of *pulCount on
 	 * entry to C_GetMechanismList has no meaning in this case (...)"
 	 */
-	if (mechanisms)
+	if (mechanisms) {
+		if (mecha_ids_memo_take(slot_id, mechanisms, count, &rv))
+			return rv;
 		out_size = *count * sizeof(*mecha_ids);
+	} else {
+		out_size = ckteec_output_size_hint(PKCS11_CMD_MECHANISM_IDS, 2);
+		token_gen = mecha_ids_token();
+	}
 
 	ctrl = ckteec_alloc_shm(sizeof(slot_id), CKTEEC_SHM_INOUT);
 	if (!ctrl) {
@@ -313,6 +429,9 @@ CK_RV ck_token_mechanism_ids(CK_SLOT_ID slot,
 	if (rv == CKR_OK || rv == CKR_BUFFER_TOO_SMALL)
 		*count = out_size / sizeof(*mecha_ids);
 
+	if (!mechanisms && rv == CKR_OK && *count)
+		mecha_ids_memo_put(slot_id, token_gen, out->buffer, *count);
+
 	if (!mechanisms && rv == CKR_BUFFER_TOO_SMALL)
 		rv = CKR_OK;
 	if (!mechanisms || rv)
@@ -600,6 +719,9 @@ CK_RV ck_init_token(CK_SLOT_ID slot, CK_UTF8CHAR_PTR pin,
 
 	ckteec_free_shm(ctrl);
 
+	/* The token in the slot may be a different one now */
+	mecha_ids_memo_drop();
+
 	return rv;
 }
 
@@ -0,0 +1,222 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "sel4_copy.h"
+
+/*
+ * Default threshold per architecture, see get_nt_threshold(). On x86_64
+ * non-temporal stores win from about the L2 size, measured with
+ * tests/sel4_copy_bench. The aarch64 kernel hasn't been measured yet so it
+ * is only used when TEEC_NT_COPY_THRESHOLD asks for it.
+ */
+#if defined(__x86_64__)
+#define NT_COPY_THRESHOLD_DEFAULT   (1024 * 1024)
+#define NT_COPY_THRESHOLD_FROM_L2   1
+#else
+#define NT_COPY_THRESHOLD_DEFAULT   (SIZE_MAX - 1)
+#define NT_COPY_THRESHOLD_FROM_L2   0
+#endif
+
+/* The kernels need room to align the destination */
+#define NT_COPY_MIN_LEN             256
+
+typedef void (*copy_fn)(void *dst, const void *src, size_t len);
+
+static size_t nt_threshold = SIZE_MAX;
+static copy_fn nt_copy;
+
+#if defined(__x86_64__)
+/*
+ * The destination is aligned with a regular copy of the head, then
+ * streamed. The tail is copied regularly too. sfence orders the
+ * streaming stores before whatever publishes the buffer.
+ */
+static void nt_copy_sse2(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t head = -(uintptr_t)d & 15;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 64; len -= 64, d += 64, s += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(const void *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(const void *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(const void *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(const void *)(s + 48));
+
+        _mm_stream_si128((__m128i *)(void *)d, a);
+        _mm_stream_si128((__m128i *)(void *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(void *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(void *)(d + 48), e);
+    }
+
+    _mm_sfence();
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx2")))
+static void nt_copy_avx2(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t head = -(uintptr_t)d & 31;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 128; len -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(const void *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(const void *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(const void *)(s + 96));
+
+        _mm256_stream_si256((__m256i *)(void *)d, a);
+        _mm256_stream_si256((__m256i *)(void *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(void *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(void *)(d + 96), e);
+    }
+
+    _mm_sfence();
+    _mm256_zeroupper();
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f")))
+static void nt_copy_avx512(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t head = -(uintptr_t)d & 63;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 128; len -= 128, d += 128, s += 128) {
+        __m512i a = _mm512_loadu_si512((const void *)s);
+        __m512i b = _mm512_loadu_si512((const void *)(s + 64));
+
+        _mm512_stream_si512((void *)d, a);
+        _mm512_stream_si512((void *)(d + 64), b);
+    }
+
+    _mm_sfence();
+    _mm256_zeroupper();
+    memcpy(d, s, len);
+}
+
+static copy_fn select_nt_copy(void)
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        return nt_copy_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return nt_copy_avx2;
+    return nt_copy_sse2;
+}
+#elif defined(__aarch64__)
+/*
+ * NEON loads paired with STNP, the non-temporal store pair hint. The
+ * final barrier orders the stores before whatever publishes the buffer.
+ */
+static void nt_copy_neon(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t head = -(uintptr_t)d & 15;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 64; len -= 64, d += 64, s += 64) {
+        asm volatile("ldp q0, q1, [%1]\n\t"
+                     "ldp q2, q3, [%1, #32]\n\t"
+                     "stnp q0, q1, [%0]\n\t"
+                     "stnp q2, q3, [%0, #32]"
+                     : : "r"(d), "r"(s)
+                     : "v0", "v1", "v2", "v3", "memory");
+    }
+
+    asm volatile("dmb ishst" : : : "memory");
+    memcpy(d, s, len);
+}
+
+static copy_fn select_nt_copy(void)
+{
+    return nt_copy_neon;
+}
+#else
+static copy_fn select_nt_copy(void)
+{
+    return NULL;
+}
+#endif
+
+static size_t get_nt_threshold(void)
+{
+    const char *env = getenv("TEEC_NT_COPY_THRESHOLD");
+    char *endp = NULL;
+    long l2 = 0;
+    size_t t = 0;
+
+    if (env) {
+        t = strtoull(env, &endp, 0);
+        if (endp != env && !*endp)
+            return t ? t : SIZE_MAX - 1;
+    }
+
+#if NT_COPY_THRESHOLD_FROM_L2 && defined(_SC_LEVEL2_CACHE_SIZE)
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (l2 <= 0)
+        return NT_COPY_THRESHOLD_DEFAULT;
+
+    return l2;
+}
+
+static void copy_init(void)
+{
+    __atomic_store_n(&nt_copy, select_nt_copy(), __ATOMIC_RELAXED);
+    __atomic_store_n(&nt_threshold, get_nt_threshold(), __ATOMIC_RELEASE);
+}
+
+void sel4_copy(void *dst, const void *src, size_t len)
+{
+    size_t threshold = __atomic_load_n(&nt_threshold, __ATOMIC_ACQUIRE);
+    copy_fn fn = NULL;
+
+    /* Racing initializers compute the same values */
+    if (threshold == SIZE_MAX) {
+        copy_init();
+        threshold = nt_threshold;
+    }
+
+    fn = __atomic_load_n(&nt_copy, __ATOMIC_RELAXED);
+    if (len < threshold || len < NT_COPY_MIN_LEN || !fn) {
+        memcpy(dst, src, len);
+        return;
+    }
+
+    fn(dst, src, len);
+}
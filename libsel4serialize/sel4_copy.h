@@ -0,0 +1,25 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef _SEL4_COPY_H_
+#define _SEL4_COPY_H_
+
+#include <stddef.h>
+
+/*
+ * sel4_copy() - Copy parameter payload into a frame
+ *
+ * Small copies are plain memcpy(). Copies larger than the last level
+ * private cache use non-temporal stores so that marshaling a multi-MB
+ * payload doesn't evict the working set of the caller. Only use it for
+ * destinations which aren't read back soon, the frame sent to the TEE,
+ * not output buffers of the application. The kernel is selected once at
+ * runtime from the CPU features. TEEC_NT_COPY_THRESHOLD in the environment
+ * overrides the threshold of the architecture, 0 disables non-temporal
+ * copies.
+ */
+void sel4_copy(void *dst, const void *src, size_t len);
+
+#endif  /* _SEL4_COPY_H_ */
@@ -29,6 +29,7 @@
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+#include "sel4_copy.h"
 #include "sel4_serializer.h"
 
 /* From OPTEE OS */
@@ -78,6 +79,10 @@ static TEEC_Result allocate_serialize_buf(TEEC_Operation *operation,
         }
     }
 
+#ifdef CFG_SEL4_CORR_ID
+    len += sizeof(struct serialized_param) + sizeof(uint64_t);
+#endif
+
     buf = calloc(1, len);
     if (!buf) {
         EMSG("out of memory");
@@ -104,7 +109,7 @@ static void serialize_tmpref(TEEC_TempMemoryReference *tmpref,
         return;
     }
 
-    memcpy(param->value, tmpref->buffer, param->val_len);
+    sel4_copy(param->value, tmpref->buffer, param->val_len);
 
     HEXDUMP("", param->value, param->val_len);
 }
@@ -143,7 +148,7 @@ serialize_memref_whole(TEEC_RegisteredMemoryReference *memref,
         return TEEC_SUCCESS;
     }
 
-    memcpy(param->value, memref->parent->buffer, param->val_len);
+    sel4_copy(param->value, memref->parent->buffer, param->val_len);
 
     HEXDUMP("", param->value, param->val_len);
 
@@ -153,6 +158,7 @@ serialize_memref_whole(TEEC_RegisteredMemoryReference *memref,
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-align"
 TEEC_Result sel4_serialize_params(TEEC_Operation *operation,
+                                  uint64_t corr_id,
                                   struct serialized_param **param_buf,
                                   uint32_t *param_buf_len)
 {
@@ -235,6 +241,14 @@ TEEC_Result sel4_serialize_params(TEEC_Operation *operation,
         param = (struct serialized_param *)(param->value + param->val_len);
     };
 
+#ifdef CFG_SEL4_CORR_ID
+    param->param_type = SEL4_PARAM_TYPE_CORR_ID;
+    param->val_len = sizeof(corr_id);
+    memcpy(param->value, &corr_id, sizeof(corr_id));
+#else
+    (void)corr_id;
+#endif
+
     *param_buf = (struct serialized_param *)buf;
     *param_buf_len = len;
 
@@ -278,6 +292,7 @@ static TEEC_Result deserialize_tmpref(uint32_t param_type,
         return TEEC_SUCCESS;
     }
 
+    /* The application reads its output right away, keep it cached */
     memcpy(teec_param->tmpref.buffer,
            param->value,
            MIN(tmpref_size, param->val_len));
@@ -324,6 +339,7 @@ static TEEC_Result deserialize_memref(TEEC_Parameter *teec_param,
         return TEEC_SUCCESS;
     }
 
+    /* The application reads its output right away, keep it cached */
     memcpy(teec_param->memref.parent->buffer,
            param->value,
            MIN(teec_param->memref.parent->size, teec_param->memref.size));
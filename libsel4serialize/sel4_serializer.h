@@ -14,7 +14,19 @@
 #define CTX_TA_FD          5
 #define TA_SESSION_ID   0x81
 
-TEEC_Result sel4_serialize_params(TEEC_Operation *operation, struct serialized_param **param_buf, uint32_t *param_buf_len);
+/*
+ * With CFG_SEL4_CORR_ID the frame is terminated by one extra parameter of
+ * this type after the TEEC_CONFIG_PAYLOAD_REF_COUNT regular ones. Its value
+ * is the 64-bit correlation ID of the client call, which the TEE forwards
+ * with the RPC requests it makes on behalf of that call.
+ */
+#define SEL4_PARAM_TYPE_CORR_ID 0x100
+
+/*
+ * @corr_id is the correlation ID of the client call the frame belongs to,
+ * 0 if none. It's only sent with CFG_SEL4_CORR_ID.
+ */
+TEEC_Result sel4_serialize_params(TEEC_Operation *operation, uint64_t corr_id, struct serialized_param **param_buf, uint32_t *param_buf_len);
 TEEC_Result sel4_deserialize_params(TEEC_Operation *operation, struct serialized_param *param_buf, uint32_t param_buf_len);
 
 #endif  /* _SEL4_SERIALIZER_H_ */
\ No newline at end of file
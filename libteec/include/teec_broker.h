@@ -0,0 +1,80 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef __TEEC_BROKER_H
+#define __TEEC_BROKER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "teec_io.h"
+
+/*
+ * Protocol between libteec and tee-broker
+ *
+ * A client connects to the broker's SOCK_SEQPACKET unix socket and sends
+ * a HELLO. The reply passes a memfd with the client's mailbox: slot slots
+ * of len bytes each. A request frame is written to a free slot and
+ * announced with a message naming the slot, the response frame comes
+ * back in the same slot. A frame that doesn't fit a slot travels in a
+ * memfd passed with the message instead (TEEC_BROKER_FLAG_FD). Each
+ * request gets exactly one reply, in any order. An open names the TA's
+ * UUID, which the frame doesn't carry, for the broker to decide whether
+ * the session may be kept open for reuse.
+ */
+#define TEEC_BROKER_VERSION	2
+#define TEEC_BROKER_UUID_LEN	16
+#define TEEC_BROKER_MAX_SLOTS	64
+
+/* A descriptor is passed with the message */
+#define TEEC_BROKER_FLAG_FD	(1 << 0)
+
+enum teec_broker_op {
+	TEEC_BROKER_HELLO,
+	TEEC_BROKER_OPEN_SESSION,
+	TEEC_BROKER_CLOSE_SESSION,
+	TEEC_BROKER_INVOKE,
+};
+
+struct teec_broker_msg {
+	uint32_t op;		/* enum teec_broker_op */
+	uint32_t slot;		/* HELLO reply: number of slots */
+	uint32_t session;	/* broker session handle */
+	uint32_t cmd_id;	/* HELLO: TEEC_BROKER_VERSION */
+	uint32_t len;		/* frame length, HELLO reply: slot size */
+	uint32_t flags;
+	int32_t ret;		/* transport result, negative errno */
+	int32_t tee_err;
+	uint32_t ta_err;
+	uint8_t uuid[TEEC_BROKER_UUID_LEN];	/* OPEN_SESSION: TA, octets */
+};
+
+/*
+ * teec_broker_connect() - Connects to the broker listening on @path
+ *
+ * Returns the connection's descriptor, to be used as a channel with
+ * teec_io_call(), or -1 on failure.
+ */
+int teec_broker_connect(const char *path);
+
+/* Closes broker connection @fd, no calls may be in progress */
+void teec_broker_disconnect(int fd);
+
+/* Returns true if @fd is a connection to the broker */
+bool teec_broker_owns(int fd);
+
+/*
+ * teec_broker_call() - Passes a frame to the TEE through the broker
+ *
+ * Arguments are those of teec_io_call(). @session is the broker's
+ * session handle, returned by TEEC_IO_OPEN_SESSION. @uuid, the UUID of the
+ * TA in octets, is passed with TEEC_IO_OPEN_SESSION and may be NULL for
+ * the other ops.
+ */
+int teec_broker_call(int fd, enum teec_io_op op, const uint8_t *uuid,
+		     uint32_t *session, uint32_t cmd_id, char **buf,
+		     uint32_t *len, int32_t *tee_err, uint32_t *ta_err);
+
+#endif /* __TEEC_BROKER_H */
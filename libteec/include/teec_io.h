@@ -0,0 +1,93 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef __TEEC_IO_H
+#define __TEEC_IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum teec_io_op {
+	TEEC_IO_OPEN_SESSION,
+	TEEC_IO_CLOSE_SESSION,
+	TEEC_IO_INVOKE,
+};
+
+/*
+ * teec_io_call() - Passes a serialized frame to the TEE and waits for the
+ * response
+ *
+ * If @fd is a broker connection the frame is passed to the broker. If the
+ * channel @fd has an I/O thread the request is queued to it, otherwise
+ * the transport is called directly from the calling thread. @session is
+ * only used by the broker, which returns its session handle there on
+ * TEEC_IO_OPEN_SESSION. Other arguments and the return value are those of
+ * the sel4_optee_*() calls.
+ */
+int teec_io_call(int fd, enum teec_io_op op, uint32_t *session,
+		 uint32_t cmd_id, char **buf, uint32_t *len, int32_t *tee_err,
+		 uint32_t *ta_err);
+
+/*
+ * teec_io_open_session() - teec_io_call() of TEEC_IO_OPEN_SESSION with the
+ * UUID of the TA in octets, @uuid
+ *
+ * Only the broker is passed the UUID, the transport doesn't take one.
+ */
+int teec_io_open_session(int fd, const uint8_t *uuid, uint32_t *session,
+			 char **buf, uint32_t *len, int32_t *tee_err,
+			 uint32_t *ta_err);
+
+/*
+ * teec_io_start() - Starts the I/O thread of channel @fd if enabled with
+ * TEEC_IO_THREAD=1 or TEEC_BUSY_POLL_US in the environment
+ *
+ * Failing to start the thread isn't fatal, the channel is then used
+ * directly.
+ */
+void teec_io_start(int fd);
+
+/* Stops the I/O thread of channel @fd, no calls may be in progress */
+void teec_io_stop(int fd);
+
+/*
+ * teec_io_channels_open() - Opens additional channels for the context
+ * channel @fd if TEEC_CHANNELS=<n> is set in the environment
+ *
+ * Each channel gets its own I/O thread if those are enabled. Having fewer
+ * channels than requested isn't fatal.
+ */
+void teec_io_channels_open(int fd);
+
+/* Closes the additional channels of context channel @fd */
+void teec_io_channels_close(int fd);
+
+/*
+ * teec_io_channel_get() - Binds @session to a channel of the context
+ * channel @fd
+ *
+ * Without a channel group every session uses @fd itself. With one, the
+ * session gets a channel no other session uses, or -1 is returned if they
+ * are all taken. The binding must be released with teec_io_channel_put()
+ * when the session closes.
+ */
+int teec_io_channel_get(int fd, const void *session);
+
+/*
+ * Returns the channel @session is bound to, @fd without a channel group,
+ * -1 if it isn't bound
+ */
+int teec_io_channel_of(int fd, const void *session);
+
+/* Returns true if @session is bound to a channel no other session uses */
+bool teec_io_channel_exclusive(int fd, const void *session);
+
+/* Rebinds the channel of @from to @to, which may be any unique pointer */
+void teec_io_channel_move(int fd, const void *from, const void *to);
+
+/* Releases the binding made by teec_io_channel_get() */
+void teec_io_channel_put(int fd, const void *session);
+
+#endif /* __TEEC_IO_H */
@@ -36,19 +36,29 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
 #include <tee_client_api_extensions.h>
 #include <tee_client_api.h>
 #include <teec_trace.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef __aligned
 #define __aligned(x) __attribute__((__aligned__(x)))
 #endif
+#include <linux/dma-buf.h>
+#include <linux/magic.h>
 #include <linux/tee.h>
 
+#ifndef DMA_BUF_MAGIC
+#define DMA_BUF_MAGIC		0x444d4142	/* "DMAB" */
+#endif
+
 #define UNUSED       __attribute__((__unused__))
 
 #include "teec_benchmark.h"
+#include "teec_broker.h"
+#include "teec_io.h"
 
 #include "sel4_serializer.h"
 #include "sel4_req.h"
@@ -68,6 +78,21 @@
  */
 #define SHM_FLAG_BUFFER_ALLOCED		(1u << 0)
 #define SHM_FLAG_SHADOW_BUFFER_ALLOCED	(1u << 1)
+#define SHM_FLAG_BUFFER_MAPPED		(1u << 2)
+#define SHM_FLAG_FD_COPY		(1u << 3)
+#define SHM_FLAG_DMABUF			(1u << 4)
+#define SHM_FLAG_BUFFER_HUGE		(1u << 5)
+
+/*
+ * Buffers of at least this size are allocated from huge pages, see
+ * shm_alloc_huge(). TEEC_SHM_HUGE_THRESHOLD in the environment overrides
+ * it, 0 disables huge page allocations.
+ */
+#ifndef TEEC_SHM_HUGE_THRESHOLD
+#define TEEC_SHM_HUGE_THRESHOLD		(2 * 1024 * 1024)
+#endif
+
+#define HUGE_PAGE_SIZE_DEFAULT		(2 * 1024 * 1024)
 
 static pthread_mutex_t teec_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -81,6 +106,474 @@ static void teec_mutex_unlock(pthread_mutex_t *mu)
 	pthread_mutex_unlock(mu);
 }
 
+/*
+ * Output size hints
+ *
+ * With TEEC_SIZE_HINTS=1 in the environment the size returned in each
+ * output memref of an invoke is remembered per (session, command, param
+ * index), see TEEC_GetOutputSizeHint(). The table is direct mapped, a
+ * colliding entry simply replaces the older one.
+ */
+#define SIZE_HINT_SLOTS		256	/* must be a power of two */
+
+struct size_hint {
+	const TEEC_Session *session;
+	uint32_t cmd_id;
+	uint32_t idx;
+	size_t size;
+};
+
+static pthread_mutex_t size_hint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct size_hint size_hints[SIZE_HINT_SLOTS];
+
+static bool size_hints_enabled(void)
+{
+	static int enabled = -1;
+	const char *env = NULL;
+	int e = __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+
+	if (e < 0) {
+		env = getenv("TEEC_SIZE_HINTS");
+		e = env && !strcmp(env, "1");
+		__atomic_store_n(&enabled, e, __ATOMIC_RELAXED);
+	}
+
+	return e;
+}
+
+static struct size_hint *size_hint_slot(const TEEC_Session *session,
+					uint32_t cmd_id, uint32_t idx)
+{
+	uintptr_t h = (uintptr_t)session >> 4;
+
+	h = (h ^ cmd_id) * 0x9e3779b1u;
+	h ^= idx;
+
+	return size_hints + (h & (SIZE_HINT_SLOTS - 1));
+}
+
+static void size_hint_update(const TEEC_Session *session, uint32_t cmd_id,
+			     TEEC_Operation *operation)
+{
+	struct size_hint *hint = NULL;
+	TEEC_Parameter *param = NULL;
+	size_t size = 0;
+	uint32_t n = 0;
+
+	if (!operation || !size_hints_enabled())
+		return;
+
+	teec_mutex_lock(&size_hint_mutex);
+
+	for (n = 0; n < TEEC_CONFIG_PAYLOAD_REF_COUNT; n++) {
+		param = operation->params + n;
+
+		switch (TEEC_PARAM_TYPE_GET(operation->paramTypes, n)) {
+		case TEEC_MEMREF_TEMP_OUTPUT:
+		case TEEC_MEMREF_TEMP_INOUT:
+			size = param->tmpref.size;
+			break;
+		case TEEC_MEMREF_WHOLE:
+			if (!param->memref.parent ||
+			    !(param->memref.parent->flags & TEEC_MEM_OUTPUT))
+				continue;
+			size = param->memref.size;
+			break;
+		default:
+			continue;
+		}
+
+		hint = size_hint_slot(session, cmd_id, n);
+		hint->session = session;
+		hint->cmd_id = cmd_id;
+		hint->idx = n;
+		hint->size = size;
+	}
+
+	teec_mutex_unlock(&size_hint_mutex);
+}
+
+static void size_hint_forget(const TEEC_Session *session)
+{
+	size_t n = 0;
+
+	if (!size_hints_enabled())
+		return;
+
+	teec_mutex_lock(&size_hint_mutex);
+
+	for (n = 0; n < SIZE_HINT_SLOTS; n++)
+		if (size_hints[n].session == session)
+			memset(size_hints + n, 0, sizeof(size_hints[n]));
+
+	teec_mutex_unlock(&size_hint_mutex);
+}
+
+/*
+ * Session cache
+ *
+ * With TEEC_SESSION_CACHE=<n> in the environment up to n sessions closed
+ * by the application are kept open in an idle pool. A later open on the
+ * same context with the same UUID, login method and connection data takes
+ * one from the pool without a round trip to the TEE. Only opens without
+ * operation parameters are cached, the TA's open entry point never sees
+ * the parameters of a reused session. Idle sessions are closed after
+ * TEEC_SESSION_CACHE_TTL seconds, checked on every open and close, and
+ * when the context is finalized.
+ *
+ * A reused session keeps whatever state the TA holds for it, a login for
+ * instance, so only the TAs listed in TEEC_SESSION_CACHE_UUIDS, separated
+ * by commas, are cached. The transport has no session handle either, a
+ * session is only cached while it has a channel of its own (TEEC_CHANNELS)
+ * so that closing it can't end another.
+ */
+#define SESSION_CACHE_SLOTS	256
+#define SESSION_CACHE_UUIDS	16
+#define SESSION_CACHE_TTL	30	/* seconds */
+
+struct cached_session {
+	TEEC_Context *ctx;		/* NULL if the slot is free */
+	const TEEC_Session *session;	/* NULL while idle */
+	TEEC_UUID uuid;
+	uint32_t login;
+	uint32_t group;
+	uint32_t session_id;
+	time_t idle_since;
+};
+
+static pthread_mutex_t session_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t session_cache_cond = PTHREAD_COND_INITIALIZER;
+static struct cached_session session_cache[SESSION_CACHE_SLOTS];
+static unsigned int session_cache_idle;
+static unsigned int session_cache_closing;	/* evicted, not closed yet */
+static int session_cache_max = -1;
+static unsigned int session_cache_ttl = SESSION_CACHE_TTL;
+static TEEC_UUID session_cache_uuids[SESSION_CACHE_UUIDS];
+static size_t session_cache_num_uuids;
+
+static unsigned long env_ulong(const char *name, unsigned long dflt)
+{
+	const char *env = getenv(name);
+	unsigned long val = 0;
+	char *endp = NULL;
+
+	if (!env)
+		return dflt;
+
+	val = strtoul(env, &endp, 0);
+	if (endp == env || *endp)
+		return dflt;
+
+	return val;
+}
+
+/* Called with session_cache_mutex held */
+static void session_cache_parse_uuids(void)
+{
+	const char *s = getenv("TEEC_SESSION_CACHE_UUIDS");
+	TEEC_UUID *u = NULL;
+	uint8_t *c = NULL;
+	int len = 0;
+
+	while (s && *s && session_cache_num_uuids < SESSION_CACHE_UUIDS) {
+		u = session_cache_uuids + session_cache_num_uuids;
+		c = u->clockSeqAndNode;
+		len = 0;
+		if (sscanf(s, "%8x-%4hx-%4hx-%2hhx%2hhx-%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%n",
+			   &u->timeLow, &u->timeMid, &u->timeHiAndVersion,
+			   c, c + 1, c + 2, c + 3, c + 4, c + 5, c + 6, c + 7,
+			   &len) != 11 || !len || (s[len] && s[len] != ',')) {
+			EMSG("bad UUID in TEEC_SESSION_CACHE_UUIDS: %s", s);
+			return;
+		}
+
+		session_cache_num_uuids++;
+		s += len;
+		if (*s == ',')
+			s++;
+	}
+}
+
+/* Called with session_cache_mutex held */
+static bool session_cache_enabled(void)
+{
+	unsigned long max = 0;
+
+	if (session_cache_max < 0) {
+		session_cache_parse_uuids();
+		max = env_ulong("TEEC_SESSION_CACHE", 0);
+		if (max > SESSION_CACHE_SLOTS)
+			max = SESSION_CACHE_SLOTS;
+		if (!session_cache_num_uuids)
+			max = 0;
+		session_cache_max = max;
+		session_cache_ttl = env_ulong("TEEC_SESSION_CACHE_TTL",
+					      SESSION_CACHE_TTL);
+	}
+
+	return session_cache_max;
+}
+
+static time_t session_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static uint32_t session_cache_group(uint32_t login, const void *data)
+{
+	uint32_t group = 0;
+
+	if ((login == TEEC_LOGIN_GROUP ||
+	     login == TEEC_LOGIN_GROUP_APPLICATION) && data)
+		memcpy(&group, data, sizeof(group));
+
+	return group;
+}
+
+static bool session_cache_cacheable(TEEC_Operation *operation)
+{
+	return !operation || !operation->paramTypes;
+}
+
+/* Called with session_cache_mutex held */
+static bool session_cache_listed(const TEEC_UUID *uuid)
+{
+	size_t n = 0;
+
+	for (n = 0; n < session_cache_num_uuids; n++)
+		if (!memcmp(session_cache_uuids + n, uuid, sizeof(*uuid)))
+			return true;
+
+	return false;
+}
+
+/* Closes an idle session taken out of the cache */
+static void session_cache_close(struct cached_session *cs)
+{
+	struct serialized_param *param_in_out = NULL;
+	uint32_t in_out_len = 0;
+	int32_t tee_err = 0;
+	uint32_t ta_err = 0;
+	int res = 0;
+
+	res = sel4_serialize_params(NULL, teec_corr_get(), &param_in_out,
+				    &in_out_len);
+	if (!res)
+		res = teec_io_call(teec_io_channel_of(cs->ctx->fd, cs),
+				   TEEC_IO_CLOSE_SESSION, &cs->session_id, 0,
+				   (char **)&param_in_out, &in_out_len,
+				   &tee_err, &ta_err);
+	if (res || tee_err || ta_err)
+		EMSG("closing cached session: %d 0x%x 0x%x", res, tee_err,
+		     ta_err);
+
+	teec_io_channel_put(cs->ctx->fd, cs);
+	free(param_in_out);
+}
+
+/*
+ * Moves idle sessions of @ctx, or of any context if NULL, that have
+ * expired or all of them if @all to @out. Called with session_cache_mutex
+ * held, returns the number moved. They are closed with
+ * session_cache_close_all(), until then their context can't be finalized.
+ */
+static size_t session_cache_evict(TEEC_Context *ctx, bool all,
+				  struct cached_session *out)
+{
+	time_t now = session_cache_now();
+	struct cached_session *cs = NULL;
+	size_t count = 0;
+	size_t n = 0;
+
+	for (n = 0; n < SESSION_CACHE_SLOTS; n++) {
+		cs = session_cache + n;
+		if (!cs->ctx || cs->session || (ctx && cs->ctx != ctx))
+			continue;
+		if (!all && now - cs->idle_since < (time_t)session_cache_ttl)
+			continue;
+
+		/* The channel goes with the copy */
+		teec_io_channel_move(cs->ctx->fd, cs, out + count);
+		out[count++] = *cs;
+		memset(cs, 0, sizeof(*cs));
+		session_cache_idle--;
+	}
+	session_cache_closing += count;
+
+	return count;
+}
+
+/* Closes @count sessions from session_cache_evict() */
+static void session_cache_close_all(struct cached_session *cs, size_t count)
+{
+	size_t n = 0;
+
+	if (!count)
+		return;
+
+	for (n = 0; n < count; n++)
+		session_cache_close(cs + n);
+
+	teec_mutex_lock(&session_cache_mutex);
+	session_cache_closing -= count;
+	if (!session_cache_closing)
+		pthread_cond_broadcast(&session_cache_cond);
+	teec_mutex_unlock(&session_cache_mutex);
+}
+
+static void session_cache_expire(void)
+{
+	struct cached_session expired[SESSION_CACHE_SLOTS];
+	size_t count = 0;
+
+	teec_mutex_lock(&session_cache_mutex);
+	if (session_cache_idle)
+		count = session_cache_evict(NULL, false, expired);
+	teec_mutex_unlock(&session_cache_mutex);
+
+	session_cache_close_all(expired, count);
+}
+
+/*
+ * Hands out an idle session matching the open. If there is none and the
+ * open is cacheable, returns false with the session to be opened noted
+ * in *@slot, to be passed to session_cache_opened().
+ */
+static bool session_cache_take(TEEC_Context *ctx, TEEC_Session *session,
+			       const TEEC_UUID *uuid, uint32_t login,
+			       const void *data, TEEC_Operation *operation,
+			       struct cached_session **slot)
+{
+	uint32_t group = session_cache_group(login, data);
+	struct cached_session *cs = NULL;
+	struct cached_session *free_cs = NULL;
+	size_t n = 0;
+
+	*slot = NULL;
+	if (!uuid || !session_cache_cacheable(operation))
+		return false;
+
+	teec_mutex_lock(&session_cache_mutex);
+	if (!session_cache_enabled() || !session_cache_listed(uuid)) {
+		teec_mutex_unlock(&session_cache_mutex);
+		return false;
+	}
+
+	for (n = 0; n < SESSION_CACHE_SLOTS; n++) {
+		cs = session_cache + n;
+		if (!cs->ctx) {
+			if (!free_cs)
+				free_cs = cs;
+			continue;
+		}
+		if (cs->session || cs->ctx != ctx || cs->login != login ||
+		    cs->group != group || memcmp(&cs->uuid, uuid, sizeof(*uuid)))
+			continue;
+
+		cs->session = session;
+		session_cache_idle--;
+		session->ctx = ctx;
+		session->session_id = cs->session_id;
+		teec_io_channel_move(ctx->fd, cs, session);
+		teec_mutex_unlock(&session_cache_mutex);
+		return true;
+	}
+
+	/* Without a free slot the session just isn't cached */
+	if (free_cs) {
+		free_cs->ctx = ctx;
+		free_cs->session = session;
+		free_cs->uuid = *uuid;
+		free_cs->login = login;
+		free_cs->group = group;
+		*slot = free_cs;
+	}
+
+	teec_mutex_unlock(&session_cache_mutex);
+
+	return false;
+}
+
+/* Completes or, if the open failed, cancels a slot from session_cache_take() */
+static void session_cache_opened(struct cached_session *slot,
+				 TEEC_Session *session, bool ok)
+{
+	if (!slot)
+		return;
+
+	teec_mutex_lock(&session_cache_mutex);
+	if (ok)
+		slot->session_id = session->session_id;
+	else
+		memset(slot, 0, sizeof(*slot));
+	teec_mutex_unlock(&session_cache_mutex);
+}
+
+/* Returns true if @session went to the idle pool instead of being closed */
+static bool session_cache_put(const TEEC_Session *session)
+{
+	struct cached_session *cs = NULL;
+	bool cached = false;
+	size_t n = 0;
+
+	teec_mutex_lock(&session_cache_mutex);
+	if (session_cache_max <= 0) {
+		teec_mutex_unlock(&session_cache_mutex);
+		return false;
+	}
+
+	for (n = 0; n < SESSION_CACHE_SLOTS; n++) {
+		cs = session_cache + n;
+		if (cs->ctx && cs->session == session)
+			break;
+	}
+
+	if (n < SESSION_CACHE_SLOTS) {
+		if (session_cache_idle < (unsigned int)session_cache_max &&
+		    teec_io_channel_exclusive(cs->ctx->fd, session)) {
+			teec_io_channel_move(cs->ctx->fd, session, cs);
+			cs->session = NULL;
+			cs->idle_since = session_cache_now();
+			session_cache_idle++;
+			cached = true;
+		} else {
+			memset(cs, 0, sizeof(*cs));
+		}
+	}
+	teec_mutex_unlock(&session_cache_mutex);
+
+	return cached;
+}
+
+/*
+ * Closes the idle sessions of @ctx and forgets the ones in use. Returns
+ * once sessions of @ctx evicted by other threads are closed too.
+ */
+static void session_cache_flush(TEEC_Context *ctx)
+{
+	struct cached_session idle[SESSION_CACHE_SLOTS];
+	size_t count = 0;
+	size_t n = 0;
+
+	teec_mutex_lock(&session_cache_mutex);
+	count = session_cache_evict(ctx, true, idle);
+	for (n = 0; n < SESSION_CACHE_SLOTS; n++)
+		if (session_cache[n].ctx == ctx)
+			memset(session_cache + n, 0, sizeof(session_cache[n]));
+	teec_mutex_unlock(&session_cache_mutex);
+
+	session_cache_close_all(idle, count);
+
+	/* Any context's, those of @ctx aren't told apart */
+	teec_mutex_lock(&session_cache_mutex);
+	while (session_cache_closing)
+		pthread_cond_wait(&session_cache_cond, &session_cache_mutex);
+	teec_mutex_unlock(&session_cache_mutex);
+}
+
 #if 0
 static void *teec_paged_aligned_alloc(size_t sz)
 {
@@ -191,9 +684,19 @@ DBG_ABORT();
 #endif
 TEEC_Result TEEC_InitializeContext(const char *name UNUSED, TEEC_Context *ctx)
 {
+	const char *broker = getenv("TEEC_BROKER_SOCKET");
+
 	if (!ctx)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
+	/* The broker keeps the channels, fall back to our own without it */
+	if (broker) {
+		ctx->fd = teec_broker_connect(broker);
+		if (ctx->fd >= 0)
+			return TEEC_SUCCESS;
+		IMSG("no broker at %s, using a private channel", broker);
+	}
+
 	ctx->fd = sel4_open_comm();
 
 	if (ctx->fd < 1) {
@@ -202,12 +705,24 @@ TEEC_Result TEEC_InitializeContext(const char *name UNUSED, TEEC_Context *ctx)
 		return TEEC_ERROR_COMMUNICATION;
 	}
 
+	teec_io_start(ctx->fd);
+	teec_io_channels_open(ctx->fd);
 
 	return TEEC_SUCCESS;
 }
 
 void TEEC_FinalizeContext(TEEC_Context *ctx)
 {
+	session_cache_flush(ctx);
+
+	if (teec_broker_owns(ctx->fd)) {
+		teec_broker_disconnect(ctx->fd);
+		ctx->fd = -1;
+		return;
+	}
+
+	teec_io_channels_close(ctx->fd);
+	teec_io_stop(ctx->fd);
 	sel4_close_comm(ctx->fd);
 	ctx->fd = -1;
 }
@@ -551,6 +1066,112 @@ static TEEC_Result ioctl_errno_to_res(int err)
 }
 #endif
 
+/*
+ * The frame sent to the TEE carries a copy of each memref, so a buffer
+ * registered from a file descriptor is mapped into the client and copied
+ * from there when the operation is serialized. The mapping is only used
+ * when the file can't shrink under it, which would raise SIGBUS in the
+ * library: dma-bufs have a fixed size and memfds must have been sealed
+ * with F_SEAL_SHRINK by their owner. The fd is never sealed here. Any
+ * other file is read into a private copy which is written back to the fd
+ * when the memory is released.
+ */
+static bool shm_fd_sealed(int fd)
+{
+	int seals = fcntl(fd, F_GET_SEALS);
+
+	return seals >= 0 && (seals & F_SEAL_SHRINK);
+}
+
+/*
+ * dma-bufs are files of their own pseudo file system. Anything else isn't
+ * sent DMA_BUF_IOCTL_SYNC, which another driver may take for a command of
+ * its own.
+ */
+static bool shm_fd_is_dmabuf(int fd, const struct stat *st)
+{
+	struct statfs sfs;
+
+	if (S_ISREG(st->st_mode))
+		return false;
+
+	memset(&sfs, 0, sizeof(sfs));
+	if (fstatfs(fd, &sfs))
+		return false;
+
+	return sfs.f_type == DMA_BUF_MAGIC;
+}
+
+static TEEC_Result shm_fd_copy(TEEC_SharedMemory *shm, int fd, size_t size)
+{
+	uint8_t *buf = NULL;
+	size_t done = 0;
+	ssize_t r = 0;
+
+	/* calloc returns allocated pointer even if size == 0 */
+	buf = calloc(1, size);
+	if (!buf)
+		return TEEC_ERROR_OUT_OF_MEMORY;
+
+	while (done < size) {
+		r = pread(fd, buf + done, size - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			EMSG("pread: %s", r ? strerror(errno) : "short file");
+			free(buf);
+			return TEEC_ERROR_BAD_PARAMETERS;
+		}
+		done += r;
+	}
+
+	shm->buffer = buf;
+	shm->internal.flags = SHM_FLAG_BUFFER_ALLOCED | SHM_FLAG_FD_COPY;
+
+	return TEEC_SUCCESS;
+}
+
+static void shm_fd_write_back(TEEC_SharedMemory *shm)
+{
+	const uint8_t *buf = shm->buffer;
+	size_t done = 0;
+	ssize_t r = 0;
+
+	while (done < shm->alloced_size) {
+		r = pwrite(shm->registered_fd, buf + done,
+			   shm->alloced_size - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			EMSG("pwrite: %s", r ? strerror(errno) : "no space");
+			return;
+		}
+		done += r;
+	}
+}
+
+/* Brackets CPU access to dma-buf backed memrefs of @operation */
+static void shm_fd_sync(TEEC_Operation *operation, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_RW };
+	TEEC_SharedMemory *shm = NULL;
+	uint32_t n = 0;
+
+	if (!operation)
+		return;
+
+	for (n = 0; n < TEEC_CONFIG_PAYLOAD_REF_COUNT; n++) {
+		if (TEEC_PARAM_TYPE_GET(operation->paramTypes, n) !=
+		    TEEC_MEMREF_WHOLE)
+			continue;
+
+		shm = operation->params[n].memref.parent;
+		if (shm && (shm->internal.flags & SHM_FLAG_DMABUF) &&
+		    ioctl(shm->registered_fd, DMA_BUF_IOCTL_SYNC, &sync))
+			EMSG("DMA_BUF_IOCTL_SYNC: %s", strerror(errno));
+	}
+}
+
 static void uuid_to_octets(uint8_t d[TEE_IOCTL_UUID_LEN], const TEEC_UUID *s)
 {
 	d[0] = s->timeLow >> 24;
@@ -709,15 +1330,30 @@ TEEC_Result TEEC_OpenSession(TEEC_Context *ctx, TEEC_Session *session,
 	uint32_t in_out_len = 0;
 	int32_t tee_err = 0;
 	uint32_t ta_err = 0;
+	uint64_t corr_prev = 0;
+	uint32_t session_id = 0;
+	struct cached_session *cache_slot = NULL;
+	int chan = -1;
 
 	memset(&buf, 0, sizeof(buf));
 
+	corr_prev = teec_corr_enter();
+	FREC(OPEN_SESSION_ENTRY, connection_method, 0, 0);
+
 	if (!ctx || !session) {
 		eorig = TEEC_ORIGIN_API;
 		res = TEEC_ERROR_BAD_PARAMETERS;
 		goto out;
 	}
 
+	session_cache_expire();
+	if (session_cache_take(ctx, session, destination, connection_method,
+			       connection_data, operation, &cache_slot)) {
+		eorig = TEEC_ORIGIN_TRUSTED_APP;
+		res = TEEC_SUCCESS;
+		goto out;
+	}
+
 	arg = &buf.arg;
 	arg->num_params = TEEC_CONFIG_PAYLOAD_REF_COUNT;
 
@@ -729,7 +1365,10 @@ TEEC_Result TEEC_OpenSession(TEEC_Context *ctx, TEEC_Session *session,
 	IMSG("arg->cancel_id:  %d", arg->cancel_id);
 	IMSG("arg->session:    %d", arg->session);
 
-	res = sel4_serialize_params(operation, &param_in_out, &in_out_len);
+	shm_fd_sync(operation, DMA_BUF_SYNC_START);
+	res = sel4_serialize_params(operation, teec_corr_get(),
+				    &param_in_out, &in_out_len);
+	shm_fd_sync(operation, DMA_BUF_SYNC_END);
 	if (res) {
 		EMSG("error: sel4_serialize_params: %d", res);
 		eorig = TEEC_ORIGIN_API;
@@ -737,8 +1376,19 @@ TEEC_Result TEEC_OpenSession(TEEC_Context *ctx, TEEC_Session *session,
 		goto out;
 	}
 
-	res = sel4_optee_open_session(ctx->fd, (char **)&param_in_out, &in_out_len,
-								&tee_err, &ta_err);
+	/* The session stays on this channel until closed */
+	chan = teec_io_channel_get(ctx->fd, session);
+	if (chan < 0) {
+		EMSG("no free channel for the session");
+		eorig = TEEC_ORIGIN_API;
+		res = TEEC_ERROR_BUSY;
+		goto out;
+	}
+	session_id = TA_SESSION_ID;
+
+	res = teec_io_open_session(chan, arg->uuid, &session_id,
+				   (char **)&param_in_out, &in_out_len,
+				   &tee_err, &ta_err);
 	if (res) {
 		EMSG("error: sel4_optee_open_session: %d", res);
 		eorig = TEEC_ORIGIN_COMMS;
@@ -753,7 +1403,9 @@ TEEC_Result TEEC_OpenSession(TEEC_Context *ctx, TEEC_Session *session,
 		goto out;
 	}
 
+	shm_fd_sync(operation, DMA_BUF_SYNC_START);
 	res = sel4_deserialize_params(operation, param_in_out, in_out_len);
+	shm_fd_sync(operation, DMA_BUF_SYNC_END);
 	if (res) {
 		EMSG("error: sel4_deserialize_params: %d", res);
 		eorig = TEEC_ORIGIN_COMMS;
@@ -770,16 +1422,25 @@ TEEC_Result TEEC_OpenSession(TEEC_Context *ctx, TEEC_Session *session,
 	eorig = TEEC_ORIGIN_TRUSTED_APP;
 
 	session->ctx = ctx;
-	session->session_id = TA_SESSION_ID;
+	session->session_id = session_id;
+	chan = -1;
 
 	res = ta_err;
 
 out:
+	if (chan >= 0)
+		teec_io_channel_put(ctx->fd, session);
+
+	session_cache_opened(cache_slot, session, res == TEEC_SUCCESS);
+
 	if (ret_origin)
 		*ret_origin = eorig;
 
 	free(param_in_out);
 
+	FREC(OPEN_SESSION_EXIT, res, eorig, 0);
+	teec_corr_leave(corr_prev);
+
 	return res;
 }
 
@@ -799,7 +1460,7 @@ void TEEC_CloseSession(TEEC_Session *session)
 }
 #endif
 
-void TEEC_CloseSession(TEEC_Session *session UNUSED)
+void TEEC_CloseSession(TEEC_Session *session)
 {
 	TEEC_Result res = TEEC_ERROR_GENERIC;
 
@@ -807,15 +1468,33 @@ void TEEC_CloseSession(TEEC_Session *session UNUSED)
 	uint32_t in_out_len = 0;
 	int32_t tee_err = 0;
 	uint32_t ta_err = 0;
+	uint64_t corr_prev = 0;
+	bool cached = false;
+
+	if (!session)
+		return;
 
-	res = sel4_serialize_params(NULL, &param_in_out, &in_out_len);
+	corr_prev = teec_corr_enter();
+	FREC(CLOSE_SESSION_ENTRY, 0, 0, 0);
+
+	/* Kept open for a later identical open */
+	cached = session_cache_put(session);
+	session_cache_expire();
+	if (cached) {
+		res = TEEC_SUCCESS;
+		goto out;
+	}
+
+	res = sel4_serialize_params(NULL, teec_corr_get(), &param_in_out,
+				    &in_out_len);
 	if (res) {
 		EMSG("error: sel4_serialize_params: %d", res);
 		goto out;
 	}
 
-	res = sel4_optee_close_session(session->ctx->fd, (char **)&param_in_out,
-								&in_out_len, &tee_err, &ta_err);
+	res = teec_io_call(teec_io_channel_of(session->ctx->fd, session),
+			   TEEC_IO_CLOSE_SESSION, &session->session_id, 0,
+			   (char **)&param_in_out, &in_out_len, &tee_err, &ta_err);
 	if (res) {
 		EMSG("error: sel4_optee_close_session: %d", res);
 		goto out;
@@ -834,7 +1513,14 @@ void TEEC_CloseSession(TEEC_Session *session UNUSED)
 	/* Close session does not send params so the won't be anything for deserialize */
 
 out:
+	size_hint_forget(session);
+	if (!cached)
+		teec_io_channel_put(session->ctx->fd, session);
+
 	free(param_in_out);
+
+	FREC(CLOSE_SESSION_EXIT, res, tee_err, ta_err);
+	teec_corr_leave(corr_prev);
 }
 
 #if 0
@@ -923,6 +1609,10 @@ TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t cmd_id,
 	uint32_t in_out_len = 0;
 	int32_t tee_err = 0;
 	uint32_t ta_err = 0;
+	uint64_t corr_prev = 0;
+
+	corr_prev = teec_corr_enter();
+	FREC(INVOKE_ENTRY, cmd_id, 0, 0);
 
 	if (!session) {
 		eorig = TEEC_ORIGIN_API;
@@ -939,7 +1629,10 @@ TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t cmd_id,
 		teec_mutex_unlock(&teec_mutex);
 	}
 
-	res = sel4_serialize_params(operation, &param_in_out, &in_out_len);
+	shm_fd_sync(operation, DMA_BUF_SYNC_START);
+	res = sel4_serialize_params(operation, teec_corr_get(),
+				    &param_in_out, &in_out_len);
+	shm_fd_sync(operation, DMA_BUF_SYNC_END);
 	if (res) {
 		EMSG("error: sel4_serialize_params: %d", res);
 		eorig = TEEC_ORIGIN_API;
@@ -947,8 +1640,10 @@ TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t cmd_id,
 		goto out;
 	}
 
-	res = sel4_optee_invoke_cmd(session->ctx->fd, cmd_id, (char **)&param_in_out,
-							&in_out_len, &tee_err, &ta_err);
+	res = teec_io_call(teec_io_channel_of(session->ctx->fd, session),
+			   TEEC_IO_INVOKE, &session->session_id, cmd_id,
+			   (char **)&param_in_out, &in_out_len, &tee_err,
+			   &ta_err);
 	if (res) {
 		EMSG("error: sel4_optee_invoke_cmd: %d", res);
 		eorig = TEEC_ORIGIN_COMMS;
@@ -963,7 +1658,9 @@ TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t cmd_id,
 		goto out;
 	}
 
+	shm_fd_sync(operation, DMA_BUF_SYNC_START);
 	res = sel4_deserialize_params(operation, param_in_out, in_out_len);
+	shm_fd_sync(operation, DMA_BUF_SYNC_END);
 	if (res) {
 		EMSG("error: sel4_deserialize_params: %d", res);
 		eorig = TEEC_ORIGIN_COMMS;
@@ -971,6 +1668,9 @@ TEEC_Result TEEC_InvokeCommand(TEEC_Session *session, uint32_t cmd_id,
 		goto out;
 	}
 
+	/* Output sizes are valid also when the TA reports a short buffer */
+	size_hint_update(session, cmd_id, operation);
+
 	eorig = TEEC_ORIGIN_TRUSTED_APP;
 
 	if (ta_err) {
@@ -984,6 +1684,9 @@ out:
 
 	free(param_in_out);
 
+	FREC(INVOKE_EXIT, cmd_id, res, eorig);
+	teec_corr_leave(corr_prev);
+
 	return res;
 }
 
@@ -1192,6 +1895,226 @@ TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *ctx, TEEC_SharedMemory *shm)
 }
 #endif
 
+static size_t shm_huge_threshold(void)
+{
+	static size_t threshold = SIZE_MAX;
+	size_t t = __atomic_load_n(&threshold, __ATOMIC_RELAXED);
+	const char *env = NULL;
+	char *endp = NULL;
+
+	if (t != SIZE_MAX)
+		return t;
+
+	t = TEEC_SHM_HUGE_THRESHOLD;
+	env = getenv("TEEC_SHM_HUGE_THRESHOLD");
+	if (env) {
+		t = strtoull(env, &endp, 0);
+		if (endp == env || *endp)
+			t = TEEC_SHM_HUGE_THRESHOLD;
+	}
+	if (t == SIZE_MAX)
+		t--;
+
+	__atomic_store_n(&threshold, t, __ATOMIC_RELAXED);
+	return t;
+}
+
+static size_t huge_page_size(void)
+{
+	static size_t size;
+	size_t sz = __atomic_load_n(&size, __ATOMIC_RELAXED);
+	unsigned long long v = 0;
+	FILE *f = NULL;
+
+	if (sz)
+		return sz;
+
+	sz = HUGE_PAGE_SIZE_DEFAULT;
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "re");
+	if (f) {
+		if (fscanf(f, "%llu", &v) == 1 && v && !(v & (v - 1)))
+			sz = v;
+		fclose(f);
+	}
+
+	__atomic_store_n(&size, sz, __ATOMIC_RELAXED);
+	return sz;
+}
+
+/* Size of the reserved huge pages MAP_HUGETLB maps by default */
+static size_t hugetlb_page_size(void)
+{
+	static size_t size;
+	size_t sz = __atomic_load_n(&size, __ATOMIC_RELAXED);
+	unsigned long long v = 0;
+	char line[64] = { 0 };
+	FILE *f = NULL;
+
+	if (sz)
+		return sz;
+
+	sz = HUGE_PAGE_SIZE_DEFAULT;
+	f = fopen("/proc/meminfo", "re");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "Hugepagesize: %llu kB", &v) != 1)
+				continue;
+			v *= 1024;
+			if (v && !(v & (v - 1)))
+				sz = v;
+			break;
+		}
+		fclose(f);
+	}
+
+	__atomic_store_n(&size, sz, __ATOMIC_RELAXED);
+	return sz;
+}
+
+/* Returns @size rounded up to @align, a power of two, or 0 on overflow */
+static size_t huge_round_up(size_t size, size_t align)
+{
+	size_t len = (size + align - 1) & ~(align - 1);
+
+	return len < size ? 0 : len;
+}
+
+/*
+ * Allocates @size bytes from huge pages to avoid the TLB misses and the
+ * page fault per 4k page of a large calloc() buffer. Reserved huge pages
+ * (MAP_HUGETLB) of the default hugetlb size are tried first, then a
+ * transparent huge page advised mapping aligned to the PMD size. Either
+ * way the pages are faulted in here rather than on first touch. The
+ * kernel hands out zeroed pages, so there's no extra pass clearing the
+ * buffer.
+ *
+ * Returns NULL if the caller should fall back to calloc().
+ */
+static void *shm_alloc_huge(size_t size, size_t *map_size)
+{
+	size_t hp = huge_page_size();
+	size_t len = huge_round_up(size, hugetlb_page_size());
+	uint8_t *p = NULL;
+	uint8_t *aligned = NULL;
+	size_t pg = sysconf(_SC_PAGESIZE);
+	size_t n = 0;
+
+	/* The length of a hugetlb mapping is a multiple of its page size */
+	if (len) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			 MAP_POPULATE, -1, 0);
+		if (p != MAP_FAILED) {
+			*map_size = len;
+			return p;
+		}
+	}
+
+	/* Over-allocate to be able to align the start to a huge page */
+	len = huge_round_up(size, hp);
+	if (!len || len + hp < len)
+		return NULL;
+	p = mmap(NULL, len + hp, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	aligned = (uint8_t *)(((uintptr_t)p + hp - 1) & ~(uintptr_t)(hp - 1));
+	if (aligned != p)
+		munmap(p, aligned - p);
+	munmap(aligned + len, p + hp - aligned);
+
+	if (madvise(aligned, len, MADV_HUGEPAGE))
+		DMSG("madvise(MADV_HUGEPAGE): %s", strerror(errno));
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(aligned, len, MADV_POPULATE_WRITE))
+#endif
+		for (n = 0; n < len; n += pg)
+			aligned[n] = 0;
+
+	*map_size = len;
+	return aligned;
+}
+
+TEEC_Result TEEC_RegisterSharedMemoryFileDescriptor(TEEC_Context *ctx,
+						    TEEC_SharedMemory *shm,
+						    int fd)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	bool dmabuf = false;
+	int prot = 0;
+	int rfd = -1;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+
+	if (!ctx || !shm || fd < 0)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	if (!shm->flags || (shm->flags & ~(TEEC_MEM_INPUT | TEEC_MEM_OUTPUT)))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	if (shm->flags & TEEC_MEM_INPUT)
+		prot |= PROT_READ;
+	if (shm->flags & TEEC_MEM_OUTPUT)
+		prot |= PROT_WRITE;
+
+	/* Keep our own reference, the caller may close @fd */
+	rfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (rfd < 0)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	if (fstat(rfd, &st)) {
+		res = TEEC_ERROR_BAD_PARAMETERS;
+		goto err;
+	}
+
+	/* dma-bufs report their size only through lseek() */
+	if (!st.st_size) {
+		st.st_size = lseek(rfd, 0, SEEK_END);
+		if (st.st_size < 0) {
+			res = TEEC_ERROR_BAD_PARAMETERS;
+			goto err;
+		}
+	}
+
+	shm->size = st.st_size;
+	shm->alloced_size = shm->size;
+	shm->shadow_buffer = NULL;
+	shm->registered_fd = rfd;
+	shm->internal.flags = 0;
+
+	if (shm->size) {
+		dmabuf = shm_fd_is_dmabuf(rfd, &st);
+		if (dmabuf || shm_fd_sealed(rfd)) {
+			shm->buffer = mmap(NULL, shm->size, prot, MAP_SHARED,
+					   rfd, 0);
+			if (shm->buffer != MAP_FAILED) {
+				shm->internal.flags = SHM_FLAG_BUFFER_MAPPED;
+				if (dmabuf)
+					shm->internal.flags |= SHM_FLAG_DMABUF;
+				return TEEC_SUCCESS;
+			}
+			IMSG("mmap: %s, falling back to a copy",
+			     strerror(errno));
+		}
+	}
+
+	res = shm_fd_copy(shm, rfd, shm->size);
+	if (res)
+		goto err;
+
+	return TEEC_SUCCESS;
+err:
+	close(rfd);
+	shm->buffer = NULL;
+	shm->size = 0;
+	shm->alloced_size = 0;
+	shm->internal.flags = 0;
+	return res;
+}
+
 TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *ctx, TEEC_SharedMemory *shm)
 {
 	if (!ctx || !shm)
@@ -1200,6 +2123,15 @@ TEEC_Result TEEC_AllocateSharedMemory(TEEC_Context *ctx, TEEC_SharedMemory *shm)
 	if (!shm->flags || (shm->flags & ~(TEEC_MEM_INPUT | TEEC_MEM_OUTPUT)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
+	if (shm->size && shm->size >= shm_huge_threshold()) {
+		shm->buffer = shm_alloc_huge(shm->size, &shm->alloced_size);
+		if (shm->buffer) {
+			shm->internal.flags = SHM_FLAG_BUFFER_HUGE;
+			return TEEC_SUCCESS;
+		}
+		DMSG("no huge pages for %zu bytes", shm->size);
+	}
+
 	/* calloc returns allocated pointer even if shm->size == 0 */
 	shm->buffer = calloc(1, shm->size);
 	if (!shm->buffer) {
@@ -1249,11 +2181,47 @@ void TEEC_ReleaseSharedMemory(TEEC_SharedMemory *shm)
 }
 #endif
 
+size_t TEEC_GetOutputSizeHint(TEEC_Session *session, uint32_t cmd_id,
+			      uint32_t idx)
+{
+	struct size_hint *hint = NULL;
+	size_t size = 0;
+
+	if (!session || idx >= TEEC_CONFIG_PAYLOAD_REF_COUNT ||
+	    !size_hints_enabled())
+		return 0;
+
+	teec_mutex_lock(&size_hint_mutex);
+
+	hint = size_hint_slot(session, cmd_id, idx);
+	if (hint->session == session && hint->cmd_id == cmd_id &&
+	    hint->idx == idx)
+		size = hint->size;
+
+	teec_mutex_unlock(&size_hint_mutex);
+
+	return size;
+}
+
 void TEEC_ReleaseSharedMemory(TEEC_SharedMemory *shm)
 {
 	if (!shm)
 		return;
 
+	if (shm->internal.flags & SHM_FLAG_FD_COPY) {
+		if (shm->flags & TEEC_MEM_OUTPUT)
+			shm_fd_write_back(shm);
+		close(shm->registered_fd);
+	}
+
+	if (shm->internal.flags & SHM_FLAG_BUFFER_MAPPED) {
+		munmap(shm->buffer, shm->alloced_size);
+		close(shm->registered_fd);
+	}
+
+	if (shm->internal.flags & SHM_FLAG_BUFFER_HUGE)
+		munmap(shm->buffer, shm->alloced_size);
+
 	/* Free only allocated buffer. Registered buffer is owned by the caller */
 	if (shm->internal.flags & SHM_FLAG_BUFFER_ALLOCED) {
 		free(shm->buffer);
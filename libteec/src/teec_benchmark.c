@@ -42,6 +42,9 @@
 #include "teec_benchmark.h"
 
 struct tee_ts_global *bench_ts_global;
+/* Layout of bench_ts_global as validated, the TEE may change the buffer */
+static uint64_t bench_cores;
+static uint64_t bench_stamps;
 static const TEEC_UUID pta_benchmark_uuid = PTA_BENCHMARK_UUID;
 
 static TEEC_Context bench_ctx;
@@ -121,17 +124,17 @@ static void *mmap_paddr(intptr_t paddr, uint64_t size)
 	int devmem = 0;
 	off_t offset = 0;
 	off_t page_addr = 0;
-	intptr_t *hw_addr = NULL;
+	uint8_t *hw_addr = NULL;
 
 	devmem = open("/dev/mem", O_RDWR);
-	if (!devmem)
+	if (devmem < 0)
 		return NULL;
 
 	offset = (off_t)paddr % getpagesize();
 	page_addr = (off_t)(paddr - offset);
 
-	hw_addr = (intptr_t *)mmap(0, size, PROT_READ|PROT_WRITE,
-					MAP_SHARED, devmem, page_addr);
+	hw_addr = mmap(0, size + offset, PROT_READ|PROT_WRITE,
+		       MAP_SHARED, devmem, page_addr);
 	if (hw_addr == MAP_FAILED) {
 		close(devmem);
 		return NULL;
@@ -141,18 +144,69 @@ static void *mmap_paddr(intptr_t paddr, uint64_t size)
 	return (hw_addr + offset);
 }
 
+static void munmap_paddr(void *va, intptr_t paddr, uint64_t size)
+{
+	off_t offset = (off_t)paddr % getpagesize();
+
+	munmap((uint8_t *)va - offset, size + offset);
+}
+
+/*
+ * check that the ring layout published by the buffer owner is usable,
+ * each field is read once and the validated copy is kept
+ */
+static bool benchmark_check_layout(struct tee_ts_global *ts_global,
+				   uint64_t ts_buf_size)
+{
+	uint64_t cores = 0;
+	uint64_t stamps = 0;
+
+	if (ts_buf_size < sizeof(*ts_global))
+		return false;
+
+	if (__atomic_load_n(&ts_global->magic, __ATOMIC_RELAXED) !=
+	    TEE_BENCH_MAGIC ||
+	    __atomic_load_n(&ts_global->version, __ATOMIC_RELAXED) !=
+	    TEE_BENCH_VERSION)
+		return false;
+
+	cores = __atomic_load_n(&ts_global->cores, __ATOMIC_RELAXED);
+	stamps = __atomic_load_n(&ts_global->stamps, __ATOMIC_RELAXED);
+	if (!tee_ts_stamps_valid(stamps))
+		return false;
+
+	/* Keeps tee_ts_global_size() from overflowing */
+	if (stamps > ts_buf_size / sizeof(struct tee_time_st) ||
+	    cores > ts_buf_size / tee_ts_cpu_buf_size(stamps))
+		return false;
+
+	if (tee_ts_global_size(cores, stamps) > ts_buf_size)
+		return false;
+
+	bench_cores = cores;
+	bench_stamps = stamps;
+	return true;
+}
+
 /* check if we are in benchmark mode */
 static bool benchmark_check_mode(void)
 {
 	uint64_t ts_buf_raw = 0;
 	uint64_t ts_buf_size = 0;
+	struct tee_ts_global *ts_global = NULL;
 	bool res = true;
 
 	if (!bench_ts_global) {
 		/* receive buffer from Benchmark PTA and register it */
 		benchmark_get_bench_buf_paddr(&ts_buf_raw, &ts_buf_size);
 		if (ts_buf_raw && ts_buf_size) {
-			bench_ts_global = mmap_paddr(ts_buf_raw, ts_buf_size);
+			ts_global = mmap_paddr(ts_buf_raw, ts_buf_size);
+			if (ts_global &&
+			    !benchmark_check_layout(ts_global, ts_buf_size)) {
+				munmap_paddr(ts_global, ts_buf_raw, ts_buf_size);
+				ts_global = NULL;
+			}
+			bench_ts_global = ts_global;
 			res = (bench_ts_global) ? true : false;
 		} else {
 			res = false;
@@ -166,7 +220,6 @@ static bool benchmark_check_mode(void)
 void bm_timestamp(void)
 {
 	struct tee_ts_cpu_buf *cpu_buf = NULL;
-	uint64_t ts_i = 0;
 	void *ret_addr = NULL;
 	uint32_t cur_cpu = 0;
 	int ret = 0;
@@ -198,19 +251,18 @@ void bm_timestamp(void)
 		goto error;
 
 	/* fill timestamp data */
-	if (cur_cpu >= bench_ts_global->cores) {
+	if (cur_cpu >= bench_cores) {
 		ret = sched_setaffinity(0, sizeof(cpu_set_old), &cpu_set_old);
 		goto error;
 	}
 
 	ret_addr = __builtin_return_address(0);
 
-	cpu_buf = &bench_ts_global->cpu_buf[cur_cpu];
-	ts_i = __sync_fetch_and_add(&cpu_buf->head, 1);
+	cpu_buf = tee_ts_get_cpu_buf(bench_ts_global, bench_stamps, cur_cpu);
 	ts_data.cnt = read_ccounter();
 	ts_data.addr = (uintptr_t)ret_addr;
 	ts_data.src = TEE_BENCH_CLIENT;
-	cpu_buf->stamps[ts_i & TEE_BENCH_MAX_MASK] = ts_data;
+	tee_ts_push(cpu_buf, bench_stamps, &ts_data);
 
 	/* set back affinity mask */
 	sched_setaffinity(0, sizeof(cpu_set_old), &cpu_set_old);
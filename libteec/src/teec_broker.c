@@ -0,0 +1,416 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "teec_broker.h"
+#include "teec_trace.h"
+
+/*
+ * Client side of the broker protocol, see teec_broker.h
+ *
+ * Calling threads share the connection. Each takes a mailbox slot, sends
+ * its request and then either waits for its reply or, if no other thread
+ * is doing it, reads replies from the socket and hands them to the
+ * threads owning the slots.
+ */
+#define TEEC_BROKER_MAX_FD	256
+
+struct broker_conn {
+	int sock;
+	uint8_t *mbox;
+	size_t slot_size;
+	uint32_t slots;
+	pthread_mutex_t mutex;	/* guards the fields below */
+	pthread_cond_t cond;
+	uint64_t free_slots;	/* bitmap */
+	bool reading;		/* a thread is reading replies */
+	bool broken;
+	uint64_t done;		/* bitmap of slots with a reply */
+	struct teec_broker_msg reply[TEEC_BROKER_MAX_SLOTS];
+	int reply_fd[TEEC_BROKER_MAX_SLOTS];
+};
+
+static struct broker_conn *conns[TEEC_BROKER_MAX_FD];
+
+static int send_msg(int sock, struct teec_broker_msg *msg, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg = NULL;
+	ssize_t r = 0;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do {
+		r = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+
+	return r == sizeof(*msg) ? 0 : -1;
+}
+
+static int recv_msg(int sock, struct teec_broker_msg *msg, int *fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg = NULL;
+	ssize_t r = 0;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	*fd = -1;
+
+	do {
+		r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	} while (r < 0 && errno == EINTR);
+	if (r != sizeof(*msg))
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (!!(msg->flags & TEEC_BROKER_FLAG_FD) != (*fd >= 0)) {
+		if (*fd >= 0)
+			close(*fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns a memfd holding @len bytes of @buf */
+static int frame_to_fd(const char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t r = 0;
+	int fd = memfd_create("teec_frame", MFD_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+
+	while (done < len) {
+		r = pwrite(fd, buf + done, len - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += r;
+	}
+
+	return fd;
+}
+
+static int frame_from_fd(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t r = 0;
+
+	while (done < len) {
+		r = pread(fd, buf + done, len - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+
+	return 0;
+}
+
+int teec_broker_connect(const char *path)
+{
+	struct sockaddr_un sa;
+	struct teec_broker_msg msg;
+	struct broker_conn *c = NULL;
+	size_t mbox_size = 0;
+	int mbox_fd = -1;
+	int sock = -1;
+	int e = 0;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		EMSG("broker socket path too long");
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (sock >= TEEC_BROKER_MAX_FD) {
+		EMSG("broker connection %d out of range", sock);
+		goto err;
+	}
+
+	if (connect(sock, (struct sockaddr *)&sa, sizeof(sa))) {
+		DMSG("connect %s: %s", path, strerror(errno));
+		goto err;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = TEEC_BROKER_HELLO;
+	msg.cmd_id = TEEC_BROKER_VERSION;
+	if (send_msg(sock, &msg, -1) || recv_msg(sock, &msg, &mbox_fd) ||
+	    msg.op != TEEC_BROKER_HELLO || msg.ret || mbox_fd < 0) {
+		EMSG("broker handshake failed");
+		goto err;
+	}
+
+	if (!msg.slot || msg.slot > TEEC_BROKER_MAX_SLOTS || !msg.len) {
+		EMSG("bad broker mailbox %u x %u", msg.slot, msg.len);
+		goto err;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		goto err;
+
+	mbox_size = (size_t)msg.slot * msg.len;
+	c->mbox = mmap(NULL, mbox_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       mbox_fd, 0);
+	if (c->mbox == MAP_FAILED) {
+		EMSG("mmap mailbox: %s", strerror(errno));
+		goto err;
+	}
+	close(mbox_fd);
+
+	c->sock = sock;
+	c->slots = msg.slot;
+	c->slot_size = msg.len;
+	if (c->slots == 64)
+		c->free_slots = UINT64_MAX;
+	else
+		c->free_slots = (UINT64_C(1) << c->slots) - 1;
+
+	e = pthread_mutex_init(&c->mutex, NULL);
+	if (!e)
+		e = pthread_cond_init(&c->cond, NULL);
+	if (e) {
+		EMSG("pthread init: %s", strerror(e));
+		munmap(c->mbox, mbox_size);
+		free(c);
+		close(sock);
+		return -1;
+	}
+
+	__atomic_store_n(&conns[sock], c, __ATOMIC_RELEASE);
+
+	return sock;
+err:
+	free(c);
+	if (mbox_fd >= 0)
+		close(mbox_fd);
+	close(sock);
+	return -1;
+}
+
+void teec_broker_disconnect(int fd)
+{
+	struct broker_conn *c = NULL;
+
+	if (fd < 0 || fd >= TEEC_BROKER_MAX_FD)
+		return;
+
+	c = __atomic_exchange_n(&conns[fd], NULL, __ATOMIC_ACQ_REL);
+	if (!c)
+		return;
+
+	/* The broker closes whatever sessions were left open */
+	close(c->sock);
+	munmap(c->mbox, (size_t)c->slots * c->slot_size);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->mutex);
+	free(c);
+}
+
+bool teec_broker_owns(int fd)
+{
+	if (fd < 0 || fd >= TEEC_BROKER_MAX_FD)
+		return false;
+
+	return __atomic_load_n(&conns[fd], __ATOMIC_ACQUIRE);
+}
+
+/* Called with the mutex held, returns with it held */
+static void read_replies(struct broker_conn *c, uint32_t slot)
+{
+	struct teec_broker_msg msg;
+	int fd = -1;
+
+	while (!(c->done & (UINT64_C(1) << slot)) && !c->broken) {
+		if (c->reading) {
+			pthread_cond_wait(&c->cond, &c->mutex);
+			continue;
+		}
+
+		c->reading = true;
+		pthread_mutex_unlock(&c->mutex);
+
+		if (recv_msg(c->sock, &msg, &fd))
+			msg.slot = UINT32_MAX;
+
+		pthread_mutex_lock(&c->mutex);
+		c->reading = false;
+
+		if (msg.slot >= c->slots) {
+			EMSG("lost broker connection");
+			if (fd >= 0)
+				close(fd);
+			c->broken = true;
+		} else {
+			c->reply[msg.slot] = msg;
+			c->reply_fd[msg.slot] = fd;
+			c->done |= UINT64_C(1) << msg.slot;
+		}
+		pthread_cond_broadcast(&c->cond);
+	}
+}
+
+int teec_broker_call(int fd, enum teec_io_op op, const uint8_t *uuid,
+		     uint32_t *session, uint32_t cmd_id, char **buf,
+		     uint32_t *len, int32_t *tee_err, uint32_t *ta_err)
+{
+	struct broker_conn *c = __atomic_load_n(&conns[fd], __ATOMIC_ACQUIRE);
+	struct teec_broker_msg msg;
+	uint32_t slot = 0;
+	char *b = NULL;
+	int frame_fd = -1;
+	int ret = -EIO;
+
+	memset(&msg, 0, sizeof(msg));
+	switch (op) {
+	case TEEC_IO_OPEN_SESSION:
+		msg.op = TEEC_BROKER_OPEN_SESSION;
+		if (uuid)
+			memcpy(msg.uuid, uuid, sizeof(msg.uuid));
+		break;
+	case TEEC_IO_CLOSE_SESSION:
+		msg.op = TEEC_BROKER_CLOSE_SESSION;
+		break;
+	case TEEC_IO_INVOKE:
+		msg.op = TEEC_BROKER_INVOKE;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	while (!c->free_slots && !c->broken)
+		pthread_cond_wait(&c->cond, &c->mutex);
+	if (c->broken) {
+		pthread_mutex_unlock(&c->mutex);
+		return -EPIPE;
+	}
+	slot = __builtin_ctzll(c->free_slots);
+	c->free_slots &= ~(UINT64_C(1) << slot);
+	pthread_mutex_unlock(&c->mutex);
+
+	msg.slot = slot;
+	msg.session = session ? *session : 0;
+	msg.cmd_id = cmd_id;
+	msg.len = *len;
+
+	if (*len <= c->slot_size) {
+		memcpy(c->mbox + slot * c->slot_size, *buf, *len);
+	} else {
+		frame_fd = frame_to_fd(*buf, *len);
+		if (frame_fd < 0) {
+			ret = -ENOMEM;
+			goto out_free_slot;
+		}
+		msg.flags = TEEC_BROKER_FLAG_FD;
+	}
+
+	ret = send_msg(c->sock, &msg, frame_fd) ? -EPIPE : 0;
+	if (frame_fd >= 0)
+		close(frame_fd);
+	frame_fd = -1;
+	if (ret)
+		goto out_free_slot;
+
+	pthread_mutex_lock(&c->mutex);
+	read_replies(c, slot);
+	if (!(c->done & (UINT64_C(1) << slot))) {
+		pthread_mutex_unlock(&c->mutex);
+		return -EPIPE;
+	}
+	c->done &= ~(UINT64_C(1) << slot);
+	msg = c->reply[slot];
+	frame_fd = c->reply_fd[slot];
+	pthread_mutex_unlock(&c->mutex);
+
+	ret = msg.ret;
+	if (ret)
+		goto out_free_slot;
+
+	b = realloc(*buf, msg.len ? msg.len : 1);
+	if (!b) {
+		ret = -ENOMEM;
+		goto out_free_slot;
+	}
+	*buf = b;
+
+	if (frame_fd >= 0) {
+		if (frame_from_fd(frame_fd, b, msg.len)) {
+			ret = -EIO;
+			goto out_free_slot;
+		}
+	} else if (msg.len <= c->slot_size) {
+		memcpy(b, c->mbox + slot * c->slot_size, msg.len);
+	} else {
+		ret = -EIO;
+		goto out_free_slot;
+	}
+
+	*len = msg.len;
+	*tee_err = msg.tee_err;
+	*ta_err = msg.ta_err;
+	if (session)
+		*session = msg.session;
+
+out_free_slot:
+	if (frame_fd >= 0)
+		close(frame_fd);
+
+	pthread_mutex_lock(&c->mutex);
+	c->free_slots |= UINT64_C(1) << slot;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+
+	return ret;
+}
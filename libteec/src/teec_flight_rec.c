@@ -0,0 +1,365 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "teec_trace.h"
+
+#ifndef TEEC_FREC_DIR
+#define TEEC_FREC_DIR			"/tmp"
+#endif
+
+#define TEEC_FREC_DEFAULT_RECS		4096
+#define TEEC_FREC_MAX_RECS		(1u << 20)
+
+/*
+ * The ring and its dumps are kept in a directory only the effective user
+ * can access, @dir_fd, named by the pid of the process.
+ */
+struct frec_state {
+	struct teec_frec_hdr *hdr;
+	struct teec_frec_rec *recs;
+	size_t map_size;
+	bool file_backed;
+	int dir_fd;
+	char name[32];
+	char dump_name[32];
+};
+
+static pthread_mutex_t frec_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct frec_state frec = { .dir_fd = -1 };
+static bool frec_initialized;
+static bool frec_enabled;
+
+static __thread uint32_t frec_tid;
+static __thread uint64_t corr_id;
+static uint32_t corr_counter;
+
+static uint32_t frec_num_recs(void)
+{
+	const char *env = getenv("TEEC_FLIGHT_REC");
+	unsigned long n = TEEC_FREC_DEFAULT_RECS;
+	uint32_t recs = 1;
+	char *endp = NULL;
+
+	if (!env)
+		return 0;
+
+	n = strtoul(env, &endp, 0);
+	if (endp == env || *endp)
+		n = TEEC_FREC_DEFAULT_RECS;
+
+	if (!n)
+		return 0;
+	if (n > TEEC_FREC_MAX_RECS)
+		n = TEEC_FREC_MAX_RECS;
+
+	/* Round up to a power of two */
+	while (recs < n)
+		recs <<= 1;
+
+	return recs;
+}
+
+static void frec_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t r = 0;
+
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		p += r;
+		len -= r;
+	}
+}
+
+/* Only async-signal-safe functions are used here */
+static void frec_dump_handler(int sig)
+{
+	int saved_errno = errno;
+	int fd = 0;
+
+	(void)sig;
+
+	if (!frec.hdr)
+		goto out;
+
+	fd = openat(frec.dir_fd, frec.dump_name,
+		    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto out;
+
+	frec_write_all(fd, frec.hdr, frec.map_size);
+	close(fd);
+out:
+	errno = saved_errno;
+}
+
+static void frec_install_dump_handler(void)
+{
+	struct sigaction old_sa;
+	struct sigaction sa;
+
+	memset(&old_sa, 0, sizeof(old_sa));
+	memset(&sa, 0, sizeof(sa));
+
+	/* Don't steal the signal from an application using it */
+	if (sigaction(SIGUSR2, NULL, &old_sa) ||
+	    old_sa.sa_handler != SIG_DFL)
+		return;
+
+	sa.sa_handler = frec_dump_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+/*
+ * Opens "<runtime dir>/teec-frec.<euid>", creating it if needed. It is
+ * refused unless it's a directory owned by us that nobody else can access,
+ * so the names in it can't be redirected by other users.
+ */
+static int frec_open_dir(void)
+{
+	const char *base = secure_getenv("XDG_RUNTIME_DIR");
+	char path[PATH_MAX];
+	struct stat st;
+	int fd = 0;
+	int n = 0;
+
+	memset(&st, 0, sizeof(st));
+
+	if (!base || *base != '/')
+		base = TEEC_FREC_DIR;
+
+	n = snprintf(path, sizeof(path), "%s/teec-frec.%u", base,
+		     (unsigned int)geteuid());
+	if (n < 0 || (size_t)n >= sizeof(path))
+		return -1;
+
+	if (mkdir(path, 0700) && errno != EEXIST)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & 0077)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void *frec_map_file(size_t size)
+{
+	void *p = NULL;
+	int fd = 0;
+
+	fd = openat(frec.dir_fd, frec.name,
+		    O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		/* Left by a crashed process that had the same pid */
+		unlinkat(frec.dir_fd, frec.name, 0);
+		fd = openat(frec.dir_fd, frec.name,
+			    O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+			    0600);
+	}
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		unlinkat(frec.dir_fd, frec.name, 0);
+		return NULL;
+	}
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		unlinkat(frec.dir_fd, frec.name, 0);
+		return NULL;
+	}
+
+	return p;
+}
+
+static void frec_exit(void)
+{
+	/* A clean exit leaves nothing behind, only crashes do */
+	if (frec.file_backed)
+		unlinkat(frec.dir_fd, frec.name, 0);
+}
+
+static void frec_atfork_child(void)
+{
+	/*
+	 * The mapping is shared with the parent, leave it alone and set up
+	 * a ring of our own on the next event.
+	 */
+	if (frec.dir_fd >= 0)
+		close(frec.dir_fd);
+	memset(&frec, 0, sizeof(frec));
+	frec.dir_fd = -1;
+	frec_initialized = false;
+	frec_enabled = false;
+	frec_tid = 0;
+	pthread_mutex_init(&frec_mu, NULL);
+}
+
+static void frec_init(void)
+{
+	static bool registered;
+	uint32_t num_recs = frec_num_recs();
+	struct teec_frec_hdr *hdr = NULL;
+	size_t size = 0;
+
+	if (!registered) {
+		pthread_atfork(NULL, NULL, frec_atfork_child);
+		atexit(frec_exit);
+		registered = true;
+	}
+
+	if (!num_recs)
+		return;
+
+	size = sizeof(*hdr) + num_recs * sizeof(struct teec_frec_rec);
+
+	snprintf(frec.name, sizeof(frec.name), "%d", (int)getpid());
+	snprintf(frec.dump_name, sizeof(frec.dump_name), "%d.dump",
+		 (int)getpid());
+
+	if (frec.dir_fd >= 0)
+		close(frec.dir_fd);
+	frec.dir_fd = frec_open_dir();
+	if (frec.dir_fd >= 0)
+		hdr = frec_map_file(size);
+	if (hdr) {
+		frec.file_backed = true;
+	} else {
+		hdr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (hdr == MAP_FAILED)
+			return;
+	}
+
+	hdr->magic = TEEC_FREC_MAGIC;
+	hdr->version = TEEC_FREC_VERSION;
+	hdr->rec_size = sizeof(struct teec_frec_rec);
+	hdr->num_recs = num_recs;
+	hdr->pid = getpid();
+	hdr->head = 0;
+
+	frec.hdr = hdr;
+	frec.recs = (void *)(hdr + 1);
+	frec.map_size = size;
+
+	/* Dumps need the private directory too */
+	if (frec.dir_fd >= 0)
+		frec_install_dump_handler();
+
+	__atomic_store_n(&frec_enabled, true, __ATOMIC_RELEASE);
+}
+
+static bool frec_ready(void)
+{
+	if (__atomic_load_n(&frec_initialized, __ATOMIC_ACQUIRE))
+		return __atomic_load_n(&frec_enabled, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&frec_mu);
+	if (!frec_initialized) {
+		frec_init();
+		__atomic_store_n(&frec_initialized, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&frec_mu);
+
+	return __atomic_load_n(&frec_enabled, __ATOMIC_ACQUIRE);
+}
+
+void teec_frec_log(uint16_t event, uint64_t a0, uint64_t a1, uint64_t a2)
+{
+	struct teec_frec_rec *rec = NULL;
+	struct timespec ts;
+	uint64_t n = 0;
+
+	if (!frec_ready())
+		return;
+
+	if (!frec_tid)
+		frec_tid = syscall(SYS_gettid);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	n = __atomic_fetch_add(&frec.hdr->head, 1, __ATOMIC_RELAXED);
+	rec = frec.recs + (n & (frec.hdr->num_recs - 1));
+
+	/* Invalidate the slot while it's being rewritten */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->corr_id = corr_id;
+	rec->tid = frec_tid;
+	rec->event = event;
+	rec->reserved = 0;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+
+	__atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t teec_corr_enter(void)
+{
+	uint64_t prev = corr_id;
+	uint32_t n = 0;
+
+	if (prev)
+		return prev;
+
+	/* The pid makes IDs unique across the processes sharing a TEE */
+	do {
+		n = __atomic_add_fetch(&corr_counter, 1, __ATOMIC_RELAXED);
+	} while (!n);
+	corr_id = ((uint64_t)getpid() << 32) | n;
+
+	return prev;
+}
+
+void teec_corr_leave(uint64_t prev)
+{
+	corr_id = prev;
+}
+
+uint64_t teec_corr_get(void)
+{
+	return corr_id;
+}
+
+void teec_corr_set(uint64_t id)
+{
+	corr_id = id;
+}
@@ -0,0 +1,726 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sel4_req.h"
+#include "teec_broker.h"
+#include "teec_io.h"
+#include "teec_trace.h"
+
+/*
+ * Transport I/O thread
+ *
+ * With TEEC_IO_THREAD=1 every channel gets one thread doing all transport
+ * calls on it. Callers push their request onto an intrusive lock-free
+ * multiple producer, single consumer queue (Vyukov) and sleep on a futex
+ * in the request until the I/O thread has completed it. Application
+ * threads then no longer contend on the channel and its state stays hot
+ * in one thread.
+ *
+ * The transport takes exactly one frame per call and returns its
+ * response synchronously, so requests are passed on one by one.
+ *
+ * Busy polling
+ *
+ * For short commands the futex sleep and wakeup dominate the latency.
+ * With TEEC_BUSY_POLL_US=<max microseconds>, which also starts the I/O
+ * threads, a caller first spins on its request for a budget tuned per
+ * session and command: 1.5 times the moving average of the service time,
+ * or no spinning at all when that exceeds the maximum. The I/O thread
+ * likewise spins on an empty queue before it sleeps, for a budget halved
+ * each time nothing came and doubled when a request came soon after it
+ * went to sleep, so an idle channel soon stops spinning. How often
+ * spinning paid off is reported when the channel is closed.
+ *
+ * Channel groups
+ *
+ * With TEEC_CHANNELS=<n> a context opens up to n comm channels instead of
+ * one; the context's own channel indexes the group. The transport carries
+ * no session handle, the TEE keeps one session per channel, so a session
+ * is bound to a channel of its own when opened and the open fails with
+ * TEEC_ERROR_BUSY when all are taken. Independent sessions then no longer
+ * share the bandwidth of one link. The binding is kept in the group, keyed
+ * by the TEEC_Session, to leave the public structure alone.
+ */
+#define TEEC_IO_MAX_FD		256
+#define TEEC_MAX_CHANNELS	16
+#define BUSY_POLL_SLOTS		64	/* must be a power of two */
+#define IDLE_SPIN_MIN_NS	1000	/* less is no spinning */
+
+/* Internal request to terminate the I/O thread */
+#define TEEC_IO_STOP		(-1)
+
+/* States of io_thread::sleeping */
+#define IO_RUNNING		0
+#define IO_IDLE			1	/* checks the queue once more */
+#define IO_SLEEPING		2	/* in FUTEX_WAIT, needs a wakeup */
+
+/* States of io_req::done */
+#define REQ_PENDING		0
+#define REQ_DONE		1
+#define REQ_SLEEPING		2	/* pending, the caller needs a wakeup */
+
+struct io_req {
+	struct io_req *next;
+	int op;
+	uint32_t session;
+	uint32_t cmd_id;
+	char **buf;
+	uint32_t *len;
+	int32_t *tee_err;
+	uint32_t *ta_err;
+	int ret;
+	uint32_t done;		/* futex word */
+};
+
+/* Fields are accessed with relaxed atomics, updates may race */
+struct busy_poll_stat {
+	uint64_t key;		/* op and command ID + 1, 0 if unused */
+	uint32_t session;
+	uint64_t service_ns;	/* moving average */
+	uint64_t budget_ns;
+	uint64_t hits;		/* completed while spinning */
+	uint64_t misses;	/* slept after spinning */
+	uint64_t sleeps;	/* no spinning budget */
+};
+
+struct io_thread {
+	int fd;
+	pthread_t tid;
+	uint64_t max_spin_ns;
+	uint64_t idle_spin_ns;	/* I/O thread only */
+	struct busy_poll_stat stats[BUSY_POLL_SLOTS];
+	struct io_req *head;	/* last pushed, producers */
+	struct io_req *tail;	/* next to pop, I/O thread only */
+	struct io_req stub;
+	uint32_t sleeping;	/* futex word, IO_* */
+};
+
+struct channel_group {
+	size_t count;
+	int fd[TEEC_MAX_CHANNELS];	/* fd[0] is the context's channel */
+	const void *owner[TEEC_MAX_CHANNELS];	/* session bound to fd[n] */
+};
+
+static struct io_thread *io_threads[TEEC_IO_MAX_FD];
+static struct channel_group *channel_groups[TEEC_IO_MAX_FD];
+
+static long futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield" : : : "memory");
+#endif
+}
+
+/*
+ * Spins until *@word is REQ_DONE or @budget_ns has passed, returns true
+ * if the request was completed
+ */
+static bool spin_on(uint32_t *word, uint64_t budget_ns)
+{
+	uint64_t end = now_ns() + budget_ns;
+	unsigned int n = 0;
+
+	while (__atomic_load_n(word, __ATOMIC_ACQUIRE) != REQ_DONE) {
+		cpu_relax();
+		/* Reading the clock costs more than a pause */
+		if (!(++n & 63) && now_ns() >= end)
+			return false;
+	}
+
+	return true;
+}
+
+#define STAT_LOAD(f)		__atomic_load_n(&(f), __ATOMIC_RELAXED)
+#define STAT_STORE(f, v)	__atomic_store_n(&(f), (v), __ATOMIC_RELAXED)
+#define STAT_INC(f)		__atomic_fetch_add(&(f), 1, __ATOMIC_RELAXED)
+
+/*
+ * Returns the counters of @req. The transport has no TA UUID, the session
+ * keeps commands of different TAs apart.
+ */
+static struct busy_poll_stat *busy_poll_stat(struct io_thread *io,
+					     struct io_req *req)
+{
+	uint64_t key = (((uint64_t)(uint32_t)req->op << 32) | req->cmd_id) + 1;
+	size_t n = ((req->cmd_id ^ req->session * 0x85ebca6bu) * 0x9e3779b1u +
+		    req->op) & (BUSY_POLL_SLOTS - 1);
+	struct busy_poll_stat *st = io->stats + n;
+
+	/* A colliding command takes the slot over */
+	if (STAT_LOAD(st->key) != key ||
+	    STAT_LOAD(st->session) != req->session) {
+		STAT_STORE(st->key, key);
+		STAT_STORE(st->session, req->session);
+		STAT_STORE(st->service_ns, 0);
+		/* Spin up to the maximum until there's an average */
+		STAT_STORE(st->budget_ns, io->max_spin_ns);
+		STAT_STORE(st->hits, 0);
+		STAT_STORE(st->misses, 0);
+		STAT_STORE(st->sleeps, 0);
+	}
+
+	return st;
+}
+
+static void busy_poll_update(struct io_thread *io,
+			     struct busy_poll_stat *st, uint64_t service_ns)
+{
+	uint64_t avg = STAT_LOAD(st->service_ns);
+	uint64_t budget = 0;
+
+	if (avg)
+		avg = avg - avg / 8 + service_ns / 8;
+	else
+		avg = service_ns;
+
+	budget = avg + avg / 2;
+	if (budget > io->max_spin_ns)
+		budget = 0;
+
+	STAT_STORE(st->service_ns, avg);
+	STAT_STORE(st->budget_ns, budget);
+}
+
+static void io_push(struct io_thread *io, struct io_req *req)
+{
+	struct io_req *prev = NULL;
+
+	__atomic_store_n(&req->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&io->head, req, __ATOMIC_ACQ_REL);
+	/* The queue is unlinked here until next is set, pop sees it empty */
+	__atomic_store_n(&prev->next, req, __ATOMIC_RELEASE);
+
+	/*
+	 * Pairs with the fence in io_thread_main(): either the I/O thread
+	 * sees the request or we see it idle. A running thread costs one
+	 * load, an idle one is sent back to its queue without a system call
+	 * and only the first producer to find it asleep wakes it.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&io->sleeping, __ATOMIC_RELAXED) != IO_RUNNING &&
+	    __atomic_exchange_n(&io->sleeping, IO_RUNNING, __ATOMIC_RELAXED) ==
+	    IO_SLEEPING)
+		futex(&io->sleeping, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static struct io_req *io_pop(struct io_thread *io)
+{
+	struct io_req *tail = io->tail;
+	struct io_req *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &io->stub) {
+		if (!next)
+			return NULL;
+		io->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		io->tail = next;
+		return tail;
+	}
+
+	/* A producer is between exchanging head and linking its request */
+	if (tail != __atomic_load_n(&io->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* @tail is the last one, put the stub behind it to be able to pop */
+	__atomic_store_n(&io->stub.next, NULL, __ATOMIC_RELAXED);
+	next = __atomic_exchange_n(&io->head, &io->stub, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&next->next, &io->stub, __ATOMIC_RELEASE);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		io->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static int transport_call(int fd, int op, uint32_t cmd_id, char **buf,
+			  uint32_t *len, int32_t *tee_err, uint32_t *ta_err)
+{
+	switch (op) {
+	case TEEC_IO_OPEN_SESSION:
+		return sel4_optee_open_session(fd, buf, len, tee_err, ta_err);
+	case TEEC_IO_CLOSE_SESSION:
+		return sel4_optee_close_session(fd, buf, len, tee_err, ta_err);
+	case TEEC_IO_INVOKE:
+		return sel4_optee_invoke_cmd(fd, cmd_id, buf, len, tee_err,
+					     ta_err);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void io_complete(struct io_req *req, int ret)
+{
+	req->ret = ret;
+	/* A caller still spinning needs no system call to be woken */
+	if (__atomic_exchange_n(&req->done, REQ_DONE, __ATOMIC_ACQ_REL) ==
+	    REQ_SLEEPING)
+		futex(&req->done, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static void idle_spin_grow(struct io_thread *io)
+{
+	if (io->idle_spin_ns)
+		io->idle_spin_ns *= 2;
+	else
+		io->idle_spin_ns = IDLE_SPIN_MIN_NS;
+	if (io->idle_spin_ns > io->max_spin_ns)
+		io->idle_spin_ns = io->max_spin_ns;
+}
+
+/* Spins on the empty queue for the idle budget, halving it if in vain */
+static struct io_req *idle_spin(struct io_thread *io)
+{
+	uint64_t end = now_ns() + io->idle_spin_ns;
+	struct io_req *req = NULL;
+
+	do {
+		cpu_relax();
+		req = io_pop(io);
+	} while (!req && now_ns() < end);
+
+	if (!req) {
+		io->idle_spin_ns /= 2;
+		if (io->idle_spin_ns < IDLE_SPIN_MIN_NS)
+			io->idle_spin_ns = 0;
+	}
+
+	return req;
+}
+
+/* Called with io->sleeping IO_IDLE and the queue found empty */
+static void io_sleep(struct io_thread *io)
+{
+	uint32_t state = IO_IDLE;
+
+	/* Fails if a producer came in meanwhile */
+	if (__atomic_compare_exchange_n(&io->sleeping, &state, IO_SLEEPING,
+					false, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+		futex(&io->sleeping, FUTEX_WAIT_PRIVATE, IO_SLEEPING);
+
+	__atomic_store_n(&io->sleeping, IO_RUNNING, __ATOMIC_RELAXED);
+}
+
+static void *io_thread_main(void *arg)
+{
+	struct io_thread *io = arg;
+	struct io_req *req = NULL;
+	uint64_t start = 0;
+	int ret = 0;
+
+	while (true) {
+		req = io_pop(io);
+		if (!req && io->idle_spin_ns)
+			req = idle_spin(io);
+		if (!req) {
+			__atomic_store_n(&io->sleeping, IO_IDLE,
+					 __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			req = io_pop(io);
+			if (!req) {
+				start = now_ns();
+				io_sleep(io);
+				/* Spinning longer would have saved the sleep */
+				if (io->max_spin_ns &&
+				    now_ns() - start < io->max_spin_ns)
+					idle_spin_grow(io);
+				continue;
+			}
+			__atomic_store_n(&io->sleeping, IO_RUNNING,
+					 __ATOMIC_RELAXED);
+		}
+
+		if (req->op == TEEC_IO_STOP) {
+			io_complete(req, 0);
+			break;
+		}
+
+		ret = transport_call(io->fd, req->op, req->cmd_id, req->buf,
+				     req->len, req->tee_err, req->ta_err);
+		io_complete(req, ret);
+	}
+
+	return NULL;
+}
+
+static void io_wait(struct io_thread *io, struct io_req *req)
+{
+	struct busy_poll_stat *st = NULL;
+	uint32_t state = REQ_PENDING;
+	uint64_t budget = 0;
+	uint64_t start = 0;
+
+	if (io->max_spin_ns && req->op != TEEC_IO_STOP) {
+		start = now_ns();
+		st = busy_poll_stat(io, req);
+		budget = STAT_LOAD(st->budget_ns);
+
+		if (!budget)
+			STAT_INC(st->sleeps);
+		else if (spin_on(&req->done, budget))
+			STAT_INC(st->hits);
+		else
+			STAT_INC(st->misses);
+	}
+
+	/* Sleep until done, telling io_complete() that a wakeup is needed */
+	while (true) {
+		state = REQ_PENDING;
+		if (!__atomic_compare_exchange_n(&req->done, &state,
+						 REQ_SLEEPING, false,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_ACQUIRE) &&
+		    state == REQ_DONE)
+			break;
+		futex(&req->done, FUTEX_WAIT_PRIVATE, REQ_SLEEPING);
+	}
+
+	if (st)
+		busy_poll_update(io, st, now_ns() - start);
+}
+
+static void busy_poll_report(struct io_thread *io)
+{
+	struct busy_poll_stat *st = NULL;
+	size_t n = 0;
+
+	for (n = 0; n < BUSY_POLL_SLOTS; n++) {
+		st = io->stats + n;
+		if (!st->key)
+			continue;
+		IMSG("busy poll session 0x%" PRIx32 " op %d cmd 0x%" PRIx32
+		     ": avg %" PRIu64 " ns, budget %" PRIu64 " ns, hits %"
+		     PRIu64 ", misses %" PRIu64 ", sleeps %" PRIu64,
+		     st->session, (int)((st->key - 1) >> 32),
+		     (uint32_t)(st->key - 1), st->service_ns, st->budget_ns,
+		     st->hits, st->misses, st->sleeps);
+	}
+}
+
+int teec_io_call(int fd, enum teec_io_op op, uint32_t *session,
+		 uint32_t cmd_id, char **buf, uint32_t *len, int32_t *tee_err,
+		 uint32_t *ta_err)
+{
+	struct io_thread *io = NULL;
+	struct io_req req;
+
+	if (teec_broker_owns(fd))
+		return teec_broker_call(fd, op, NULL, session, cmd_id, buf,
+					len, tee_err, ta_err);
+
+	if (fd < 0 || fd >= TEEC_IO_MAX_FD)
+		return transport_call(fd, op, cmd_id, buf, len, tee_err,
+				      ta_err);
+
+	io = __atomic_load_n(&io_threads[fd], __ATOMIC_ACQUIRE);
+	if (!io)
+		return transport_call(fd, op, cmd_id, buf, len, tee_err,
+				      ta_err);
+
+	memset(&req, 0, sizeof(req));
+	req.op = op;
+	/* Not yet known when opening */
+	if (op != TEEC_IO_OPEN_SESSION && session)
+		req.session = *session;
+	req.cmd_id = cmd_id;
+	req.buf = buf;
+	req.len = len;
+	req.tee_err = tee_err;
+	req.ta_err = ta_err;
+
+	io_push(io, &req);
+	io_wait(io, &req);
+
+	return req.ret;
+}
+
+int teec_io_open_session(int fd, const uint8_t *uuid, uint32_t *session,
+			 char **buf, uint32_t *len, int32_t *tee_err,
+			 uint32_t *ta_err)
+{
+	if (teec_broker_owns(fd))
+		return teec_broker_call(fd, TEEC_IO_OPEN_SESSION, uuid,
+					session, 0, buf, len, tee_err, ta_err);
+
+	return teec_io_call(fd, TEEC_IO_OPEN_SESSION, session, 0, buf, len,
+			    tee_err, ta_err);
+}
+
+static uint64_t busy_poll_max_ns(void)
+{
+	const char *env = getenv("TEEC_BUSY_POLL_US");
+	unsigned long us = 0;
+	char *endp = NULL;
+
+	if (!env)
+		return 0;
+
+	us = strtoul(env, &endp, 0);
+	if (endp == env || *endp)
+		return 0;
+
+	/* Spinning only keeps the completing thread off the only CPU */
+	if (us && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+		IMSG("single CPU, busy polling disabled");
+		return 0;
+	}
+
+	return (uint64_t)us * 1000;
+}
+
+void teec_io_start(int fd)
+{
+	const char *env = getenv("TEEC_IO_THREAD");
+	struct io_thread *io = NULL;
+	uint64_t max_spin_ns = 0;
+	sigset_t old_mask;
+	sigset_t mask;
+	int e = 0;
+
+	/* Busy polling is done on requests passed to the I/O thread */
+	max_spin_ns = busy_poll_max_ns();
+	if ((!env || strcmp(env, "1")) && !max_spin_ns)
+		return;
+
+	if (fd < 0 || fd >= TEEC_IO_MAX_FD) {
+		EMSG("channel %d out of range for an I/O thread", fd);
+		return;
+	}
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return;
+
+	io->fd = fd;
+	io->max_spin_ns = max_spin_ns;
+	io->idle_spin_ns = max_spin_ns;
+	io->head = &io->stub;
+	io->tail = &io->stub;
+
+	/* Keep the application's signals away from the I/O thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	e = pthread_create(&io->tid, NULL, io_thread_main, io);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		free(io);
+		return;
+	}
+
+	__atomic_store_n(&io_threads[fd], io, __ATOMIC_RELEASE);
+}
+
+void teec_io_stop(int fd)
+{
+	struct io_thread *io = NULL;
+	struct io_req req;
+
+	if (fd < 0 || fd >= TEEC_IO_MAX_FD)
+		return;
+
+	io = __atomic_exchange_n(&io_threads[fd], NULL, __ATOMIC_ACQ_REL);
+	if (!io)
+		return;
+
+	memset(&req, 0, sizeof(req));
+	req.op = TEEC_IO_STOP;
+	io_push(io, &req);
+	io_wait(io, &req);
+
+	pthread_join(io->tid, NULL);
+	busy_poll_report(io);
+	free(io);
+}
+
+void teec_io_channels_open(int fd)
+{
+	const char *env = getenv("TEEC_CHANNELS");
+	struct channel_group *grp = NULL;
+	unsigned long n = 0;
+	char *endp = NULL;
+	int cfd = 0;
+
+	if (!env)
+		return;
+
+	n = strtoul(env, &endp, 0);
+	if (endp == env || *endp || n < 2)
+		return;
+	if (n > TEEC_MAX_CHANNELS)
+		n = TEEC_MAX_CHANNELS;
+
+	if (fd < 0 || fd >= TEEC_IO_MAX_FD) {
+		EMSG("channel %d out of range for a channel group", fd);
+		return;
+	}
+
+	grp = calloc(1, sizeof(*grp));
+	if (!grp)
+		return;
+
+	grp->fd[0] = fd;
+	grp->count = 1;
+
+	/* Use as many channels as the platform provides */
+	while (grp->count < n) {
+		cfd = sel4_open_comm();
+		if (cfd < 1) {
+			DMSG("sel4_open_comm: %d", cfd);
+			break;
+		}
+		if (cfd >= TEEC_IO_MAX_FD) {
+			sel4_close_comm(cfd);
+			break;
+		}
+
+		teec_io_start(cfd);
+		grp->fd[grp->count++] = cfd;
+	}
+
+	if (grp->count == 1) {
+		IMSG("no additional channels available");
+		free(grp);
+		return;
+	}
+	if (grp->count < n)
+		IMSG("using %zu of %lu channels", grp->count, n);
+
+	__atomic_store_n(&channel_groups[fd], grp, __ATOMIC_RELEASE);
+}
+
+void teec_io_channels_close(int fd)
+{
+	struct channel_group *grp = NULL;
+	size_t n = 0;
+
+	if (fd < 0 || fd >= TEEC_IO_MAX_FD)
+		return;
+
+	/* Sessions left open on the channels are gone with them */
+	grp = __atomic_exchange_n(&channel_groups[fd], NULL, __ATOMIC_ACQ_REL);
+	if (!grp)
+		return;
+
+	for (n = 1; n < grp->count; n++) {
+		teec_io_stop(grp->fd[n]);
+		sel4_close_comm(grp->fd[n]);
+	}
+
+	free(grp);
+}
+
+static struct channel_group *channel_group(int fd)
+{
+	if (fd < 0 || fd >= TEEC_IO_MAX_FD)
+		return NULL;
+
+	return __atomic_load_n(&channel_groups[fd], __ATOMIC_ACQUIRE);
+}
+
+/* Returns the index of the channel of @grp bound to @owner, -1 if none */
+static int channel_find(struct channel_group *grp, const void *owner)
+{
+	size_t n = 0;
+
+	for (n = 0; n < grp->count; n++)
+		if (__atomic_load_n(&grp->owner[n], __ATOMIC_ACQUIRE) == owner)
+			return n;
+
+	return -1;
+}
+
+int teec_io_channel_get(int fd, const void *session)
+{
+	struct channel_group *grp = channel_group(fd);
+	const void *owner = NULL;
+	size_t n = 0;
+
+	if (!grp)
+		return fd;
+
+	for (n = 0; n < grp->count; n++) {
+		owner = NULL;
+		if (__atomic_compare_exchange_n(&grp->owner[n], &owner,
+						session, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			return grp->fd[n];
+	}
+
+	return -1;
+}
+
+int teec_io_channel_of(int fd, const void *session)
+{
+	struct channel_group *grp = channel_group(fd);
+	int n = 0;
+
+	if (!grp)
+		return fd;
+
+	n = channel_find(grp, session);
+	return n < 0 ? -1 : grp->fd[n];
+}
+
+bool teec_io_channel_exclusive(int fd, const void *session)
+{
+	struct channel_group *grp = channel_group(fd);
+
+	return grp && channel_find(grp, session) >= 0;
+}
+
+void teec_io_channel_move(int fd, const void *from, const void *to)
+{
+	struct channel_group *grp = channel_group(fd);
+	int n = 0;
+
+	if (!grp)
+		return;
+
+	n = channel_find(grp, from);
+	if (n >= 0)
+		__atomic_store_n(&grp->owner[n], to, __ATOMIC_RELEASE);
+}
+
+void teec_io_channel_put(int fd, const void *session)
+{
+	teec_io_channel_move(fd, session, NULL);
+}
@@ -26,9 +26,16 @@
  */
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <sys/syscall.h>
@@ -48,6 +55,284 @@
  */
 #define MAX_PRINT_SIZE 256
 
+static const char * const trace_level_strings[] = {
+	"", "ERR", "INF", "DBG", "FLW"
+};
+
+#ifdef CFG_TEE_CLIENT_LOG_ASYNC
+/*
+ * Asynchronous logging
+ *
+ * Each thread formats its messages into a private single producer, single
+ * consumer ring. A background writer thread drains all rings to stdout and
+ * to the log file, which is kept open. The calling thread never waits for
+ * I/O: if its ring is full the message is dropped and accounted for, the
+ * writer reports the number of dropped messages once there is room again.
+ */
+#define LOG_RING_SLOTS		64	/* must be a power of two */
+#define LOG_WRITER_IDLE_SEC	1
+
+struct log_ring {
+	uint32_t head;		/* next slot written by the owner thread */
+	uint32_t tail;		/* next slot read by the writer */
+	uint64_t dropped;	/* updated by the owner thread */
+	uint64_t reported;	/* dropped messages already reported */
+	bool in_use;
+	struct log_ring *next;
+	char msg[LOG_RING_SLOTS][MAX_PRINT_SIZE];
+};
+
+static pthread_mutex_t log_ring_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_drain_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_ring_head;
+static pthread_key_t log_ring_key;
+static bool log_writer_started;
+static bool log_writer_idle;
+static sem_t log_sem;
+#ifdef TEEC_LOG_FILE
+static int log_fd = -1;
+#endif
+
+static __thread struct log_ring *log_ring;
+
+static void log_ring_release(void *ptr)
+{
+	struct log_ring *ring = ptr;
+
+	/* The writer drains what is left before the ring is reused */
+	__atomic_store_n(&ring->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void log_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t r = 0;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += r;
+		len -= r;
+	}
+}
+
+static void log_emit(const char *msg)
+{
+	size_t len = strnlen(msg, MAX_PRINT_SIZE);
+
+	log_write_all(STDOUT_FILENO, msg, len);
+#ifdef TEEC_LOG_FILE
+	if (log_fd < 0)
+		log_fd = open(TEEC_LOG_FILE,
+			      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (log_fd >= 0)
+		log_write_all(log_fd, msg, len);
+#endif
+}
+
+/* Drains all rings, returns true if anything was written */
+static bool log_drain(void)
+{
+	struct log_ring *ring = NULL;
+	char note[MAX_PRINT_SIZE];
+	uint64_t dropped = 0;
+	uint32_t head = 0;
+	bool progress = false;
+
+	pthread_mutex_lock(&log_drain_mu);
+
+	ring = __atomic_load_n(&log_ring_head, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (ring->tail != head) {
+			log_emit(ring->msg[ring->tail & (LOG_RING_SLOTS - 1)]);
+			__atomic_store_n(&ring->tail, ring->tail + 1,
+					 __ATOMIC_RELEASE);
+			progress = true;
+		}
+
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			snprintf(note, sizeof(note),
+				 "%s: %" PRIu64 " log messages dropped\n",
+				 trace_level_strings[TRACE_ERROR],
+				 dropped - ring->reported);
+			log_emit(note);
+			ring->reported = dropped;
+			progress = true;
+		}
+	}
+
+	pthread_mutex_unlock(&log_drain_mu);
+
+	return progress;
+}
+
+static bool log_pending(void)
+{
+	struct log_ring *ring = __atomic_load_n(&log_ring_head,
+						__ATOMIC_ACQUIRE);
+
+	for (; ring; ring = ring->next)
+		if (ring->tail != __atomic_load_n(&ring->head,
+						  __ATOMIC_ACQUIRE))
+			return true;
+
+	return false;
+}
+
+static void *log_writer(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+
+	while (true) {
+		if (log_drain())
+			continue;
+
+		__atomic_store_n(&log_writer_idle, true, __ATOMIC_SEQ_CST);
+		/* Recheck to not miss a message published before going idle */
+		if (log_pending()) {
+			__atomic_store_n(&log_writer_idle, false,
+					 __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += LOG_WRITER_IDLE_SEC;
+		sem_timedwait(&log_sem, &ts);
+		__atomic_store_n(&log_writer_idle, false, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+static void log_flush(void)
+{
+	log_drain();
+}
+
+static void log_atfork_prepare(void)
+{
+	pthread_mutex_lock(&log_ring_mu);
+	pthread_mutex_lock(&log_drain_mu);
+}
+
+static void log_atfork_parent(void)
+{
+	pthread_mutex_unlock(&log_drain_mu);
+	pthread_mutex_unlock(&log_ring_mu);
+}
+
+static void log_atfork_child(void)
+{
+	/* The writer thread doesn't exist in the child, start a new one */
+	log_writer_started = false;
+	log_writer_idle = false;
+	pthread_mutex_unlock(&log_drain_mu);
+	pthread_mutex_unlock(&log_ring_mu);
+}
+
+/* Called with log_ring_mu held */
+static bool log_writer_start(void)
+{
+	static bool initialized;
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t mask;
+	sigset_t old_mask;
+	int e = 0;
+
+	if (log_writer_started)
+		return true;
+
+	if (!initialized) {
+		if (pthread_key_create(&log_ring_key, log_ring_release) ||
+		    sem_init(&log_sem, 0, 0))
+			return false;
+		pthread_atfork(log_atfork_prepare, log_atfork_parent,
+			       log_atfork_child);
+		atexit(log_flush);
+		initialized = true;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* Keep the application's signals away from the writer */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	e = pthread_create(&tid, &attr, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	pthread_attr_destroy(&attr);
+	if (e)
+		return false;
+
+	log_writer_started = true;
+	return true;
+}
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring = NULL;
+
+	if (log_ring)
+		return log_ring;
+
+	pthread_mutex_lock(&log_ring_mu);
+
+	if (!log_writer_start())
+		goto out;
+
+	/* Reuse a ring left by an exited thread once it has been drained */
+	for (ring = log_ring_head; ring; ring = ring->next)
+		if (!__atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE) &&
+		    ring->tail == ring->head)
+			break;
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			goto out;
+		ring->next = log_ring_head;
+		__atomic_store_n(&log_ring_head, ring, __ATOMIC_RELEASE);
+	}
+
+	ring->in_use = true;
+	pthread_setspecific(log_ring_key, ring);
+	log_ring = ring;
+out:
+	pthread_mutex_unlock(&log_ring_mu);
+
+	return ring;
+}
+
+static char *log_slot_get(struct log_ring *ring)
+{
+	uint32_t head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+	    LOG_RING_SLOTS) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return ring->msg[head & (LOG_RING_SLOTS - 1)];
+}
+
+static void log_slot_put(struct log_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_exchange_n(&log_writer_idle, false, __ATOMIC_SEQ_CST))
+		sem_post(&log_sem);
+}
+#endif /*CFG_TEE_CLIENT_LOG_ASYNC*/
+
 #ifdef TEEC_LOG_FILE
 static void log_to_file(const char *buffer)
 {
@@ -63,35 +348,52 @@ static void log_to_file(const char *buffer)
 #define log_to_file(buffer)
 #endif
 
-static const char * const trace_level_strings[] = {
-	"", "ERR", "INF", "DBG", "FLW"
-};
-
 void _dprintf(const char *function, int line, int level, const char *prefix,
 	      const char *fmt, ...)
 {
+#ifdef CFG_TEE_CLIENT_LOG_ASYNC
+	struct log_ring *ring = log_ring_get();
+	char fallback[MAX_PRINT_SIZE];
+	char *msg = fallback;
+#else
 	char msg[MAX_PRINT_SIZE];
+#endif
 	int n = 0;
 	va_list ap;
 
+#ifdef CFG_TEE_CLIENT_LOG_ASYNC
+	if (ring) {
+		msg = log_slot_get(ring);
+		if (!msg)
+			return;
+	}
+#endif
+
 	if (function) {
 		int thread_id = syscall(SYS_gettid);
 
-		n = snprintf(msg, sizeof(msg), "%s [%d] %s:%s:%d: ",
+		n = snprintf(msg, MAX_PRINT_SIZE, "%s [%d] %s:%s:%d: ",
 			trace_level_strings[level], thread_id, prefix,
 			function, line);
 		if (n < 0)
 			return;
 	}
 
-	if ((size_t)n < sizeof(msg)) {
+	if ((size_t)n < MAX_PRINT_SIZE) {
 		va_start(ap, fmt);
-		n = vsnprintf(msg + n, sizeof(msg) - n, fmt, ap);
+		n = vsnprintf(msg + n, MAX_PRINT_SIZE - n, fmt, ap);
 		va_end(ap);
 		if (n < 0)
 			return;
 	}
 
+#ifdef CFG_TEE_CLIENT_LOG_ASYNC
+	if (ring) {
+		log_slot_put(ring);
+		return;
+	}
+	/* No ring could be set up, print directly instead */
+#endif
 	fprintf(stdout, "%s", msg);
 	log_to_file(msg);
 }
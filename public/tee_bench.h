@@ -29,6 +29,8 @@
 #define TEE_BENCH_H
 
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #define PTA_BENCHMARK_UUID \
 		{ 0x0b9a63b0, 0xb4c6, 0x4c85, \
@@ -44,10 +46,21 @@
  * CCNT value is incremented every 64th clock cycle
  */
 #define TEE_BENCH_DIVIDER		64
-/* max amount of timestamps per buffer */
+/*
+ * Default amount of timestamps per buffer. The actual ring size is chosen
+ * by whoever sets up the shared buffer and is published in
+ * struct tee_ts_global::stamps, it must be a power of two.
+ */
 #define TEE_BENCH_MAX_STAMPS	32
 #define TEE_BENCH_MAX_MASK		(TEE_BENCH_MAX_STAMPS - 1)
 
+/*
+ * Identifies the layout of struct tee_ts_global, the buffer owner sets both
+ * and a mismatch means the buffer must not be used
+ */
+#define TEE_BENCH_MAGIC		0x48434e42	/* "BNCH" */
+#define TEE_BENCH_VERSION	1
+
 /* OP-TEE susbsystems ids */
 #define TEE_BENCH_CLIENT	0x10000000
 #define TEE_BENCH_KMOD		0x20000000
@@ -62,16 +75,120 @@ struct tee_time_st {
 	uint64_t src;	/* OP-TEE subsystem id */
 };
 
-/* per-cpu circular buffer for timestamps */
+/*
+ * per-cpu circular buffer for timestamps
+ *
+ * Producers reserve a slot by advancing @head and publish it by writing a
+ * non-zero @cnt last. A single consumer reads published slots from @tail,
+ * clears @cnt and advances @tail. When the ring is full the stamp is not
+ * stored and @overflow is incremented instead, so history is never
+ * silently overwritten.
+ */
 struct tee_ts_cpu_buf {
 	uint64_t head;
 	uint64_t tail;
-	struct tee_time_st stamps[TEE_BENCH_MAX_STAMPS];
+	uint64_t overflow;
+	uint64_t reserved;
+	struct tee_time_st stamps[];
 };
 
-/* memory layout for shared memory, where timestamps will be stored */
+/*
+ * memory layout for shared memory, where timestamps will be stored
+ *
+ * @cores per-cpu buffers of tee_ts_cpu_buf_size(@stamps) bytes each
+ * follow the header, use tee_ts_get_cpu_buf() to locate them. @magic and
+ * @version hold TEE_BENCH_MAGIC and TEE_BENCH_VERSION.
+ *
+ * The buffer is shared with the TEE, so users read @cores and @stamps
+ * once, validate that copy and only pass the copy to the helpers below.
+ */
 struct tee_ts_global {
+	uint32_t magic;
+	uint32_t version;
 	uint64_t cores;
-	struct tee_ts_cpu_buf cpu_buf[];
+	uint64_t stamps;
+	uint8_t cpu_buf[];
 };
+
+static inline bool tee_ts_stamps_valid(uint64_t stamps)
+{
+	return stamps && !(stamps & (stamps - 1));
+}
+
+static inline size_t tee_ts_cpu_buf_size(uint64_t stamps)
+{
+	return sizeof(struct tee_ts_cpu_buf) +
+	       stamps * sizeof(struct tee_time_st);
+}
+
+static inline size_t tee_ts_global_size(uint64_t cores, uint64_t stamps)
+{
+	return sizeof(struct tee_ts_global) +
+	       cores * tee_ts_cpu_buf_size(stamps);
+}
+
+static inline struct tee_ts_cpu_buf *
+tee_ts_get_cpu_buf(struct tee_ts_global *g, uint64_t stamps, uint64_t cpu)
+{
+	return (void *)(g->cpu_buf + cpu * tee_ts_cpu_buf_size(stamps));
+}
+
+/*
+ * Store a timestamp, returns false if it was dropped due to overflow.
+ * @stamps is the validated ring size, see struct tee_ts_global.
+ */
+static inline bool tee_ts_push(struct tee_ts_cpu_buf *buf, uint64_t stamps,
+			       const struct tee_time_st *ts)
+{
+	struct tee_time_st *slot = NULL;
+	uint64_t head = __atomic_load_n(&buf->head, __ATOMIC_RELAXED);
+
+	do {
+		if (head - __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE) >=
+		    stamps) {
+			__atomic_fetch_add(&buf->overflow, 1,
+					   __ATOMIC_RELAXED);
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&buf->head, &head, head + 1,
+					      true, __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+
+	slot = &buf->stamps[head & (stamps - 1)];
+	slot->addr = ts->addr;
+	slot->src = ts->src;
+	/* A zero count would look like an unpublished slot */
+	__atomic_store_n(&slot->cnt, ts->cnt ? ts->cnt : 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Fetch the oldest published timestamp. Must only be called from a single
+ * consumer per buffer. Returns false if there is nothing to read yet.
+ */
+static inline bool tee_ts_pop(struct tee_ts_cpu_buf *buf, uint64_t stamps,
+			      struct tee_time_st *ts)
+{
+	struct tee_time_st *slot = NULL;
+	uint64_t tail = __atomic_load_n(&buf->tail, __ATOMIC_RELAXED);
+	uint64_t cnt = 0;
+
+	if (tail == __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE))
+		return false;
+
+	slot = &buf->stamps[tail & (stamps - 1)];
+	cnt = __atomic_load_n(&slot->cnt, __ATOMIC_ACQUIRE);
+	if (!cnt)
+		return false;
+
+	ts->cnt = cnt;
+	ts->addr = slot->addr;
+	ts->src = slot->src;
+
+	__atomic_store_n(&slot->cnt, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&buf->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
 #endif /* TEE_BENCH_H */
@@ -42,6 +42,11 @@ extern "C" {
  * @param sharedMem  pointer to the shared memory structure to register.
  * @param fd         file descriptor of the target memory.
  *
+ * A dma-buf, or a memfd sealed with F_SEAL_SHRINK, is used in place. The
+ * content of any other file is copied at registration and written back
+ * when the memory is released, changes in between aren't seen. The file
+ * descriptor is never sealed.
+ *
  * @return TEEC_SUCCESS              The registration was successful.
  * @return TEEC_ERROR_OUT_OF_MEMORY  Memory exhaustion.
  * @return TEEC_Result               Something failed.
@@ -50,6 +55,23 @@ TEEC_Result TEEC_RegisterSharedMemoryFileDescriptor(TEEC_Context *context,
 						    TEEC_SharedMemory *sharedMem,
 						    int fd);
 
+/**
+ * TEEC_GetOutputSizeHint() - Get the size last returned in an output memref
+ *
+ * Hints are only kept when TEEC_SIZE_HINTS=1 is set in the environment.
+ * Sizing the output buffer from the hint before calling
+ * TEEC_AllocateSharedMemory() avoids an invoke that only returns
+ * TEEC_ERROR_SHORT_BUFFER.
+ *
+ * @param session    The session the command was invoked on.
+ * @param cmd_id     The command ID passed to TEEC_InvokeCommand().
+ * @param idx        Index of the parameter in the operation.
+ *
+ * @return the size in bytes, or 0 if no size is known.
+ */
+size_t TEEC_GetOutputSizeHint(TEEC_Session *session, uint32_t cmd_id,
+			      uint32_t idx);
+
 #ifdef __cplusplus
 }
 #endif
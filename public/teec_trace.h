@@ -141,6 +141,88 @@ void _dprintf(const char *function, int line, int level, const char *prefix,
  */
 void dump_buffer(const char *bname, const uint8_t *buffer, size_t blen);
 
+/*
+ * Flight recorder
+ *
+ * When TEEC_FLIGHT_REC is set in the environment, compact binary records
+ * are written to a per-process ring which is mapped from a file, so the
+ * most recent history survives a crash. TEEC_FLIGHT_REC holds the number
+ * of records of the ring, 0 disables recording and any other value picks
+ * the default size. Sending SIGUSR2 to the process dumps a snapshot of the
+ * ring next to it.
+ *
+ * The ring of process <pid> is "<pid>" and its dump "<pid>.dump" in the
+ * directory "teec-frec.<euid>" of $XDG_RUNTIME_DIR, or of the directory
+ * configured with CFG_TEE_FLIGHT_REC_DIR if that isn't set. The directory
+ * is created with mode 0700 and isn't used unless it's owned by the user
+ * and private, then the ring is only kept in memory.
+ *
+ * Every record carries the correlation ID of the client call the thread is
+ * working on. libteec allocates one per call, tee-supplicant picks it up
+ * from the RPC request when the TEE forwards it. Timestamps are taken from
+ * CLOCK_MONOTONIC, so the rings of the client and of tee-supplicant can be
+ * merged into one timeline.
+ */
+#define TEEC_FREC_MAGIC		0x43455246	/* "FREC" */
+#define TEEC_FREC_VERSION	2
+
+enum teec_frec_event {
+	TEEC_FREC_OPEN_SESSION_ENTRY = 1,
+	TEEC_FREC_OPEN_SESSION_EXIT,
+	TEEC_FREC_CLOSE_SESSION_ENTRY,
+	TEEC_FREC_CLOSE_SESSION_EXIT,
+	TEEC_FREC_INVOKE_ENTRY,
+	TEEC_FREC_INVOKE_EXIT,
+	TEEC_FREC_CK_INVOKE_ENTRY,
+	TEEC_FREC_CK_INVOKE_EXIT,
+	TEEC_FREC_RPC_ENTRY,
+	TEEC_FREC_RPC_EXIT,
+	TEEC_FREC_FS_ENTRY,
+	TEEC_FREC_FS_EXIT,
+};
+
+/* File header, followed by @num_recs records */
+struct teec_frec_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t num_recs;	/* power of two */
+	uint32_t pid;
+	uint64_t head;		/* total number of records ever written */
+};
+
+/*
+ * @seq is the record number + 1 and is written last, a record whose @seq
+ * doesn't match its position in the ring is being overwritten.
+ */
+struct teec_frec_rec {
+	uint64_t seq;
+	uint64_t ts_ns;		/* CLOCK_MONOTONIC */
+	uint64_t corr_id;	/* 0 if not part of a client call */
+	uint32_t tid;
+	uint16_t event;
+	uint16_t reserved;
+	uint64_t args[3];
+};
+
+void teec_frec_log(uint16_t event, uint64_t a0, uint64_t a1, uint64_t a2);
+
+/*
+ * teec_corr_enter() - Starts a client call on the calling thread
+ *
+ * Allocates a new correlation ID unless the thread is already inside a
+ * call, in which case the outer ID is kept.
+ *
+ * @return the ID to pass to teec_corr_leave()
+ */
+uint64_t teec_corr_enter(void);
+void teec_corr_leave(uint64_t prev);
+uint64_t teec_corr_get(void);
+void teec_corr_set(uint64_t corr_id);
+
+#define FREC(event, a0, a1, a2) \
+	teec_frec_log(TEEC_FREC_##event, (a0), (a1), (a2))
+
 #ifdef TRACE_PKCS11_API_CALLS
 #define IMSG_FN_ENTRY()    _dprintf(__func__, __LINE__, TRACE_INFO, BINARY_PREFIX, "->\n")
 #else
@@ -0,0 +1,1217 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tee_client_api.h>
+#include <teec_broker.h>
+#include <teec_io.h>
+#include <teec_trace.h>
+
+#include "sel4_req.h"
+#include "sel4_serializer.h"
+
+/*
+ * tee-broker owns the seL4 comm channels and serves libteec clients over
+ * a unix socket (see teec_broker.h for the protocol). Short-lived tools
+ * then don't pay for opening a channel, and with --warm sessions closed
+ * by a client are kept open for the next open from the same user of the
+ * same TA with an identical open frame. A reused session keeps whatever
+ * state the TA holds for it, a login for instance, so only sessions of
+ * the TAs listed with --warm-uuid are kept.
+ *
+ * The main thread accepts clients and reads their requests into per
+ * client, per channel queues. Each channel has a worker serving its
+ * queues round robin, one request per client per turn, so a busy client
+ * can't starve the others. A client has at most as many requests queued
+ * as it has mailbox slots. The transport has no session handle, so each
+ * session, warm ones included, owns a channel until closed and an open
+ * finding all channels taken fails with TEEC_ERROR_BUSY. Queue and
+ * service time, request count and bytes are accounted per client, logged
+ * when the client disconnects and for all clients on SIGUSR1.
+ */
+#ifndef TEE_BROKER_SOCKET
+#define TEE_BROKER_SOCKET	"/run/tee-broker.sock"
+#endif
+
+#define MAX_CLIENTS		128	/* clients[0] is the broker itself */
+#define MAX_SESSIONS		1024
+#define MAX_CHANNELS		16
+
+#define DEFAULT_SLOTS		16
+#define DEFAULT_SLOT_SIZE	(64 * 1024)
+#define DEFAULT_WARM_IDLE	30	/* seconds */
+#define MAX_WARM_UUIDS		16
+
+struct req {
+	struct req *next;
+	struct client *cl;
+	struct teec_broker_msg msg;
+	char *frame;
+	char *open_frame;	/* copy of an open's frame for warm reuse */
+	uint64_t queued_ns;
+};
+
+struct req_fifo {
+	struct req *head;
+	struct req *tail;
+};
+
+struct client {
+	int sock;
+	pid_t pid;
+	uid_t uid;
+	uint8_t *mbox;
+	bool dead;
+	unsigned int queued;	/* queued or being served */
+	struct req_fifo q[MAX_CHANNELS];
+	uint64_t requests;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t queue_ns;
+	uint64_t service_ns;
+};
+
+struct session {
+	bool used;
+	bool warm;		/* closed by its client, kept open */
+	bool closing;
+	struct client *owner;
+	uid_t uid;
+	size_t chan;
+	char *open_frame;	/* for matching warm sessions */
+	uint32_t open_len;
+	uint8_t uuid[TEEC_BROKER_UUID_LEN];
+	char *resp;		/* response to the open */
+	uint32_t resp_len;
+	time_t idle_since;
+};
+
+struct channel {
+	int fd;
+	pthread_t tid;
+	pthread_cond_t cond;
+	bool busy;		/* owned by a session or an open */
+	size_t next;		/* client served next */
+};
+
+/* Guards everything below */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct client self = { .sock = -1 };
+static struct client *clients[MAX_CLIENTS] = { &self };
+static struct session sessions[MAX_SESSIONS];
+static struct channel channels[MAX_CHANNELS];
+static size_t num_channels = 1;
+static bool quit;
+
+static uint32_t num_slots = DEFAULT_SLOTS;
+static uint32_t slot_size = DEFAULT_SLOT_SIZE;
+static unsigned int warm_max;
+static unsigned int warm_count;
+static unsigned int warm_idle = DEFAULT_WARM_IDLE;
+static uint8_t warm_uuids[MAX_WARM_UUIDS][TEEC_BROKER_UUID_LEN];
+static size_t num_warm_uuids;
+
+static volatile sig_atomic_t sig_quit;
+static volatile sig_atomic_t sig_dump;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static time_t now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static int send_msg(int sock, struct teec_broker_msg *msg, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg = NULL;
+	ssize_t r = 0;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do {
+		r = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+
+	return r == sizeof(*msg) ? 0 : -1;
+}
+
+/* Returns 1 on a message, 0 on end of stream and -1 on error */
+static int recv_msg(int sock, struct teec_broker_msg *msg, int *fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg = NULL;
+	ssize_t r = 0;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	*fd = -1;
+
+	do {
+		r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	} while (r < 0 && errno == EINTR);
+	if (r <= 0)
+		return r;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (r != sizeof(*msg) ||
+	    !!(msg->flags & TEEC_BROKER_FLAG_FD) != (*fd >= 0)) {
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Seals the size of a memfd before it is passed to a client, a client
+ * shrinking one the broker has mapped would kill it with SIGBUS.
+ */
+static int seal_size(int fd)
+{
+	return fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+}
+
+static int frame_to_fd(const char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t r = 0;
+	int fd = memfd_create("tee_broker_frame",
+			      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (fd < 0)
+		return -1;
+
+	while (done < len) {
+		r = pwrite(fd, buf + done, len - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += r;
+	}
+
+	if (seal_size(fd)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static char *frame_from_fd(int fd, size_t len)
+{
+	struct stat st;
+	size_t done = 0;
+	ssize_t r = 0;
+	char *buf = NULL;
+
+	if (fstat(fd, &st) || (uint64_t)st.st_size < len)
+		return NULL;
+
+	buf = malloc(len ? len : 1);
+	while (buf && done < len) {
+		r = pread(fd, buf + done, len - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			free(buf);
+			return NULL;
+		}
+		done += r;
+	}
+
+	return buf;
+}
+
+/* Sends the reply to @msg with the response frame @frame, if any */
+static void reply(struct client *cl, struct teec_broker_msg *msg,
+		  const char *frame, uint32_t len)
+{
+	int fd = -1;
+
+	msg->flags = 0;
+	msg->len = 0;
+
+	if (!msg->ret && frame) {
+		msg->len = len;
+		if (len <= slot_size) {
+			memcpy(cl->mbox + (size_t)msg->slot * slot_size, frame,
+			       len);
+		} else {
+			fd = frame_to_fd(frame, len);
+			if (fd < 0)
+				msg->ret = -ENOMEM;
+			else
+				msg->flags = TEEC_BROKER_FLAG_FD;
+		}
+	}
+
+	if (send_msg(cl->sock, msg, fd))
+		DMSG("client %d: reply lost", (int)cl->pid);
+	if (fd >= 0)
+		close(fd);
+}
+
+static void fifo_push(struct req_fifo *q, struct req *r)
+{
+	r->next = NULL;
+	if (q->tail)
+		q->tail->next = r;
+	else
+		q->head = r;
+	q->tail = r;
+}
+
+static struct req *fifo_pop(struct req_fifo *q)
+{
+	struct req *r = q->head;
+
+	if (r) {
+		q->head = r->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+
+	return r;
+}
+
+/* Called with the mutex held */
+static void enqueue(struct client *cl, size_t chan, struct req *r)
+{
+	r->cl = cl;
+	r->queued_ns = now_ns();
+	cl->queued++;
+	fifo_push(&cl->q[chan], r);
+	pthread_cond_signal(&channels[chan].cond);
+}
+
+/* Called with the mutex held, queues a close the broker itself waits on */
+static void close_internal(uint32_t handle)
+{
+	struct session *s = sessions + handle - 1;
+	struct serialized_param *frame = NULL;
+	struct req *r = calloc(1, sizeof(*r));
+
+	if (!r || sel4_serialize_params(NULL, 0, &frame, &r->msg.len)) {
+		EMSG("out of memory, leaking session %" PRIu32, handle);
+		free(r);
+		return;
+	}
+
+	s->owner = &self;
+	s->closing = true;
+	r->msg.op = TEEC_BROKER_CLOSE_SESSION;
+	r->msg.session = handle;
+	r->frame = (char *)frame;
+	enqueue(&self, s->chan, r);
+}
+
+static void session_free(struct session *s)
+{
+	channels[s->chan].busy = false;
+	free(s->open_frame);
+	free(s->resp);
+	memset(s, 0, sizeof(*s));
+}
+
+/* Called with the mutex held */
+static struct req *next_req(struct channel *ch, size_t chan)
+{
+	struct client *cl = NULL;
+	struct req *r = NULL;
+	size_t n = 0;
+
+	for (n = 0; n < MAX_CLIENTS; n++) {
+		cl = clients[(ch->next + n) % MAX_CLIENTS];
+		if (!cl)
+			continue;
+
+		r = fifo_pop(&cl->q[chan]);
+		if (r) {
+			ch->next = (ch->next + n + 1) % MAX_CLIENTS;
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+static int32_t session_open(struct req *r, size_t chan, const char *resp,
+			    uint32_t resp_len)
+{
+	struct session *s = NULL;
+	uint32_t n = 0;
+
+	for (n = 0; n < MAX_SESSIONS; n++)
+		if (!sessions[n].used)
+			break;
+	if (n == MAX_SESSIONS)
+		return -ENOSPC;
+
+	s = sessions + n;
+	s->used = true;
+	s->owner = r->cl;
+	s->uid = r->cl->uid;
+	s->chan = chan;
+	memcpy(s->uuid, r->msg.uuid, sizeof(s->uuid));
+
+	/* Only sessions with a recorded open can be kept warm */
+	if (r->open_frame) {
+		s->resp = malloc(resp_len ? resp_len : 1);
+		if (s->resp) {
+			memcpy(s->resp, resp, resp_len);
+			s->resp_len = resp_len;
+			s->open_frame = r->open_frame;
+			s->open_len = r->msg.len;
+			r->open_frame = NULL;
+		}
+	}
+
+	r->msg.session = n + 1;
+
+	return 0;
+}
+
+static void *channel_main(void *arg)
+{
+	struct channel *ch = arg;
+	size_t chan = ch - channels;
+	struct teec_broker_msg *msg = NULL;
+	enum teec_io_op op = TEEC_IO_INVOKE;
+	struct client *cl = NULL;
+	struct req *r = NULL;
+	uint64_t start = 0;
+	uint32_t len = 0;
+	int32_t tee_err = 0;
+	uint32_t ta_err = 0;
+
+	pthread_mutex_lock(&mutex);
+	while (!quit) {
+		r = next_req(ch, chan);
+		if (!r) {
+			pthread_cond_wait(&ch->cond, &mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&mutex);
+
+		cl = r->cl;
+		msg = &r->msg;
+		if (msg->op == TEEC_BROKER_OPEN_SESSION)
+			op = TEEC_IO_OPEN_SESSION;
+		else if (msg->op == TEEC_BROKER_CLOSE_SESSION)
+			op = TEEC_IO_CLOSE_SESSION;
+		else
+			op = TEEC_IO_INVOKE;
+
+		/* The close frame carries no parameters */
+		if (!r->frame)
+			r->frame = calloc(1, 1);
+
+		start = now_ns();
+		len = msg->len;
+		tee_err = 0;
+		ta_err = 0;
+		msg->ret = teec_io_call(ch->fd, op, NULL, msg->cmd_id,
+					&r->frame, &len, &tee_err, &ta_err);
+		msg->tee_err = tee_err;
+		msg->ta_err = ta_err;
+
+		pthread_mutex_lock(&mutex);
+		cl->requests++;
+		cl->bytes_in += msg->len;
+		cl->bytes_out += len;
+		cl->queue_ns += start - r->queued_ns;
+		cl->service_ns += now_ns() - start;
+
+		if (op == TEEC_IO_OPEN_SESSION && !msg->ret && !tee_err &&
+		    !ta_err) {
+			msg->ret = session_open(r, chan, r->frame, len);
+			/* A dead client leaves nobody to close it */
+			if (msg->ret)
+				ch->busy = false;
+			else if (cl->dead)
+				close_internal(msg->session);
+		} else if (op == TEEC_IO_OPEN_SESSION) {
+			ch->busy = false;
+		} else if (op == TEEC_IO_CLOSE_SESSION) {
+			session_free(sessions + msg->session - 1);
+		}
+
+		if (!cl->dead && cl != &self) {
+			pthread_mutex_unlock(&mutex);
+			reply(cl, msg, r->frame, len);
+			pthread_mutex_lock(&mutex);
+		}
+
+		/* The main thread reaps dead clients once they're idle */
+		cl->queued--;
+
+		free(r->open_frame);
+		free(r->frame);
+		free(r);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return NULL;
+}
+
+/* Returns true if sessions of the TA with UUID @uuid may be kept warm */
+static bool warm_listed(const uint8_t *uuid)
+{
+	size_t n = 0;
+
+	for (n = 0; n < num_warm_uuids; n++)
+		if (!memcmp(warm_uuids[n], uuid, TEEC_BROKER_UUID_LEN))
+			return true;
+
+	return false;
+}
+
+/* Called with the mutex held, returns a session to reuse or 0 */
+static uint32_t warm_lookup(struct client *cl, const uint8_t *uuid,
+			    const char *frame, uint32_t len)
+{
+	struct session *s = NULL;
+	uint32_t n = 0;
+
+	for (n = 0; n < MAX_SESSIONS; n++) {
+		s = sessions + n;
+		if (s->used && s->warm && s->uid == cl->uid &&
+		    !memcmp(s->uuid, uuid, sizeof(s->uuid)) &&
+		    s->open_len == len && !memcmp(s->open_frame, frame, len))
+			return n + 1;
+	}
+
+	return 0;
+}
+
+/* Called with the mutex held */
+static struct session *client_session(struct client *cl, uint32_t handle)
+{
+	struct session *s = NULL;
+
+	if (!handle || handle > MAX_SESSIONS)
+		return NULL;
+
+	s = sessions + handle - 1;
+	if (!s->used || s->warm || s->closing || s->owner != cl)
+		return NULL;
+
+	return s;
+}
+
+/*
+ * Called with the mutex held, claims a channel for an open. If all are
+ * taken the warm session idle the longest is closed, so that a retry
+ * can succeed, and -1 is returned.
+ */
+static int claim_channel(void)
+{
+	struct session *oldest = NULL;
+	struct session *s = NULL;
+	size_t n = 0;
+
+	for (n = 0; n < num_channels; n++) {
+		if (!channels[n].busy) {
+			channels[n].busy = true;
+			return n;
+		}
+	}
+
+	for (n = 0; n < MAX_SESSIONS; n++) {
+		s = sessions + n;
+		if (s->used && s->warm &&
+		    (!oldest || s->idle_since < oldest->idle_since))
+			oldest = s;
+	}
+	if (oldest) {
+		oldest->warm = false;
+		warm_count--;
+		close_internal(oldest - sessions + 1);
+	}
+
+	return -1;
+}
+
+static void handle_request(struct client *cl, struct teec_broker_msg *msg,
+			   int fd)
+{
+	struct session *s = NULL;
+	struct req *r = NULL;
+	uint32_t handle = 0;
+	char *frame = NULL;
+	int chan = -1;
+
+	if (msg->slot >= num_slots) {
+		msg->ret = -EINVAL;
+		goto err;
+	}
+
+	if (fd >= 0) {
+		frame = frame_from_fd(fd, msg->len);
+	} else if (msg->len <= slot_size) {
+		/* Copied, the client can still write the slot */
+		frame = malloc(msg->len ? msg->len : 1);
+		if (frame)
+			memcpy(frame, cl->mbox + (size_t)msg->slot * slot_size,
+			       msg->len);
+	} else {
+		msg->ret = -EINVAL;
+		goto err;
+	}
+	if (!frame) {
+		msg->ret = -ENOMEM;
+		goto err;
+	}
+
+	pthread_mutex_lock(&mutex);
+	switch (msg->op) {
+	case TEEC_BROKER_OPEN_SESSION:
+		handle = warm_lookup(cl, msg->uuid, frame, msg->len);
+		if (handle) {
+			s = sessions + handle - 1;
+			s->warm = false;
+			s->owner = cl;
+			warm_count--;
+			pthread_mutex_unlock(&mutex);
+			msg->ret = 0;
+			msg->tee_err = 0;
+			msg->ta_err = 0;
+			msg->session = handle;
+			reply(cl, msg, s->resp, s->resp_len);
+			free(frame);
+			return;
+		}
+		msg->session = 0;
+		chan = claim_channel();
+		if (chan < 0) {
+			pthread_mutex_unlock(&mutex);
+			msg->ret = 0;
+			msg->tee_err = TEEC_ERROR_BUSY;
+			msg->ta_err = 0;
+			goto err;
+		}
+		break;
+	case TEEC_BROKER_CLOSE_SESSION:
+	case TEEC_BROKER_INVOKE:
+		s = client_session(cl, msg->session);
+		if (!s) {
+			pthread_mutex_unlock(&mutex);
+			msg->ret = -EBADF;
+			goto err;
+		}
+		chan = s->chan;
+		if (msg->op == TEEC_BROKER_INVOKE)
+			break;
+
+		s->closing = true;
+		if (warm_count < warm_max && s->open_frame) {
+			s->closing = false;
+			s->warm = true;
+			s->owner = NULL;
+			s->idle_since = now_sec();
+			warm_count++;
+			pthread_mutex_unlock(&mutex);
+			msg->ret = 0;
+			msg->tee_err = 0;
+			msg->ta_err = 0;
+			reply(cl, msg, NULL, 0);
+			free(frame);
+			return;
+		}
+		break;
+	default:
+		pthread_mutex_unlock(&mutex);
+		msg->ret = -EINVAL;
+		goto err;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		if (msg->op == TEEC_BROKER_OPEN_SESSION)
+			channels[chan].busy = false;
+		pthread_mutex_unlock(&mutex);
+		msg->ret = -ENOMEM;
+		goto err;
+	}
+	r->msg = *msg;
+	r->frame = frame;
+	if (msg->op == TEEC_BROKER_OPEN_SESSION && warm_max &&
+	    warm_listed(msg->uuid)) {
+		r->open_frame = malloc(msg->len ? msg->len : 1);
+		if (r->open_frame)
+			memcpy(r->open_frame, frame, msg->len);
+	}
+	enqueue(cl, chan, r);
+	pthread_mutex_unlock(&mutex);
+
+	return;
+err:
+	free(frame);
+	reply(cl, msg, NULL, 0);
+}
+
+static void client_report(struct client *cl)
+{
+	IMSG("client %d uid %d: %" PRIu64 " requests, %" PRIu64
+	     " bytes in, %" PRIu64 " bytes out, avg queue %" PRIu64
+	     " ns, avg service %" PRIu64 " ns",
+	     (int)cl->pid, (int)cl->uid, cl->requests, cl->bytes_in,
+	     cl->bytes_out, cl->requests ? cl->queue_ns / cl->requests : 0,
+	     cl->requests ? cl->service_ns / cl->requests : 0);
+}
+
+static void client_accept(int lsock)
+{
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	struct client *cl = NULL;
+	int sock = -1;
+	size_t n = 0;
+
+	sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0)
+		return;
+
+	cl = calloc(1, sizeof(*cl));
+	if (!cl)
+		goto err;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len))
+		goto err;
+	cl->pid = cred.pid;
+	cl->uid = cred.uid;
+	cl->sock = sock;
+
+	pthread_mutex_lock(&mutex);
+	for (n = 1; n < MAX_CLIENTS; n++)
+		if (!clients[n])
+			break;
+	if (n < MAX_CLIENTS)
+		clients[n] = cl;
+	pthread_mutex_unlock(&mutex);
+	if (n == MAX_CLIENTS) {
+		EMSG("too many clients");
+		goto err;
+	}
+
+	DMSG("client %d uid %d connected", (int)cl->pid, (int)cl->uid);
+
+	return;
+err:
+	free(cl);
+	close(sock);
+}
+
+/* The first message of a client must be a HELLO, answered with its mailbox */
+static int client_hello(struct client *cl, struct teec_broker_msg *msg)
+{
+	size_t mbox_size = (size_t)num_slots * slot_size;
+	void *mbox = NULL;
+	int mbox_fd = -1;
+	int ret = -1;
+
+	if (msg->op != TEEC_BROKER_HELLO ||
+	    msg->cmd_id != TEEC_BROKER_VERSION) {
+		EMSG("client %d: bad handshake", (int)cl->pid);
+		return -1;
+	}
+
+	mbox_fd = memfd_create("tee_broker_mbox",
+			       MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mbox_fd < 0 || ftruncate(mbox_fd, mbox_size) || seal_size(mbox_fd))
+		goto out;
+	mbox = mmap(NULL, mbox_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    mbox_fd, 0);
+	if (mbox == MAP_FAILED)
+		goto out;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->op = TEEC_BROKER_HELLO;
+	msg->slot = num_slots;
+	msg->len = slot_size;
+	msg->flags = TEEC_BROKER_FLAG_FD;
+	if (send_msg(cl->sock, msg, mbox_fd)) {
+		munmap(mbox, mbox_size);
+		goto out;
+	}
+
+	cl->mbox = mbox;
+	ret = 0;
+out:
+	if (mbox_fd >= 0)
+		close(mbox_fd);
+	return ret;
+}
+
+/* Called with the mutex held */
+static void client_disconnect(struct client *cl)
+{
+	struct session *s = NULL;
+	size_t n = 0;
+
+	cl->dead = true;
+
+	for (n = 0; n < MAX_SESSIONS; n++) {
+		s = sessions + n;
+		if (!s->used || s->owner != cl || s->closing)
+			continue;
+
+		if (warm_count < warm_max && s->open_frame) {
+			s->warm = true;
+			s->owner = NULL;
+			s->idle_since = now_sec();
+			warm_count++;
+		} else {
+			close_internal(n + 1);
+		}
+	}
+}
+
+/* Called with the mutex held */
+static void client_reap(size_t idx)
+{
+	struct client *cl = clients[idx];
+
+	clients[idx] = NULL;
+	client_report(cl);
+	close(cl->sock);
+	if (cl->mbox)
+		munmap(cl->mbox, (size_t)num_slots * slot_size);
+	free(cl);
+}
+
+/* Called with the mutex held */
+static void warm_expire(void)
+{
+	time_t now = now_sec();
+	struct session *s = NULL;
+	size_t n = 0;
+
+	for (n = 0; n < MAX_SESSIONS; n++) {
+		s = sessions + n;
+		if (s->used && s->warm && now - s->idle_since >= warm_idle) {
+			s->warm = false;
+			warm_count--;
+			close_internal(n + 1);
+		}
+	}
+}
+
+static void serve(int lsock)
+{
+	struct pollfd pfd[MAX_CLIENTS];
+	struct client *cl = NULL;
+	struct teec_broker_msg msg;
+	size_t idx[MAX_CLIENTS];
+	size_t nfds = 0;
+	size_t n = 0;
+	int fd = -1;
+	int r = 0;
+
+	while (!sig_quit) {
+		pthread_mutex_lock(&mutex);
+		if (sig_dump) {
+			sig_dump = 0;
+			for (n = 1; n < MAX_CLIENTS; n++)
+				if (clients[n])
+					client_report(clients[n]);
+			IMSG("%u warm sessions", warm_count);
+		}
+
+		warm_expire();
+
+		pfd[0].fd = lsock;
+		pfd[0].events = POLLIN;
+		nfds = 1;
+		for (n = 1; n < MAX_CLIENTS; n++) {
+			cl = clients[n];
+			if (!cl)
+				continue;
+			if (cl->dead) {
+				if (!cl->queued)
+					client_reap(n);
+				continue;
+			}
+
+			/* No more requests than mailbox slots */
+			pfd[nfds].fd = cl->sock;
+			pfd[nfds].events = cl->queued < num_slots ? POLLIN : 0;
+			idx[nfds] = n;
+			nfds++;
+		}
+		pthread_mutex_unlock(&mutex);
+
+		if (poll(pfd, nfds, 1000) < 0) {
+			if (errno == EINTR)
+				continue;
+			EMSG("poll: %s", strerror(errno));
+			break;
+		}
+
+		for (n = 1; n < nfds; n++) {
+			if (!pfd[n].revents)
+				continue;
+
+			cl = clients[idx[n]];
+			r = 0;
+			if (pfd[n].revents & POLLIN)
+				r = recv_msg(cl->sock, &msg, &fd);
+			if (r < 0 && errno == EAGAIN)
+				continue;
+
+			if (r == 1 && !cl->mbox && fd < 0 &&
+			    !client_hello(cl, &msg))
+				continue;
+
+			if (r == 1 && cl->mbox) {
+				handle_request(cl, &msg, fd);
+				if (fd >= 0)
+					close(fd);
+				continue;
+			}
+
+			if (fd >= 0)
+				close(fd);
+
+			DMSG("client %d disconnected", (int)cl->pid);
+			pthread_mutex_lock(&mutex);
+			client_disconnect(cl);
+			pthread_mutex_unlock(&mutex);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			client_accept(lsock);
+	}
+}
+
+/*
+ * Removes the socket a previous instance left at @path. Anything else
+ * there, or a socket that is still served, is left alone and fails.
+ */
+static int remove_stale(const struct sockaddr_un *sa)
+{
+	struct stat st;
+	int sock = -1;
+	int ret = 0;
+
+	if (lstat(sa->sun_path, &st))
+		return errno == ENOENT ? 0 : -1;
+
+	if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	ret = connect(sock, (const struct sockaddr *)sa, sizeof(*sa));
+	close(sock);
+	if (!ret) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+	if (errno != ECONNREFUSED)
+		return -1;
+
+	return unlink(sa->sun_path);
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un sa;
+	mode_t mask = 0;
+	int sock = -1;
+	int ret = 0;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		EMSG("socket path too long");
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		EMSG("socket: %s", strerror(errno));
+		return -1;
+	}
+
+	if (remove_stale(&sa)) {
+		EMSG("%s: %s", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	/*
+	 * Access is granted through the socket's group. The socket is
+	 * created with its final mode, no threads run yet to see the umask.
+	 */
+	mask = umask(0117);
+	ret = bind(sock, (struct sockaddr *)&sa, sizeof(sa));
+	umask(mask);
+	if (ret || listen(sock, 64)) {
+		EMSG("%s: %s", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static void handle_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		sig_dump = 1;
+	else
+		sig_quit = 1;
+}
+
+static int usage(int status)
+{
+	fprintf(stderr, "Usage: tee-broker [options]\n");
+	fprintf(stderr, "  -d, --daemon          run as a daemon\n");
+	fprintf(stderr, "  -s, --socket=PATH     listen on PATH [%s]\n",
+		TEE_BROKER_SOCKET);
+	fprintf(stderr, "  -c, --channels=N      comm channels to open [1]\n");
+	fprintf(stderr, "  -n, --slots=N         mailbox slots per client [%d]\n",
+		DEFAULT_SLOTS);
+	fprintf(stderr, "  -b, --slot-size=N     bytes per mailbox slot [%d]\n",
+		DEFAULT_SLOT_SIZE);
+	fprintf(stderr, "  -w, --warm=N          sessions kept open after close [0]\n");
+	fprintf(stderr, "  -i, --warm-idle=SEC   close warm sessions idle for SEC [%d]\n",
+		DEFAULT_WARM_IDLE);
+	fprintf(stderr, "  -u, --warm-uuid=UUID  keep sessions of TA UUID warm, up to %d\n",
+		MAX_WARM_UUIDS);
+	return status;
+}
+
+static bool parse_uint(const char *s, unsigned long min, unsigned long max,
+		       unsigned long *val)
+{
+	char *endp = NULL;
+
+	errno = 0;
+	*val = strtoul(s, &endp, 0);
+
+	return !errno && endp != s && !*endp && *val >= min && *val <= max;
+}
+
+/* Parses a UUID in its string form to octets, as libteec sends it */
+static bool parse_uuid(const char *s, uint8_t *uuid)
+{
+	size_t n = 0;
+
+	for (n = 0; n < TEEC_BROKER_UUID_LEN; n++) {
+		if ((n == 4 || n == 6 || n == 8 || n == 10) && *s++ != '-')
+			return false;
+		if (!isxdigit((unsigned char)s[0]) ||
+		    !isxdigit((unsigned char)s[1]) ||
+		    sscanf(s, "%2hhx", uuid + n) != 1)
+			return false;
+		s += 2;
+	}
+
+	return !*s;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "daemon", no_argument, NULL, 'd' },
+		{ "socket", required_argument, NULL, 's' },
+		{ "channels", required_argument, NULL, 'c' },
+		{ "slots", required_argument, NULL, 'n' },
+		{ "slot-size", required_argument, NULL, 'b' },
+		{ "warm", required_argument, NULL, 'w' },
+		{ "warm-idle", required_argument, NULL, 'i' },
+		{ "warm-uuid", required_argument, NULL, 'u' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	const char *path = TEE_BROKER_SOCKET;
+	struct sigaction sa;
+	bool daemonize = false;
+	unsigned long val = 0;
+	size_t n = 0;
+	int lsock = -1;
+	int opt = 0;
+	int e = 0;
+
+	while ((opt = getopt_long(argc, argv, "ds:c:n:b:w:i:u:h", opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			daemonize = true;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'c':
+			if (!parse_uint(optarg, 1, MAX_CHANNELS, &val))
+				return usage(EXIT_FAILURE);
+			num_channels = val;
+			break;
+		case 'n':
+			if (!parse_uint(optarg, 1, TEEC_BROKER_MAX_SLOTS, &val))
+				return usage(EXIT_FAILURE);
+			num_slots = val;
+			break;
+		case 'b':
+			if (!parse_uint(optarg, 4096, UINT32_MAX, &val))
+				return usage(EXIT_FAILURE);
+			slot_size = val;
+			break;
+		case 'w':
+			if (!parse_uint(optarg, 0, MAX_SESSIONS, &val))
+				return usage(EXIT_FAILURE);
+			warm_max = val;
+			break;
+		case 'i':
+			if (!parse_uint(optarg, 1, UINT32_MAX, &val))
+				return usage(EXIT_FAILURE);
+			warm_idle = val;
+			break;
+		case 'u':
+			if (num_warm_uuids == MAX_WARM_UUIDS ||
+			    !parse_uuid(optarg, warm_uuids[num_warm_uuids]))
+				return usage(EXIT_FAILURE);
+			num_warm_uuids++;
+			break;
+		case 'h':
+			return usage(EXIT_SUCCESS);
+		default:
+			return usage(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc)
+		return usage(EXIT_FAILURE);
+	if (warm_max && !num_warm_uuids) {
+		IMSG("no --warm-uuid, no sessions kept warm");
+		warm_max = 0;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	lsock = listen_on(path);
+	if (lsock < 0)
+		exit(EXIT_FAILURE);
+
+	if (daemonize && daemon(0, 0) < 0) {
+		EMSG("daemon(): %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (n = 0; n < num_channels; n++) {
+		channels[n].fd = sel4_open_comm();
+		if (channels[n].fd < 1) {
+			EMSG("sel4_open_comm: %d", channels[n].fd);
+			break;
+		}
+		teec_io_start(channels[n].fd);
+
+		pthread_cond_init(&channels[n].cond, NULL);
+		e = pthread_create(&channels[n].tid, NULL, channel_main,
+				   channels + n);
+		if (e) {
+			EMSG("pthread_create: %s", strerror(e));
+			teec_io_stop(channels[n].fd);
+			sel4_close_comm(channels[n].fd);
+			break;
+		}
+	}
+	if (!n) {
+		unlink(path);
+		exit(EXIT_FAILURE);
+	}
+	if (n < num_channels)
+		IMSG("using %zu of %zu channels", n, num_channels);
+	num_channels = n;
+
+	serve(lsock);
+
+	close(lsock);
+	unlink(path);
+
+	pthread_mutex_lock(&mutex);
+	quit = true;
+	for (n = 0; n < num_channels; n++)
+		pthread_cond_signal(&channels[n].cond);
+	pthread_mutex_unlock(&mutex);
+
+	/* Closing the channels ends whatever sessions are left */
+	for (n = 0; n < num_channels; n++) {
+		pthread_join(channels[n].tid, NULL);
+		teec_io_stop(channels[n].fd);
+		sel4_close_comm(channels[n].fd);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -148,6 +148,28 @@
  */
 #define OPTEE_MRF_READDIR		10
 
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+/*
+ * Read as many next file names of directory as fit
+ *
+ * Not sent by upstream OP-TEE OS, which may take the number for another
+ * request. Only enable it with an OP-TEE OS built to send it.
+ *
+ * [in]  param[0].u.value.a	OPTEE_MRF_READDIR_BATCH
+ * [in]  param[0].u.value.b	handle to open directory
+ * [in]  param[0].u.value.c	cookie to continue from, 0 to continue
+ *				where the previous call left off
+ * [out] param[1].u.tmem	file names, each a string, back to back
+ * [out] param[2].u.value.a	number of file names
+ * [out] param[2].u.value.b	cookie for the next call, 0 if the
+ *				directory has no more file names
+ *
+ * If not even the first file name fits, TEEC_ERROR_SHORT_BUFFER is
+ * returned with the size needed in param[1].u.tmem.size.
+ */
+#define OPTEE_MRF_READDIR_BATCH		11
+#endif
+
 /*
  * End of definitions for messages with .cmd == OPTEE_MSG_RPC_CMD_FS
  */
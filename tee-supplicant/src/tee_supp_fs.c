@@ -31,15 +31,18 @@
 #include <handle.h>
 #include <libgen.h>
 #include <optee_msg_supplicant.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <teec_trace.h>
 #include <tee_supp_fs.h>
 #include <tee_supplicant.h>
+#include <tee_supp_uring.h>
 #include <unistd.h>
 
 #ifndef __aligned
@@ -53,6 +56,44 @@
 
 /* Path to all secure storage files. */
 static char tee_fs_root[PATH_MAX];
+static size_t tee_fs_root_len;
+
+/*
+ * Striping
+ *
+ * With --fs-root, files are spread over more root directories, one per
+ * device. A file is placed by a consistent hash of its path below the
+ * root: each root owns FS_RING_POINTS points of a ring of hashes and a
+ * file goes to the root owning the first point from the hash of its path
+ * on, so adding a root only moves about one file in N to it. A file not
+ * found in the root it's placed in, having been placed before the roots
+ * changed, is looked up in the others. Creating or renaming to it moves
+ * it where it's placed, leaving one copy. A directory exists in each
+ * root holding files under it and opendir lists the union.
+ */
+#define FS_RING_POINTS	64
+
+struct fs_root {
+	char *path;		/* ending with a '/' */
+	size_t len;
+};
+
+struct fs_ring_point {
+	uint64_t hash;
+	size_t root;
+};
+
+/* The first one is tee_fs_root */
+static struct fs_root fs_roots[TEE_SUPP_FS_MAX_ROOTS];
+static size_t fs_num_roots = 1;
+static struct fs_ring_point fs_ring[TEE_SUPP_FS_MAX_ROOTS * FS_RING_POINTS];
+
+static const struct tee_supp_fs_backend tee_supp_fs_file_backend;
+static const struct tee_supp_fs_backend *fs_backend =
+		&tee_supp_fs_file_backend;
+
+/* Workers may race for the first request, the backend is set up once */
+static pthread_mutex_t fs_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define TEE_FS_FILENAME_MAX_LENGTH 150
 
@@ -60,20 +101,286 @@ static pthread_mutex_t dir_handle_db_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct handle_db dir_handle_db =
 		HANDLE_DB_INITIALIZER_WITH_MUTEX(&dir_handle_db_mutex);
 
-static size_t tee_fs_get_absolute_filename(char *file, char *out,
-					   size_t out_size)
+/*
+ * Group commit
+ *
+ * By default files are opened O_SYNC and each write is flushed on its
+ * own. With TEE_SUPP_FS_SYNC_COMMIT writes only go to the page cache and
+ * are flushed where the TEE relies on them:
+ * - The REE FS hash tree keeps its header in the first block of a file
+ *   and writes it last to commit an update. The file is flushed before
+ *   such a write, so the header never reaches the disk ahead of what it
+ *   covers, and after it, so the commit is durable once acknowledged.
+ * - A file is flushed when it's closed.
+ * - All files are flushed before an RPMB request, which may record the
+ *   state the TEE just committed, and around a rename.
+ * Directories that got entries created, renamed or removed are flushed
+ * along with the files.
+ */
+#define FS_COMMIT_BLOCK		4096
+#define FS_MAX_DIRTY_DIRS	16
+
+static bool fs_group_commit;
+
+/* Serializes flushes, so none returns while another is still flushing */
+static pthread_mutex_t fs_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Protects the dirty state below */
+static pthread_mutex_t fs_dirty_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool *fs_dirty_fds;
+static size_t fs_num_fds;
+static char fs_dirty_dirs[FS_MAX_DIRTY_DIRS][PATH_MAX];
+static size_t fs_num_dirty_dirs;
+
+/*
+ * Descriptor cache
+ *
+ * The TEE opens and closes the same dirf.db and object files over and
+ * over. Up to fd_cache_max closed files are kept open, least recently
+ * used dropped first, and an open of the same path gets the descriptor
+ * back. A file the TEE has open more than once shares the descriptor,
+ * which is reference counted. Removing, renaming or truncating a file
+ * drops its entry, the descriptor is then closed by the last close.
+ */
+struct fd_entry {
+	char *path;		/* NULL once dropped */
+	int fd;
+	unsigned int refs;
+	TAILQ_ENTRY(fd_entry) link;
+};
+
+static pthread_mutex_t fd_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Entries with an open descriptor, most recently used first */
+static TAILQ_HEAD(fd_entry_head, fd_entry) fd_entries =
+		TAILQ_HEAD_INITIALIZER(fd_entries);
+static size_t fd_cache_idle;
+static size_t fd_cache_max = TEE_SUPP_FS_FD_CACHE_DEFAULT;
+
+/*
+ * Directories known to exist
+ *
+ * A create in one of them goes straight to the open, and a directory
+ * made under one of them is made before the open rather than after it
+ * failed. Entries are replaced round robin and forgotten when the
+ * directory is removed, or found missing.
+ */
+#define DIR_CACHE_SIZE	32
+
+static pthread_mutex_t dir_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *dir_cache[DIR_CACHE_SIZE];
+static size_t dir_cache_next;
+
+/* Returns the slot of @dir, dir_cache_mutex held */
+static char **dir_cache_slot(const char *dir)
+{
+	size_t n = 0;
+
+	for (n = 0; n < DIR_CACHE_SIZE; n++)
+		if (dir_cache[n] && !strcmp(dir_cache[n], dir))
+			return dir_cache + n;
+
+	return NULL;
+}
+
+static bool dir_cache_find(const char *dir)
+{
+	bool ret = false;
+
+	tee_supp_mutex_lock(&dir_cache_mutex);
+	ret = dir_cache_slot(dir);
+	tee_supp_mutex_unlock(&dir_cache_mutex);
+
+	return ret;
+}
+
+static void dir_cache_add(const char *dir)
+{
+	char **slot = NULL;
+	char *d = NULL;
+
+	tee_supp_mutex_lock(&dir_cache_mutex);
+	if (!dir_cache_slot(dir)) {
+		/* Not cached if out of memory */
+		d = strdup(dir);
+		if (d) {
+			slot = dir_cache + dir_cache_next;
+			dir_cache_next = (dir_cache_next + 1) % DIR_CACHE_SIZE;
+			free(*slot);
+			*slot = d;
+		}
+	}
+	tee_supp_mutex_unlock(&dir_cache_mutex);
+}
+
+static void dir_cache_forget(const char *dir)
 {
-	int s = 0;
+	char **slot = NULL;
+
+	tee_supp_mutex_lock(&dir_cache_mutex);
+	slot = dir_cache_slot(dir);
+	if (slot) {
+		free(*slot);
+		*slot = NULL;
+	}
+	tee_supp_mutex_unlock(&dir_cache_mutex);
+}
 
-	if (!file || !out || (out_size <= strlen(tee_fs_root) + 1))
+/* Returns true if the parent of @dir is known to exist */
+static bool dir_cache_find_parent(const char *dir)
+{
+	char buf[PATH_MAX] = { 0 };
+
+	strncpy(buf, dir, sizeof(buf));
+	buf[sizeof(buf) - 1] = '\0';
+
+	return dir_cache_find(dirname(buf));
+}
+
+static uint64_t fs_hash(const char *str, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	size_t n = 0;
+
+	for (n = 0; n < len; n++)
+		h = (h ^ (uint8_t)str[n]) * 0x100000001b3;
+
+	/* FNV-1a spreads similar names poorly, mixed as by MurmurHash3 */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static int ring_cmp(const void *a, const void *b)
+{
+	const struct fs_ring_point *x = a;
+	const struct fs_ring_point *y = b;
+
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/* Points of a root are hashed from its path, not its place in the list */
+static void fs_ring_init(void)
+{
+	char buf[PATH_MAX + 16] = { 0 };
+	size_t k = 0;
+	size_t r = 0;
+	size_t n = 0;
+	int len = 0;
+
+	for (r = 0; r < fs_num_roots; r++) {
+		for (n = 0; n < FS_RING_POINTS; n++) {
+			len = snprintf(buf, sizeof(buf), "%s#%zu",
+				       fs_roots[r].path, n);
+			fs_ring[k].hash = fs_hash(buf, len);
+			fs_ring[k].root = r;
+			k++;
+		}
+	}
+
+	qsort(fs_ring, k, sizeof(*fs_ring), ring_cmp);
+}
+
+/* Returns the root @file is placed in */
+static size_t fs_place(const char *file)
+{
+	size_t hi = fs_num_roots * FS_RING_POINTS;
+	uint64_t h = 0;
+	size_t lo = 0;
+	size_t mid = 0;
+
+	if (fs_num_roots == 1)
 		return 0;
 
-	s = snprintf(out, out_size, "%s%s", tee_fs_root, file);
-	if (s < 0 || (size_t)s >= out_size)
+	h = fs_hash(file, strlen(file));
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (fs_ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Past the last point it wraps around to the first */
+	return fs_ring[lo % (fs_num_roots * FS_RING_POINTS)].root;
+}
+
+static size_t fs_root_filename(size_t root, const char *file, char *out,
+			       size_t out_size)
+{
+	size_t len = 0;
+
+	if (!file || !out)
+		return 0;
+
+	/* The root is prepended as is, it was resolved by tee_supp_fs_init() */
+	len = strlen(file);
+	if (fs_roots[root].len + len >= out_size)
 		return 0;
 
-	/* Safe to cast since we have checked that sizes are OK */
-	return (size_t)s;
+	memcpy(out, fs_roots[root].path, fs_roots[root].len);
+	memcpy(out + fs_roots[root].len, file, len + 1);
+
+	return fs_roots[root].len + len;
+}
+
+static size_t tee_fs_get_absolute_filename(const char *file, char *out,
+					   size_t out_size)
+{
+	return fs_root_filename(fs_place(file), file, out, out_size);
+}
+
+/*
+ * Looks for @file in the roots it isn't placed in. Returns the root it's
+ * found in, with its path in @out, or -1.
+ */
+static int fs_find_stray(const char *file, char *out, size_t out_size)
+{
+	char path[PATH_MAX] = { 0 };
+	size_t placed = fs_place(file);
+	size_t r = 0;
+
+	for (r = 0; r < fs_num_roots; r++) {
+		if (r == placed ||
+		    !fs_root_filename(r, file, path, sizeof(path)) ||
+		    access(path, F_OK))
+			continue;
+		if (strlen(path) >= out_size)
+			return -1;
+		strcpy(out, path);
+		return r;
+	}
+
+	return -1;
+}
+
+bool tee_supp_fs_add_root(const char *path)
+{
+	size_t len = strlen(path);
+	char *p = NULL;
+
+	/* Kept as given otherwise, as files are placed by it */
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	if (fs_num_roots == TEE_SUPP_FS_MAX_ROOTS || !len ||
+	    len + 2 > PATH_MAX)
+		return false;
+
+	p = malloc(len + 2);
+	if (!p)
+		return false;
+	memcpy(p, path, len);
+	strcpy(p + len, "/");
+
+	fs_roots[fs_num_roots].path = p;
+	fs_roots[fs_num_roots].len = len + 1;
+	fs_num_roots++;
+
+	return true;
 }
 
 static int do_mkdir(const char *path, mode_t mode)
@@ -118,7 +425,9 @@ static int mkpath(const char *path, mode_t mode)
 
 static int tee_supp_fs_init(void)
 {
+	char buf[PATH_MAX] = { 0 };
 	size_t n = 0;
+	size_t r = 0;
 	mode_t mode = 0700;
 
 	n = snprintf(tee_fs_root, sizeof(tee_fs_root), "%s/", TEE_FS_PARENT_PATH);
@@ -128,20 +437,389 @@ static int tee_supp_fs_init(void)
 	if (mkpath(tee_fs_root, mode) != 0)
 		return -1;
 
+	dir_cache_add(TEE_FS_PARENT_PATH);
+
+	fs_roots[0].path = tee_fs_root;
+	fs_roots[0].len = n;
+	for (r = 1; r < fs_num_roots; r++) {
+		if (mkpath(fs_roots[r].path, mode) != 0) {
+			EMSG("failed to create %s", fs_roots[r].path);
+			return -1;
+		}
+		snprintf(buf, sizeof(buf), "%.*s", (int)fs_roots[r].len - 1,
+			 fs_roots[r].path);
+		dir_cache_add(buf);
+	}
+	fs_ring_init();
+	if (fs_num_roots > 1 && fs_backend != &tee_supp_fs_file_backend)
+		IMSG("--fs-root is only used by the file backend");
+
+	if (fs_backend->init && fs_backend->init(tee_fs_root))
+		return -1;
+
+	tee_fs_root_len = n;
+
 	return 0;
 }
 
+static bool fs_datasync(int fd, bool dir)
+{
+	while (dir ? fsync(fd) : fdatasync(fd)) {
+		if (errno != EINTR) {
+			EMSG("fsync: %s", strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool fs_sync_dir(const char *path)
+{
+	bool ret = false;
+	int fd = 0;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return errno == ENOENT;
+
+	ret = fs_datasync(fd, true);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * fs_sync() - Flushes file @fd, or all files if @fd is -1, and the
+ * directories with pending entries
+ */
+static bool fs_sync(int fd)
+{
+	char (*dirs)[PATH_MAX] = NULL;
+	size_t num_dirs = 0;
+	bool dirty = false;
+	bool ret = true;
+	size_t end = 0;
+	size_t n = 0;
+
+	tee_supp_mutex_lock(&fs_sync_mutex);
+
+	tee_supp_mutex_lock(&fs_dirty_mutex);
+	num_dirs = fs_num_dirty_dirs;
+	if (num_dirs) {
+		dirs = malloc(num_dirs * sizeof(*dirs));
+		if (dirs) {
+			memcpy(dirs, fs_dirty_dirs, num_dirs * sizeof(*dirs));
+			fs_num_dirty_dirs = 0;
+		} else {
+			ret = false;
+			num_dirs = 0;
+		}
+	}
+	end = fd < 0 ? fs_num_fds : (size_t)fd + 1;
+	tee_supp_mutex_unlock(&fs_dirty_mutex);
+
+	for (n = fd < 0 ? 0 : (size_t)fd; n < end; n++) {
+		tee_supp_mutex_lock(&fs_dirty_mutex);
+		dirty = n < fs_num_fds && fs_dirty_fds[n];
+		if (dirty)
+			fs_dirty_fds[n] = false;
+		tee_supp_mutex_unlock(&fs_dirty_mutex);
+
+		if (dirty && !fs_datasync(n, false))
+			ret = false;
+	}
+
+	for (n = 0; n < num_dirs; n++)
+		if (!fs_sync_dir(dirs[n]))
+			ret = false;
+
+	tee_supp_mutex_unlock(&fs_sync_mutex);
+
+	free(dirs);
+
+	return ret;
+}
+
+/* Marks @fd as written since it was last flushed */
+static bool fs_set_dirty(int fd)
+{
+	bool *fds = NULL;
+	size_t num = 0;
+
+	tee_supp_mutex_lock(&fs_dirty_mutex);
+	if ((size_t)fd >= fs_num_fds) {
+		num = fd + 64;
+		fds = realloc(fs_dirty_fds, num * sizeof(*fds));
+		if (!fds) {
+			tee_supp_mutex_unlock(&fs_dirty_mutex);
+			return fs_datasync(fd, false);
+		}
+		memset(fds + fs_num_fds, 0, (num - fs_num_fds) * sizeof(*fds));
+		fs_dirty_fds = fds;
+		fs_num_fds = num;
+	}
+	fs_dirty_fds[fd] = true;
+	tee_supp_mutex_unlock(&fs_dirty_mutex);
+
+	return true;
+}
+
+/* Marks the directory holding @path as having pending entries */
+static bool fs_set_dir_dirty(const char *path)
+{
+	char buf[PATH_MAX] = { 0 };
+	char *dir = NULL;
+	size_t n = 0;
+
+	if (!fs_group_commit)
+		return true;
+
+	strncpy(buf, path, sizeof(buf));
+	buf[sizeof(buf) - 1] = '\0';
+	dir = dirname(buf);
+
+	while (true) {
+		tee_supp_mutex_lock(&fs_dirty_mutex);
+		for (n = 0; n < fs_num_dirty_dirs; n++)
+			if (!strcmp(fs_dirty_dirs[n], dir))
+				break;
+		if (n == fs_num_dirty_dirs && n < FS_MAX_DIRTY_DIRS) {
+			strcpy(fs_dirty_dirs[n], dir);
+			fs_num_dirty_dirs++;
+		}
+		tee_supp_mutex_unlock(&fs_dirty_mutex);
+
+		if (n < FS_MAX_DIRTY_DIRS)
+			return true;
+		/* Full, flush what's pending to make room */
+		if (!fs_sync(-1))
+			return false;
+	}
+}
+
+void tee_supp_fs_set_sync(enum tee_supp_fs_sync mode)
+{
+	fs_group_commit = mode == TEE_SUPP_FS_SYNC_COMMIT;
+}
+
+static TEEC_Result ree_fs_new_commit(void)
+{
+	if (!fs_group_commit)
+		return TEEC_SUCCESS;
+
+	return fs_sync(-1) ? TEEC_SUCCESS : TEEC_ERROR_GENERIC;
+}
+
+void tee_supp_fs_set_fd_cache(size_t max)
+{
+	fd_cache_max = max;
+}
+
+static void fd_entry_free(struct fd_entry *e)
+{
+	TAILQ_REMOVE(&fd_entries, e, link);
+	if (!e->refs)
+		fd_cache_idle--;
+	free(e->path);
+	free(e);
+}
+
+/* Returns a cached descriptor of @path with a reference taken, or -1 */
+static int fd_cache_get(const char *path)
+{
+	struct fd_entry *e = NULL;
+	int fd = -1;
+
+	tee_supp_mutex_lock(&fd_cache_mutex);
+	TAILQ_FOREACH(e, &fd_entries, link) {
+		if (e->path && !strcmp(e->path, path)) {
+			if (!e->refs++)
+				fd_cache_idle--;
+			TAILQ_REMOVE(&fd_entries, e, link);
+			TAILQ_INSERT_HEAD(&fd_entries, e, link);
+			fd = e->fd;
+			break;
+		}
+	}
+	tee_supp_mutex_unlock(&fd_cache_mutex);
+
+	return fd;
+}
+
+/* Adds the just opened descriptor @fd of @path, with one reference */
+static void fd_cache_add(const char *path, int fd)
+{
+	struct fd_entry *e = NULL;
+
+	if (!fd_cache_max)
+		return;
+
+	/* Not cached, it's then closed by the close */
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return;
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		return;
+	}
+	e->fd = fd;
+	e->refs = 1;
+
+	tee_supp_mutex_lock(&fd_cache_mutex);
+	TAILQ_INSERT_HEAD(&fd_entries, e, link);
+	tee_supp_mutex_unlock(&fd_cache_mutex);
+}
+
+/*
+ * fd_cache_put() - Releases a reference of @fd
+ *
+ * Returns true if the descriptor is kept, or still in use, and false if
+ * the caller should close it.
+ */
+static bool fd_cache_put(int fd)
+{
+	struct fd_entry *e = NULL;
+	bool kept = false;
+
+	tee_supp_mutex_lock(&fd_cache_mutex);
+	TAILQ_FOREACH(e, &fd_entries, link)
+		if (e->fd == fd)
+			break;
+	if (!e)
+		goto out;
+
+	kept = true;
+	if (--e->refs)
+		goto out;
+
+	fd_cache_idle++;
+	if (!e->path) {
+		fd_entry_free(e);
+		kept = false;
+		goto out;
+	}
+	TAILQ_REMOVE(&fd_entries, e, link);
+	TAILQ_INSERT_HEAD(&fd_entries, e, link);
+
+	/* Make room by closing the least recently used idle descriptor */
+	TAILQ_FOREACH_REVERSE(e, &fd_entries, fd_entry_head, link) {
+		if (fd_cache_idle <= fd_cache_max)
+			break;
+		if (e->refs)
+			continue;
+		if (e->fd == fd)
+			kept = false;
+		else
+			close(e->fd);
+		fd_entry_free(e);
+		break;
+	}
+out:
+	tee_supp_mutex_unlock(&fd_cache_mutex);
+
+	return kept;
+}
+
+/* Drops the entries of @path, or of @fd if @path is NULL */
+static void fd_cache_drop(const char *path, int fd)
+{
+	struct fd_entry *next = NULL;
+	struct fd_entry *e = NULL;
+
+	tee_supp_mutex_lock(&fd_cache_mutex);
+	for (e = TAILQ_FIRST(&fd_entries); e; e = next) {
+		next = TAILQ_NEXT(e, link);
+
+		if (!e->path)
+			continue;
+		if (path ? strcmp(e->path, path) : e->fd != fd)
+			continue;
+
+		if (e->refs) {
+			free(e->path);
+			e->path = NULL;
+		} else {
+			close(e->fd);
+			fd_entry_free(e);
+		}
+	}
+	tee_supp_mutex_unlock(&fd_cache_mutex);
+}
+
 static int open_wrapper(const char *fname, int flags)
 {
 	int fd = 0;
 
+	/*
+	 * With io_uring every write is followed by an fdatasync() instead,
+	 * with group commit they're flushed by fs_sync()
+	 */
+	if (!tee_supp_uring_active() && !fs_group_commit)
+		flags |= O_SYNC;
+
 	while (true) {
-		fd = open(fname, flags | O_SYNC, 0600);
+		fd = open(fname, flags, 0600);
 		if (fd >= 0 || errno != EINTR)
 			return fd;
 	}
 }
 
+/* Removes @abs_filename and the directories it leaves empty */
+static TEEC_Result fs_unlink(char *abs_filename)
+{
+	char *d = NULL;
+
+	/*
+	 * Idle descriptors are closed first, NFS keeps a file unlinked while
+	 * open as .nfsXXXX which then keeps its directory from going
+	 */
+	fd_cache_drop(abs_filename, -1);
+	if (unlink(abs_filename)) {
+		if (errno == ENOENT)
+			return TEEC_ERROR_ITEM_NOT_FOUND;
+		return TEEC_ERROR_GENERIC;
+	}
+	if (!fs_set_dir_dirty(abs_filename))
+		return TEEC_ERROR_GENERIC;
+
+	/* If a file is removed, maybe the directory can be removed to? */
+	d = dirname(abs_filename);
+	if (!rmdir(d)) {
+		dir_cache_forget(d);
+		if (!fs_set_dir_dirty(d))
+			return TEEC_ERROR_GENERIC;
+		/*
+		 * If the directory was removed, maybe the parent directory
+		 * can be removed too?
+		 */
+		d = dirname(d);
+		if (!rmdir(d)) {
+			dir_cache_forget(d);
+			if (!fs_set_dir_dirty(d))
+				return TEEC_ERROR_GENERIC;
+		}
+	}
+
+	return TEEC_SUCCESS;
+}
+
+/* Removes copies of @file left in the roots it isn't placed in */
+static TEEC_Result fs_drop_strays(const char *file)
+{
+	char abs_filename[PATH_MAX] = { 0 };
+	TEEC_Result res = TEEC_SUCCESS;
+
+	while (fs_find_stray(file, abs_filename, sizeof(abs_filename)) >= 0) {
+		res = fs_unlink(abs_filename);
+		if (res && res != TEEC_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	return TEEC_SUCCESS;
+}
+
 static TEEC_Result ree_fs_new_open(size_t num_params,
 				   struct tee_ioctl_param *params)
 {
@@ -166,7 +844,19 @@ static TEEC_Result ree_fs_new_open(size_t num_params,
 					  sizeof(abs_filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
+	fd = fd_cache_get(abs_filename);
+	if (fd >= 0)
+		goto out;
+
 	fd = open_wrapper(abs_filename, O_RDWR);
+	/* Placed in another root before the roots changed */
+	if (fd < 0 && errno == ENOENT &&
+	    fs_find_stray(fname, abs_filename, sizeof(abs_filename)) >= 0) {
+		fd = fd_cache_get(abs_filename);
+		if (fd >= 0)
+			goto out;
+		fd = open_wrapper(abs_filename, O_RDWR);
+	}
 	if (fd < 0) {
 		/*
 		 * In case the problem is the filesystem is RO, retry with the
@@ -176,7 +866,9 @@ static TEEC_Result ree_fs_new_open(size_t num_params,
 		if (fd < 0)
 			return TEEC_ERROR_ITEM_NOT_FOUND;
 	}
+	fd_cache_add(abs_filename, fd);
 
+out:
 	params[2].a = fd;
 	return TEEC_SUCCESS;
 }
@@ -190,6 +882,8 @@ static TEEC_Result ree_fs_new_create(size_t num_params,
 	char *d = NULL;
 	int fd = 0;
 	const int flags = O_RDWR | O_CREAT | O_TRUNC;
+	size_t made_dirs = 0;
+	size_t n = 0;
 
 	if (num_params != 3 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -208,17 +902,35 @@ static TEEC_Result ree_fs_new_create(size_t num_params,
 					  sizeof(abs_filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
+	/* Idle descriptors of the file being replaced aren't needed */
+	fd_cache_drop(abs_filename, -1);
+
+	strncpy(abs_dir, abs_filename, sizeof(abs_dir));
+	abs_dir[sizeof(abs_dir) - 1] = '\0';
+	d = dirname(abs_dir);
+
+	/* A new directory under a known one is made before the open */
+	if (!dir_cache_find(d) && dir_cache_find_parent(d) && !mkdir(d, 0700))
+		made_dirs = 1;
+
 	fd = open_wrapper(abs_filename, flags);
 	if (fd >= 0)
 		goto out;
+	if (made_dirs) {
+		/* The directory was made, the file still can't be */
+		rmdir(d);
+		return TEEC_ERROR_GENERIC;
+	}
 	if (errno != ENOENT)
 		return TEEC_ERROR_GENERIC;
+	dir_cache_forget(d);
 
 	/* Directory for file missing, try make to it */
 	strncpy(abs_dir, abs_filename, sizeof(abs_dir));
 	abs_dir[sizeof(abs_dir) - 1] = '\0';
 	d = dirname(abs_dir);
 	if (!mkdir(d, 0700)) {
+		made_dirs = 1;
 		fd = open_wrapper(abs_filename, flags);
 		if (fd >= 0)
 			goto out;
@@ -254,8 +966,35 @@ static TEEC_Result ree_fs_new_create(size_t num_params,
 		rmdir(d);
 		return TEEC_ERROR_GENERIC;
 	}
+	made_dirs = 2;
 
 out:
+	/* The directory exists, and so does its parent */
+	strncpy(abs_dir, abs_filename, sizeof(abs_dir));
+	abs_dir[sizeof(abs_dir) - 1] = '\0';
+	d = dirname(abs_dir);
+	dir_cache_add(d);
+	dir_cache_add(dirname(d));
+
+	/* The new entries are flushed along with the file, see fs_sync() */
+	strncpy(abs_dir, abs_filename, sizeof(abs_dir));
+	abs_dir[sizeof(abs_dir) - 1] = '\0';
+	d = abs_dir;
+	for (n = 0; n <= made_dirs; n++) {
+		if (!fs_set_dir_dirty(d)) {
+			close(fd);
+			return TEEC_ERROR_GENERIC;
+		}
+		d = dirname(d);
+	}
+
+	/* A copy of the file in another root would be found instead */
+	if (fs_drop_strays(fname)) {
+		close(fd);
+		return TEEC_ERROR_GENERIC;
+	}
+	fd_cache_add(abs_filename, fd);
+
 	params[2].a = fd;
 	return TEEC_SUCCESS;
 }
@@ -263,6 +1002,7 @@ out:
 static TEEC_Result ree_fs_new_close(size_t num_params,
 				    struct tee_ioctl_param *params)
 {
+	TEEC_Result res = TEEC_SUCCESS;
 	int fd = 0;
 
 	if (num_params != 1 ||
@@ -271,11 +1011,18 @@ static TEEC_Result ree_fs_new_close(size_t num_params,
 		return TEEC_ERROR_BAD_PARAMETERS;
 
 	fd = params[0].b;
+	if (fs_group_commit && !fs_sync(fd))
+		res = TEEC_ERROR_GENERIC;
+
+	/* Closed lazily, see fd_cache_put() */
+	if (fd_cache_put(fd))
+		return res;
+
 	while (close(fd)) {
 		if (errno != EINTR)
 			return TEEC_ERROR_GENERIC;
 	}
-	return TEEC_SUCCESS;
+	return res;
 }
 
 static TEEC_Result ree_fs_new_read(size_t num_params,
@@ -303,6 +1050,11 @@ static TEEC_Result ree_fs_new_read(size_t num_params,
 		return TEEC_ERROR_BAD_PARAMETERS;
 	len = MEMREF_SIZE(params + 1);
 
+	/* The response is sent once the read completes */
+	if (tee_supp_uring_read(&params, fd, buf, len, offs,
+				MEMREF_SHM_ID(params + 1)))
+		return TEEC_SUCCESS;
+
 	s = 0;
 	r = -1;
 	while (r && len) {
@@ -323,6 +1075,26 @@ static TEEC_Result ree_fs_new_read(size_t num_params,
 	return TEEC_SUCCESS;
 }
 
+static bool write_all(int fd, uint8_t *buf, size_t len, off_t offs)
+{
+	ssize_t r = 0;
+
+	while (len) {
+		r = pwrite(fd, buf, len, offs);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		assert((size_t)r <= len);
+		buf += r;
+		len -= r;
+		offs += r;
+	}
+
+	return true;
+}
+
 static TEEC_Result ree_fs_new_write(size_t num_params,
 				    struct tee_ioctl_param *params)
 {
@@ -330,7 +1102,6 @@ static TEEC_Result ree_fs_new_write(size_t num_params,
 	size_t len = 0;
 	off_t offs = 0;
 	int fd = 0;
-	ssize_t r = 0;
 
 	if (num_params != 2 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -347,19 +1118,30 @@ static TEEC_Result ree_fs_new_write(size_t num_params,
 		return TEEC_ERROR_BAD_PARAMETERS;
 	len = MEMREF_SIZE(params + 1);
 
-	while (len) {
-		r = pwrite(fd, buf, len, offs);
-		if (r < 0) {
-			if (errno == EINTR)
-				continue;
+	if (fs_group_commit && offs >= FS_COMMIT_BLOCK) {
+		/* Flushed before the header commits it */
+		if (!write_all(fd, buf, len, offs) || !fs_set_dirty(fd))
 			return TEEC_ERROR_GENERIC;
-		}
-		assert((size_t)r <= len);
-		buf += r;
-		len -= r;
-		offs += r;
+		return TEEC_SUCCESS;
 	}
 
+	/* What the header covers reaches the disk first */
+	if (fs_group_commit && !fs_sync(fd))
+		return TEEC_ERROR_GENERIC;
+
+	/* The response is sent once the write and fdatasync() complete */
+	if (tee_supp_uring_write(&params, fd, buf, len, offs,
+				 MEMREF_SHM_ID(params + 1)))
+		return TEEC_SUCCESS;
+
+	if (!write_all(fd, buf, len, offs))
+		return TEEC_ERROR_GENERIC;
+
+	/* Not opened O_SYNC with io_uring or group commit */
+	if ((tee_supp_uring_active() || fs_group_commit) &&
+	    !fs_datasync(fd, false))
+		return TEEC_ERROR_GENERIC;
+
 	return TEEC_SUCCESS;
 }
 
@@ -382,6 +1164,11 @@ static TEEC_Result ree_fs_new_truncate(size_t num_params,
 			return TEEC_ERROR_GENERIC;
 	}
 
+	fd_cache_drop(NULL, fd);
+
+	if (fs_group_commit && !fs_set_dirty(fd))
+		return TEEC_ERROR_GENERIC;
+
 	return TEEC_SUCCESS;
 }
 
@@ -389,8 +1176,8 @@ static TEEC_Result ree_fs_new_remove(size_t num_params,
 				     struct tee_ioctl_param *params)
 {
 	char abs_filename[PATH_MAX] = { 0 };
+	TEEC_Result res = TEEC_SUCCESS;
 	char *fname = NULL;
-	char *d = NULL;
 
 	if (num_params != 2 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -403,28 +1190,233 @@ static TEEC_Result ree_fs_new_remove(size_t num_params,
 	if (!fname)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!tee_fs_get_absolute_filename(fname, abs_filename,
-					  sizeof(abs_filename)))
+	if (!tee_fs_get_absolute_filename(fname, abs_filename,
+					  sizeof(abs_filename)))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	res = fs_unlink(abs_filename);
+	/*
+	 * Placed in another root before the roots changed, or left there by a
+	 * crash before it was dropped, it must not come back
+	 */
+	if ((!res || res == TEEC_ERROR_ITEM_NOT_FOUND) &&
+	    fs_find_stray(fname, abs_filename, sizeof(abs_filename)) >= 0)
+		res = fs_drop_strays(fname);
+
+	return res;
+}
+
+/*
+ * Moves to another root
+ *
+ * A rename to another root copies the file to a temporary file there,
+ * which is renamed into place, and removes the source. So that a crash
+ * doesn't leave the file under both names, an intent file in the first
+ * root, .move.XXXXXX, holds the paths of the copy and of the source from
+ * when the copy is on disk until the source is gone. At start up the
+ * copy still being there means the rename didn't happen and it's dropped,
+ * else the source is.
+ */
+#define FS_MOVE_INTENT	".move."
+
+/* Flushes the nearest directory of @path that's still there */
+static bool fs_sync_parent(const char *path)
+{
+	char buf[PATH_MAX] = { 0 };
+	char *d = buf;
+
+	strncpy(buf, path, sizeof(buf) - 1);
+	do {
+		d = dirname(d);
+		if (!access(d, F_OK))
+			return fs_sync_dir(d);
+	} while (strcmp(d, "/") && strcmp(d, "."));
+
+	return true;
+}
+
+/* Records the move of @src by renaming @tmp in @intent, on disk */
+static bool fs_move_intent(const char *tmp, const char *src, char *intent,
+			   size_t intent_size)
+{
+	size_t tmp_len = strlen(tmp) + 1;
+	size_t src_len = strlen(src) + 1;
+	bool ok = false;
+	int fd = -1;
+
+	if (snprintf(intent, intent_size, "%s%sXXXXXX", fs_roots[0].path,
+		     FS_MOVE_INTENT) >= (int)intent_size)
+		return false;
+
+	fd = mkstemp(intent);
+	if (fd < 0) {
+		EMSG("%s: %s", intent, strerror(errno));
+		return false;
+	}
+
+	ok = write_all(fd, (uint8_t *)tmp, tmp_len, 0) &&
+	     write_all(fd, (uint8_t *)src, src_len, tmp_len) &&
+	     fs_datasync(fd, false);
+	close(fd);
+	if (ok && fs_sync_dir(fs_roots[0].path))
+		return true;
+
+	unlink(intent);
+	return false;
+}
+
+static bool fs_move_done(const char *intent)
+{
+	if (unlink(intent)) {
+		EMSG("%s: %s", intent, strerror(errno));
+		return false;
+	}
+
+	/* Or a file created under the old name would be removed later */
+	return fs_sync_dir(fs_roots[0].path);
+}
+
+/* Finishes or undoes the move recorded in @intent */
+static void fs_move_replay(const char *intent)
+{
+	char buf[2 * PATH_MAX] = { 0 };
+	char path[PATH_MAX] = { 0 };
+	const char *tmp = buf;
+	const char *src = NULL;
+	ssize_t r = 0;
+	int fd = -1;
+
+	fd = open(intent, O_RDONLY);
+	if (fd < 0)
+		return;
+	r = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+
+	/* Not complete, the copy wasn't renamed either */
+	src = r > 0 ? memchr(buf, '\0', r) : NULL;
+	if (!src || !memchr(src + 1, '\0', buf + r - src - 1) ||
+	    strlen(src + 1) >= sizeof(path)) {
+		unlink(intent);
+		return;
+	}
+	src++;
+
+	if (!access(tmp, F_OK)) {
+		IMSG("dropping %s of a move cut short", tmp);
+		unlink(tmp);
+		fs_sync_parent(tmp);
+	} else if (!access(src, F_OK)) {
+		IMSG("removing %s moved before a crash", src);
+		/* fs_unlink() cuts the path down to its directory */
+		strcpy(path, src);
+		fs_unlink(path);
+		fs_sync_parent(src);
+	}
+
+	fs_move_done(intent);
+}
+
+/* Replays the moves a crash interrupted, see fs_move() */
+static int ree_fs_new_init(const char *root)
+{
+	char path[PATH_MAX] = { 0 };
+	struct dirent *dent = NULL;
+	DIR *dir = opendir(root);
+
+	if (!dir)
+		return 0;
+
+	while ((dent = readdir(dir))) {
+		if (strncmp(dent->d_name, FS_MOVE_INTENT,
+			    strlen(FS_MOVE_INTENT)) ||
+		    snprintf(path, sizeof(path), "%s%s", root,
+			     dent->d_name) >= (int)sizeof(path))
+			continue;
+		fs_move_replay(path);
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+/* Renames @src to @dst in another root, see above */
+static TEEC_Result fs_move(char *src, char *dst)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	char intent[PATH_MAX] = { 0 };
+	char tmp[PATH_MAX] = { 0 };
+	char dir[PATH_MAX] = { 0 };
+	uint8_t buf[4096];
+	char *base = strrchr(dst, '/') + 1;
+	off_t offs = 0;
+	ssize_t r = 0;
+	int in = -1;
+	int out = -1;
+
+	/* Hidden from opendir like other dotfiles */
+	if (snprintf(tmp, sizeof(tmp), "%.*s.%s.tmp", (int)(base - dst), dst,
+		     base) >= (int)sizeof(tmp))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (unlink(abs_filename)) {
-		if (errno == ENOENT)
-			return TEEC_ERROR_ITEM_NOT_FOUND;
+	/* The directory may not exist in this root yet */
+	strcpy(dir, dst);
+	if (mkpath(dirname(dir), 0700) || !fs_set_dir_dirty(dir))
 		return TEEC_ERROR_GENERIC;
+
+	in = open(src, O_RDONLY);
+	if (in < 0)
+		return errno == ENOENT ? TEEC_ERROR_ITEM_NOT_FOUND :
+					 TEEC_ERROR_GENERIC;
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out < 0)
+		goto out;
+
+	while (true) {
+		r = pread(in, buf, sizeof(buf), offs);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			goto out;
+		if (!r)
+			break;
+		if (!write_all(out, buf, r, offs))
+			goto out;
+		offs += r;
 	}
 
-	/* If a file is removed, maybe the directory can be removed to? */
-	d = dirname(abs_filename);
-	if (!rmdir(d)) {
-		/*
-		 * If the directory was removed, maybe the parent directory
-		 * can be removed too?
-		 */
-		d = dirname(d);
-		rmdir(d);
+	/* The copy is on disk before the intent names it */
+	if (!fs_datasync(out, false) || !fs_sync_parent(tmp) ||
+	    !fs_move_intent(tmp, src, intent, sizeof(intent)))
+		goto out;
+	if (rename(tmp, dst)) {
+		fs_move_done(intent);
+		goto out;
 	}
+	close(out);
+	out = -1;
 
-	return TEEC_SUCCESS;
+	/*
+	 * The rename is on disk before the source goes, and the source is
+	 * gone before the intent. If either fails the intent is left to
+	 * finish the move at start up.
+	 */
+	if (!fs_sync_parent(dst))
+		goto out;
+	/* fs_unlink() cuts the path down to its directory */
+	strcpy(dir, src);
+	res = fs_unlink(dir);
+	if (res)
+		goto out;
+	if (!fs_sync_parent(src) || !fs_move_done(intent))
+		res = TEEC_ERROR_GENERIC;
+out:
+	if (out >= 0) {
+		close(out);
+		unlink(tmp);
+	}
+	close(in);
+
+	return res;
 }
 
 static TEEC_Result ree_fs_new_rename(size_t num_params,
@@ -432,9 +1424,13 @@ static TEEC_Result ree_fs_new_rename(size_t num_params,
 {
 	char old_abs_filename[PATH_MAX] = { 0 };
 	char new_abs_filename[PATH_MAX] = { 0 };
+	char path[PATH_MAX] = { 0 };
+	TEEC_Result res = TEEC_SUCCESS;
 	char *old_fname = NULL;
 	char *new_fname = NULL;
 	bool overwrite = false;
+	size_t old_root = 0;
+	int root = 0;
 
 	if (num_params != 3 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -466,14 +1462,78 @@ static TEEC_Result ree_fs_new_rename(size_t num_params,
 	if (!overwrite) {
 		struct stat st;
 
-		if (!stat(new_abs_filename, &st))
+		if (!stat(new_abs_filename, &st) ||
+		    fs_find_stray(new_fname, path, sizeof(path)) >= 0)
 			return TEEC_ERROR_ACCESS_CONFLICT;
 	}
-	if (rename(old_abs_filename, new_abs_filename)) {
-		if (errno == ENOENT)
-			return TEEC_ERROR_ITEM_NOT_FOUND;
+
+	/* Placed in another root before the roots changed */
+	old_root = fs_place(old_fname);
+	if (fs_num_roots > 1 && access(old_abs_filename, F_OK)) {
+		root = fs_find_stray(old_fname, old_abs_filename,
+				     sizeof(old_abs_filename));
+		if (root >= 0)
+			old_root = root;
 	}
-	return TEEC_SUCCESS;
+
+	/* The content of the files is flushed before the names switch */
+	if (ree_fs_new_commit())
+		return TEEC_ERROR_GENERIC;
+
+	/* Closed before the names change, like in fs_unlink() */
+	fd_cache_drop(old_abs_filename, -1);
+	fd_cache_drop(new_abs_filename, -1);
+
+	if (old_root == fs_place(new_fname)) {
+		if (rename(old_abs_filename, new_abs_filename)) {
+			if (errno == ENOENT)
+				return TEEC_ERROR_ITEM_NOT_FOUND;
+		}
+	} else {
+		res = fs_move(old_abs_filename, new_abs_filename);
+		if (res)
+			return res;
+	}
+
+	if (!fs_set_dir_dirty(old_abs_filename) ||
+	    !fs_set_dir_dirty(new_abs_filename) ||
+	    fs_drop_strays(new_fname))
+		return TEEC_ERROR_GENERIC;
+
+	return ree_fs_new_commit();
+}
+
+/* Lists the union of directory @fname in all roots */
+static TEEC_Result fs_opendir_merged(const char *fname,
+				     struct tee_ioctl_param *params)
+{
+	char path[PATH_MAX] = { 0 };
+	char name[PATH_MAX] = { 0 };
+	struct tee_supp_fs_dir *dir = NULL;
+	const char *sep = "/";
+	struct dirent *dent = NULL;
+	DIR *d = NULL;
+	size_t r = 0;
+
+	if (*fname && fname[strlen(fname) - 1] == '/')
+		sep = "";
+
+	dir = tee_supp_fs_dir_new(fname);
+	for (r = 0; r < fs_num_roots; r++) {
+		if (!fs_root_filename(r, fname, path, sizeof(path)))
+			continue;
+		d = opendir(path);
+		if (!d)
+			continue;
+		while ((dent = readdir(d))) {
+			snprintf(name, sizeof(name), "%s%s%s", fname, sep,
+				 dent->d_name);
+			tee_supp_fs_dir_add(dir, name);
+		}
+		closedir(d);
+	}
+
+	return tee_supp_fs_dir_open(dir, params);
 }
 
 static TEEC_Result ree_fs_new_opendir(size_t num_params,
@@ -499,6 +1559,9 @@ static TEEC_Result ree_fs_new_opendir(size_t num_params,
 	if (!fname)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
+	if (fs_num_roots > 1)
+		return fs_opendir_merged(fname, params);
+
 	if (!tee_fs_get_absolute_filename(fname, abs_filename,
 					  sizeof(abs_filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
@@ -546,6 +1609,10 @@ static TEEC_Result ree_fs_new_closedir(size_t num_params,
 {
 	DIR *dir = NULL;
 
+	/* Merged listings of all roots, see fs_opendir_merged() */
+	if (fs_num_roots > 1)
+		return tee_supp_fs_dir_close(num_params, params);
+
 	if (num_params != 1 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
 			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT)
@@ -569,6 +1636,10 @@ static TEEC_Result ree_fs_new_readdir(size_t num_params,
 	size_t len = 0;
 	size_t fname_len = 0;
 
+	/* Merged listings of all roots, see fs_opendir_merged() */
+	if (fs_num_roots > 1)
+		return tee_supp_fs_dir_read(num_params, params);
+
 	if (num_params != 2 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
 			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT ||
@@ -604,45 +1675,441 @@ static TEEC_Result ree_fs_new_readdir(size_t num_params,
 	return TEEC_SUCCESS;
 }
 
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+static TEEC_Result ree_fs_new_readdir_batch(size_t num_params,
+					    struct tee_ioctl_param *params)
+{
+	DIR *dir = NULL;
+	struct dirent *dirent = NULL;
+	char *buf = NULL;
+	size_t len = 0;
+	size_t used = 0;
+	size_t fname_len = 0;
+	uint64_t count = 0;
+	long pos = 0;
+
+	/* Merged listings of all roots, see fs_opendir_merged() */
+	if (fs_num_roots > 1)
+		return tee_supp_fs_dir_read_batch(num_params, params);
+
+	if (num_params != 3 ||
+	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT ||
+	    (params[1].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT ||
+	    (params[2].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+
+	dir = handle_lookup(&dir_handle_db, params[0].b);
+	if (!dir)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	/* Cookies are telldir() positions plus one, leaving 0 as "none" */
+	if (params[0].c)
+		seekdir(dir, params[0].c - 1);
+
+	while (true) {
+		pos = telldir(dir);
+		dirent = readdir(dir);
+		if (!dirent)
+			break;
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		fname_len = strlen(dirent->d_name) + 1;
+		if (fname_len > len - used) {
+			/* Returned by the next call */
+			seekdir(dir, pos);
+			break;
+		}
+		memcpy(buf + used, dirent->d_name, fname_len);
+		used += fname_len;
+		count++;
+	}
+
+	if (!count) {
+		if (!dirent)
+			return TEEC_ERROR_ITEM_NOT_FOUND;
+		MEMREF_SIZE(params + 1) = fname_len;
+		return TEEC_ERROR_SHORT_BUFFER;
+	}
+
+	MEMREF_SIZE(params + 1) = used;
+	params[2].a = count;
+	params[2].b = dirent ? (uint64_t)pos + 1 : 0;
+
+	return TEEC_SUCCESS;
+}
+#endif
+
+bool tee_supp_fs_params_ok(size_t num_params, struct tee_ioctl_param *params,
+			   const uint64_t *types, size_t num_types)
+{
+	size_t n = 0;
+
+	if (num_params != num_types)
+		return false;
+
+	for (n = 0; n < num_types; n++)
+		if ((params[n].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+		    types[n])
+			return false;
+
+	return true;
+}
+
+const char *tee_supp_fs_param_to_name(struct tee_ioctl_param *param,
+				      size_t max_len)
+{
+	const char *name = tee_supp_param_to_va(param);
+	size_t len = MEMREF_SIZE(param);
+
+	if (!name || strnlen(name, len) == len || strlen(name) > max_len)
+		return NULL;
+
+	return name;
+}
+
+size_t tee_supp_fs_name_hash(const char *name, size_t tab_size)
+{
+	uint64_t h = 0xcbf29ce484222325;
+
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 0x100000001b3;
+
+	return h & (tab_size - 1);
+}
+
+/*
+ * Directories of backends keeping objects by name, and of the file
+ * backend striped over several roots
+ *
+ * A directory exists while names of objects are under it, as the file
+ * backend removes directories left empty. Opening one takes a sorted
+ * snapshot of the entries directly under it, which the READDIR requests
+ * then walk, the cookie of OPTEE_MRF_READDIR_BATCH being the position
+ * in the snapshot plus one.
+ */
+struct tee_supp_fs_dir {
+	char *path;		/* ending with a '/' */
+	char **names;
+	size_t num;
+	size_t max;
+	size_t pos;
+	bool failed;		/* an entry couldn't be added */
+};
+
+static pthread_mutex_t name_dir_db_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct handle_db name_dir_db = HANDLE_DB_INITIALIZER;
+
+static void name_dir_free(struct tee_supp_fs_dir *dir)
+{
+	size_t n = 0;
+
+	for (n = 0; n < dir->num; n++)
+		free(dir->names[n]);
+	free(dir->names);
+	free(dir->path);
+	free(dir);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+struct tee_supp_fs_dir *tee_supp_fs_dir_new(const char *path)
+{
+	struct tee_supp_fs_dir *dir = NULL;
+	size_t len = strlen(path);
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return NULL;
+
+	dir->path = malloc(len + 2);
+	if (!dir->path) {
+		free(dir);
+		return NULL;
+	}
+	memcpy(dir->path, path, len + 1);
+	if (!len || path[len - 1] != '/')
+		strcpy(dir->path + len, "/");
+
+	return dir;
+}
+
+void tee_supp_fs_dir_add(struct tee_supp_fs_dir *dir, const char *name)
+{
+	const char *child = NULL;
+	char **names = NULL;
+	size_t plen = 0;
+	size_t len = 0;
+
+	if (!dir || dir->failed)
+		return;
+
+	plen = strlen(dir->path);
+	child = name + plen;
+
+	if (strncmp(name, dir->path, plen))
+		return;
+
+	/* Dotfiles are skipped like by the file backend */
+	len = strcspn(child, "/");
+	if (!len || *child == '.')
+		return;
+
+	if (dir->num == dir->max) {
+		names = realloc(dir->names,
+				(dir->max ? dir->max * 2 : 16) * sizeof(*names));
+		if (!names) {
+			dir->failed = true;
+			return;
+		}
+		dir->names = names;
+		dir->max = dir->max ? dir->max * 2 : 16;
+	}
+
+	dir->names[dir->num] = strndup(child, len);
+	if (!dir->names[dir->num]) {
+		dir->failed = true;
+		return;
+	}
+	dir->num++;
+}
+
+TEEC_Result tee_supp_fs_dir_open(struct tee_supp_fs_dir *dir,
+				 struct tee_ioctl_param *params)
+{
+	size_t n = 0;
+	size_t k = 0;
+	int handle = 0;
+
+	if (!dir)
+		return TEEC_ERROR_OUT_OF_MEMORY;
+	if (dir->failed) {
+		name_dir_free(dir);
+		return TEEC_ERROR_OUT_OF_MEMORY;
+	}
+
+	/* Objects in a subdirectory list it once */
+	qsort(dir->names, dir->num, sizeof(*dir->names), name_cmp);
+	for (n = 0; n < dir->num; n++) {
+		if (k && !strcmp(dir->names[k - 1], dir->names[n]))
+			free(dir->names[n]);
+		else
+			dir->names[k++] = dir->names[n];
+	}
+	dir->num = k;
+
+	/* Like an empty directory of the file backend, see opendir */
+	if (!dir->num) {
+		name_dir_free(dir);
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+	}
+
+	tee_supp_mutex_lock(&name_dir_db_mutex);
+	handle = handle_get(&name_dir_db, dir);
+	tee_supp_mutex_unlock(&name_dir_db_mutex);
+	if (handle < 0) {
+		name_dir_free(dir);
+		return TEEC_ERROR_OUT_OF_MEMORY;
+	}
+	params[2].a = handle;
+
+	return TEEC_SUCCESS;
+}
+
+TEEC_Result tee_supp_fs_dir_close(size_t num_params,
+				  struct tee_ioctl_param *params)
+{
+	struct tee_supp_fs_dir *dir = NULL;
+
+	if (num_params != 1 ||
+	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&name_dir_db_mutex);
+	dir = handle_put(&name_dir_db, params[0].b);
+	tee_supp_mutex_unlock(&name_dir_db_mutex);
+	if (!dir)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name_dir_free(dir);
+
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result name_dir_read(size_t num_params,
+				 struct tee_ioctl_param *params, bool batch)
+{
+	struct tee_supp_fs_dir *dir = NULL;
+	size_t fname_len = 0;
+	uint64_t count = 0;
+	size_t used = 0;
+	char *buf = NULL;
+	size_t len = 0;
+
+	if (num_params != (batch ? 3 : 2) ||
+	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT ||
+	    (params[1].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT ||
+	    (batch && (params[2].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+
+	/* A handle used by two requests at once would be a TEE bug */
+	tee_supp_mutex_lock(&name_dir_db_mutex);
+	dir = handle_lookup(&name_dir_db, params[0].b);
+	tee_supp_mutex_unlock(&name_dir_db_mutex);
+	if (!dir)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	if (batch && params[0].c)
+		dir->pos = params[0].c - 1 < dir->num ? params[0].c - 1 :
+							dir->num;
+
+	while (dir->pos < dir->num) {
+		fname_len = strlen(dir->names[dir->pos]) + 1;
+		if (fname_len > len - used)
+			break;
+		memcpy(buf + used, dir->names[dir->pos], fname_len);
+		used += fname_len;
+		dir->pos++;
+		count++;
+		if (!batch)
+			break;
+	}
+
+	if (!count) {
+		if (dir->pos == dir->num)
+			return TEEC_ERROR_ITEM_NOT_FOUND;
+		MEMREF_SIZE(params + 1) = fname_len;
+		return TEEC_ERROR_SHORT_BUFFER;
+	}
+
+	MEMREF_SIZE(params + 1) = used;
+	if (batch) {
+		params[2].a = count;
+		params[2].b = dir->pos < dir->num ? dir->pos + 1 : 0;
+	}
+
+	return TEEC_SUCCESS;
+}
+
+TEEC_Result tee_supp_fs_dir_read(size_t num_params,
+				 struct tee_ioctl_param *params)
+{
+	return name_dir_read(num_params, params, false);
+}
+
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+TEEC_Result tee_supp_fs_dir_read_batch(size_t num_params,
+				       struct tee_ioctl_param *params)
+{
+	return name_dir_read(num_params, params, true);
+}
+#endif
+
+static const struct tee_supp_fs_backend tee_supp_fs_file_backend = {
+	.name = "file",
+	.init = ree_fs_new_init,
+	.commit = ree_fs_new_commit,
+	.ops = {
+		[OPTEE_MRF_OPEN] = ree_fs_new_open,
+		[OPTEE_MRF_CREATE] = ree_fs_new_create,
+		[OPTEE_MRF_CLOSE] = ree_fs_new_close,
+		[OPTEE_MRF_READ] = ree_fs_new_read,
+		[OPTEE_MRF_WRITE] = ree_fs_new_write,
+		[OPTEE_MRF_TRUNCATE] = ree_fs_new_truncate,
+		[OPTEE_MRF_REMOVE] = ree_fs_new_remove,
+		[OPTEE_MRF_RENAME] = ree_fs_new_rename,
+		[OPTEE_MRF_OPENDIR] = ree_fs_new_opendir,
+		[OPTEE_MRF_CLOSEDIR] = ree_fs_new_closedir,
+		[OPTEE_MRF_READDIR] = ree_fs_new_readdir,
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+		[OPTEE_MRF_READDIR_BATCH] = ree_fs_new_readdir_batch,
+#endif
+	},
+};
+
+static const struct tee_supp_fs_backend *fs_backends[] = {
+	&tee_supp_fs_file_backend,
+	&tee_supp_fs_log_backend,
+	&tee_supp_fs_ram_backend,
+};
+
+bool tee_supp_fs_set_backend(const char *name)
+{
+	size_t n = 0;
+
+	for (n = 0; n < sizeof(fs_backends) / sizeof(fs_backends[0]); n++) {
+		if (!strcmp(fs_backends[n]->name, name)) {
+			fs_backend = fs_backends[n];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+TEEC_Result tee_supp_fs_commit(void)
+{
+	/* Nothing to flush before the first request */
+	if (!tee_fs_root_len || !fs_backend->commit)
+		return TEEC_SUCCESS;
+
+	return fs_backend->commit();
+}
+
+void tee_supp_fs_snapshot(void)
+{
+	if (tee_fs_root_len && fs_backend->snapshot)
+		fs_backend->snapshot();
+}
+
 TEEC_Result tee_supp_fs_process(size_t num_params,
 				struct tee_ioctl_param *params)
 {
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+
 	if (!num_params || !tee_supp_param_is_value(params))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (strlen(tee_fs_root) == 0) {
-		if (tee_supp_fs_init() != 0) {
+	if (!tee_fs_root_len) {
+		tee_supp_mutex_lock(&fs_init_mutex);
+		if (!tee_fs_root_len && tee_supp_fs_init() != 0) {
 			EMSG("error tee_supp_fs_init: failed to create %s/",
 				TEE_FS_PARENT_PATH);
 			memset(tee_fs_root, 0, sizeof(tee_fs_root));
+			tee_supp_mutex_unlock(&fs_init_mutex);
 			return TEEC_ERROR_STORAGE_NOT_AVAILABLE;
 		}
+		tee_supp_mutex_unlock(&fs_init_mutex);
 	}
 
-	switch (params->a) {
-	case OPTEE_MRF_OPEN:
-		return ree_fs_new_open(num_params, params);
-	case OPTEE_MRF_CREATE:
-		return ree_fs_new_create(num_params, params);
-	case OPTEE_MRF_CLOSE:
-		return ree_fs_new_close(num_params, params);
-	case OPTEE_MRF_READ:
-		return ree_fs_new_read(num_params, params);
-	case OPTEE_MRF_WRITE:
-		return ree_fs_new_write(num_params, params);
-	case OPTEE_MRF_TRUNCATE:
-		return ree_fs_new_truncate(num_params, params);
-	case OPTEE_MRF_REMOVE:
-		return ree_fs_new_remove(num_params, params);
-	case OPTEE_MRF_RENAME:
-		return ree_fs_new_rename(num_params, params);
-	case OPTEE_MRF_OPENDIR:
-		return ree_fs_new_opendir(num_params, params);
-	case OPTEE_MRF_CLOSEDIR:
-		return ree_fs_new_closedir(num_params, params);
-	case OPTEE_MRF_READDIR:
-		return ree_fs_new_readdir(num_params, params);
-	default:
-		return TEEC_ERROR_BAD_PARAMETERS;
-	}
+	FREC(FS_ENTRY, params->a, params->b, 0);
+
+	if (params->a < TEE_SUPP_FS_NUM_OPS && fs_backend->ops[params->a])
+		res = fs_backend->ops[params->a](num_params, params);
+	else
+		res = TEEC_ERROR_BAD_PARAMETERS;
+
+	FREC(FS_EXIT, params->a, res, 0);
+
+	return res;
 }
@@ -27,10 +27,128 @@
 #ifndef TEE_SUPP_FS_H
 #define TEE_SUPP_FS_H
 
+#include <optee_msg_supplicant.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <tee_client_api.h>
 
 struct tee_ioctl_param;
 
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+#define TEE_SUPP_FS_NUM_OPS	(OPTEE_MRF_READDIR_BATCH + 1)
+#else
+#define TEE_SUPP_FS_NUM_OPS	(OPTEE_MRF_READDIR + 1)
+#endif
+
+/*
+ * struct tee_supp_fs_backend - Storage behind the OPTEE_MRF_* requests
+ * @name:	selects the backend with --fs-backend
+ * @init:	optional, called with the storage root, ending with a '/',
+ *		before the first request. Returns 0 on success.
+ * @commit:	optional, see tee_supp_fs_commit()
+ * @snapshot:	optional, see tee_supp_fs_snapshot()
+ * @ops:	handler of each OPTEE_MRF_* request, called with all the
+ *		parameters, the first holding the request
+ */
+struct tee_supp_fs_backend {
+	const char *name;
+	int (*init)(const char *root);
+	TEEC_Result (*commit)(void);
+	void (*snapshot)(void);
+	TEEC_Result (*ops[TEE_SUPP_FS_NUM_OPS])(size_t num_params,
+						struct tee_ioctl_param *params);
+};
+
+/* Objects packed into segment files, see tee_supp_fs_log.c */
+extern const struct tee_supp_fs_backend tee_supp_fs_log_backend;
+/* Objects kept in memory, see tee_supp_fs_ram.c */
+extern const struct tee_supp_fs_backend tee_supp_fs_ram_backend;
+
+/*
+ * Directories of backends keeping objects by name, see tee_supp_fs.c
+ *
+ * The OPTEE_MRF_OPENDIR handler of such a backend adds the names of all
+ * its objects to a tee_supp_fs_dir_new() listing and returns
+ * tee_supp_fs_dir_open(). The other directory requests are served by
+ * the handlers below.
+ */
+struct tee_supp_fs_dir;
+
+struct tee_supp_fs_dir *tee_supp_fs_dir_new(const char *path);
+void tee_supp_fs_dir_add(struct tee_supp_fs_dir *dir, const char *name);
+TEEC_Result tee_supp_fs_dir_open(struct tee_supp_fs_dir *dir,
+				 struct tee_ioctl_param *params);
+TEEC_Result tee_supp_fs_dir_close(size_t num_params,
+				  struct tee_ioctl_param *params);
+TEEC_Result tee_supp_fs_dir_read(size_t num_params,
+				 struct tee_ioctl_param *params);
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+TEEC_Result tee_supp_fs_dir_read_batch(size_t num_params,
+				       struct tee_ioctl_param *params);
+#endif
+
+/*
+ * Helpers of the backends
+ *
+ * tee_supp_fs_params_ok() returns true if there are @num_types
+ * parameters of the TEE_IOCTL_PARAM_ATTR_TYPE_* @types.
+ * tee_supp_fs_param_to_name() returns the name held by memref @param, at
+ * most @max_len long, NULL if it isn't one.
+ * tee_supp_fs_name_hash() returns the bucket of @name in a table of
+ * @tab_size buckets, a power of two.
+ */
+bool tee_supp_fs_params_ok(size_t num_params, struct tee_ioctl_param *params,
+			   const uint64_t *types, size_t num_types);
+const char *tee_supp_fs_param_to_name(struct tee_ioctl_param *param,
+				      size_t max_len);
+size_t tee_supp_fs_name_hash(const char *name, size_t tab_size);
+
+/* Selects backend @name, "file" by default. Returns false if unknown. */
+bool tee_supp_fs_set_backend(const char *name);
+
+#define TEE_SUPP_FS_MAX_ROOTS	16
+
+/*
+ * tee_supp_fs_add_root() - Adds directory @path to stripe files of the
+ * file backend over, besides TEE_FS_PARENT_PATH
+ *
+ * Returns false if there are too many roots or @path is too long.
+ */
+bool tee_supp_fs_add_root(const char *path);
+
+/* How secure storage writes are flushed */
+enum tee_supp_fs_sync {
+	/* Each write, files are opened O_SYNC */
+	TEE_SUPP_FS_SYNC_ALWAYS,
+	/* Once per commit of the TEE, see tee_supp_fs.c */
+	TEE_SUPP_FS_SYNC_COMMIT,
+};
+
+void tee_supp_fs_set_sync(enum tee_supp_fs_sync mode);
+
+#define TEE_SUPP_FS_FD_CACHE_DEFAULT	16
+
+/* Sets how many closed files are kept open for reuse, 0 none */
+void tee_supp_fs_set_fd_cache(size_t max);
+
+/*
+ * tee_supp_fs_commit() - Flushes all secure storage writes not flushed
+ * yet, before the TEE acts on what it has committed
+ */
+TEEC_Result tee_supp_fs_commit(void);
+
+#define TEE_SUPP_FS_SNAPSHOT_DEFAULT	30	/* seconds */
+
+/*
+ * Sets how often storage kept in memory is saved, 0 only on
+ * tee_supp_fs_snapshot()
+ */
+void tee_supp_fs_set_snapshot_interval(unsigned int sec);
+
+/* Saves storage kept in memory now, if the backend keeps it there */
+void tee_supp_fs_snapshot(void);
+
 TEEC_Result tee_supp_fs_process(size_t num_params,
 				struct tee_ioctl_param *params);
 
@@ -0,0 +1,1689 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <handle.h>
+#include <optee_msg_supplicant.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <teec_trace.h>
+#include <tee_supp_fs.h>
+#include <tee_supplicant.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 255
+#endif
+
+/*
+ * Log-structured secure storage
+ *
+ * Instead of a file each, objects are packed into append-only segment
+ * files, <storage root>/log/<id>.seg. Every change appends a record:
+ * - META binds a name to an object, on create and rename, and sets its
+ *   size.
+ * - BLOCK holds a block of an object and the object size after the write.
+ * - TRUNCATE sets the size of an object.
+ * - DELETE drops an object, on remove.
+ * The index, kept in memory, maps names to objects and each block of an
+ * object to the record holding it. It's rebuilt at start up by replaying
+ * the segments in order. A name bound to another object leaves the old
+ * one without a name, objects without a name after replay are dropped.
+ * A record setting a size drops the blocks past it.
+ *
+ * Records carry a CRC. Replay of a segment stops at the first record that
+ * doesn't check out and the rest, torn by a crash, is cut off. As the
+ * records are replayed in the order they were appended, what's recovered
+ * is a prefix of the changes, so the active segment doesn't need to be
+ * flushed to order writes. It's flushed where the TEE commits: after a
+ * write to the first block of an object, where the REE FS hash tree keeps
+ * its header, on close, rename and remove, and before an RPMB request.
+ * One fdatasync() covers the updates of all objects: it runs without the
+ * lock, and the requests that appended meanwhile share the next one.
+ *
+ * A thread compacts sealed segments less than half live, least live
+ * first: the records still needed are appended again and the segment is
+ * deleted. TRUNCATE and DELETE records, tombstones, are needed as long as
+ * an older segment holds records of their object, which they shadow on
+ * replay. Each segment lists the objects it holds records of and its
+ * tombstones, which count as live until the older segments of their
+ * object are gone.
+ */
+#define LOG_DIR			"log"
+#define LOG_SEGMENT_SIZE	(16 * 1024 * 1024)
+#define LOG_BLOCK_SIZE		4096
+#define LOG_NAME_MAX		255
+#define LOG_MAGIC		0x474f4c54	/* "TLOG" */
+#define LOG_COMPACT_INTERVAL	10		/* seconds */
+
+#define LOG_ALIGN(x)		(((x) + 7) & ~(size_t)7)
+#define LOG_REC_SIZE(len)	(sizeof(struct log_rec) + LOG_ALIGN(len))
+
+enum log_rec_type {
+	LOG_REC_META = 1,
+	LOG_REC_BLOCK,
+	LOG_REC_TRUNCATE,
+	LOG_REC_DELETE,
+};
+
+struct log_rec {
+	uint32_t magic;
+	uint32_t crc;		/* of the record and its data, with crc 0 */
+	uint32_t type;		/* enum log_rec_type */
+	uint32_t len;		/* bytes of data following, name or block */
+	uint64_t obj;
+	uint64_t block;		/* BLOCK: index of the block */
+	uint64_t size;		/* object size after the record */
+};
+
+struct log_tomb {
+	uint64_t obj;
+	uint32_t len;		/* bytes of the record */
+};
+
+struct log_seg {
+	uint32_t id;
+	int fd;
+	uint32_t size;		/* bytes appended */
+	uint32_t live;		/* bytes of records still in use */
+	uint64_t *objs;		/* objects with records here, sorted if sealed */
+	size_t num_objs;
+	size_t max_objs;
+	struct log_tomb *tombs;	/* tombstones still needed */
+	size_t num_tombs;
+	size_t max_tombs;
+	TAILQ_ENTRY(log_seg) link;
+};
+
+struct log_loc {
+	struct log_seg *seg;	/* NULL if none */
+	uint32_t off;
+	uint32_t len;		/* bytes of data of the record */
+};
+
+struct log_obj {
+	uint64_t id;
+	char *name;		/* NULL once removed */
+	uint64_t size;
+	struct log_loc meta;	/* META record holding the name */
+	struct log_loc size_loc; /* newest record setting the size */
+	struct log_loc *blocks;
+	size_t num_blocks;
+	unsigned int refs;	/* open handles */
+	struct log_obj *name_next;
+	struct log_obj *id_next;
+};
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_flush_cond = PTHREAD_COND_INITIALIZER;
+static char log_path[PATH_MAX];
+static int log_dir_fd = -1;
+
+/* Oldest first, the last one is appended to */
+static TAILQ_HEAD(log_seg_head, log_seg) log_segs =
+		TAILQ_HEAD_INITIALIZER(log_segs);
+static struct log_seg *log_active;
+static uint64_t log_gen;	/* bumped by every change */
+static uint64_t log_synced;	/* log_gen of the last flush */
+static struct log_seg *log_flushing; /* flushed without the lock */
+static bool log_dir_dirty;	/* segments created or deleted since */
+
+static uint64_t log_next_id = 1;
+static struct log_obj **log_names;
+static struct log_obj **log_ids;
+static size_t log_tab_size;
+static size_t log_num_objs;
+
+static struct handle_db log_files = HANDLE_DB_INITIALIZER;
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+	uint32_t c = 0;
+	size_t n = 0;
+	size_t k = 0;
+
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t crc_update(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *b = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *b++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static uint32_t rec_crc(const struct log_rec *rec, const void *data)
+{
+	struct log_rec r = *rec;
+
+	r.crc = 0;
+	return crc_update(crc_update(0, &r, sizeof(r)), data, rec->len);
+}
+
+static struct log_obj *obj_by_name(const char *name)
+{
+	struct log_obj *obj = NULL;
+
+	if (!log_tab_size)
+		return NULL;
+
+	obj = log_names[tee_supp_fs_name_hash(name, log_tab_size)];
+	for (; obj; obj = obj->name_next)
+		if (!strcmp(obj->name, name))
+			return obj;
+
+	return NULL;
+}
+
+static struct log_obj *obj_by_id(uint64_t id)
+{
+	struct log_obj *obj = NULL;
+
+	if (!log_tab_size)
+		return NULL;
+
+	for (obj = log_ids[id & (log_tab_size - 1)]; obj; obj = obj->id_next)
+		if (obj->id == id)
+			return obj;
+
+	return NULL;
+}
+
+static bool tab_grow(void)
+{
+	size_t old_size = log_tab_size;
+	size_t size = old_size ? old_size * 2 : 1024;
+	struct log_obj **names = NULL;
+	struct log_obj **ids = NULL;
+	struct log_obj *next = NULL;
+	struct log_obj *obj = NULL;
+	size_t n = 0;
+	size_t h = 0;
+
+	names = calloc(size, sizeof(*names));
+	ids = calloc(size, sizeof(*ids));
+	if (!names || !ids) {
+		free(names);
+		free(ids);
+		return false;
+	}
+
+	for (n = 0; n < old_size; n++) {
+		for (obj = log_ids[n]; obj; obj = next) {
+			next = obj->id_next;
+			h = obj->id & (size - 1);
+			obj->id_next = ids[h];
+			ids[h] = obj;
+		}
+	}
+
+	free(log_ids);
+	log_ids = ids;
+	log_tab_size = size;
+
+	/* Rehashed by the new size */
+	for (n = 0; n < old_size; n++) {
+		for (obj = log_names[n]; obj; obj = next) {
+			next = obj->name_next;
+			h = tee_supp_fs_name_hash(obj->name, log_tab_size);
+			obj->name_next = names[h];
+			names[h] = obj;
+		}
+	}
+
+	free(log_names);
+	log_names = names;
+
+	return true;
+}
+
+static struct log_obj *obj_new(uint64_t id)
+{
+	struct log_obj *obj = NULL;
+	size_t h = 0;
+
+	if (log_num_objs >= log_tab_size && !tab_grow())
+		return NULL;
+
+	obj = calloc(1, sizeof(*obj));
+	if (!obj)
+		return NULL;
+
+	obj->id = id;
+	h = id & (log_tab_size - 1);
+	obj->id_next = log_ids[h];
+	log_ids[h] = obj;
+	log_num_objs++;
+
+	return obj;
+}
+
+/* The record at @loc isn't needed any longer */
+static void loc_release(struct log_loc *loc)
+{
+	if (loc->seg)
+		loc->seg->live -= LOG_REC_SIZE(loc->len);
+	loc->seg = NULL;
+}
+
+static bool loc_is(struct log_loc *loc, struct log_seg *seg, uint32_t off)
+{
+	return loc->seg == seg && loc->off == off;
+}
+
+/*
+ * Binds @obj to @name, which it takes over, or unbinds it if NULL. The
+ * META record of an object is only released when it's unbound, as rename
+ * may have to restore the old name.
+ */
+static void obj_set_name(struct log_obj *obj, char *name)
+{
+	struct log_obj **pp = NULL;
+
+	if (obj->name) {
+		pp = log_names + tee_supp_fs_name_hash(obj->name, log_tab_size);
+		while (*pp != obj)
+			pp = &(*pp)->name_next;
+		*pp = obj->name_next;
+		free(obj->name);
+	}
+
+	obj->name = name;
+	if (!name)
+		loc_release(&obj->meta);
+	else {
+		pp = log_names + tee_supp_fs_name_hash(name, log_tab_size);
+		obj->name_next = *pp;
+		*pp = obj;
+	}
+}
+
+/* Sets the size of @obj, dropping the blocks past it */
+static void obj_set_size(struct log_obj *obj, uint64_t size)
+{
+	size_t num = (size + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE;
+
+	obj->size = size;
+	while (obj->num_blocks > num)
+		loc_release(obj->blocks + --obj->num_blocks);
+}
+
+static void obj_free(struct log_obj *obj)
+{
+	struct log_obj **pp = NULL;
+
+	obj_set_name(obj, NULL);
+	obj_set_size(obj, 0);
+
+	pp = log_ids + (obj->id & (log_tab_size - 1));
+	while (*pp != obj)
+		pp = &(*pp)->id_next;
+	*pp = obj->id_next;
+	log_num_objs--;
+
+	free(obj->blocks);
+	free(obj);
+}
+
+static bool obj_grow(struct log_obj *obj, size_t num)
+{
+	struct log_loc *blocks = NULL;
+
+	if (num <= obj->num_blocks)
+		return true;
+
+	blocks = realloc(obj->blocks, num * sizeof(*blocks));
+	if (!blocks)
+		return false;
+	memset(blocks + obj->num_blocks, 0,
+	       (num - obj->num_blocks) * sizeof(*blocks));
+	obj->blocks = blocks;
+	obj->num_blocks = num;
+
+	return true;
+}
+
+static bool log_datasync(int fd)
+{
+	while (fdatasync(fd)) {
+		if (errno != EINTR) {
+			EMSG("fdatasync: %s", strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Flushes what was appended, log_mutex held. The lock is dropped while
+ * flushing. A caller finding a flush in progress waits for it, and then
+ * for a next one only if its changes came too late for it.
+ */
+static bool log_sync(void)
+{
+	uint64_t gen = log_gen;
+	uint64_t target = 0;
+	bool dir = false;
+	bool ok = true;
+
+	while (log_synced < gen) {
+		if (log_flushing) {
+			pthread_cond_wait(&log_flush_cond, &log_mutex);
+			continue;
+		}
+
+		/* Sealed segments were flushed when sealed */
+		target = log_gen;
+		dir = log_dir_dirty;
+		log_dir_dirty = false;
+		log_flushing = log_active;
+		tee_supp_mutex_unlock(&log_mutex);
+
+		ok = log_datasync(log_flushing->fd);
+		if (ok && dir && fsync(log_dir_fd)) {
+			EMSG("fsync: %s", strerror(errno));
+			ok = false;
+		}
+
+		tee_supp_mutex_lock(&log_mutex);
+		log_flushing = NULL;
+		pthread_cond_broadcast(&log_flush_cond);
+		if (!ok) {
+			log_dir_dirty |= dir;
+			return false;
+		}
+		log_synced = target;
+	}
+
+	return true;
+}
+
+/* Returns false if the path of segment @id doesn't fit @path */
+static bool seg_path(char *path, size_t size, uint32_t id)
+{
+	int len = snprintf(path, size, "%s%08x.seg", log_path, id);
+
+	if (len < 0 || (size_t)len >= size) {
+		EMSG("segment %08x: %s", id, strerror(ENAMETOOLONG));
+		return false;
+	}
+
+	return true;
+}
+
+static struct log_seg *seg_open(uint32_t id, bool create)
+{
+	char path[PATH_MAX] = { 0 };
+	struct log_seg *seg = NULL;
+	int flags = O_RDWR;
+
+	if (!seg_path(path, sizeof(path), id))
+		return NULL;
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return NULL;
+
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+
+	seg->fd = open(path, flags, 0600);
+	if (seg->fd < 0) {
+		EMSG("%s: %s", path, strerror(errno));
+		free(seg);
+		return NULL;
+	}
+	seg->id = id;
+
+	return seg;
+}
+
+static void seg_free(struct log_seg *seg)
+{
+	close(seg->fd);
+	free(seg->objs);
+	free(seg->tombs);
+	free(seg);
+}
+
+/* Notes that @seg holds a record of object @id */
+static bool seg_add_obj(struct log_seg *seg, uint64_t id)
+{
+	uint64_t *objs = NULL;
+	size_t max = 0;
+
+	/* Mostly a run of records of one object */
+	if (seg->num_objs && seg->objs[seg->num_objs - 1] == id)
+		return true;
+
+	if (seg->num_objs == seg->max_objs) {
+		max = seg->max_objs ? seg->max_objs * 2 : 64;
+		objs = realloc(seg->objs, max * sizeof(*objs));
+		if (!objs)
+			return false;
+		seg->objs = objs;
+		seg->max_objs = max;
+	}
+	seg->objs[seg->num_objs++] = id;
+
+	return true;
+}
+
+static bool seg_add_tomb(struct log_seg *seg, uint64_t id, uint32_t len)
+{
+	struct log_tomb *tombs = NULL;
+	size_t max = 0;
+
+	if (seg->num_tombs == seg->max_tombs) {
+		max = seg->max_tombs ? seg->max_tombs * 2 : 16;
+		tombs = realloc(seg->tombs, max * sizeof(*tombs));
+		if (!tombs)
+			return false;
+		seg->tombs = tombs;
+		seg->max_tombs = max;
+	}
+	seg->tombs[seg->num_tombs].obj = id;
+	seg->tombs[seg->num_tombs].len = len;
+	seg->num_tombs++;
+	seg->live += len;
+
+	return true;
+}
+
+static int obj_id_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts the objects of @seg, which isn't appended to any longer */
+static void seg_seal(struct log_seg *seg)
+{
+	size_t n = 0;
+	size_t k = 0;
+
+	if (!seg->num_objs)
+		return;
+
+	qsort(seg->objs, seg->num_objs, sizeof(*seg->objs), obj_id_cmp);
+	for (n = 1; n < seg->num_objs; n++)
+		if (seg->objs[n] != seg->objs[k])
+			seg->objs[++k] = seg->objs[n];
+	seg->num_objs = k + 1;
+}
+
+/* Returns true if a segment older than @seg holds records of object @id */
+static bool seg_shadows(struct log_seg *seg, uint64_t id)
+{
+	struct log_seg *s = NULL;
+
+	TAILQ_FOREACH(s, &log_segs, link) {
+		if (s == seg)
+			break;
+		if (bsearch(&id, s->objs, s->num_objs, sizeof(*s->objs),
+			    obj_id_cmp))
+			return true;
+	}
+
+	return false;
+}
+
+/* Drops the tombstones that @seg no longer needs */
+static void seg_drop_tombs(struct log_seg *seg)
+{
+	struct log_tomb *t = NULL;
+	size_t n = 0;
+
+	while (n < seg->num_tombs) {
+		t = seg->tombs + n;
+		if (seg_shadows(seg, t->obj)) {
+			n++;
+			continue;
+		}
+		seg->live -= t->len;
+		*t = seg->tombs[--seg->num_tombs];
+	}
+}
+
+static void seg_delete(struct log_seg *seg)
+{
+	char path[PATH_MAX] = { 0 };
+	struct log_seg *s = NULL;
+
+	/* Sealed since log_sync() started flushing it */
+	while (log_flushing == seg)
+		pthread_cond_wait(&log_flush_cond, &log_mutex);
+
+	TAILQ_REMOVE(&log_segs, seg, link);
+	if (seg_path(path, sizeof(path), seg->id) && unlink(path))
+		EMSG("%s: %s", path, strerror(errno));
+	log_dir_dirty = true;
+	log_gen++;
+	seg_free(seg);
+
+	/* Tombstones shadowing records of it may go */
+	TAILQ_FOREACH(s, &log_segs, link)
+		seg_drop_tombs(s);
+}
+
+/* Seals the active segment and starts a new one, log_mutex held */
+static bool log_new_segment(void)
+{
+	struct log_seg *seg = NULL;
+
+	/* Sealed segments are always flushed */
+	if (log_active && log_synced != log_gen &&
+	    !log_datasync(log_active->fd))
+		return false;
+
+	seg = seg_open(log_active ? log_active->id + 1 : 0, true);
+	if (!seg)
+		return false;
+
+	if (log_active)
+		seg_seal(log_active);
+	TAILQ_INSERT_TAIL(&log_segs, seg, link);
+	log_active = seg;
+	log_dir_dirty = true;
+	log_gen++;
+	pthread_cond_signal(&log_cond);
+
+	return true;
+}
+
+/*
+ * log_append() - Appends a record of @type for @obj, log_mutex held
+ *
+ * @loc is updated to the new record if not NULL, releasing the record it
+ * pointed to.
+ */
+static bool log_append(enum log_rec_type type, struct log_obj *obj,
+		       uint64_t block, const void *data, uint32_t len,
+		       struct log_loc *loc)
+{
+	size_t rec_len = LOG_REC_SIZE(len);
+	struct log_rec *rec = NULL;
+	uint8_t *buf = NULL;
+	size_t done = 0;
+	ssize_t r = 0;
+
+	if (log_active->size + rec_len > LOG_SEGMENT_SIZE &&
+	    !log_new_segment())
+		return false;
+
+	/* Noted first, a record must not be appended unaccounted */
+	if (!seg_add_obj(log_active, obj->id) ||
+	    ((type == LOG_REC_TRUNCATE || type == LOG_REC_DELETE) &&
+	     !seg_add_tomb(log_active, obj->id, rec_len)))
+		return false;
+
+	buf = calloc(1, rec_len);
+	if (!buf)
+		return false;
+
+	rec = (struct log_rec *)buf;
+	rec->magic = LOG_MAGIC;
+	rec->type = type;
+	rec->len = len;
+	rec->obj = obj->id;
+	rec->block = block;
+	rec->size = obj->size;
+	memcpy(buf + sizeof(*rec), data, len);
+	rec->crc = rec_crc(rec, buf + sizeof(*rec));
+
+	while (done < rec_len) {
+		r = pwrite(log_active->fd, buf + done, rec_len - done,
+			   log_active->size + done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			EMSG("pwrite: %s", strerror(errno));
+			free(buf);
+			return false;
+		}
+		done += r;
+	}
+	free(buf);
+
+	if (loc) {
+		loc_release(loc);
+		loc->seg = log_active;
+		loc->off = log_active->size;
+		loc->len = len;
+		log_active->live += rec_len;
+	}
+	if (type != LOG_REC_DELETE) {
+		obj->size_loc.seg = log_active;
+		obj->size_loc.off = log_active->size;
+	}
+	log_active->size += rec_len;
+	log_gen++;
+
+	return true;
+}
+
+static bool log_append_meta(struct log_obj *obj)
+{
+	return log_append(LOG_REC_META, obj, 0, obj->name, strlen(obj->name),
+			  &obj->meta);
+}
+
+/* Reads up to @len bytes of the data of the record at @loc at @offs */
+static bool loc_read(struct log_loc *loc, void *buf, size_t len, size_t offs)
+{
+	uint8_t *b = buf;
+	ssize_t r = 0;
+
+	offs += loc->off + sizeof(struct log_rec);
+	while (len) {
+		r = pread(loc->seg->fd, b, len, offs);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			EMSG("pread: %s", r ? strerror(errno) : "short read");
+			return false;
+		}
+		b += r;
+		len -= r;
+		offs += r;
+	}
+
+	return true;
+}
+
+/* Copies block @idx of @obj to @buf, zero filled, log_mutex held */
+static bool obj_read_block(struct log_obj *obj, size_t idx, uint8_t *buf)
+{
+	struct log_loc *loc = NULL;
+	size_t len = 0;
+
+	if (idx < obj->num_blocks && obj->blocks[idx].seg) {
+		loc = obj->blocks + idx;
+		len = loc->len;
+		if (!loc_read(loc, buf, len, 0))
+			return false;
+	}
+	memset(buf + len, 0, LOG_BLOCK_SIZE - len);
+
+	return true;
+}
+
+static TEEC_Result log_open(size_t num_params, struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct log_obj *obj = NULL;
+	const char *name = NULL;
+	int fd = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, LOG_NAME_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&log_mutex);
+	obj = obj_by_name(name);
+	if (!obj) {
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+
+	fd = handle_get(&log_files, obj);
+	if (fd < 0) {
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	obj->refs++;
+	params[2].a = fd;
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return res;
+}
+
+static TEEC_Result log_create(size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT,
+	};
+	TEEC_Result res = TEEC_ERROR_OUT_OF_MEMORY;
+	struct log_obj *obj = NULL;
+	const char *name = NULL;
+	char *n = NULL;
+	int fd = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, LOG_NAME_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&log_mutex);
+
+	/* Like O_TRUNC, an existing object is truncated in place */
+	obj = obj_by_name(name);
+	if (obj) {
+		fd = handle_get(&log_files, obj);
+		if (fd < 0)
+			goto out;
+		obj_set_size(obj, 0);
+		if (!log_append(LOG_REC_TRUNCATE, obj, 0, NULL, 0, NULL)) {
+			handle_put(&log_files, fd);
+			res = TEEC_ERROR_GENERIC;
+			goto out;
+		}
+		goto done;
+	}
+
+	n = strdup(name);
+	obj = obj_new(log_next_id);
+	if (!n || !obj)
+		goto err;
+	log_next_id++;
+
+	fd = handle_get(&log_files, obj);
+	if (fd < 0)
+		goto err;
+
+	obj_set_name(obj, n);
+	n = NULL;
+	if (!log_append_meta(obj)) {
+		handle_put(&log_files, fd);
+		res = TEEC_ERROR_GENERIC;
+		goto err;
+	}
+done:
+	obj->refs++;
+	params[2].a = fd;
+	res = TEEC_SUCCESS;
+	goto out;
+err:
+	if (obj)
+		obj_free(obj);
+	free(n);
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return res;
+}
+
+static TEEC_Result log_close(size_t num_params,
+			     struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct log_obj *obj = NULL;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 1))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&log_mutex);
+	obj = handle_put(&log_files, params[0].b);
+	if (!obj) {
+		res = TEEC_ERROR_BAD_PARAMETERS;
+		goto out;
+	}
+
+	if (!log_sync())
+		res = TEEC_ERROR_GENERIC;
+
+	if (!--obj->refs && !obj->name)
+		obj_free(obj);
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return res;
+}
+
+static TEEC_Result log_read(size_t num_params, struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct log_obj *obj = NULL;
+	struct log_loc *loc = NULL;
+	uint8_t *buf = NULL;
+	uint64_t offs = 0;
+	size_t len = 0;
+	size_t idx = 0;
+	size_t o = 0;
+	size_t n = 0;
+	size_t m = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 2))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+	offs = params[0].c;
+
+	tee_supp_mutex_lock(&log_mutex);
+	obj = handle_lookup(&log_files, params[0].b);
+	if (!obj) {
+		res = TEEC_ERROR_BAD_PARAMETERS;
+		goto out;
+	}
+
+	if (offs >= obj->size)
+		len = 0;
+	else if (len > obj->size - offs)
+		len = obj->size - offs;
+	MEMREF_SIZE(params + 1) = len;
+
+	while (len) {
+		idx = offs / LOG_BLOCK_SIZE;
+		o = offs % LOG_BLOCK_SIZE;
+		n = LOG_BLOCK_SIZE - o;
+		if (n > len)
+			n = len;
+
+		m = 0;
+		if (idx < obj->num_blocks && obj->blocks[idx].seg) {
+			loc = obj->blocks + idx;
+			if (loc->len > o)
+				m = loc->len - o < n ? loc->len - o : n;
+			if (m && !loc_read(loc, buf, m, o)) {
+				res = TEEC_ERROR_GENERIC;
+				goto out;
+			}
+		}
+		memset(buf + m, 0, n - m);
+
+		buf += n;
+		offs += n;
+		len -= n;
+	}
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return res;
+}
+
+static TEEC_Result log_write(size_t num_params,
+			     struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+	};
+	uint8_t block[LOG_BLOCK_SIZE];
+	TEEC_Result res = TEEC_SUCCESS;
+	struct log_obj *obj = NULL;
+	const uint8_t *buf = NULL;
+	uint64_t offs = 0;
+	size_t len = 0;
+	size_t blen = 0;
+	size_t idx = 0;
+	size_t o = 0;
+	size_t n = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 2))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+	offs = params[0].c;
+
+	tee_supp_mutex_lock(&log_mutex);
+	obj = handle_lookup(&log_files, params[0].b);
+	if (!obj) {
+		res = TEEC_ERROR_BAD_PARAMETERS;
+		goto out;
+	}
+
+	if (len && !obj_grow(obj, (offs + len - 1) / LOG_BLOCK_SIZE + 1)) {
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	while (len) {
+		idx = offs / LOG_BLOCK_SIZE;
+		o = offs % LOG_BLOCK_SIZE;
+		n = LOG_BLOCK_SIZE - o;
+		if (n > len)
+			n = len;
+
+		/* Blocks are rewritten whole, up to the last byte written */
+		blen = obj->blocks[idx].seg ? obj->blocks[idx].len : 0;
+		if ((o || n < blen) && !obj_read_block(obj, idx, block)) {
+			res = TEEC_ERROR_GENERIC;
+			goto out;
+		}
+		memcpy(block + o, buf, n);
+		if (blen < o + n)
+			blen = o + n;
+
+		if (obj->size < offs + n)
+			obj->size = offs + n;
+		if (!log_append(LOG_REC_BLOCK, obj, idx, block, blen,
+				obj->blocks + idx)) {
+			res = TEEC_ERROR_GENERIC;
+			goto out;
+		}
+
+		buf += n;
+		offs += n;
+		len -= n;
+	}
+
+	/* A write of the header commits an update of the object */
+	if (params[0].c < LOG_BLOCK_SIZE && !log_sync())
+		res = TEEC_ERROR_GENERIC;
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return res;
+}
+
+static TEEC_Result log_truncate(size_t num_params,
+				struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+	};
+	uint8_t block[LOG_BLOCK_SIZE];
+	TEEC_Result res = TEEC_SUCCESS;
+	struct log_obj *obj = NULL;
+	uint64_t len = 0;
+	size_t idx = 0;
+	size_t o = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 1))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	len = params[0].c;
+
+	tee_supp_mutex_lock(&log_mutex);
+	obj = handle_lookup(&log_files, params[0].b);
+	if (!obj) {
+		res = TEEC_ERROR_BAD_PARAMETERS;
+		goto out;
+	}
+
+	/* What's cut off a block must read back as zeros if extended */
+	idx = len / LOG_BLOCK_SIZE;
+	o = len % LOG_BLOCK_SIZE;
+	if (len < obj->size && o && idx < obj->num_blocks &&
+	    obj->blocks[idx].seg && obj->blocks[idx].len > o) {
+		if (!obj_read_block(obj, idx, block)) {
+			res = TEEC_ERROR_GENERIC;
+			goto out;
+		}
+		obj_set_size(obj, len);
+		if (!log_append(LOG_REC_BLOCK, obj, idx, block, o,
+				obj->blocks + idx)) {
+			res = TEEC_ERROR_GENERIC;
+			goto out;
+		}
+	}
+
+	obj_set_size(obj, len);
+	if (!log_append(LOG_REC_TRUNCATE, obj, 0, NULL, 0, NULL))
+		res = TEEC_ERROR_GENERIC;
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return res;
+}
+
+static TEEC_Result log_remove(size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct log_obj *obj = NULL;
+	const char *name = NULL;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 2))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, LOG_NAME_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&log_mutex);
+	obj = obj_by_name(name);
+	if (!obj) {
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+
+	if (!log_append(LOG_REC_DELETE, obj, 0, NULL, 0, NULL)) {
+		res = TEEC_ERROR_GENERIC;
+		goto out;
+	}
+
+	/* Still usable by open handles */
+	obj_set_name(obj, NULL);
+	if (!obj->refs)
+		obj_free(obj);
+
+	/* Gone before the lock is dropped to flush */
+	if (!log_sync())
+		res = TEEC_ERROR_GENERIC;
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return res;
+}
+
+static TEEC_Result log_rename(size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct log_obj *dst = NULL;
+	struct log_obj *obj = NULL;
+	const char *old_name = NULL;
+	const char *new_name = NULL;
+	char *old = NULL;
+	char *n = NULL;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	old_name = tee_supp_fs_param_to_name(params + 1, LOG_NAME_MAX);
+	new_name = tee_supp_fs_param_to_name(params + 2, LOG_NAME_MAX);
+	if (!old_name || !new_name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	n = strdup(new_name);
+	if (!n)
+		return TEEC_ERROR_OUT_OF_MEMORY;
+
+	tee_supp_mutex_lock(&log_mutex);
+	dst = obj_by_name(new_name);
+	if (dst && !params[0].b) {
+		res = TEEC_ERROR_ACCESS_CONFLICT;
+		goto out;
+	}
+
+	obj = obj_by_name(old_name);
+	if (!obj) {
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+	if (dst == obj)
+		goto out;
+
+	/* Binding the name leaves the object replaced without one */
+	old = strdup(obj->name);
+	if (!old) {
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	obj_set_name(obj, n);
+	n = NULL;
+	if (!log_append_meta(obj)) {
+		obj_set_name(obj, old);
+		res = TEEC_ERROR_GENERIC;
+		goto out;
+	}
+	free(old);
+
+	if (dst) {
+		obj_set_name(dst, NULL);
+		if (!dst->refs)
+			obj_free(dst);
+	}
+
+	if (!log_sync())
+		res = TEEC_ERROR_GENERIC;
+out:
+	tee_supp_mutex_unlock(&log_mutex);
+	free(n);
+
+	return res;
+}
+
+static TEEC_Result log_opendir(size_t num_params,
+			       struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT,
+	};
+	struct tee_supp_fs_dir *dir = NULL;
+	struct log_obj *obj = NULL;
+	const char *name = NULL;
+	size_t n = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, LOG_NAME_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	dir = tee_supp_fs_dir_new(name);
+
+	tee_supp_mutex_lock(&log_mutex);
+	for (n = 0; n < log_tab_size; n++)
+		for (obj = log_names[n]; obj; obj = obj->name_next)
+			tee_supp_fs_dir_add(dir, obj->name);
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return tee_supp_fs_dir_open(dir, params);
+}
+
+static TEEC_Result log_commit(void)
+{
+	bool ok = false;
+
+	tee_supp_mutex_lock(&log_mutex);
+	ok = log_sync();
+	tee_supp_mutex_unlock(&log_mutex);
+
+	return ok ? TEEC_SUCCESS : TEEC_ERROR_GENERIC;
+}
+
+/*
+ * Appends @obj anew after a TRUNCATE to zero, which shadows all its older
+ * records, log_mutex held
+ */
+static bool obj_rewrite(struct log_obj *obj)
+{
+	uint8_t block[LOG_BLOCK_SIZE];
+	uint64_t size = obj->size;
+	struct log_loc *loc = NULL;
+	size_t n = 0;
+	bool ok = false;
+
+	obj->size = 0;
+	ok = log_append(LOG_REC_TRUNCATE, obj, 0, NULL, 0, NULL);
+	obj->size = size;
+
+	for (n = 0; ok && n < obj->num_blocks; n++) {
+		loc = obj->blocks + n;
+		if (loc->seg)
+			ok = loc_read(loc, block, loc->len, 0) &&
+			     log_append(LOG_REC_BLOCK, obj, n, block, loc->len,
+					loc);
+	}
+
+	return ok && log_append_meta(obj);
+}
+
+/* Moves the record at @off of @seg out of it if still needed */
+static bool compact_rec(struct log_seg *seg, uint32_t off,
+			const struct log_rec *rec, const uint8_t *data)
+{
+	struct log_obj *obj = obj_by_id(rec->obj);
+	struct log_obj gone = { .id = rec->obj };
+
+	/* Also of objects removed while open, or replay revives them */
+	if (rec->type == LOG_REC_DELETE) {
+		if (!seg_shadows(seg, rec->obj))
+			return true;
+		return log_append(LOG_REC_DELETE, &gone, 0, NULL, 0, NULL);
+	}
+
+	if (!obj)
+		return true;
+
+	if (rec->type == LOG_REC_BLOCK && rec->block < obj->num_blocks &&
+	    loc_is(obj->blocks + rec->block, seg, off))
+		return log_append(LOG_REC_BLOCK, obj, rec->block, data,
+				  rec->len, obj->blocks + rec->block);
+
+	/* The name and size of an object removed but open aren't needed */
+	if (!obj->name)
+		return true;
+
+	/*
+	 * Blocks it dropped may still be in older segments. Appended again
+	 * it would cut what was written since, the object is rewritten.
+	 */
+	if (rec->type == LOG_REC_TRUNCATE && seg_shadows(seg, rec->obj))
+		return obj_rewrite(obj);
+
+	if (loc_is(&obj->meta, seg, off) || loc_is(&obj->size_loc, seg, off))
+		return log_append_meta(obj);
+
+	return true;
+}
+
+/* Returns the sealed segment least live, if less than half */
+static struct log_seg *compact_pick(void)
+{
+	struct log_seg *best = NULL;
+	struct log_seg *seg = NULL;
+
+	TAILQ_FOREACH(seg, &log_segs, link) {
+		if (seg == log_active || seg->live >= seg->size / 2)
+			continue;
+		if (!best || seg->live < best->live)
+			best = seg;
+	}
+
+	return best;
+}
+
+static bool seg_read(struct log_seg *seg, uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t r = 0;
+
+	while (done < len) {
+		r = pread(seg->fd, buf + done, len - done, done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		done += r;
+	}
+
+	return true;
+}
+
+/* Returns the size of the valid record at @off of @buf, 0 if none */
+static size_t rec_check(const uint8_t *buf, size_t size, size_t off)
+{
+	const struct log_rec *rec = (const void *)(buf + off);
+
+	if (size - off < sizeof(*rec) || rec->magic != LOG_MAGIC ||
+	    rec->len > size - off - sizeof(*rec) ||
+	    rec_crc(rec, rec + 1) != rec->crc)
+		return 0;
+
+	return LOG_REC_SIZE(rec->len) <= size - off ?
+	       LOG_REC_SIZE(rec->len) : 0;
+}
+
+/* Moves what's still needed out of sealed @seg and deletes it */
+static bool compact_seg(struct log_seg *seg)
+{
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	size_t off = 0;
+	size_t n = 0;
+	bool ok = true;
+
+	/* Sealed, it doesn't change and only this thread deletes it */
+	size = seg->size;
+	tee_supp_mutex_unlock(&log_mutex);
+	buf = malloc(size);
+	ok = buf && seg_read(seg, buf, size);
+	tee_supp_mutex_lock(&log_mutex);
+
+	for (off = 0; ok && off < size; off += n) {
+		n = rec_check(buf, size, off);
+		if (!n)
+			break;
+		ok = compact_rec(seg, off, (void *)(buf + off),
+				 buf + off + sizeof(struct log_rec));
+
+		/* Let requests in between records */
+		tee_supp_mutex_unlock(&log_mutex);
+		tee_supp_mutex_lock(&log_mutex);
+	}
+	free(buf);
+
+	/* The moved records must be on disk before the segment goes */
+	if (!ok || !log_sync()) {
+		EMSG("failed to compact segment %08x", seg->id);
+		return false;
+	}
+	DMSG("compacted segment %08x", seg->id);
+	seg_delete(seg);
+	log_sync();
+
+	return true;
+}
+
+static void *compact_main(void *arg)
+{
+	struct log_seg *seg = NULL;
+	struct timespec ts;
+
+	(void)arg;
+
+	tee_supp_mutex_lock(&log_mutex);
+	while (true) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += LOG_COMPACT_INTERVAL;
+		pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+
+		seg = compact_pick();
+		if (seg)
+			compact_seg(seg);
+	}
+
+	return NULL;
+}
+
+static void replay_rec(struct log_seg *seg, uint32_t off,
+		       const struct log_rec *rec, const char *data)
+{
+	struct log_obj *obj = obj_by_id(rec->obj);
+	struct log_obj *other = NULL;
+	struct log_loc loc = { .seg = seg, .off = off, .len = rec->len };
+	char *name = NULL;
+
+	if (rec->obj >= log_next_id)
+		log_next_id = rec->obj + 1;
+
+	if (!seg_add_obj(seg, rec->obj) ||
+	    ((rec->type == LOG_REC_TRUNCATE || rec->type == LOG_REC_DELETE) &&
+	     !seg_add_tomb(seg, rec->obj, LOG_REC_SIZE(rec->len))))
+		goto oom;
+
+	if (rec->type == LOG_REC_DELETE) {
+		if (obj)
+			obj_free(obj);
+		return;
+	}
+
+	if (!obj) {
+		obj = obj_new(rec->obj);
+		if (!obj)
+			goto oom;
+	}
+
+	switch (rec->type) {
+	case LOG_REC_META:
+		name = strndup(data, rec->len);
+		if (!name)
+			goto oom;
+		other = obj_by_name(name);
+		if (other && other != obj)
+			obj_set_name(other, NULL);
+		obj_set_name(obj, name);
+		loc_release(&obj->meta);
+		obj->meta = loc;
+		seg->live += LOG_REC_SIZE(rec->len);
+		break;
+	case LOG_REC_BLOCK:
+		if (!obj_grow(obj, rec->block + 1))
+			goto oom;
+		loc_release(obj->blocks + rec->block);
+		obj->blocks[rec->block] = loc;
+		seg->live += LOG_REC_SIZE(rec->len);
+		break;
+	case LOG_REC_TRUNCATE:
+		break;
+	default:
+		EMSG("unknown record type %u", rec->type);
+		return;
+	}
+
+	obj_set_size(obj, rec->size);
+	obj->size_loc = loc;
+	return;
+oom:
+	EMSG("out of memory replaying the log");
+	exit(EXIT_FAILURE);
+}
+
+static bool replay_seg(struct log_seg *seg, bool last)
+{
+	uint8_t *buf = NULL;
+	struct stat st;
+	size_t off = 0;
+	size_t n = 0;
+
+	if (fstat(seg->fd, &st)) {
+		EMSG("fstat: %s", strerror(errno));
+		return false;
+	}
+	if (st.st_size > LOG_SEGMENT_SIZE)
+		st.st_size = LOG_SEGMENT_SIZE;
+
+	if (st.st_size) {
+		buf = malloc(st.st_size);
+		if (!buf || !seg_read(seg, buf, st.st_size)) {
+			EMSG("failed to read segment %08x", seg->id);
+			free(buf);
+			return false;
+		}
+	}
+
+	for (off = 0; off < (size_t)st.st_size; off += n) {
+		n = rec_check(buf, st.st_size, off);
+		if (!n)
+			break;
+		replay_rec(seg, off, (void *)(buf + off),
+			   (char *)buf + off + sizeof(struct log_rec));
+	}
+	free(buf);
+
+	seg->size = off;
+	if (off < (size_t)st.st_size) {
+		if (last)
+			IMSG("segment %08x: dropping %zu bytes torn by a crash",
+			     seg->id, (size_t)st.st_size - off);
+		else
+			EMSG("segment %08x: dropping %zu corrupt bytes",
+			     seg->id, (size_t)st.st_size - off);
+		if (ftruncate(seg->fd, off))
+			EMSG("ftruncate: %s", strerror(errno));
+	}
+
+	return true;
+}
+
+static int id_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Returns the ids of the segments in the log directory, sorted */
+static uint32_t *list_segs(size_t *num)
+{
+	struct dirent *dent = NULL;
+	uint32_t *ids = NULL;
+	uint32_t *p = NULL;
+	size_t max = 0;
+	DIR *d = NULL;
+	unsigned int id = 0;
+	char c = 0;
+
+	*num = 0;
+	d = opendir(log_path);
+	if (!d)
+		return NULL;
+
+	while ((dent = readdir(d))) {
+		if (sscanf(dent->d_name, "%8x.se%c", &id, &c) != 2 || c != 'g')
+			continue;
+		if (*num == max) {
+			max = max ? max * 2 : 16;
+			p = realloc(ids, max * sizeof(*ids));
+			if (!p)
+				break;
+			ids = p;
+		}
+		ids[(*num)++] = id;
+	}
+	closedir(d);
+
+	if (ids)
+		qsort(ids, *num, sizeof(*ids), id_cmp);
+
+	return ids;
+}
+
+/* Rebuilds the index from the segments under @root */
+static int log_load(const char *root)
+{
+	struct log_obj *next = NULL;
+	struct log_obj *obj = NULL;
+	struct log_seg *seg = NULL;
+	uint32_t *ids = NULL;
+	size_t num_ids = 0;
+	size_t n = 0;
+
+	/* A replay that failed half way can't be redone over its state */
+	if (log_dir_fd >= 0)
+		return -1;
+
+	crc_init();
+
+	n = snprintf(log_path, sizeof(log_path), "%s%s/", root, LOG_DIR);
+	if (n >= sizeof(log_path)) {
+		EMSG("%s%s/: %s", root, LOG_DIR, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	if (mkdir(log_path, 0700) && errno != EEXIST) {
+		EMSG("%s: %s", log_path, strerror(errno));
+		return -1;
+	}
+	log_dir_fd = open(log_path, O_RDONLY | O_DIRECTORY);
+	if (log_dir_fd < 0) {
+		EMSG("%s: %s", log_path, strerror(errno));
+		return -1;
+	}
+
+	tee_supp_mutex_lock(&log_mutex);
+
+	ids = list_segs(&num_ids);
+	for (n = 0; n < num_ids; n++) {
+		seg = seg_open(ids[n], false);
+		if (!seg || !replay_seg(seg, n == num_ids - 1))
+			goto err;
+		TAILQ_INSERT_TAIL(&log_segs, seg, link);
+		log_active = seg;
+	}
+	free(ids);
+	ids = NULL;
+
+	/* Tombstones shadowing nothing replayed don't count as live */
+	TAILQ_FOREACH(seg, &log_segs, link)
+		if (seg != log_active)
+			seg_seal(seg);
+	TAILQ_FOREACH(seg, &log_segs, link)
+		seg_drop_tombs(seg);
+
+	/* Replaced or written to after being removed */
+	for (n = 0; n < log_tab_size; n++) {
+		for (obj = log_ids[n]; obj; obj = next) {
+			next = obj->id_next;
+			if (!obj->name)
+				obj_free(obj);
+		}
+	}
+
+	if (!log_active && !log_new_segment())
+		goto err;
+	if (!log_sync())
+		goto err;
+
+	tee_supp_mutex_unlock(&log_mutex);
+
+	IMSG("log storage: %zu objects in %zu segments", log_num_objs,
+	     num_ids);
+	return 0;
+err:
+	tee_supp_mutex_unlock(&log_mutex);
+	free(ids);
+	if (seg && seg != log_active)
+		seg_free(seg);
+	return -1;
+}
+
+static int log_init(const char *root)
+{
+	sigset_t set;
+	sigset_t old;
+	pthread_t tid;
+	int e = 0;
+
+	if (log_load(root))
+		return -1;
+
+	/* Signals are for the workers */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	e = pthread_create(&tid, NULL, compact_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		return -1;
+	}
+	pthread_detach(tid);
+
+	return 0;
+}
+
+const struct tee_supp_fs_backend tee_supp_fs_log_backend = {
+	.name = "log",
+	.init = log_init,
+	.commit = log_commit,
+	.ops = {
+		[OPTEE_MRF_OPEN] = log_open,
+		[OPTEE_MRF_CREATE] = log_create,
+		[OPTEE_MRF_CLOSE] = log_close,
+		[OPTEE_MRF_READ] = log_read,
+		[OPTEE_MRF_WRITE] = log_write,
+		[OPTEE_MRF_TRUNCATE] = log_truncate,
+		[OPTEE_MRF_REMOVE] = log_remove,
+		[OPTEE_MRF_RENAME] = log_rename,
+		[OPTEE_MRF_OPENDIR] = log_opendir,
+		[OPTEE_MRF_CLOSEDIR] = tee_supp_fs_dir_close,
+		[OPTEE_MRF_READDIR] = tee_supp_fs_dir_read,
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+		[OPTEE_MRF_READDIR_BATCH] = tee_supp_fs_dir_read_batch,
+#endif
+	},
+};
@@ -0,0 +1,826 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <handle.h>
+#include <optee_msg_supplicant.h>
+#include <pthread.h>
+#include <sha2.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <teec_trace.h>
+#include <tee_supp_fs.h>
+#include <tee_supplicant.h>
+#include <unistd.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 255
+#endif
+
+/*
+ * Secure storage kept in memory
+ *
+ * For test setups where storage doesn't need to survive each write, a
+ * file is a buffer looked up by its name. The whole storage is saved to
+ * <storage root>/ram.img every --fs-snapshot seconds if it changed, on
+ * tee_supp_fs_snapshot() and when the supplicant is stopped by SIGTERM
+ * or SIGINT, and loaded back at start up. The image is
+ * written aside and renamed over the previous one, so a crash leaves
+ * one or the other, and it's checked by a SHA-256 of its content.
+ *
+ * Changes since the last snapshot are lost on a crash, including ones
+ * the TEE has committed to RPMB.
+ */
+#define RAM_IMAGE		"ram.img"
+#define RAM_MAGIC		0x4d415254	/* "TRAM" */
+#define RAM_VERSION		1
+
+struct ram_file {
+	char *name;		/* NULL once removed */
+	uint8_t *data;
+	size_t size;
+	size_t max;		/* allocated */
+	unsigned int refs;	/* open handles */
+	struct ram_file *next;
+};
+
+struct ram_image_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t num_files;
+};
+
+/* Followed by the name, without NUL, and the content */
+struct ram_image_file {
+	uint32_t name_len;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+static pthread_mutex_t ram_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ram_file **ram_tab;
+static size_t ram_tab_size;
+static size_t ram_num_files;
+static size_t ram_bytes;	/* content of the named files */
+static uint64_t ram_gen;	/* bumped on each change */
+static uint64_t ram_saved_gen;
+
+static struct handle_db ram_files = HANDLE_DB_INITIALIZER;
+
+/* Serializes writers of the image */
+static pthread_mutex_t ram_snap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int ram_snap_interval = TEE_SUPP_FS_SNAPSHOT_DEFAULT;
+static char ram_root[PATH_MAX];
+
+void tee_supp_fs_set_snapshot_interval(unsigned int sec)
+{
+	ram_snap_interval = sec;
+}
+
+static struct ram_file *file_find(const char *name)
+{
+	struct ram_file *f = NULL;
+
+	if (!ram_tab_size)
+		return NULL;
+
+	f = ram_tab[tee_supp_fs_name_hash(name, ram_tab_size)];
+	for (; f; f = f->next)
+		if (!strcmp(f->name, name))
+			return f;
+
+	return NULL;
+}
+
+static bool tab_grow(void)
+{
+	size_t size = ram_tab_size ? ram_tab_size * 2 : 256;
+	struct ram_file **tab = NULL;
+	struct ram_file *next = NULL;
+	struct ram_file *f = NULL;
+	size_t h = 0;
+	size_t n = 0;
+
+	tab = calloc(size, sizeof(*tab));
+	if (!tab)
+		return false;
+
+	for (n = 0; n < ram_tab_size; n++) {
+		for (f = ram_tab[n]; f; f = next) {
+			next = f->next;
+			h = tee_supp_fs_name_hash(f->name, size);
+			f->next = tab[h];
+			tab[h] = f;
+		}
+	}
+
+	free(ram_tab);
+	ram_tab = tab;
+	ram_tab_size = size;
+
+	return true;
+}
+
+/* Binds @f, not found by name yet, to @name which it takes over */
+static bool file_link(struct ram_file *f, char *name)
+{
+	size_t h = 0;
+
+	if (ram_num_files >= ram_tab_size && !tab_grow())
+		return false;
+
+	f->name = name;
+	h = tee_supp_fs_name_hash(name, ram_tab_size);
+	f->next = ram_tab[h];
+	ram_tab[h] = f;
+	ram_num_files++;
+	ram_bytes += f->size;
+
+	return true;
+}
+
+static void file_unlink(struct ram_file *f)
+{
+	struct ram_file **pp = NULL;
+
+	pp = ram_tab + tee_supp_fs_name_hash(f->name, ram_tab_size);
+	while (*pp != f)
+		pp = &(*pp)->next;
+	*pp = f->next;
+	ram_num_files--;
+	ram_bytes -= f->size;
+
+	free(f->name);
+	f->name = NULL;
+}
+
+static void file_free(struct ram_file *f)
+{
+	free(f->data);
+	free(f);
+}
+
+/* Sets the size of @f, what's added reading as zeros */
+static bool file_resize(struct ram_file *f, size_t size)
+{
+	size_t max = f->max ? f->max : 256;
+	uint8_t *data = NULL;
+
+	if (size > f->max) {
+		while (max < size && max <= SIZE_MAX / 2)
+			max *= 2;
+		if (max < size)
+			max = size;
+		data = realloc(f->data, max);
+		if (!data)
+			return false;
+		f->data = data;
+		f->max = max;
+	}
+
+	if (size > f->size)
+		memset(f->data + f->size, 0, size - f->size);
+	if (f->name)
+		ram_bytes += size - f->size;
+	f->size = size;
+
+	return true;
+}
+
+static TEEC_Result ram_open(size_t num_params, struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct ram_file *f = NULL;
+	const char *name = NULL;
+	int fd = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, SIZE_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&ram_mutex);
+	f = file_find(name);
+	if (!f) {
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+
+	fd = handle_get(&ram_files, f);
+	if (fd < 0) {
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	f->refs++;
+	params[2].a = fd;
+out:
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_create(size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT,
+	};
+	TEEC_Result res = TEEC_ERROR_OUT_OF_MEMORY;
+	struct ram_file *f = NULL;
+	const char *name = NULL;
+	char *n = NULL;
+	int fd = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, SIZE_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&ram_mutex);
+
+	/* Like O_TRUNC, an existing file is truncated in place */
+	f = file_find(name);
+	if (f) {
+		fd = handle_get(&ram_files, f);
+		if (fd < 0)
+			goto out;
+		file_resize(f, 0);
+		goto done;
+	}
+
+	n = strdup(name);
+	f = calloc(1, sizeof(*f));
+	if (!n || !f)
+		goto err;
+
+	fd = handle_get(&ram_files, f);
+	if (fd < 0)
+		goto err;
+	if (!file_link(f, n)) {
+		handle_put(&ram_files, fd);
+		goto err;
+	}
+done:
+	f->refs++;
+	params[2].a = fd;
+	ram_gen++;
+	res = TEEC_SUCCESS;
+	goto out;
+err:
+	free(f);
+	free(n);
+out:
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_close(size_t num_params,
+			     struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+	};
+	struct ram_file *f = NULL;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 1))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&ram_mutex);
+	f = handle_put(&ram_files, params[0].b);
+	if (f && !--f->refs && !f->name)
+		file_free(f);
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return f ? TEEC_SUCCESS : TEEC_ERROR_BAD_PARAMETERS;
+}
+
+static TEEC_Result ram_read(size_t num_params, struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT,
+	};
+	struct ram_file *f = NULL;
+	uint8_t *buf = NULL;
+	uint64_t offs = 0;
+	size_t len = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 2))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+	offs = params[0].c;
+
+	tee_supp_mutex_lock(&ram_mutex);
+	f = handle_lookup(&ram_files, params[0].b);
+	if (f) {
+		if (offs >= f->size)
+			len = 0;
+		else if (len > f->size - offs)
+			len = f->size - offs;
+		memcpy(buf, f->data + offs, len);
+		MEMREF_SIZE(params + 1) = len;
+	}
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return f ? TEEC_SUCCESS : TEEC_ERROR_BAD_PARAMETERS;
+}
+
+static TEEC_Result ram_write(size_t num_params,
+			     struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct ram_file *f = NULL;
+	const uint8_t *buf = NULL;
+	uint64_t offs = 0;
+	size_t len = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 2))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+	offs = params[0].c;
+
+	tee_supp_mutex_lock(&ram_mutex);
+	f = handle_lookup(&ram_files, params[0].b);
+	if (!f) {
+		res = TEEC_ERROR_BAD_PARAMETERS;
+		goto out;
+	}
+
+	if (offs > SIZE_MAX - len ||
+	    (offs + len > f->size && !file_resize(f, offs + len))) {
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	memcpy(f->data + offs, buf, len);
+	ram_gen++;
+out:
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_truncate(size_t num_params,
+				struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	struct ram_file *f = NULL;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 1))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&ram_mutex);
+	f = handle_lookup(&ram_files, params[0].b);
+	if (!f)
+		res = TEEC_ERROR_BAD_PARAMETERS;
+	else if (params[0].c > SIZE_MAX || !file_resize(f, params[0].c))
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+	else
+		ram_gen++;
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_remove(size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+	};
+	struct ram_file *f = NULL;
+	const char *name = NULL;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 2))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, SIZE_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&ram_mutex);
+	f = file_find(name);
+	if (f) {
+		/* Still usable by open handles */
+		file_unlink(f);
+		if (!f->refs)
+			file_free(f);
+		ram_gen++;
+	}
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return f ? TEEC_SUCCESS : TEEC_ERROR_ITEM_NOT_FOUND;
+}
+
+static TEEC_Result ram_rename(size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+	};
+	TEEC_Result res = TEEC_SUCCESS;
+	const char *old_name = NULL;
+	const char *new_name = NULL;
+	struct ram_file *dst = NULL;
+	struct ram_file *f = NULL;
+	char *n = NULL;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	old_name = tee_supp_fs_param_to_name(params + 1, SIZE_MAX);
+	new_name = tee_supp_fs_param_to_name(params + 2, SIZE_MAX);
+	if (!old_name || !new_name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	n = strdup(new_name);
+	if (!n)
+		return TEEC_ERROR_OUT_OF_MEMORY;
+
+	tee_supp_mutex_lock(&ram_mutex);
+	dst = file_find(new_name);
+	if (dst && !params[0].b) {
+		res = TEEC_ERROR_ACCESS_CONFLICT;
+		goto out;
+	}
+
+	f = file_find(old_name);
+	if (!f) {
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+	if (dst == f)
+		goto out;
+
+	/* Unlinked first, relinking doesn't need the table to grow */
+	file_unlink(f);
+	if (dst) {
+		file_unlink(dst);
+		if (!dst->refs)
+			file_free(dst);
+	}
+	file_link(f, n);
+	n = NULL;
+	ram_gen++;
+out:
+	tee_supp_mutex_unlock(&ram_mutex);
+	free(n);
+
+	return res;
+}
+
+static TEEC_Result ram_opendir(size_t num_params,
+			       struct tee_ioctl_param *params)
+{
+	static const uint64_t types[] = {
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+		TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT,
+	};
+	struct tee_supp_fs_dir *dir = NULL;
+	struct ram_file *f = NULL;
+	const char *name = NULL;
+	size_t n = 0;
+
+	if (!tee_supp_fs_params_ok(num_params, params, types, 3))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = tee_supp_fs_param_to_name(params + 1, SIZE_MAX);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	dir = tee_supp_fs_dir_new(name);
+
+	tee_supp_mutex_lock(&ram_mutex);
+	for (n = 0; n < ram_tab_size; n++)
+		for (f = ram_tab[n]; f; f = f->next)
+			tee_supp_fs_dir_add(dir, f->name);
+	tee_supp_mutex_unlock(&ram_mutex);
+
+	return tee_supp_fs_dir_open(dir, params);
+}
+
+/* Returns the image of all files, with its length in @len */
+static uint8_t *image_build(size_t *len)
+{
+	struct ram_image_file hdr = { 0 };
+	struct ram_image_hdr ihdr = {
+		.magic = RAM_MAGIC,
+		.version = RAM_VERSION,
+		.num_files = ram_num_files,
+	};
+	struct ram_file *f = NULL;
+	sha256_ctx ctx;
+	uint8_t *buf = NULL;
+	uint8_t *p = NULL;
+	size_t n = 0;
+
+	*len = sizeof(ihdr) + ram_bytes + SHA256_DIGEST_SIZE;
+	for (n = 0; n < ram_tab_size; n++)
+		for (f = ram_tab[n]; f; f = f->next)
+			*len += sizeof(hdr) + strlen(f->name);
+
+	buf = malloc(*len);
+	if (!buf)
+		return NULL;
+
+	memcpy(buf, &ihdr, sizeof(ihdr));
+	p = buf + sizeof(ihdr);
+	for (n = 0; n < ram_tab_size; n++) {
+		for (f = ram_tab[n]; f; f = f->next) {
+			hdr.name_len = strlen(f->name);
+			hdr.size = f->size;
+			memcpy(p, &hdr, sizeof(hdr));
+			p += sizeof(hdr);
+			memcpy(p, f->name, hdr.name_len);
+			p += hdr.name_len;
+			memcpy(p, f->data, f->size);
+			p += f->size;
+		}
+	}
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, buf, p - buf);
+	sha256_final(&ctx, p);
+
+	return buf;
+}
+
+static bool write_file(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t r = 0;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return false;
+		buf += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+/* Returns false if the path of the image with @suffix doesn't fit @path */
+static bool image_path(char *path, size_t size, const char *suffix)
+{
+	int len = snprintf(path, size, "%s%s%s", ram_root, RAM_IMAGE, suffix);
+
+	if (len < 0 || (size_t)len >= size) {
+		EMSG("%s%s%s: %s", ram_root, RAM_IMAGE, suffix,
+		     strerror(ENAMETOOLONG));
+		return false;
+	}
+
+	return true;
+}
+
+/* Saves the files if they changed since the last time */
+static void ram_snapshot(void)
+{
+	char path[PATH_MAX] = { 0 };
+	char tmp[PATH_MAX] = { 0 };
+	uint8_t *buf = NULL;
+	uint64_t gen = 0;
+	size_t len = 0;
+	int fd = -1;
+
+	tee_supp_mutex_lock(&ram_snap_mutex);
+
+	tee_supp_mutex_lock(&ram_mutex);
+	gen = ram_gen;
+	if (gen != ram_saved_gen)
+		buf = image_build(&len);
+	tee_supp_mutex_unlock(&ram_mutex);
+	if (gen == ram_saved_gen)
+		goto out;
+	if (!buf) {
+		EMSG("out of memory for the storage image");
+		goto out;
+	}
+
+	if (!image_path(path, sizeof(path), "") ||
+	    !image_path(tmp, sizeof(tmp), ".tmp"))
+		goto out;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || !write_file(fd, buf, len) || fsync(fd)) {
+		EMSG("%s: %s", tmp, strerror(errno));
+		goto out;
+	}
+	if (rename(tmp, path)) {
+		EMSG("rename %s: %s", tmp, strerror(errno));
+		goto out;
+	}
+	close(fd);
+	fd = open(ram_root, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd))
+		EMSG("%s: %s", ram_root, strerror(errno));
+
+	ram_saved_gen = gen;
+	DMSG("saved %zu bytes of storage", len);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	tee_supp_mutex_unlock(&ram_snap_mutex);
+}
+
+static void *snap_main(void *arg)
+{
+	(void)arg;
+
+	while (true) {
+		sleep(ram_snap_interval);
+		ram_snapshot();
+	}
+
+	return NULL;
+}
+
+/* Loads @buf, an image of @len bytes */
+static bool image_load(const uint8_t *buf, size_t len)
+{
+	struct ram_image_hdr ihdr = { 0 };
+	struct ram_image_file hdr = { 0 };
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	const uint8_t *end = buf + len;
+	const uint8_t *p = buf;
+	struct ram_file *f = NULL;
+	char *name = NULL;
+	uint64_t n = 0;
+
+	if (len < sizeof(ihdr) + SHA256_DIGEST_SIZE)
+		return false;
+	end -= SHA256_DIGEST_SIZE;
+	sha256(buf, end - buf, digest);
+	if (memcmp(digest, end, sizeof(digest)))
+		return false;
+
+	memcpy(&ihdr, p, sizeof(ihdr));
+	p += sizeof(ihdr);
+	if (ihdr.magic != RAM_MAGIC || ihdr.version != RAM_VERSION)
+		return false;
+
+	for (n = 0; n < ihdr.num_files; n++) {
+		if ((size_t)(end - p) < sizeof(hdr))
+			return false;
+		memcpy(&hdr, p, sizeof(hdr));
+		p += sizeof(hdr);
+		if (hdr.name_len > (size_t)(end - p) ||
+		    hdr.size > (size_t)(end - p) - hdr.name_len)
+			return false;
+
+		name = strndup((const char *)p, hdr.name_len);
+		f = calloc(1, sizeof(*f));
+		if (!name || !f || !file_resize(f, hdr.size) ||
+		    file_find(name) || !file_link(f, name)) {
+			free(name);
+			if (f)
+				file_free(f);
+			return false;
+		}
+		memcpy(f->data, p + hdr.name_len, hdr.size);
+		p += hdr.name_len + hdr.size;
+	}
+
+	return p == end;
+}
+
+static int ram_init(const char *root)
+{
+	char path[PATH_MAX] = { 0 };
+	uint8_t *buf = NULL;
+	struct stat st;
+	sigset_t set;
+	sigset_t old;
+	pthread_t tid;
+	size_t done = 0;
+	ssize_t r = 0;
+	int fd = -1;
+	int e = 0;
+
+	if (strlen(root) >= sizeof(ram_root)) {
+		EMSG("%s: %s", root, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	strcpy(ram_root, root);
+
+	/* Refused now rather than failing each snapshot */
+	if (!image_path(path, sizeof(path), ".tmp") ||
+	    !image_path(path, sizeof(path), ""))
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 && errno != ENOENT) {
+		EMSG("%s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (fd >= 0) {
+		if (fstat(fd, &st) || !(buf = malloc(st.st_size + 1))) {
+			close(fd);
+			return -1;
+		}
+		while (done < (size_t)st.st_size) {
+			r = read(fd, buf + done, st.st_size - done);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				break;
+			done += r;
+		}
+		close(fd);
+
+		tee_supp_mutex_lock(&ram_mutex);
+		if (done != (size_t)st.st_size || !image_load(buf, done)) {
+			tee_supp_mutex_unlock(&ram_mutex);
+			EMSG("%s: not a valid storage image", path);
+			free(buf);
+			return -1;
+		}
+		tee_supp_mutex_unlock(&ram_mutex);
+		free(buf);
+	}
+
+	if (ram_snap_interval) {
+		/* Signals are for the workers */
+		sigfillset(&set);
+		pthread_sigmask(SIG_SETMASK, &set, &old);
+		e = pthread_create(&tid, NULL, snap_main, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (e) {
+			EMSG("pthread_create: %s", strerror(e));
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+
+	IMSG("storage in memory: %zu files, %zu bytes", ram_num_files,
+	     ram_bytes);
+	return 0;
+}
+
+const struct tee_supp_fs_backend tee_supp_fs_ram_backend = {
+	.name = "ram",
+	.init = ram_init,
+	.snapshot = ram_snapshot,
+	.ops = {
+		[OPTEE_MRF_OPEN] = ram_open,
+		[OPTEE_MRF_CREATE] = ram_create,
+		[OPTEE_MRF_CLOSE] = ram_close,
+		[OPTEE_MRF_READ] = ram_read,
+		[OPTEE_MRF_WRITE] = ram_write,
+		[OPTEE_MRF_TRUNCATE] = ram_truncate,
+		[OPTEE_MRF_REMOVE] = ram_remove,
+		[OPTEE_MRF_RENAME] = ram_rename,
+		[OPTEE_MRF_OPENDIR] = ram_opendir,
+		[OPTEE_MRF_CLOSEDIR] = tee_supp_fs_dir_close,
+		[OPTEE_MRF_READDIR] = tee_supp_fs_dir_read,
+#ifdef CFG_TEE_SUPP_READDIR_BATCH
+		[OPTEE_MRF_READDIR_BATCH] = tee_supp_fs_dir_read_batch,
+#endif
+	},
+};
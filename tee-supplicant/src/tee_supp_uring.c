@@ -0,0 +1,519 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <teec_trace.h>
+#include <tee_client_api.h>
+#include <tee_supp_uring.h>
+#include <tee_supplicant.h>
+#include <unistd.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+/*
+ * Secure storage I/O ring
+ *
+ * All workers share one io_uring. A worker serving a read or write RPC
+ * submits the I/O, defers the response and goes back to wait for the
+ * next request, so the storage requests in flight are bounded by the
+ * ring instead of by the workers. I/O the ring doesn't take is done with
+ * pread() and pwrite() instead. A write is linked to an fdatasync(),
+ * which replaces opening the files O_SYNC. The completion thread reaps
+ * the CQEs, resubmits the rest of short reads and writes, and sends the
+ * responses.
+ *
+ * RPC shared memory with an ID below URING_FIXED_BUFS is registered as
+ * the fixed buffer of that index when it's allocated, so requests on it
+ * don't pin its pages each time. This needs Linux 5.19, with older
+ * kernels plain reads and writes are used.
+ */
+#define URING_FIXED_BUFS	1024
+
+/* SQE user_data: index of the op shifted up, low bit set for the fsync */
+#define URING_FSYNC_BIT		1
+
+/* Tries of an io_uring_enter() failing with EAGAIN or EBUSY */
+#define URING_ENTER_TRIES	16
+
+struct uring_op {
+	struct tee_supp_rpc *rpc;	/* NULL while its worker waits for it */
+	struct tee_ioctl_param *params;
+	bool write;
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	off_t offs;
+	size_t done;
+	int buf_index;		/* -1 if not in a fixed buffer */
+	unsigned int pending;	/* CQEs still to come */
+	int err;
+	struct uring_op *next;
+};
+
+struct fixed_buf {
+	uint8_t *p;
+	size_t len;
+};
+
+static pthread_mutex_t uring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uring_cond = PTHREAD_COND_INITIALIZER;
+static int ring_fd = -1;
+
+/* Submission queue, guarded by uring_mutex */
+static unsigned int sq_entries;
+static unsigned int *sq_head;
+static unsigned int *sq_tail;
+static unsigned int *sq_mask;
+static unsigned int *sq_array;
+static struct io_uring_sqe *sqes;
+
+/* Completion queue, only used by the completion thread */
+static unsigned int *cq_head;
+static unsigned int *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* Guarded by uring_mutex */
+static struct uring_op *ops;
+static struct uring_op *free_ops;
+static bool fixed_bufs;
+static struct fixed_buf fixed[URING_FIXED_BUFS];
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/* Adds the SQEs of @op at *@tail, mutex held */
+static void op_prep(struct uring_op *op, unsigned int *tail)
+{
+	struct io_uring_sqe *sqe = NULL;
+	unsigned int idx = 0;
+	uint64_t user_data = (uint64_t)(op - ops) << 1;
+
+	idx = *tail & *sq_mask;
+	sqe = sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	if (op->buf_index >= 0) {
+		sqe->opcode = op->write ? IORING_OP_WRITE_FIXED :
+					  IORING_OP_READ_FIXED;
+		sqe->buf_index = op->buf_index;
+	} else {
+		sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = op->fd;
+	sqe->addr = (uintptr_t)(op->buf + op->done);
+	sqe->len = op->len - op->done;
+	sqe->off = op->offs + op->done;
+	sqe->user_data = user_data;
+	sq_array[idx] = idx;
+	(*tail)++;
+	op->pending++;
+
+	if (!op->write)
+		return;
+
+	sqe->flags = IOSQE_IO_LINK;
+
+	idx = *tail & *sq_mask;
+	sqe = sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = op->fd;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	sqe->user_data = user_data | URING_FSYNC_BIT;
+	sq_array[idx] = idx;
+	(*tail)++;
+	op->pending++;
+}
+
+/*
+ * Submits the remaining I/O of @op, mutex held. Returns false if none of
+ * it could be submitted. If only the write of a write and its fdatasync()
+ * could, the fdatasync() is taken back and the op fails once the write
+ * completes. Nothing is left in the ring for a later submit.
+ */
+static bool op_submit(struct uring_op *op)
+{
+	unsigned int old_tail = *sq_tail;
+	unsigned int tail = old_tail;
+	unsigned int pending = op->pending;
+	unsigned int tries = 0;
+	unsigned int n = 0;
+	int r = 0;
+
+	op_prep(op, &tail);
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (n < tail - old_tail) {
+		r = sys_io_uring_enter(tail - old_tail - n, 0, 0);
+		if (r > 0) {
+			n += r;
+			continue;
+		}
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EAGAIN || errno == EBUSY) &&
+		    ++tries < URING_ENTER_TRIES) {
+			sched_yield();
+			continue;
+		}
+		break;
+	}
+
+	if (n == tail - old_tail)
+		return true;
+
+	EMSG("io_uring_enter: %s", r ? strerror(errno) : "nothing submitted");
+	/* The kernel has consumed the first n entries only */
+	__atomic_store_n(sq_tail, old_tail + n, __ATOMIC_RELEASE);
+	if (!n) {
+		op->pending = pending;
+		return false;
+	}
+	op->pending -= tail - old_tail - n;
+	op->err = -EIO;
+	return true;
+}
+
+/* Handles the CQE of @user_data with result @res */
+static void op_complete(uint64_t user_data, int32_t res)
+{
+	struct uring_op *op = ops + (user_data >> 1);
+	struct tee_supp_rpc *rpc = NULL;
+	bool resubmit = false;
+	uint32_t ret = TEEC_SUCCESS;
+
+	tee_supp_mutex_lock(&uring_mutex);
+
+	op->pending--;
+	if (user_data & URING_FSYNC_BIT) {
+		/* Cancelled after a short write, redone with the rest */
+		if (res < 0 && res != -ECANCELED)
+			op->err = res;
+	} else if (res == -EINTR || res == -EAGAIN) {
+		resubmit = true;
+	} else if (res < 0) {
+		op->err = res;
+	} else if (!res) {
+		/* End of file, a write can't make progress */
+		if (op->write)
+			op->err = -EIO;
+	} else {
+		op->done += res;
+		resubmit = op->done < op->len;
+	}
+
+	if (resubmit && !op->err && !op_submit(op))
+		op->err = -EIO;
+
+	if (op->pending) {
+		tee_supp_mutex_unlock(&uring_mutex);
+		return;
+	}
+
+	if (!op->rpc) {
+		/* Its worker takes it from here */
+		pthread_cond_broadcast(&uring_cond);
+		tee_supp_mutex_unlock(&uring_mutex);
+		return;
+	}
+
+	if (op->err) {
+		EMSG("%s: %s", op->write ? "write" : "read",
+		     strerror(-op->err));
+		ret = TEEC_ERROR_GENERIC;
+	} else if (!op->write) {
+		MEMREF_SIZE(op->params + 1) = op->done;
+	}
+
+	rpc = op->rpc;
+	op->next = free_ops;
+	free_ops = op;
+
+	tee_supp_mutex_unlock(&uring_mutex);
+
+	tee_supp_rpc_complete(rpc, ret);
+}
+
+static void *uring_main(void *a)
+{
+	struct io_uring_cqe *cqe = NULL;
+	uint64_t user_data = 0;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	int32_t res = 0;
+
+	(void)a;
+
+	while (true) {
+		if (sys_io_uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			EMSG("io_uring_enter: %s", strerror(errno));
+			EMSG("terminating...");
+			exit(EXIT_FAILURE);
+		}
+
+		head = *cq_head;
+		tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			cqe = cqes + (head & *cq_mask);
+			user_data = cqe->user_data;
+			res = cqe->res;
+			head++;
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+			op_complete(user_data, res);
+		}
+	}
+
+	return NULL;
+}
+
+bool tee_supp_uring_init(unsigned int entries)
+{
+	struct io_uring_rsrc_register reg;
+	struct io_uring_params p;
+	uint8_t *ring = MAP_FAILED;
+	size_t ring_len = 0;
+	size_t cq_len = 0;
+	size_t num_ops = 0;
+	size_t n = 0;
+	sigset_t set;
+	sigset_t old;
+	pthread_t tid;
+	int e = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	memset(&p, 0, sizeof(p));
+
+	/* A write takes two entries */
+	if (entries < 2)
+		entries = 2;
+
+	ring_fd = sys_io_uring_setup(entries, &p);
+	if (ring_fd < 0) {
+		DMSG("io_uring_setup: %s", strerror(errno));
+		return false;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		DMSG("io_uring too old");
+		goto err;
+	}
+
+	ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > ring_len)
+		ring_len = cq_len;
+
+	ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		goto err;
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err;
+
+	sq_entries = p.sq_entries;
+	sq_head = (unsigned int *)(ring + p.sq_off.head);
+	sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+	sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+	sq_array = (unsigned int *)(ring + p.sq_off.array);
+	cq_head = (unsigned int *)(ring + p.cq_off.head);
+	cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+	cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/*
+	 * With every op taking at most two entries the ring never fills
+	 * up, and neither does the twice as large completion queue.
+	 */
+	num_ops = sq_entries / 2;
+	ops = calloc(num_ops, sizeof(*ops));
+	if (!ops)
+		goto err;
+	for (n = 0; n < num_ops; n++) {
+		ops[n].next = free_ops;
+		free_ops = ops + n;
+	}
+
+	reg.nr = URING_FIXED_BUFS;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	fixed_bufs = !sys_io_uring_register(IORING_REGISTER_BUFFERS2, &reg,
+					    sizeof(reg));
+
+	/* Signals are for the workers */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	e = pthread_create(&tid, NULL, uring_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		goto err;
+	}
+	pthread_detach(tid);
+
+	IMSG("io_uring with %u entries%s", sq_entries,
+	     fixed_bufs ? ", fixed buffers" : "");
+	return true;
+err:
+	free(ops);
+	ops = NULL;
+	free_ops = NULL;
+	if (sqes != MAP_FAILED && sqes)
+		munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+	sqes = NULL;
+	if (ring != MAP_FAILED)
+		munmap(ring, ring_len);
+	close(ring_fd);
+	ring_fd = -1;
+	return false;
+}
+
+bool tee_supp_uring_active(void)
+{
+	return ring_fd >= 0;
+}
+
+static void buf_update(int id, void *p, size_t len)
+{
+	struct io_uring_rsrc_update2 up;
+	struct iovec iov = { .iov_base = p, .iov_len = len };
+
+	memset(&up, 0, sizeof(up));
+	up.offset = id;
+	up.data = (uintptr_t)&iov;
+	up.nr = 1;
+
+	if (sys_io_uring_register(IORING_REGISTER_BUFFERS_UPDATE, &up,
+				  sizeof(up)) != 1) {
+		DMSG("fixed buffer %d: %s", id, strerror(errno));
+		return;
+	}
+
+	fixed[id].p = p;
+	fixed[id].len = len;
+}
+
+void tee_supp_uring_buf_register(int id, void *p, size_t len)
+{
+	if (ring_fd < 0 || id < 0 || id >= URING_FIXED_BUFS)
+		return;
+
+	tee_supp_mutex_lock(&uring_mutex);
+	if (fixed_bufs)
+		buf_update(id, p, len);
+	tee_supp_mutex_unlock(&uring_mutex);
+}
+
+void tee_supp_uring_buf_unregister(int id)
+{
+	if (ring_fd < 0 || id < 0 || id >= URING_FIXED_BUFS)
+		return;
+
+	/* An empty entry clears the slot */
+	tee_supp_mutex_lock(&uring_mutex);
+	if (fixed[id].p)
+		buf_update(id, NULL, 0);
+	tee_supp_mutex_unlock(&uring_mutex);
+}
+
+static bool uring_submit(struct tee_ioctl_param **params, bool write,
+			 int fd, void *buf, size_t len, off_t offs, int id)
+{
+	struct uring_op *op = NULL;
+	bool deferred = false;
+	uint8_t *b = buf;
+
+	if (ring_fd < 0 || !len || !tee_supp_rpc_deferrable())
+		return false;
+
+	tee_supp_mutex_lock(&uring_mutex);
+
+	op = free_ops;
+	if (!op)
+		goto out;
+
+	free_ops = op->next;
+	memset(op, 0, sizeof(*op));
+	op->write = write;
+	op->fd = fd;
+	op->buf = b;
+	op->len = len;
+	op->offs = offs;
+	op->buf_index = -1;
+	if (id >= 0 && id < URING_FIXED_BUFS && fixed[id].p &&
+	    b >= fixed[id].p && len <= fixed[id].len &&
+	    (size_t)(b - fixed[id].p) <= fixed[id].len - len)
+		op->buf_index = id;
+
+	/* Not deferred yet, the caller does the I/O itself */
+	if (!op_submit(op))
+		goto put_op;
+
+	/* Its completions wait for the mutex, so set up the op first */
+	op->rpc = tee_supp_rpc_defer(params);
+	if (op->rpc) {
+		op->params = *params;
+		deferred = true;
+		goto out;
+	}
+
+	/*
+	 * Out of memory to defer: wait for the I/O, which the caller then
+	 * does again. Reading or writing the same range twice is harmless.
+	 */
+	while (op->pending)
+		pthread_cond_wait(&uring_cond, &uring_mutex);
+put_op:
+	op->next = free_ops;
+	free_ops = op;
+out:
+	tee_supp_mutex_unlock(&uring_mutex);
+
+	return deferred;
+}
+
+bool tee_supp_uring_read(struct tee_ioctl_param **params, int fd, void *buf,
+			 size_t len, off_t offs, int id)
+{
+	return uring_submit(params, false, fd, buf, len, offs, id);
+}
+
+bool tee_supp_uring_write(struct tee_ioctl_param **params, int fd,
+			  void *buf, size_t len, off_t offs, int id)
+{
+	return uring_submit(params, true, fd, buf, len, offs, id);
+}
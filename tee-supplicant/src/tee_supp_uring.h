@@ -0,0 +1,109 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TEE_SUPP_URING_H
+#define TEE_SUPP_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct tee_ioctl_param;
+
+#define URING_DEFAULT_ENTRIES	64
+#define URING_MAX_ENTRIES	4096
+
+#ifdef CFG_TEE_SUPP_IO_URING
+/*
+ * tee_supp_uring_init() - Sets up the shared ring with room for @entries
+ * submissions
+ *
+ * Returns false if io_uring isn't available, secure storage I/O is then
+ * done synchronously.
+ */
+bool tee_supp_uring_init(unsigned int entries);
+
+/* Returns true if secure storage I/O goes through the ring */
+bool tee_supp_uring_active(void);
+
+/*
+ * tee_supp_uring_buf_register() - Registers RPC shared memory @id as a
+ * fixed buffer of the ring
+ *
+ * Failing isn't fatal, I/O on the buffer then just isn't done with fixed
+ * buffer requests.
+ */
+void tee_supp_uring_buf_register(int id, void *p, size_t len);
+
+/* Unregisters RPC shared memory @id before it's torn down */
+void tee_supp_uring_buf_unregister(int id);
+
+/*
+ * tee_supp_uring_read() - Reads @len bytes at @offs of @fd into @buf,
+ * RPC shared memory @id, for the RPC request being served
+ *
+ * On success the response of the request is deferred and sent once the
+ * read completes, with the number of bytes read in the memref size of
+ * *@params[1]. *@params is updated to point into the deferred request.
+ * Returns false if the read wasn't submitted, it should then be done
+ * synchronously.
+ */
+bool tee_supp_uring_read(struct tee_ioctl_param **params, int fd, void *buf,
+			 size_t len, off_t offs, int id);
+
+/*
+ * tee_supp_uring_write() - Like tee_supp_uring_read() but writes @buf
+ * followed by a linked fdatasync() of @fd
+ */
+bool tee_supp_uring_write(struct tee_ioctl_param **params, int fd,
+			  void *buf, size_t len, off_t offs, int id);
+#else
+static inline bool tee_supp_uring_active(void)
+{
+	return false;
+}
+
+static inline void tee_supp_uring_buf_register(int id, void *p, size_t len)
+{
+	(void)id;
+	(void)p;
+	(void)len;
+}
+
+static inline void tee_supp_uring_buf_unregister(int id)
+{
+	(void)id;
+}
+
+static inline bool tee_supp_uring_read(struct tee_ioctl_param **params,
+				       int fd, void *buf, size_t len,
+				       off_t offs, int id)
+{
+	(void)params;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offs;
+	(void)id;
+
+	return false;
+}
+
+static inline bool tee_supp_uring_write(struct tee_ioctl_param **params,
+					int fd, void *buf, size_t len,
+					off_t offs, int id)
+{
+	(void)params;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offs;
+	(void)id;
+
+	return false;
+}
+#endif /*CFG_TEE_SUPP_IO_URING*/
+
+#endif /*TEE_SUPP_URING_H*/
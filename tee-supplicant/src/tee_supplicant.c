@@ -31,11 +31,15 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <prof.h>
 #include <plugin.h>
 #include <pthread.h>
 #include <rpmb.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -52,6 +56,8 @@
 #include <tee_socket.h>
 #include <tee_supp_fs.h>
 #include <tee_supplicant.h>
+#include <tee_supp_uring.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "optee_msg_supplicant.h"
@@ -63,6 +69,13 @@
 
 #define RPC_NUM_PARAMS	5
 
+/*
+ * A TEE that knows which client call an RPC request is made for passes
+ * the correlation ID of that call in a meta value parameter with this tag
+ * in .c and the ID in .a.
+ */
+#define RPC_CORR_ID_TAG	0x434f5252	/* "CORR" */
+
 #define RPC_BUF_SIZE	(sizeof(struct tee_iocl_supp_send_arg) + \
 			 RPC_NUM_PARAMS * sizeof(struct tee_ioctl_param))
 
@@ -76,17 +89,121 @@ struct tee_shm {
 	int id;
 	void *p;
 	size_t size;
+	size_t len;		/* Length of the buffer, >= size */
 	bool registered;
 	int fd;
+	time_t cached_since;
 	struct tee_shm *next;
 };
 
+/*
+ * Worker pool
+ *
+ * Every worker waits for requests in TEE_IOC_SUPPL_RECV. When a request
+ * that may block leaves no worker waiting another one is started, up to
+ * --max-threads; beyond that requests wait for a worker to become free.
+ * --min-threads workers are started up front. A worker beyond the minimum
+ * that has waited for longer than --idle-timeout seconds is told to exit
+ * and woken with POOL_SIGNAL. The signal is only unblocked while a worker
+ * waits for a request, so it never interrupts one being served. It is
+ * lost if it comes after the worker checked for it but before it blocked
+ * in the driver, so the reaper sends it again on every pass until the
+ * worker is gone.
+ */
+#define POOL_MAX_THREADS	256
+#define POOL_DEFAULT_MAX	64
+#define POOL_DEFAULT_STACK	(256 * 1024)
+#define POOL_DEFAULT_IDLE	30	/* seconds */
+#define POOL_SIGNAL		SIGUSR2
+
+/*
+ * RPC classes
+ *
+ * Requests are classed by how long they may take. Critical ones (shared
+ * memory and RPMB) are always served at once. Normal ones (file system,
+ * TA loading) may keep at most --max-threads minus --reserved-threads
+ * workers busy, bulk ones (sockets, profiling, plugins) at most
+ * --reserved-threads fewer than that. A request over its class limit is
+ * queued and picked up by the next worker finishing a request of the
+ * same or a lower class, higher classes first. Latency counters of each
+ * class are logged on STATS_SIGNAL.
+ */
+enum rpc_class {
+	RPC_CLASS_CRITICAL,
+	RPC_CLASS_NORMAL,
+	RPC_CLASS_BULK,
+	RPC_NUM_CLASSES,
+};
+
+#define POOL_DEFAULT_RESERVED	2
+#define STATS_SIGNAL		SIGUSR1
+
+/* Saves secure storage kept in memory, see tee_supp_fs_snapshot() */
+#define SNAPSHOT_SIGNAL		SIGHUP
+
+/* Stop the supplicant, saving secure storage kept in memory first */
+#define STOP_SIGNAL		SIGTERM
+#define STOP_SIGNAL_TTY		SIGINT
+
+struct thread_arg;
+
+struct worker {
+	struct thread_arg *arg;
+	pthread_t tid;
+	bool used;
+	bool waiting;
+	bool exit;
+	time_t wait_since;
+};
+
+/* A received request, queued if over its class limit */
+struct rpc_req {
+	union tee_rpc_invoke request;
+	uint32_t func;
+	enum rpc_class class;
+	size_t num_meta;
+	uint64_t recv_ns;
+	uint64_t start_ns;
+	struct rpc_req *next;
+};
+
+/* A request whose response is sent later, see tee_supp_rpc_defer() */
+struct tee_supp_rpc {
+	struct thread_arg *arg;
+	struct rpc_req req;
+};
+
+struct rpc_class_stat {
+	uint64_t count;
+	uint64_t queued;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t service_ns;
+	uint64_t max_service_ns;
+};
+
 struct thread_arg {
 	int fd;
 	uint32_t gen_caps;
 	bool abort;
 	size_t num_waiters;
 	pthread_mutex_t mutex;
+	/* Pool configuration */
+	size_t min_threads;
+	size_t max_threads;
+	size_t stack_size;
+	unsigned int idle_timeout;
+	bool pin;
+	cpu_set_t cpus;
+	size_t reserved;
+	/* Guarded by mutex */
+	size_t num_threads;
+	bool pool_full;
+	size_t busy[RPC_NUM_CLASSES];
+	struct rpc_req *queue_head[RPC_NUM_CLASSES];
+	struct rpc_req *queue_tail[RPC_NUM_CLASSES];
+	struct rpc_class_stat stats[RPC_NUM_CLASSES];
+	struct worker workers[POOL_MAX_THREADS];	/* [0] is main() */
 };
 
 struct param_value {
@@ -95,11 +212,68 @@ struct param_value {
 	uint64_t c;
 };
 
+/*
+ * Shared memory table
+ *
+ * Shared memory objects are indexed by ID in a two level table, the
+ * driver hands out the lowest free IDs so it stays small. Leaves are
+ * allocated on demand and never freed. Slots are updated under shm_mutex
+ * and read without locking, the reader retries if the sequence count of
+ * the slot changed meanwhile. IDs beyond the table, or whose leaf
+ * couldn't be allocated, are kept in a list under shm_mutex instead.
+ */
+#define SHM_LEAF_SHIFT	10
+#define SHM_LEAF_SLOTS	(1 << SHM_LEAF_SHIFT)
+#define SHM_TOP_SLOTS	1024
+
+struct shm_slot {
+	unsigned int seq;	/* Odd while the slot is updated */
+	struct tee_shm *shm;
+	void *p;
+	size_t size;
+};
+
 static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct shm_slot *shm_table[SHM_TOP_SLOTS];
 static struct tee_shm *shm_head;
 
+/*
+ * Shared memory cache
+ *
+ * Freed RPC buffers of up to 1 MiB are kept registered in power of two
+ * size classes and handed out again by the next allocation of that
+ * class, saving the ioctl, mmap and page faults. Allocations are rounded
+ * up to their class. At most --shm-cache buffers are kept per class,
+ * any more are torn down. Buffers unused for SHM_CACHE_IDLE seconds are
+ * torn down by the stats thread every SHM_CACHE_IDLE / 2 seconds. A
+ * recycled buffer isn't cleared.
+ */
+#define SHM_CACHE_MIN_SHIFT	12
+#define SHM_CACHE_CLASSES	9	/* 4 KiB to 1 MiB */
+#define SHM_CACHE_CLASS_SIZE(c)	((size_t)1 << (SHM_CACHE_MIN_SHIFT + (c)))
+#define SHM_CACHE_DEFAULT	8
+#define SHM_CACHE_IDLE		60	/* seconds */
+
+struct shm_cache_class {
+	struct tee_shm *head;
+	size_t count;
+	size_t high;		/* High-water mark of count */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evicted;
+};
+
+static pthread_mutex_t shm_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct shm_cache_class shm_cache[SHM_CACHE_CLASSES];
+static size_t shm_cache_max = SHM_CACHE_DEFAULT;
+
 static const char *ta_dir;
 
+/* The request served by this thread, for tee_supp_rpc_defer() */
+static __thread struct thread_arg *rpc_arg;
+static __thread struct rpc_req *rpc_current;
+static __thread struct tee_supp_rpc *rpc_deferred;
+
 static void *thread_main(void *a);
 
 static size_t num_waiters_inc(struct thread_arg *arg)
@@ -128,6 +302,22 @@ static size_t num_waiters_dec(struct thread_arg *arg)
 	return ret;
 }
 
+static time_t monotonic_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void *paged_aligned_alloc(size_t sz)
 {
 	void *p = NULL;
@@ -155,34 +345,111 @@ static int get_value(size_t num_params, struct tee_ioctl_param *params,
 	}
 }
 
-static struct tee_shm *find_tshm(int id)
+/* Returns the slot of @id, allocating its leaf if @alloc and mutex held */
+static struct shm_slot *shm_slot(int id, bool alloc)
 {
-	struct tee_shm *tshm = NULL;
+	struct shm_slot **top = NULL;
+	struct shm_slot *leaf = NULL;
 
-	tee_supp_mutex_lock(&shm_mutex);
+	if (id < 0 || id >= SHM_TOP_SLOTS * SHM_LEAF_SLOTS)
+		return NULL;
 
-	tshm = shm_head;
-	while (tshm && tshm->id != id)
-		tshm = tshm->next;
+	top = shm_table + (id >> SHM_LEAF_SHIFT);
+	leaf = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+	if (!leaf && alloc) {
+		leaf = calloc(SHM_LEAF_SLOTS, sizeof(*leaf));
+		if (!leaf)
+			return NULL;
+		__atomic_store_n(top, leaf, __ATOMIC_RELEASE);
+	}
+	if (!leaf)
+		return NULL;
+
+	return leaf + (id & (SHM_LEAF_SLOTS - 1));
+}
 
+/* Updates @slot, mutex held */
+static void shm_slot_set(struct shm_slot *slot, struct tee_shm *tshm)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&slot->shm, tshm, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->p, tshm ? tshm->p : NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->size, tshm ? tshm->size : 0, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Looks up shared memory object @id and copies its ID, address and size
+ * to @tshm. The object itself may be freed once this returns.
+ */
+static bool find_tshm(int id, struct tee_shm *tshm)
+{
+	struct shm_slot *slot = shm_slot(id, false);
+	struct tee_shm *l = NULL;
+	struct tee_shm *shm = NULL;
+	unsigned int seq = 0;
+	size_t size = 0;
+	void *p = NULL;
+
+	if (slot) {
+		do {
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			shm = __atomic_load_n(&slot->shm, __ATOMIC_RELAXED);
+			p = __atomic_load_n(&slot->p, __ATOMIC_RELAXED);
+			size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while ((seq & 1) ||
+			 seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+
+		if (shm) {
+			tshm->id = id;
+			tshm->p = p;
+			tshm->size = size;
+			return true;
+		}
+	}
+
+	if (!__atomic_load_n(&shm_head, __ATOMIC_RELAXED))
+		return false;
+
+	tee_supp_mutex_lock(&shm_mutex);
+	for (l = shm_head; l; l = l->next) {
+		if (l->id == id) {
+			tshm->id = id;
+			tshm->p = l->p;
+			tshm->size = l->size;
+			break;
+		}
+	}
 	tee_supp_mutex_unlock(&shm_mutex);
 
-	return tshm;
+	return l;
 }
 
 static struct tee_shm *pop_tshm(int id)
 {
+	struct shm_slot *slot = NULL;
 	struct tee_shm *tshm = NULL;
 	struct tee_shm *prev = NULL;
 
 	tee_supp_mutex_lock(&shm_mutex);
 
+	slot = shm_slot(id, false);
+	if (slot && slot->shm) {
+		tshm = slot->shm;
+		shm_slot_set(slot, NULL);
+		goto out;
+	}
+
 	tshm = shm_head;
 	if (!tshm)
 		goto out;
 
 	if (tshm->id == id) {
-		shm_head = tshm->next;
+		__atomic_store_n(&shm_head, tshm->next, __ATOMIC_RELAXED);
 		goto out;
 	}
 
@@ -202,10 +469,17 @@ out:
 
 static void push_tshm(struct tee_shm *tshm)
 {
+	struct shm_slot *slot = NULL;
+
 	tee_supp_mutex_lock(&shm_mutex);
 
-	tshm->next = shm_head;
-	shm_head = tshm;
+	slot = shm_slot(tshm->id, true);
+	if (slot) {
+		shm_slot_set(slot, tshm);
+	} else {
+		tshm->next = shm_head;
+		__atomic_store_n(&shm_head, tshm, __ATOMIC_RELAXED);
+	}
 
 	tee_supp_mutex_unlock(&shm_mutex);
 }
@@ -214,7 +488,7 @@ static void push_tshm(struct tee_shm *tshm)
 static int get_param(size_t num_params, struct tee_ioctl_param *params,
 		     const uint32_t idx, TEEC_SharedMemory *shm)
 {
-	struct tee_shm *tshm = NULL;
+	struct tee_shm tshm;
 	size_t offs = 0;
 	size_t sz = 0;
 
@@ -231,9 +505,9 @@ static int get_param(size_t num_params, struct tee_ioctl_param *params,
 	}
 
 	memset(shm, 0, sizeof(*shm));
+	memset(&tshm, 0, sizeof(tshm));
 
-	tshm = find_tshm(MEMREF_SHM_ID(params + idx));
-	if (!tshm) {
+	if (!find_tshm(MEMREF_SHM_ID(params + idx), &tshm)) {
 		/*
 		 * It doesn't make sense to query required size of an
 		 * input buffer.
@@ -253,13 +527,13 @@ static int get_param(size_t num_params, struct tee_ioctl_param *params,
 	offs = MEMREF_SHM_OFFS(params + idx);
 	if ((sz + offs) < sz)
 		return -1;
-	if ((sz + offs) > tshm->size)
+	if ((sz + offs) > tshm.size)
 		return -1;
 
 	shm->flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
 	shm->size = sz;
 	shm->id = MEMREF_SHM_ID(params + idx);
-	shm->buffer = (uint8_t *)tshm->p + offs;
+	shm->buffer = (uint8_t *)tshm.p + offs;
 
 	return 0;
 }
@@ -335,6 +609,7 @@ static struct tee_shm *alloc_shm(int fd, size_t size)
 	}
 
 	shm->id = data.id;
+	shm->len = data.size;
 	shm->registered = false;
 	return shm;
 }
@@ -368,25 +643,170 @@ static struct tee_shm *register_local_shm(int fd, size_t size)
 	}
 
 	shm->p = buf;
+	shm->len = size;
 	shm->registered = true;
 	shm->id = data.id;
 
 	return shm;
 }
 
+static bool release_shm(struct tee_shm *shm)
+{
+	bool ret = true;
+
+	tee_supp_uring_buf_unregister(shm->id);
+
+	if (shm->registered) {
+		free(shm->p);
+	} else if (munmap(shm->p, shm->len) != 0) {
+		EMSG("munmap(%p, %zu) failed - Error = %s",
+		     shm->p, shm->len, strerror(errno));
+		ret = false;
+	}
+
+	close(shm->fd);
+	free(shm);
+	return ret;
+}
+
+/* Returns the cache class fitting @size, or -1 if too large */
+static int shm_cache_class(size_t size)
+{
+	int n = 0;
+
+	for (n = 0; n < SHM_CACHE_CLASSES; n++)
+		if (size <= SHM_CACHE_CLASS_SIZE(n))
+			return n;
+
+	return -1;
+}
+
+/* Tears down buffers of class @c cached for too long, shm_cache_mutex held */
+static struct tee_shm *shm_cache_expire(int c)
+{
+	struct shm_cache_class *cc = shm_cache + c;
+	struct tee_shm **pp = &cc->head;
+	struct tee_shm *expired = NULL;
+	struct tee_shm *shm = NULL;
+	time_t now = monotonic_sec();
+
+	/* Most recently cached first, so the old ones are at the end */
+	while (*pp && now - (*pp)->cached_since < SHM_CACHE_IDLE)
+		pp = &(*pp)->next;
+
+	expired = *pp;
+	*pp = NULL;
+	for (shm = expired; shm; shm = shm->next) {
+		cc->count--;
+		cc->evicted++;
+	}
+
+	return expired;
+}
+
+static void shm_release_list(struct tee_shm *shm)
+{
+	struct tee_shm *next = NULL;
+
+	for (; shm; shm = next) {
+		next = shm->next;
+		release_shm(shm);
+	}
+}
+
+static struct tee_shm *shm_cache_get(size_t size)
+{
+	struct shm_cache_class *cc = NULL;
+	struct tee_shm *shm = NULL;
+	int c = shm_cache_class(size);
+
+	if (c < 0 || !shm_cache_max)
+		return NULL;
+
+	cc = shm_cache + c;
+	tee_supp_mutex_lock(&shm_cache_mutex);
+	shm = cc->head;
+	if (shm) {
+		cc->head = shm->next;
+		cc->count--;
+		cc->hits++;
+	} else {
+		cc->misses++;
+	}
+	tee_supp_mutex_unlock(&shm_cache_mutex);
+
+	return shm;
+}
+
+/* Returns true if @shm was cached instead of being torn down */
+static bool shm_cache_put(struct tee_shm *shm)
+{
+	struct shm_cache_class *cc = NULL;
+	int c = shm_cache_class(shm->len);
+	bool cached = false;
+
+	if (c < 0 || shm->len != SHM_CACHE_CLASS_SIZE(c) || !shm_cache_max)
+		return false;
+
+	cc = shm_cache + c;
+	tee_supp_mutex_lock(&shm_cache_mutex);
+	if (cc->count < shm_cache_max) {
+		shm->cached_since = monotonic_sec();
+		shm->next = cc->head;
+		cc->head = shm;
+		cc->count++;
+		if (cc->count > cc->high)
+			cc->high = cc->count;
+		cached = true;
+	} else {
+		cc->evicted++;
+	}
+	tee_supp_mutex_unlock(&shm_cache_mutex);
+
+	return cached;
+}
+
+/* Tears down the buffers of all classes cached for too long */
+static void shm_cache_reap(void)
+{
+	struct tee_shm *expired[SHM_CACHE_CLASSES] = { NULL };
+	int c = 0;
+
+	tee_supp_mutex_lock(&shm_cache_mutex);
+	for (c = 0; c < SHM_CACHE_CLASSES; c++)
+		expired[c] = shm_cache_expire(c);
+	tee_supp_mutex_unlock(&shm_cache_mutex);
+
+	for (c = 0; c < SHM_CACHE_CLASSES; c++)
+		shm_release_list(expired[c]);
+}
+
 static uint32_t process_alloc(struct thread_arg *arg, size_t num_params,
 			      struct tee_ioctl_param *params)
 {
 	struct param_value *val = NULL;
 	struct tee_shm *shm = NULL;
+	size_t len = 0;
+	int c = 0;
 
 	if (num_params != 1 || get_value(num_params, params, 0, &val))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (arg->gen_caps & TEE_GEN_CAP_REG_MEM)
-		shm = register_local_shm(arg->fd, val->b);
-	else
-		shm = alloc_shm(arg->fd, val->b);
+	shm = shm_cache_get(val->b);
+	if (!shm) {
+		/* Round up to the cache class so the buffer can be recycled */
+		len = val->b;
+		c = shm_cache_class(len);
+		if (c >= 0 && shm_cache_max)
+			len = SHM_CACHE_CLASS_SIZE(c);
+
+		if (arg->gen_caps & TEE_GEN_CAP_REG_MEM)
+			shm = register_local_shm(arg->fd, len);
+		else
+			shm = alloc_shm(arg->fd, len);
+		if (shm)
+			tee_supp_uring_buf_register(shm->id, shm->p, shm->len);
+	}
 
 	if (!shm)
 		return TEEC_ERROR_OUT_OF_MEMORY;
@@ -413,25 +833,15 @@ static uint32_t process_free(size_t num_params, struct tee_ioctl_param *params)
 	if (!shm)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (shm->registered) {
-		free(shm->p);
-	} else  {
-		if (munmap(shm->p, shm->size) != 0) {
-			EMSG("munmap(%p, %zu) failed - Error = %s",
-			     shm->p, shm->size, strerror(errno));
-			close(shm->fd);
-			free(shm);
-			return TEEC_ERROR_BAD_PARAMETERS;
-		}
-	}
+	if (shm_cache_put(shm))
+		return TEEC_SUCCESS;
+
+	if (!release_shm(shm))
+		return TEEC_ERROR_BAD_PARAMETERS;
 
-	close(shm->fd);
-	free(shm);
 	return TEEC_SUCCESS;
 }
 
-
-
 /* How many device sequence numbers will be tried before giving up */
 #define MAX_DEV_SEQ	10
 
@@ -481,12 +891,92 @@ static int get_dev_fd(uint32_t *gen_caps)
 
 static int usage(int status)
 {
-	fprintf(stderr, "Usage: tee-supplicant [-d] [<device-name>]\n");
-	fprintf(stderr, "       -d: run as a daemon (fork after successful "
-			"initialization)\n");
+	fprintf(stderr, "Usage: tee-supplicant [options] [<device-name>]\n");
+	fprintf(stderr, "  -d, --daemon           run as a daemon (fork after "
+			"successful initialization)\n");
+	fprintf(stderr, "      --min-threads=N    workers started up front "
+			"[1]\n");
+	fprintf(stderr, "      --max-threads=N    upper bound of workers "
+			"[%d]\n", POOL_DEFAULT_MAX);
+	fprintf(stderr, "      --thread-stack=N   worker stack size in bytes "
+			"[%d]\n", POOL_DEFAULT_STACK);
+	fprintf(stderr, "      --cpus=LIST        pin workers to CPUs, e.g. "
+			"0-3,6\n");
+	fprintf(stderr, "      --idle-timeout=SEC stop extra workers idle for "
+			"SEC, 0 never [%d]\n", POOL_DEFAULT_IDLE);
+	fprintf(stderr, "      --reserved-threads=N workers kept from each "
+			"slower RPC class [%d]\n", POOL_DEFAULT_RESERVED);
+	fprintf(stderr, "      --shm-cache=N      freed RPC buffers kept per "
+			"size class, 0 none [%d]\n", SHM_CACHE_DEFAULT);
+#ifdef CFG_TEE_SUPP_IO_URING
+	fprintf(stderr, "      --io-uring=N       secure storage I/O ring "
+			"entries, 0 none [%d]\n", URING_DEFAULT_ENTRIES);
+#endif
+	fprintf(stderr, "      --fs-sync=MODE     flush secure storage writes "
+			"each \"always\" or per \"commit\" [always]\n");
+	fprintf(stderr, "      --fd-cache=N       closed secure storage files "
+			"kept open, 0 none [%d]\n", TEE_SUPP_FS_FD_CACHE_DEFAULT);
+	fprintf(stderr, "      --fs-backend=NAME  secure storage as a \"file\" "
+			"each, in a \"log\" of segments or in \"ram\" "
+			"[file]\n");
+	fprintf(stderr, "      --fs-snapshot=SEC  interval of saving \"ram\" "
+			"storage, 0 only on SIGHUP and exit [%d]\n",
+			TEE_SUPP_FS_SNAPSHOT_DEFAULT);
+	fprintf(stderr, "      --fs-root=DIR      also stripe \"file\" storage "
+			"over DIR, may be repeated\n");
 	return status;
 }
 
+static bool parse_size(const char *str, size_t min, size_t max, size_t *val)
+{
+	char *endp = NULL;
+	unsigned long long v = 0;
+
+	errno = 0;
+	v = strtoull(str, &endp, 0);
+	if (errno || endp == str || *endp || v < min || v > max)
+		return false;
+
+	*val = v;
+	return true;
+}
+
+/* Parses a CPU list like "0-3,6" */
+static bool parse_cpus(const char *str, cpu_set_t *cpus)
+{
+	unsigned long first = 0;
+	unsigned long last = 0;
+	char *endp = NULL;
+
+	CPU_ZERO(cpus);
+
+	while (*str) {
+		first = strtoul(str, &endp, 10);
+		if (endp == str)
+			return false;
+		last = first;
+		if (*endp == '-') {
+			str = endp + 1;
+			last = strtoul(str, &endp, 10);
+			if (endp == str)
+				return false;
+		}
+		if (first > last || last >= CPU_SETSIZE)
+			return false;
+
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+
+		if (*endp == ',')
+			endp++;
+		else if (*endp)
+			return false;
+		str = endp;
+	}
+
+	return CPU_COUNT(cpus);
+}
+
 static uint32_t process_rpmb(size_t num_params, struct tee_ioctl_param *params)
 {
 	TEEC_SharedMemory req;
@@ -499,6 +989,10 @@ static uint32_t process_rpmb(size_t num_params, struct tee_ioctl_param *params)
 	    get_param(num_params, params, 1, &rsp))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
+	/* RPMB may record state the TEE has just committed to REE FS */
+	if (tee_supp_fs_commit())
+		return TEEC_ERROR_GENERIC;
+
 	return rpmb_process_request(req.buffer, req.size, rsp.buffer, rsp.size);
 }
 
@@ -511,7 +1005,8 @@ static bool read_request(int fd, union tee_rpc_invoke *request)
 	data.buf_ptr = (uintptr_t)request;
 	data.buf_len = sizeof(*request);
 	if (ioctl(fd, TEE_IOC_SUPPL_RECV, &data)) {
-		EMSG("TEE_IOC_SUPPL_RECV: %s", strerror(errno));
+		if (errno != EINTR)
+			EMSG("TEE_IOC_SUPPL_RECV: %s", strerror(errno));
 		return false;
 	}
 	return true;
@@ -564,63 +1059,445 @@ static bool find_params(union tee_rpc_invoke *request, uint32_t *func,
 	return true;
 }
 
+static enum rpc_class rpc_class_of(uint32_t func)
+{
+	switch (func) {
+	case OPTEE_MSG_RPC_CMD_SHM_ALLOC:
+	case OPTEE_MSG_RPC_CMD_SHM_FREE:
+	case OPTEE_MSG_RPC_CMD_RPMB:
+		return RPC_CLASS_CRITICAL;
+	case OPTEE_MSG_RPC_CMD_FS:
+	case OPTEE_MSG_RPC_CMD_LOAD_TA:
+		return RPC_CLASS_NORMAL;
+	default:
+		return RPC_CLASS_BULK;
+	}
+}
+
+static const char *rpc_class_name(enum rpc_class class)
+{
+	switch (class) {
+	case RPC_CLASS_CRITICAL:
+		return "critical";
+	case RPC_CLASS_NORMAL:
+		return "normal";
+	default:
+		return "bulk";
+	}
+}
+
 static bool spawn_thread(struct thread_arg *arg)
 {
-	int e = 0;
+	struct worker *w = NULL;
+	pthread_attr_t attr;
 	pthread_t tid;
+	size_t n = 0;
+	int e = 0;
 
-	memset(&tid, 0, sizeof(tid));
+	tee_supp_mutex_lock(&arg->mutex);
+	for (n = 1; n < arg->max_threads && n < POOL_MAX_THREADS; n++)
+		if (!arg->workers[n].used)
+			break;
+	if (n >= arg->max_threads || n == POOL_MAX_THREADS) {
+		if (!arg->pool_full)
+			IMSG("worker pool full at %zu threads", arg->num_threads);
+		arg->pool_full = true;
+		tee_supp_mutex_unlock(&arg->mutex);
+		/* Requests queue up until a worker is free again */
+		return true;
+	}
 
-	DMSG("Spawning a new thread");
+	w = arg->workers + n;
+	memset(w, 0, sizeof(*w));
+	w->arg = arg;
+	w->used = true;
+	arg->num_threads++;
 
 	/*
 	 * Increase number of waiters now to avoid starting another thread
 	 * before this thread has been scheduled.
 	 */
-	num_waiters_inc(arg);
+	arg->num_waiters++;
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	DMSG("Spawning a new thread");
 
-	e = pthread_create(&tid, NULL, thread_main, arg);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	e = pthread_attr_setstacksize(&attr, arg->stack_size);
+	if (e)
+		EMSG("pthread_attr_setstacksize: %s", strerror(e));
+	if (arg->pin) {
+		e = pthread_attr_setaffinity_np(&attr, sizeof(arg->cpus),
+						&arg->cpus);
+		if (e)
+			EMSG("pthread_attr_setaffinity_np: %s", strerror(e));
+	}
+
+	e = pthread_create(&tid, &attr, thread_main, w);
+	pthread_attr_destroy(&attr);
 	if (e) {
 		EMSG("pthread_create: %s", strerror(e));
-		num_waiters_dec(arg);
+		tee_supp_mutex_lock(&arg->mutex);
+		arg->num_waiters--;
+		arg->num_threads--;
+		w->used = false;
+		tee_supp_mutex_unlock(&arg->mutex);
 		return false;
 	}
 
-	e = pthread_detach(tid);
+	return true;
+}
+
+/*
+ * Marks @w as waiting for a request, or done waiting if !@waiting.
+ * Returns false if @w was told to exit instead of waiting.
+ */
+static bool worker_wait(struct thread_arg *arg, struct worker *w,
+			bool waiting)
+{
+	bool exiting = false;
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, POOL_SIGNAL);
+
+	if (!waiting)
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	tee_supp_mutex_lock(&arg->mutex);
+	exiting = waiting && w->exit;
+	w->waiting = waiting && !exiting;
+	if (w->waiting) {
+		w->tid = pthread_self();
+		w->wait_since = monotonic_sec();
+	}
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	if (waiting && !exiting)
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	return !exiting;
+}
+
+static bool worker_exiting(struct thread_arg *arg, struct worker *w)
+{
+	bool ret = false;
+
+	tee_supp_mutex_lock(&arg->mutex);
+	ret = w->exit;
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	return ret;
+}
+
+/* Tells workers idle for too long to exit, keeping one waiting */
+static void *reaper_main(void *a)
+{
+	struct thread_arg *arg = a;
+	struct worker *w = NULL;
+	size_t leaving = 0;
+	time_t now = 0;
+	size_t n = 0;
+
+	while (!arg->abort) {
+		sleep(arg->idle_timeout > 1 ? arg->idle_timeout / 2 : 1);
+		now = monotonic_sec();
+		leaving = 0;
+
+		tee_supp_mutex_lock(&arg->mutex);
+		/* The signal may have come before they blocked */
+		for (n = 1; n < POOL_MAX_THREADS; n++) {
+			w = arg->workers + n;
+			if (w->used && w->waiting && w->exit) {
+				leaving++;
+				pthread_kill(w->tid, POOL_SIGNAL);
+			}
+		}
+
+		for (n = 1; n < POOL_MAX_THREADS; n++) {
+			if (arg->num_threads - leaving <= arg->min_threads ||
+			    arg->num_waiters - leaving <= 1)
+				break;
+
+			w = arg->workers + n;
+			if (!w->used || !w->waiting || w->exit ||
+			    now - w->wait_since < (time_t)arg->idle_timeout)
+				continue;
+
+			w->exit = true;
+			leaving++;
+			pthread_kill(w->tid, POOL_SIGNAL);
+		}
+		if (leaving)
+			arg->pool_full = false;
+		tee_supp_mutex_unlock(&arg->mutex);
+
+		if (leaving)
+			DMSG("%zu idle workers exiting", leaving);
+	}
+
+	return NULL;
+}
+
+static void shm_cache_dump(void)
+{
+	struct shm_cache_class cc[SHM_CACHE_CLASSES];
+	size_t n = 0;
+
+	tee_supp_mutex_lock(&shm_cache_mutex);
+	memcpy(cc, shm_cache, sizeof(cc));
+	tee_supp_mutex_unlock(&shm_cache_mutex);
+
+	for (n = 0; n < SHM_CACHE_CLASSES; n++) {
+		if (!cc[n].hits && !cc[n].misses)
+			continue;
+		IMSG("shm %zu KiB: %zu cached, high %zu, %" PRIu64 " hits, "
+		     "%" PRIu64 " misses, %" PRIu64 " evicted",
+		     SHM_CACHE_CLASS_SIZE(n) / 1024, cc[n].count, cc[n].high,
+		     cc[n].hits, cc[n].misses, cc[n].evicted);
+	}
+}
+
+static void stats_dump(struct thread_arg *arg)
+{
+	struct rpc_class_stat st[RPC_NUM_CLASSES];
+	size_t busy[RPC_NUM_CLASSES];
+	size_t n = 0;
+
+	tee_supp_mutex_lock(&arg->mutex);
+	memcpy(st, arg->stats, sizeof(st));
+	memcpy(busy, arg->busy, sizeof(busy));
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	for (n = 0; n < RPC_NUM_CLASSES; n++) {
+		if (!st[n].count)
+			continue;
+		IMSG("%s: %" PRIu64 " requests, %" PRIu64 " queued, %zu busy, "
+		     "wait avg %" PRIu64 " max %" PRIu64 " us, "
+		     "service avg %" PRIu64 " max %" PRIu64 " us",
+		     rpc_class_name(n), st[n].count, st[n].queued, busy[n],
+		     st[n].wait_ns / st[n].count / 1000,
+		     st[n].max_wait_ns / 1000,
+		     st[n].service_ns / st[n].count / 1000,
+		     st[n].max_service_ns / 1000);
+	}
+
+	shm_cache_dump();
+}
+
+/*
+ * Logs the RPC class and shared memory cache counters on STATS_SIGNAL,
+ * saves secure storage on SNAPSHOT_SIGNAL, and once more before the
+ * default action of STOP_SIGNAL and STOP_SIGNAL_TTY. Expires idle shared
+ * memory cache buffers between signals.
+ */
+static void *stats_main(void *a)
+{
+	struct thread_arg *arg = a;
+	struct timespec tick = { .tv_sec = SHM_CACHE_IDLE / 2 };
+	sigset_t set;
+	int sig = 0;
+
+	sigemptyset(&set);
+	sigaddset(&set, STATS_SIGNAL);
+	sigaddset(&set, SNAPSHOT_SIGNAL);
+	sigaddset(&set, STOP_SIGNAL);
+	sigaddset(&set, STOP_SIGNAL_TTY);
+
+	while (!arg->abort) {
+		sig = sigtimedwait(&set, NULL, &tick);
+		if (sig < 0) {
+			if (errno == EAGAIN)
+				shm_cache_reap();
+			continue;
+		}
+		if (sig == STOP_SIGNAL || sig == STOP_SIGNAL_TTY) {
+			tee_supp_fs_snapshot();
+			signal(sig, SIG_DFL);
+			sigemptyset(&set);
+			sigaddset(&set, sig);
+			pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+			raise(sig);
+		} else if (sig == SNAPSHOT_SIGNAL) {
+			tee_supp_fs_snapshot();
+		} else {
+			stats_dump(arg);
+		}
+	}
+
+	return NULL;
+}
+
+static void pool_signal_handler(int sig)
+{
+	(void)sig;
+}
+
+static void pool_start(struct thread_arg *arg)
+{
+	struct sigaction sa;
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set;
+	size_t n = 0;
+	int e = 0;
+
+	/* Without SA_RESTART the signal interrupts TEE_IOC_SUPPL_RECV */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pool_signal_handler;
+	sigaction(POOL_SIGNAL, &sa, NULL);
+
+	/*
+	 * Inherited by all workers, see worker_wait(). STATS_SIGNAL is
+	 * taken by stats_main() only, as are SNAPSHOT_SIGNAL and the stop
+	 * signals.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, POOL_SIGNAL);
+	sigaddset(&set, STATS_SIGNAL);
+	sigaddset(&set, SNAPSHOT_SIGNAL);
+	sigaddset(&set, STOP_SIGNAL);
+	sigaddset(&set, STOP_SIGNAL_TTY);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	arg->workers[0].arg = arg;
+	arg->workers[0].used = true;
+	arg->num_threads = 1;
+
+	if (arg->pin) {
+		e = pthread_setaffinity_np(pthread_self(), sizeof(arg->cpus),
+					   &arg->cpus);
+		if (e)
+			EMSG("pthread_setaffinity_np: %s", strerror(e));
+	}
+
+	for (n = 1; n < arg->min_threads; n++)
+		if (!spawn_thread(arg))
+			break;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, arg->stack_size);
+
+	e = pthread_create(&tid, &attr, stats_main, arg);
 	if (e)
-		EMSG("pthread_detach: %s", strerror(e));
+		EMSG("pthread_create: %s", strerror(e));
+
+	if (arg->idle_timeout && arg->max_threads > arg->min_threads) {
+		e = pthread_create(&tid, &attr, reaper_main, arg);
+		if (e)
+			EMSG("pthread_create: %s", strerror(e));
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+static uint64_t find_corr_id(union tee_rpc_invoke *request, size_t num_meta)
+{
+	struct tee_ioctl_param *p = NULL;
+	size_t n = 0;
+
+	p = (struct tee_ioctl_param *)(&request->recv + 1);
+
+	for (n = 0; n < num_meta; n++) {
+		switch (p[n].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) {
+		case TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT:
+		case TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INOUT:
+			if (p[n].c == RPC_CORR_ID_TAG)
+				return p[n].a;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns true if a request of @class may be served now, mutex held */
+static bool rpc_admit(struct thread_arg *arg, enum rpc_class class)
+{
+	size_t reserve = arg->reserved * class;
+	size_t limit = 1;
+	size_t busy = 0;
+	size_t n = 0;
+
+	if (class == RPC_CLASS_CRITICAL)
+		return true;
+
+	if (arg->max_threads > reserve)
+		limit = arg->max_threads - reserve;
+
+	for (n = class; n < RPC_NUM_CLASSES; n++)
+		busy += arg->busy[n];
+
+	return busy < limit;
+}
+
+/* Queues @req to be served later, mutex held */
+static bool rpc_queue(struct thread_arg *arg, struct rpc_req *req)
+{
+	struct rpc_req *q = NULL;
+
+	q = malloc(sizeof(*q));
+	if (!q)
+		return false;
+
+	*q = *req;
+	q->next = NULL;
+	if (arg->queue_tail[q->class])
+		arg->queue_tail[q->class]->next = q;
+	else
+		arg->queue_head[q->class] = q;
+	arg->queue_tail[q->class] = q;
+	arg->stats[q->class].queued++;
 
 	return true;
 }
 
-static bool process_one_request(struct thread_arg *arg)
+/* Returns the next queued request that may be served now, mutex held */
+static struct rpc_req *rpc_dequeue(struct thread_arg *arg)
+{
+	struct rpc_req *q = NULL;
+	size_t n = 0;
+
+	for (n = 0; n < RPC_NUM_CLASSES; n++) {
+		q = arg->queue_head[n];
+		if (!q || !rpc_admit(arg, n))
+			continue;
+
+		arg->queue_head[n] = q->next;
+		if (!q->next)
+			arg->queue_tail[n] = NULL;
+		arg->busy[n]++;
+		return q;
+	}
+
+	return NULL;
+}
+
+/* Sets *@deferred if the handler deferred the response */
+static bool serve_request(struct thread_arg *arg, struct rpc_req *req,
+			  bool *deferred)
 {
 	size_t num_params = 0;
 	size_t num_meta = 0;
 	struct tee_ioctl_param *params = NULL;
 	uint32_t func = 0;
 	uint32_t ret = 0;
-	union tee_rpc_invoke request;
-
-	memset(&request, 0, sizeof(request));
 
-	DMSG("looping");
-	request.recv.num_params = RPC_NUM_PARAMS;
-
-	/* Let it be known that we can deal with meta parameters */
-	params = (struct tee_ioctl_param *)(&request.send + 1);
-	params->attr = TEE_IOCTL_PARAM_ATTR_META;
-
-	num_waiters_inc(arg);
-
-	if (!read_request(arg->fd, &request))
+	/* Params point into the request, which may have been copied */
+	if (!find_params(&req->request, &func, &num_params, &params,
+			 &num_meta))
 		return false;
 
-	if (!find_params(&request, &func, &num_params, &params, &num_meta))
-		return false;
+	teec_corr_set(find_corr_id(&req->request, num_meta));
+	FREC(RPC_ENTRY, func, num_params, 0);
 
-	if (num_meta && !num_waiters_dec(arg) && !spawn_thread(arg))
-		return false;
+	rpc_arg = arg;
+	rpc_current = req;
+	rpc_deferred = NULL;
 
 	switch (func) {
 	case OPTEE_MSG_RPC_CMD_LOAD_TA:
@@ -657,13 +1534,179 @@ static bool process_one_request(struct thread_arg *arg)
 		break;
 	}
 
-	request.send.ret = ret;
-	return write_response(arg->fd, &request);
+	FREC(RPC_EXIT, func, ret, 0);
+	teec_corr_set(0);
+
+	rpc_current = NULL;
+	*deferred = rpc_deferred != NULL;
+	if (rpc_deferred) {
+		rpc_deferred = NULL;
+		return true;
+	}
+
+	req->request.send.ret = ret;
+	return write_response(arg->fd, &req->request);
+}
+
+/* Updates the class counters with served request @req, mutex held */
+static void rpc_account(struct thread_arg *arg, struct rpc_req *req)
+{
+	struct rpc_class_stat *st = arg->stats + req->class;
+	uint64_t wait = req->start_ns - req->recv_ns;
+	uint64_t service = monotonic_ns() - req->start_ns;
+
+	st->count++;
+	st->wait_ns += wait;
+	st->service_ns += service;
+	if (wait > st->max_wait_ns)
+		st->max_wait_ns = wait;
+	if (service > st->max_service_ns)
+		st->max_service_ns = service;
+}
+
+bool tee_supp_rpc_deferrable(void)
+{
+	/*
+	 * Without meta parameters the driver expects the response before
+	 * passing the next request.
+	 */
+	return rpc_current && rpc_current->num_meta && !rpc_deferred;
+}
+
+struct tee_supp_rpc *tee_supp_rpc_defer(struct tee_ioctl_param **params)
+{
+	struct rpc_req *req = rpc_current;
+	struct tee_supp_rpc *rpc = NULL;
+	struct tee_ioctl_param *p = NULL;
+
+	if (!tee_supp_rpc_deferrable())
+		return NULL;
+
+	rpc = malloc(sizeof(*rpc));
+	if (!rpc)
+		return NULL;
+
+	rpc->arg = rpc_arg;
+	rpc->req = *req;
+	rpc->req.next = NULL;
+
+	p = (struct tee_ioctl_param *)(&req->request.recv + 1);
+	*params = (struct tee_ioctl_param *)(&rpc->req.request.recv + 1) +
+		  (*params - p);
+
+	rpc_deferred = rpc;
+	return rpc;
+}
+
+void tee_supp_rpc_complete(struct tee_supp_rpc *rpc, uint32_t ret)
+{
+	struct thread_arg *arg = rpc->arg;
+
+	rpc->req.request.send.ret = ret;
+	if (!write_response(arg->fd, &rpc->req.request))
+		arg->abort = true;
+
+	tee_supp_mutex_lock(&arg->mutex);
+	rpc_account(arg, &rpc->req);
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	free(rpc);
+}
+
+/*
+ * Serves @req, counted as busy by the caller, and then the queued
+ * requests that it unblocks. Frees @req if it was queued.
+ */
+static bool run_request(struct thread_arg *arg, struct rpc_req *req,
+			bool queued)
+{
+	bool deferred = false;
+	bool ok = true;
+
+	while (req) {
+		req->start_ns = monotonic_ns();
+		ok = serve_request(arg, req, &deferred) && ok;
+
+		tee_supp_mutex_lock(&arg->mutex);
+		/* A deferred request is accounted when it completes */
+		if (!deferred)
+			rpc_account(arg, req);
+		arg->busy[req->class]--;
+		if (queued)
+			free(req);
+		req = rpc_dequeue(arg);
+		queued = true;
+		tee_supp_mutex_unlock(&arg->mutex);
+	}
+
+	return ok;
+}
+
+static bool process_one_request(struct thread_arg *arg, struct worker *w)
+{
+	size_t num_params = 0;
+	struct tee_ioctl_param *params = NULL;
+	struct rpc_req req;
+	bool ok = false;
+	int e = 0;
+
+	memset(&req, 0, sizeof(req));
+
+	DMSG("looping");
+	req.request.recv.num_params = RPC_NUM_PARAMS;
+
+	/* Let it be known that we can deal with meta parameters */
+	params = (struct tee_ioctl_param *)(&req.request.send + 1);
+	params->attr = TEE_IOCTL_PARAM_ATTR_META;
+
+	num_waiters_inc(arg);
+
+	if (!worker_wait(arg, w, true)) {
+		num_waiters_dec(arg);
+		return true;
+	}
+	ok = read_request(arg->fd, &req.request);
+	e = errno;
+	worker_wait(arg, w, false);
+	if (!ok) {
+		if (e != EINTR)
+			return false;
+		/* Woken up to exit, or by a stray signal */
+		num_waiters_dec(arg);
+		return true;
+	}
+	req.recv_ns = monotonic_ns();
+
+	if (!find_params(&req.request, &req.func, &num_params, &params,
+			 &req.num_meta))
+		return false;
+
+	if (req.num_meta && !num_waiters_dec(arg) && !spawn_thread(arg))
+		return false;
+
+	req.class = rpc_class_of(req.func);
+
+	/*
+	 * Without meta parameters the driver passes one request at a time
+	 * and expects the response before the next, nothing to queue.
+	 */
+	tee_supp_mutex_lock(&arg->mutex);
+	if (req.num_meta && !rpc_admit(arg, req.class) &&
+	    rpc_queue(arg, &req)) {
+		tee_supp_mutex_unlock(&arg->mutex);
+		DMSG("queued %s request", rpc_class_name(req.class));
+		return true;
+	}
+	arg->busy[req.class]++;
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	return run_request(arg, &req, false);
 }
 
 static void *thread_main(void *a)
 {
-	struct thread_arg *arg = a;
+	struct worker *w = a;
+	struct thread_arg *arg = w->arg;
 
 	/*
 	 * Now that this thread has been scheduled, compensate for the
@@ -671,21 +1714,72 @@ static void *thread_main(void *a)
 	 */
 	num_waiters_dec(arg);
 
-	while (!arg->abort) {
-		if (!process_one_request(arg))
+	while (!arg->abort && !worker_exiting(arg, w)) {
+		if (!process_one_request(arg, w))
 			arg->abort = true;
 	}
 
+	tee_supp_mutex_lock(&arg->mutex);
+	arg->num_threads--;
+	arg->pool_full = false;
+	memset(w, 0, sizeof(*w));
+	tee_supp_mutex_unlock(&arg->mutex);
+
 	return NULL;
 }
 
 int main(int argc, char *argv[])
 {
-	struct thread_arg arg = { .fd = -1 };
+	enum {
+		OPT_MIN_THREADS = 0x100,
+		OPT_MAX_THREADS,
+		OPT_THREAD_STACK,
+		OPT_CPUS,
+		OPT_IDLE_TIMEOUT,
+		OPT_RESERVED_THREADS,
+		OPT_SHM_CACHE,
+		OPT_IO_URING,
+		OPT_FS_SYNC,
+		OPT_FD_CACHE,
+		OPT_FS_BACKEND,
+		OPT_FS_SNAPSHOT,
+		OPT_FS_ROOT,
+	};
+	static const struct option opts[] = {
+		{ "daemon", no_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "min-threads", required_argument, NULL, OPT_MIN_THREADS },
+		{ "max-threads", required_argument, NULL, OPT_MAX_THREADS },
+		{ "thread-stack", required_argument, NULL, OPT_THREAD_STACK },
+		{ "cpus", required_argument, NULL, OPT_CPUS },
+		{ "idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT },
+		{ "reserved-threads", required_argument, NULL,
+		  OPT_RESERVED_THREADS },
+		{ "shm-cache", required_argument, NULL, OPT_SHM_CACHE },
+#ifdef CFG_TEE_SUPP_IO_URING
+		{ "io-uring", required_argument, NULL, OPT_IO_URING },
+#endif
+		{ "fs-sync", required_argument, NULL, OPT_FS_SYNC },
+		{ "fd-cache", required_argument, NULL, OPT_FD_CACHE },
+		{ "fs-backend", required_argument, NULL, OPT_FS_BACKEND },
+		{ "fs-snapshot", required_argument, NULL, OPT_FS_SNAPSHOT },
+		{ "fs-root", required_argument, NULL, OPT_FS_ROOT },
+		{ NULL, 0, NULL, 0 },
+	};
+	static struct thread_arg arg = {
+		.fd = -1,
+		.min_threads = 1,
+		.max_threads = POOL_DEFAULT_MAX,
+		.stack_size = POOL_DEFAULT_STACK,
+		.idle_timeout = POOL_DEFAULT_IDLE,
+		.reserved = POOL_DEFAULT_RESERVED,
+	};
+	size_t uring_entries = URING_DEFAULT_ENTRIES;
 	bool daemonize = false;
 	char *dev = NULL;
+	size_t val = 0;
+	int opt = 0;
 	int e = 0;
-	int i = 0;
 
 	e = pthread_mutex_init(&arg.mutex, NULL);
 	if (e) {
@@ -694,18 +1788,88 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (argc > 3)
-		return usage(EXIT_FAILURE);
-
-	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "-d"))
+	while ((opt = getopt_long(argc, argv, "dh", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
 			daemonize = true;
-		else if (!strcmp(argv[i], "-h"))
+			break;
+		case 'h':
 			return usage(EXIT_SUCCESS);
-		else
-			dev = argv[i];
+		case OPT_MIN_THREADS:
+			if (!parse_size(optarg, 1, POOL_MAX_THREADS,
+					&arg.min_threads))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_MAX_THREADS:
+			if (!parse_size(optarg, 1, POOL_MAX_THREADS,
+					&arg.max_threads))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_THREAD_STACK:
+			if (!parse_size(optarg, PTHREAD_STACK_MIN, SIZE_MAX,
+					&arg.stack_size))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_CPUS:
+			if (!parse_cpus(optarg, &arg.cpus))
+				return usage(EXIT_FAILURE);
+			arg.pin = true;
+			break;
+		case OPT_IDLE_TIMEOUT:
+			if (!parse_size(optarg, 0, UINT_MAX, &val))
+				return usage(EXIT_FAILURE);
+			arg.idle_timeout = val;
+			break;
+		case OPT_RESERVED_THREADS:
+			if (!parse_size(optarg, 0, POOL_MAX_THREADS,
+					&arg.reserved))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_SHM_CACHE:
+			if (!parse_size(optarg, 0, SIZE_MAX, &shm_cache_max))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_IO_URING:
+			if (!parse_size(optarg, 0, URING_MAX_ENTRIES,
+					&uring_entries))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_SYNC:
+			if (!strcmp(optarg, "always"))
+				tee_supp_fs_set_sync(TEE_SUPP_FS_SYNC_ALWAYS);
+			else if (!strcmp(optarg, "commit"))
+				tee_supp_fs_set_sync(TEE_SUPP_FS_SYNC_COMMIT);
+			else
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FD_CACHE:
+			if (!parse_size(optarg, 0, SIZE_MAX, &val))
+				return usage(EXIT_FAILURE);
+			tee_supp_fs_set_fd_cache(val);
+			break;
+		case OPT_FS_BACKEND:
+			if (!tee_supp_fs_set_backend(optarg))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_SNAPSHOT:
+			if (!parse_size(optarg, 0, UINT_MAX, &val))
+				return usage(EXIT_FAILURE);
+			tee_supp_fs_set_snapshot_interval(val);
+			break;
+		case OPT_FS_ROOT:
+			if (!tee_supp_fs_add_root(optarg))
+				return usage(EXIT_FAILURE);
+			break;
+		default:
+			return usage(EXIT_FAILURE);
+		}
 	}
 
+	if (optind < argc)
+		dev = argv[optind++];
+	if (optind < argc || arg.min_threads > arg.max_threads)
+		return usage(EXIT_FAILURE);
+
 	if (daemonize && daemon(0, 0) < 0) {
 		EMSG("daemon(): %s", strerror(errno));
 		exit(EXIT_FAILURE);
@@ -714,7 +1878,7 @@ int main(int argc, char *argv[])
 	if (dev) {
 		arg.fd = open_dev(dev, &arg.gen_caps);
 		if (arg.fd < 0) {
-			EMSG("failed to open \"%s\"", argv[1]);
+			EMSG("failed to open \"%s\"", dev);
 			exit(EXIT_FAILURE);
 		}
 	} else {
@@ -730,8 +1894,15 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+#ifdef CFG_TEE_SUPP_IO_URING
+	if (uring_entries && !tee_supp_uring_init(uring_entries))
+		IMSG("io_uring not available, using synchronous storage I/O");
+#endif
+
+	pool_start(&arg);
+
 	while (!arg.abort) {
-		if (!process_one_request(&arg))
+		if (!process_one_request(&arg, arg.workers))
 			arg.abort = true;
 	}
 
@@ -766,9 +1937,11 @@ bool tee_supp_param_is_value(struct tee_ioctl_param *param)
 
 void *tee_supp_param_to_va(struct tee_ioctl_param *param)
 {
-	struct tee_shm *tshm = NULL;
+	struct tee_shm tshm;
 	size_t end_offs = 0;
 
+	memset(&tshm, 0, sizeof(tshm));
+
 	if (!tee_supp_param_is_memref(param))
 		return NULL;
 
@@ -776,14 +1949,13 @@ void *tee_supp_param_to_va(struct tee_ioctl_param *param)
 	if (end_offs < MEMREF_SIZE(param) || end_offs < MEMREF_SHM_OFFS(param))
 		return NULL;
 
-	tshm = find_tshm(MEMREF_SHM_ID(param));
-	if (!tshm)
+	if (!find_tshm(MEMREF_SHM_ID(param), &tshm))
 		return NULL;
 
-	if (end_offs > tshm->size)
+	if (end_offs > tshm.size)
 		return NULL;
 
-	return (uint8_t *)tshm->p + MEMREF_SHM_OFFS(param);
+	return (uint8_t *)tshm.p + MEMREF_SHM_OFFS(param);
 }
 
 void tee_supp_mutex_lock(pthread_mutex_t *mu)
@@ -29,6 +29,7 @@
 #define TEE_SUPPLICANT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 /* Helpers to access memref parts of a struct tee_ioctl_param */
@@ -37,11 +38,33 @@
 #define MEMREF_SIZE(p)		((p)->b)
 
 struct tee_ioctl_param;
+struct tee_supp_rpc;
 
 bool tee_supp_param_is_memref(struct tee_ioctl_param *param);
 bool tee_supp_param_is_value(struct tee_ioctl_param *param);
 void *tee_supp_param_to_va(struct tee_ioctl_param *param);
 
+/*
+ * tee_supp_rpc_defer() - Takes over the response of the RPC request
+ * served by the calling thread
+ *
+ * *@params, pointing into the request, is updated to point to the same
+ * parameter of the returned deferred request, and the return value of
+ * the handler is ignored. The response is sent by
+ * tee_supp_rpc_complete(). Returns NULL if the response can't be
+ * deferred.
+ */
+struct tee_supp_rpc *tee_supp_rpc_defer(struct tee_ioctl_param **params);
+
+/*
+ * Returns true if the RPC request served by the calling thread can be
+ * deferred, so that tee_supp_rpc_defer() fails only if out of memory
+ */
+bool tee_supp_rpc_deferrable(void);
+
+/* Sends the response of deferred request @rpc with result @ret */
+void tee_supp_rpc_complete(struct tee_supp_rpc *rpc, uint32_t ret);
+
 void tee_supp_mutex_lock(pthread_mutex_t *mu);
 void tee_supp_mutex_unlock(pthread_mutex_t *mu);
 
@@ -6,7 +6,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 LOCAL_CFLAGS += $(optee_CFLAGS)
 
-LOCAL_CFLAGS += -DDEBUGLEVEL_$(CFG_TEE_SUPP_LOG_LEVEL) \
+LOCAL_CFLAGS += -D_GNU_SOURCE \
+		-DDEBUGLEVEL_$(CFG_TEE_SUPP_LOG_LEVEL) \
 		-DBINARY_PREFIX=\"TEES\" \
 		-DTEE_FS_PARENT_PATH=\"$(CFG_TEE_FS_PARENT_PATH)\" \
 		-DTEEC_LOAD_PATH=\"$(CFG_TEE_CLIENT_LOAD_PATH)\"
@@ -22,6 +23,9 @@ endif
 LOCAL_SRC_FILES += src/tee_supplicant.c \
 		   src/teec_ta_load.c \
 		   src/tee_supp_fs.c \
+		   src/tee_supp_fs_log.c \
+		   src/tee_supp_fs_ram.c \
+		   src/sha2.c \
 		   src/rpmb.c \
 		   src/handle.c
 
@@ -32,7 +36,7 @@ endif
 
 RPMB_EMU        := 1
 ifeq ($(RPMB_EMU),1)
-LOCAL_SRC_FILES += src/sha2.c src/hmac_sha2.c
+LOCAL_SRC_FILES += src/hmac_sha2.c
 LOCAL_CFLAGS += -DRPMB_EMU=1
 endif
 
@@ -56,6 +60,15 @@ LOCAL_LDFLAGS += -ldl
 LOCAL_LDFLAGS += -Wl,-rpath=$(CFG_TEE_PLUGIN_LOAD_PATH)
 endif
 
+ifeq ($(CFG_TEE_SUPP_IO_URING),y)
+LOCAL_SRC_FILES += src/tee_supp_uring.c
+LOCAL_CFLAGS += -DCFG_TEE_SUPP_IO_URING
+endif
+
+ifeq ($(CFG_TEE_SUPP_READDIR_BATCH),y)
+LOCAL_CFLAGS += -DCFG_TEE_SUPP_READDIR_BATCH
+endif
+
 LOCAL_CFLAGS += -pthread
 
 ifeq ($(CFG_FTRACE_SUPPORT),y)
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sel4_copy.h"
+
+/*
+ * Compares the throughput of memcpy() and of the non-temporal kernel of
+ * sel4_copy() over payload sizes from 64 KiB to @max MiB. The size from
+ * which the kernel wins is the threshold to pick for the architecture,
+ * see NT_COPY_THRESHOLD_DEFAULT and TEEC_NT_COPY_THRESHOLD.
+ *
+ * Usage: sel4_copy_bench [max MiB, default 64]
+ */
+#define BENCH_BYTES	(1ULL << 30)	/* copied per size and kernel */
+
+typedef void (*copy_fn)(void *dst, const void *src, size_t len);
+
+static void copy_memcpy(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns GB/s */
+static double bench(copy_fn fn, uint8_t *dst, const uint8_t *src,
+		    size_t len)
+{
+	size_t iters = BENCH_BYTES / len;
+	double t = 0;
+	size_t n = 0;
+
+	/* Fault in and warm up */
+	fn(dst, src, len);
+
+	t = now_sec();
+	for (n = 0; n < iters; n++)
+		fn(dst, src, len);
+	t = now_sec() - t;
+
+	return (double)iters * len / t / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t max = 64;
+	uint8_t *dst = NULL;
+	uint8_t *src = NULL;
+	size_t len = 0;
+
+	if (argc > 1)
+		max = strtoul(argv[1], NULL, 0);
+	if (!max)
+		return 1;
+	max <<= 20;
+
+	/* Every size above the kernel's minimum goes non-temporal */
+	setenv("TEEC_NT_COPY_THRESHOLD", "256", 1);
+
+	dst = malloc(max);
+	src = malloc(max);
+	if (!dst || !src)
+		return 1;
+	memset(src, 0x5a, max);
+
+	printf("%10s %14s %14s\n", "size", "memcpy GB/s", "sel4_copy GB/s");
+	for (len = 64 << 10; len <= max; len <<= 1)
+		printf("%10zu %14.2f %14.2f\n", len,
+		       bench(copy_memcpy, dst, src, len),
+		       bench(sel4_copy, dst, src, len));
+
+	free(dst);
+	free(src);
+
+	return 0;
+}
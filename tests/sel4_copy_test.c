@@ -0,0 +1,84 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sel4_copy.h"
+
+#define GUARD		64
+#define GUARD_BYTE	0xa5
+
+static unsigned int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, \
+				#cond); \
+			failures++; \
+		} \
+	} while (0)
+
+/*
+ * Copies @len bytes between buffers offset by @doff and @soff from their
+ * alignment, checks the copy and that nothing around it was touched
+ */
+static void check_copy(uint8_t *dbuf, const uint8_t *sbuf, size_t len,
+		       size_t doff, size_t soff)
+{
+	uint8_t *d = dbuf + GUARD + doff;
+	const uint8_t *s = sbuf + soff;
+	size_t n = 0;
+
+	memset(dbuf, GUARD_BYTE, len + 2 * GUARD + doff);
+	sel4_copy(d, s, len);
+
+	CHECK(!memcmp(d, s, len));
+	for (n = 0; n < GUARD + doff; n++)
+		CHECK(dbuf[n] == GUARD_BYTE);
+	for (n = 0; n < GUARD; n++)
+		CHECK(d[len + n] == GUARD_BYTE);
+}
+
+int main(void)
+{
+	static const size_t sizes[] = {
+		0, 1, 63, 255, 256, 257, 300, 1023, 4096, 4096 + 13,
+		65536 + 17, (2 << 20) + 5,
+	};
+	uint8_t *dbuf = NULL;
+	uint8_t *sbuf = NULL;
+	size_t max = (2 << 20) + 5 + 128;
+	size_t doff = 0;
+	size_t soff = 0;
+	size_t n = 0;
+
+	/* Use the non-temporal kernels for everything they can copy */
+	setenv("TEEC_NT_COPY_THRESHOLD", "256", 1);
+
+	dbuf = aligned_alloc(64, max + 2 * GUARD + 64);
+	sbuf = aligned_alloc(64, max + 64);
+	if (!dbuf || !sbuf)
+		return 1;
+
+	for (n = 0; n < max + 64; n++)
+		sbuf[n] = n * 7 + (n >> 8);
+
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+		for (doff = 0; doff < 64; doff += 7)
+			for (soff = 0; soff < 64; soff += 5)
+				check_copy(dbuf, sbuf, sizes[n], doff, soff);
+
+	free(dbuf);
+	free(sbuf);
+
+	if (failures)
+		fprintf(stderr, "%u checks failed\n", failures);
+
+	return failures != 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * The broker is built into the test with its main() renamed, its channel
+ * workers talk to the fake TEE below and clients are socket pairs.
+ */
+int tee_broker_main(int argc, char *argv[]);
+#define main tee_broker_main
+#include "../tee-broker/src/tee_broker.c"
+#undef main
+
+#include <fcntl.h>
+#include <stdarg.h>
+
+#define FIRST_FD	100
+#define TEST_CHANNELS	2
+
+static unsigned int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, \
+				#cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static unsigned int open_on[TEST_CHANNELS];
+static unsigned int shared_opens;
+
+/* UUID of the TA opens are for, only TA 1 is listed with --warm-uuid */
+static uint8_t ta;
+
+void _dprintf(const char *function, int line, int level, const char *prefix,
+	      const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)function;
+	(void)line;
+	(void)prefix;
+
+	if (level > TRACE_ERROR)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void teec_io_start(int fd)
+{
+	(void)fd;
+}
+
+void teec_io_stop(int fd)
+{
+	(void)fd;
+}
+
+/* Answers every call with the descriptor of the channel it came in on */
+int teec_io_call(int fd, enum teec_io_op op, uint32_t *session,
+		 uint32_t cmd_id, char **buf, uint32_t *len,
+		 int32_t *tee_err, uint32_t *ta_err)
+{
+	unsigned int *open = open_on + fd - FIRST_FD;
+	char *b = NULL;
+
+	(void)session;
+	(void)cmd_id;
+	(void)tee_err;
+	(void)ta_err;
+
+	if (op == TEEC_IO_OPEN_SESSION &&
+	    __atomic_fetch_add(open, 1, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&shared_opens, 1, __ATOMIC_RELAXED);
+	else if (op == TEEC_IO_CLOSE_SESSION)
+		__atomic_fetch_sub(open, 1, __ATOMIC_RELAXED);
+
+	b = realloc(*buf, sizeof(fd));
+	if (!b)
+		return -ENOMEM;
+	memcpy(b, &fd, sizeof(fd));
+	*buf = b;
+	*len = sizeof(fd);
+
+	return 0;
+}
+
+static struct client *client_new(uid_t uid, int *peer)
+{
+	struct client *cl = calloc(1, sizeof(*cl));
+	int sv[2] = { -1, -1 };
+	size_t n = 0;
+
+	if (!cl || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		abort();
+
+	cl->sock = sv[0];
+	cl->pid = getpid();
+	cl->uid = uid;
+	cl->mbox = calloc(num_slots, slot_size);
+	if (!cl->mbox)
+		abort();
+	*peer = sv[1];
+
+	pthread_mutex_lock(&mutex);
+	for (n = 1; n < MAX_CLIENTS; n++) {
+		if (!clients[n]) {
+			clients[n] = cl;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return cl;
+}
+
+/*
+ * Passes request @op with the one byte frame @tag to the broker and
+ * returns its reply. @chan_fd is set to the channel that served it.
+ */
+static struct teec_broker_msg call(struct client *cl, int peer, uint32_t op,
+				   uint32_t session, char tag, int *chan_fd)
+{
+	struct teec_broker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = op;
+	msg.session = session;
+	msg.uuid[0] = ta;
+	msg.len = 1;
+	cl->mbox[0] = tag;
+	handle_request(cl, &msg, -1);
+
+	memset(&msg, 0, sizeof(msg));
+	if (recv(peer, &msg, sizeof(msg), 0) != sizeof(msg))
+		abort();
+
+	*chan_fd = -1;
+	if (!msg.ret && msg.len == sizeof(*chan_fd))
+		memcpy(chan_fd, cl->mbox, sizeof(*chan_fd));
+
+	return msg;
+}
+
+/* Waits for the closes the broker queued itself */
+static void wait_internal(void)
+{
+	unsigned int queued = 0;
+
+	do {
+		pthread_mutex_lock(&mutex);
+		queued = self.queued;
+		pthread_mutex_unlock(&mutex);
+		if (queued)
+			usleep(1000);
+	} while (queued);
+}
+
+static void test_routing(void)
+{
+	struct teec_broker_msg m;
+	struct client *a = NULL;
+	struct client *b = NULL;
+	struct client *c = NULL;
+	uint32_t sa = 0;
+	uint32_t sb = 0;
+	int pa = -1;
+	int pb = -1;
+	int pc = -1;
+	int fa = -1;
+	int fb = -1;
+	int fd = -1;
+
+	a = client_new(1000, &pa);
+	b = client_new(1001, &pb);
+	c = client_new(1002, &pc);
+	warm_max = 1;
+	warm_uuids[0][0] = 1;
+	num_warm_uuids = 1;
+	ta = 1;
+
+	/* One session per channel, an open with none free is refused */
+	m = call(a, pa, TEEC_BROKER_OPEN_SESSION, 0, 'a', &fa);
+	CHECK(!m.ret && !m.tee_err && m.session);
+	sa = m.session;
+	m = call(b, pb, TEEC_BROKER_OPEN_SESSION, 0, 'b', &fb);
+	CHECK(!m.ret && !m.tee_err && m.session);
+	sb = m.session;
+	CHECK(fa >= FIRST_FD && fb >= FIRST_FD && fa != fb);
+	m = call(a, pa, TEEC_BROKER_OPEN_SESSION, 0, 'c', &fd);
+	CHECK(!m.ret && m.tee_err == (int32_t)TEEC_ERROR_BUSY);
+
+	/* Invokes stay on the session's channel, sessions are per client */
+	m = call(a, pa, TEEC_BROKER_INVOKE, sa, 'i', &fd);
+	CHECK(!m.ret && fd == fa);
+	m = call(b, pb, TEEC_BROKER_INVOKE, sb, 'i', &fd);
+	CHECK(!m.ret && fd == fb);
+	m = call(a, pa, TEEC_BROKER_INVOKE, sb, 'i', &fd);
+	CHECK(m.ret == -EBADF);
+
+	/* A warm session keeps its channel until an open needs it */
+	m = call(a, pa, TEEC_BROKER_CLOSE_SESSION, sa, 0, &fd);
+	CHECK(!m.ret && warm_count == 1);
+	m = call(a, pa, TEEC_BROKER_OPEN_SESSION, 0, 'c', &fd);
+	CHECK(!m.ret && m.tee_err == (int32_t)TEEC_ERROR_BUSY);
+	wait_internal();
+	CHECK(!warm_count);
+	m = call(a, pa, TEEC_BROKER_OPEN_SESSION, 0, 'c', &fd);
+	CHECK(!m.ret && !m.tee_err && fd == fa);
+	sa = m.session;
+
+	/* and is only reused by its user */
+	m = call(b, pb, TEEC_BROKER_CLOSE_SESSION, sb, 0, &fd);
+	CHECK(!m.ret && warm_count == 1);
+	m = call(c, pc, TEEC_BROKER_OPEN_SESSION, 0, 'b', &fd);
+	CHECK(!m.ret && m.tee_err == (int32_t)TEEC_ERROR_BUSY);
+	wait_internal();
+	m = call(b, pb, TEEC_BROKER_OPEN_SESSION, 0, 'b', &fd);
+	CHECK(!m.ret && !m.tee_err && fd == fb);
+	sb = m.session;
+
+	/* nor for another TA */
+	m = call(b, pb, TEEC_BROKER_CLOSE_SESSION, sb, 0, &fd);
+	CHECK(!m.ret && warm_count == 1);
+	ta = 2;
+	m = call(b, pb, TEEC_BROKER_OPEN_SESSION, 0, 'b', &fd);
+	CHECK(!m.ret && m.tee_err == (int32_t)TEEC_ERROR_BUSY);
+	wait_internal();
+	m = call(b, pb, TEEC_BROKER_OPEN_SESSION, 0, 'b', &fd);
+	CHECK(!m.ret && !m.tee_err && fd == fb);
+	sb = m.session;
+
+	/* Sessions of TAs not listed aren't kept warm */
+	m = call(b, pb, TEEC_BROKER_CLOSE_SESSION, sb, 0, &fd);
+	CHECK(!m.ret && !warm_count && fd == fb);
+	m = call(b, pb, TEEC_BROKER_OPEN_SESSION, 0, 'b', &fd);
+	CHECK(!m.ret && !m.tee_err && fd == fb);
+	sb = m.session;
+	ta = 1;
+
+	/* Without warm sessions a close frees the channel */
+	warm_max = 0;
+	m = call(b, pb, TEEC_BROKER_CLOSE_SESSION, sb, 0, &fd);
+	CHECK(!m.ret && !warm_count && fd == fb);
+	m = call(c, pc, TEEC_BROKER_OPEN_SESSION, 0, 'b', &fd);
+	CHECK(!m.ret && !m.tee_err && fd == fb);
+
+	CHECK(!__atomic_load_n(&shared_opens, __ATOMIC_RELAXED));
+
+	close(pa);
+	close(pb);
+	close(pc);
+}
+
+static void test_listen(void)
+{
+	char dir[] = "/tmp/tee_broker_test.XXXXXX";
+	char path[sizeof(dir) + 8];
+	struct sockaddr_un sa;
+	struct stat st;
+	int sock = -1;
+	int sock2 = -1;
+	int fd = -1;
+
+	if (!mkdtemp(dir))
+		abort();
+	snprintf(path, sizeof(path), "%s/sock", dir);
+
+	/* Only a stale socket of ours is replaced */
+	fd = open(path, O_CREAT | O_WRONLY, 0600);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(listen_on(path) < 0);
+	CHECK(!lstat(path, &st) && S_ISREG(st.st_mode));
+	unlink(path);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	CHECK(!bind(sock, (struct sockaddr *)&sa, sizeof(sa)));
+	close(sock);
+
+	sock = listen_on(path);
+	CHECK(sock >= 0);
+	CHECK(!lstat(path, &st) && S_ISSOCK(st.st_mode) &&
+	      (st.st_mode & 0777) == 0660);
+
+	/* A socket that is still served is left alone */
+	sock2 = listen_on(path);
+	CHECK(sock2 < 0);
+	CHECK(!lstat(path, &st) && S_ISSOCK(st.st_mode));
+
+	close(sock);
+	unlink(path);
+	rmdir(dir);
+}
+
+int main(void)
+{
+	size_t n = 0;
+
+	num_channels = TEST_CHANNELS;
+	for (n = 0; n < num_channels; n++) {
+		channels[n].fd = FIRST_FD + n;
+		pthread_cond_init(&channels[n].cond, NULL);
+		if (pthread_create(&channels[n].tid, NULL, channel_main,
+				   channels + n))
+			abort();
+	}
+
+	test_routing();
+	test_listen();
+
+	pthread_mutex_lock(&mutex);
+	quit = true;
+	for (n = 0; n < num_channels; n++)
+		pthread_cond_signal(&channels[n].cond);
+	pthread_mutex_unlock(&mutex);
+	for (n = 0; n < num_channels; n++)
+		pthread_join(channels[n].tid, NULL);
+
+	if (failures) {
+		fprintf(stderr, "%u checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * The log backend is built into the test to seal and compact segments when
+ * the test says so, without its compaction thread. Each step runs in a
+ * child process which replays the log like the supplicant after a restart.
+ */
+#include "../tee-supplicant/src/tee_supp_fs_log.c"
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "tee_supp_fs_test.h"
+
+#define ROOT		TEE_FS_PARENT_PATH "/"
+#define SIZE		(3 * LOG_BLOCK_SIZE + 100)
+#define NUM_THREADS	8
+#define NUM_PUTS	16
+
+static TEEC_Result log_op(size_t num_params, struct tee_ioctl_param *params)
+{
+	return tee_supp_fs_log_backend.ops[params->a](num_params, params);
+}
+
+static void load(void)
+{
+	fs_test_op = log_op;
+	if (log_load(ROOT))
+		abort();
+}
+
+static struct log_seg *seg_by_id(uint32_t id)
+{
+	struct log_seg *seg = NULL;
+
+	TAILQ_FOREACH(seg, &log_segs, link)
+		if (seg->id == id)
+			return seg;
+
+	return NULL;
+}
+
+static void seal(void)
+{
+	tee_supp_mutex_lock(&log_mutex);
+	CHECK(log_new_segment());
+	tee_supp_mutex_unlock(&log_mutex);
+}
+
+static void compact(uint32_t id)
+{
+	struct log_seg *seg = seg_by_id(id);
+
+	CHECK(seg && seg != log_active);
+	if (!seg || seg == log_active)
+		return;
+
+	tee_supp_mutex_lock(&log_mutex);
+	CHECK(compact_seg(seg));
+	tee_supp_mutex_unlock(&log_mutex);
+}
+
+static bool has_segment(uint32_t id)
+{
+	char path[PATH_MAX] = { 0 };
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s%s/%08x.seg", ROOT, LOG_DIR, id);
+
+	return !stat(path, &st);
+}
+
+static bool matches(const char *name, uint8_t seed, size_t len)
+{
+	static uint8_t buf[SIZE];
+
+	fs_test_pattern(buf, seed, len);
+
+	return fs_test_equals(name, buf, len);
+}
+
+static void reset(void)
+{
+	fs_test_rm_tree(TEE_FS_PARENT_PATH);
+	if (mkdir(TEE_FS_PARENT_PATH, 0700))
+		abort();
+}
+
+static void replay_write(void)
+{
+	load();
+	CHECK(fs_test_put("a", 1, SIZE));
+	CHECK(fs_test_put("b", 2, 10));
+	CHECK(fs_test_put("b", 3, 20));
+}
+
+static void replay_check(void)
+{
+	load();
+	CHECK(matches("a", 1, SIZE));
+	CHECK(matches("b", 3, 20));
+	CHECK(log_num_objs == 2);
+}
+
+static void *put_main(void *arg)
+{
+	uintptr_t t = (uintptr_t)arg;
+	uint8_t buf[100 + NUM_PUTS];
+	char name[16] = { 0 };
+	size_t n = 0;
+	int fd = -1;
+
+	/* Not fs_test_put(), its buffer is shared */
+	for (n = 0; n < NUM_PUTS; n++) {
+		snprintf(name, sizeof(name), "p%u.%zu", (unsigned int)t, n);
+		fs_test_pattern(buf, t + n, 100 + n);
+		if (fs_test_create(name, &fd) ||
+		    fs_test_write(fd, 0, buf, 100 + n) || fs_test_close(fd))
+			__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* Requests flushing at the same time share flushes without the lock */
+static void concurrent_write(void)
+{
+	pthread_t tids[NUM_THREADS];
+	uintptr_t t = 0;
+
+	load();
+	for (t = 0; t < NUM_THREADS; t++)
+		if (pthread_create(tids + t, NULL, put_main, (void *)t))
+			abort();
+	for (t = 0; t < NUM_THREADS; t++)
+		pthread_join(tids[t], NULL);
+	CHECK(log_synced == log_gen && !log_flushing);
+}
+
+static void concurrent_check(void)
+{
+	char name[16] = { 0 };
+	unsigned int t = 0;
+	size_t n = 0;
+
+	load();
+	for (t = 0; t < NUM_THREADS; t++) {
+		for (n = 0; n < NUM_PUTS; n++) {
+			snprintf(name, sizeof(name), "p%u.%zu", t, n);
+			CHECK(matches(name, t + n, 100 + n));
+		}
+	}
+}
+
+/*
+ * Segment 0 holds all of "t", segment 1 cuts it to nothing and writes its
+ * second block anew. Compacted, segment 1 must still cut the first block in
+ * segment 0, which reads back as zeros.
+ */
+static void truncate_write(void)
+{
+	uint8_t buf[LOG_BLOCK_SIZE];
+	int fd = -1;
+
+	load();
+	CHECK(fs_test_put("t", 4, SIZE));
+	CHECK(fs_test_put("u", 5, 100));
+	seal();
+
+	CHECK(!fs_test_open("t", &fd));
+	CHECK(!fs_test_truncate(fd, 0));
+	fs_test_pattern(buf, 6, sizeof(buf));
+	CHECK(!fs_test_write(fd, LOG_BLOCK_SIZE, buf, sizeof(buf)));
+	CHECK(!fs_test_close(fd));
+	seal();
+
+	compact(1);
+	CHECK(!has_segment(1));
+}
+
+static void truncate_check(void)
+{
+	static uint8_t buf[2 * LOG_BLOCK_SIZE];
+
+	load();
+	fs_test_pattern(buf + LOG_BLOCK_SIZE, 6, LOG_BLOCK_SIZE);
+	CHECK(fs_test_equals("t", buf, sizeof(buf)));
+	CHECK(matches("u", 5, 100));
+}
+
+/* With segment 0 gone too, nothing of the old "t" is left to cut */
+static void truncate_compact_old(void)
+{
+	struct log_seg *seg = NULL;
+
+	load();
+	compact(0);
+	CHECK(!has_segment(0));
+	TAILQ_FOREACH(seg, &log_segs, link)
+		CHECK(!seg->num_tombs);
+	seal();
+	compact(2);
+	CHECK(!has_segment(2));
+}
+
+/*
+ * Segment 0 holds "d", segment 1 removes it. Compacted, the DELETE must
+ * move on while segment 0 is around, or replay revives "d".
+ */
+static void delete_write(void)
+{
+	load();
+	CHECK(fs_test_put("d", 7, SIZE));
+	CHECK(fs_test_put("k", 8, 200));
+	seal();
+
+	CHECK(!fs_test_remove("d"));
+	seal();
+
+	compact(1);
+	CHECK(!has_segment(1));
+}
+
+static void delete_check(void)
+{
+	int fd = -1;
+
+	load();
+	CHECK(fs_test_open("d", &fd) == TEEC_ERROR_ITEM_NOT_FOUND);
+	CHECK(matches("k", 8, 200));
+}
+
+/* Once segment 0 is gone the DELETE is dead weight */
+static void delete_compact_old(void)
+{
+	struct log_seg *seg = NULL;
+
+	load();
+	compact(0);
+	CHECK(!has_segment(0));
+	TAILQ_FOREACH(seg, &log_segs, link)
+		CHECK(!seg->num_tombs);
+}
+
+int main(void)
+{
+	reset();
+	CHECK(fs_test_run(replay_write));
+	CHECK(fs_test_run(replay_check));
+
+	reset();
+	CHECK(fs_test_run(concurrent_write));
+	CHECK(fs_test_run(concurrent_check));
+
+	reset();
+	CHECK(fs_test_run(truncate_write));
+	CHECK(fs_test_run(truncate_check));
+	CHECK(fs_test_run(truncate_compact_old));
+	CHECK(fs_test_run(truncate_check));
+
+	reset();
+	CHECK(fs_test_run(delete_write));
+	CHECK(fs_test_run(delete_check));
+	CHECK(fs_test_run(delete_compact_old));
+	CHECK(fs_test_run(delete_check));
+
+	fs_test_rm_tree(TEE_FS_PARENT_PATH);
+
+	if (failures) {
+		fprintf(stderr, "%u checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
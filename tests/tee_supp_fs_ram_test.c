@@ -0,0 +1,154 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Snapshots of the ram backend, taken with tee_supp_fs_snapshot() only.
+ * Each step runs in a child process which loads the image like the
+ * supplicant after a restart.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tee_supp_fs.h>
+#include <unistd.h>
+
+#include "tee_supp_fs_test.h"
+
+#define IMAGE		TEE_FS_PARENT_PATH "/ram.img"
+#define RAM_IMAGE_TMP	"ram.img.tmp"
+
+static void use_ram(void)
+{
+	if (!tee_supp_fs_set_backend("ram"))
+		abort();
+	tee_supp_fs_set_snapshot_interval(0);
+}
+
+static bool matches(const char *name, uint8_t seed, size_t len)
+{
+	static uint8_t buf[8192];
+
+	fs_test_pattern(buf, seed, len);
+
+	return fs_test_equals(name, buf, len);
+}
+
+static void save(void)
+{
+	use_ram();
+	CHECK(fs_test_put("a", 1, 5000));
+	CHECK(fs_test_put("b", 2, 0));
+	CHECK(fs_test_put("c", 3, 300));
+	tee_supp_fs_snapshot();
+
+	/* Lost on a crash, nothing saves them */
+	CHECK(fs_test_put("lost", 4, 10));
+}
+
+static void load(void)
+{
+	int fd = -1;
+
+	use_ram();
+	CHECK(matches("a", 1, 5000));
+	CHECK(matches("b", 2, 0));
+	CHECK(matches("c", 3, 300));
+	CHECK(fs_test_open("lost", &fd) == TEEC_ERROR_ITEM_NOT_FOUND);
+}
+
+static void change(void)
+{
+	use_ram();
+	CHECK(!fs_test_remove("c"));
+	CHECK(!fs_test_rename("a", "b", true));
+	tee_supp_fs_snapshot();
+	CHECK(!access(IMAGE, F_OK) && access(IMAGE ".tmp", F_OK));
+}
+
+static void load_changed(void)
+{
+	int fd = -1;
+
+	use_ram();
+	CHECK(matches("b", 1, 5000));
+	CHECK(fs_test_open("a", &fd) == TEEC_ERROR_ITEM_NOT_FOUND);
+	CHECK(fs_test_open("c", &fd) == TEEC_ERROR_ITEM_NOT_FOUND);
+}
+
+/* A crash writing the next image leaves the previous one */
+static void load_torn(void)
+{
+	int fd = open(IMAGE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	CHECK(fd >= 0 && write(fd, "torn", 4) == 4);
+	close(fd);
+	load_changed();
+}
+
+/* An image that doesn't check out isn't loaded */
+static void load_corrupt(void)
+{
+	int fd = -1;
+	char c = 0;
+
+	fd = open(IMAGE, O_RDWR);
+	CHECK(fd >= 0 && pread(fd, &c, 1, 20) == 1);
+	c ^= 1;
+	CHECK(pwrite(fd, &c, 1, 20) == 1);
+	close(fd);
+
+	use_ram();
+	CHECK(fs_test_open("b", &fd) == TEEC_ERROR_STORAGE_NOT_AVAILABLE);
+}
+
+/* Inits the backend with a root of @len bytes, "/r/r/.../", not there */
+static bool init_root(size_t len)
+{
+	static char root[PATH_MAX + 1];
+	size_t n = 0;
+
+	for (n = 0; n < len; n++)
+		root[n] = n % 2 ? 'r' : '/';
+	root[len - 1] = '/';
+	root[len] = '\0';
+
+	return !tee_supp_fs_ram_backend.init(root);
+}
+
+/* A root that leaves no room for the image paths is refused up front */
+static void long_root(void)
+{
+	size_t tmp_len = sizeof(RAM_IMAGE_TMP) - 1;
+
+	CHECK(init_root(PATH_MAX - 1 - tmp_len));
+	/* ram.img fits, ram.img.tmp doesn't */
+	CHECK(!init_root(PATH_MAX - tmp_len));
+	CHECK(!init_root(PATH_MAX - 1));
+	CHECK(!init_root(PATH_MAX));
+}
+
+int main(void)
+{
+	fs_test_rm_tree(TEE_FS_PARENT_PATH);
+
+	CHECK(fs_test_run(save));
+	CHECK(fs_test_run(load));
+	CHECK(fs_test_run(change));
+	CHECK(fs_test_run(load_changed));
+	CHECK(fs_test_run(load_torn));
+	CHECK(fs_test_run(load_corrupt));
+	CHECK(fs_test_run(long_root));
+
+	fs_test_rm_tree(TEE_FS_PARENT_PATH);
+
+	if (failures) {
+		fprintf(stderr, "%u checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * The file backend striped over two roots. Each step runs in a child
+ * process, starting up like the supplicant after a restart or a crash.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <tee_supp_fs.h>
+#include <unistd.h>
+
+#include "tee_supp_fs_test.h"
+
+#define ROOT0		TEE_FS_PARENT_PATH "/"
+#define ROOT1		TEE_FS_PARENT_PATH ".1/"
+#define NUM_FILES	32
+
+static const char *const roots[] = { ROOT0, ROOT1 };
+
+/* Files of stripe() placed in root 0 and in root 1 */
+static char in_root[2][16];
+static size_t in_root_idx[2];
+
+static void use_roots(void)
+{
+	if (!tee_supp_fs_add_root(ROOT1))
+		abort();
+}
+
+static void path_in(size_t root, const char *name, char *path, size_t size)
+{
+	snprintf(path, size, "%s%s", roots[root], name);
+}
+
+/* Returns a bit per root holding a file @name */
+static unsigned int roots_of(const char *name)
+{
+	char path[PATH_MAX] = { 0 };
+	unsigned int mask = 0;
+	size_t r = 0;
+
+	for (r = 0; r < 2; r++) {
+		path_in(r, name, path, sizeof(path));
+		if (!access(path, F_OK))
+			mask |= 1 << r;
+	}
+
+	return mask;
+}
+
+static bool matches(const char *name, uint8_t seed, size_t len)
+{
+	static uint8_t buf[8192];
+
+	fs_test_pattern(buf, seed, len);
+
+	return fs_test_equals(name, buf, len);
+}
+
+static bool gone(const char *name)
+{
+	int fd = -1;
+
+	return fs_test_open(name, &fd) == TEEC_ERROR_ITEM_NOT_FOUND &&
+	       !roots_of(name);
+}
+
+/* Files are spread over both roots, each in one */
+static void stripe(void)
+{
+	unsigned int seen = 0;
+	unsigned int mask = 0;
+	char name[16] = { 0 };
+	size_t n = 0;
+
+	use_roots();
+	for (n = 0; n < NUM_FILES; n++) {
+		snprintf(name, sizeof(name), "f%zu", n);
+		CHECK(fs_test_put(name, n, 100 + n));
+		mask = roots_of(name);
+		CHECK(mask == 1 || mask == 2);
+		seen |= mask;
+	}
+	CHECK(seen == 3);
+}
+
+static void stripe_check(void)
+{
+	char name[16] = { 0 };
+	size_t n = 0;
+
+	use_roots();
+	for (n = 0; n < NUM_FILES; n++) {
+		snprintf(name, sizeof(name), "f%zu", n);
+		CHECK(matches(name, n, 100 + n));
+	}
+}
+
+/* Returns true if no temporary copy or intent is left in the roots */
+static bool no_leftovers(void)
+{
+	struct dirent *de = NULL;
+	bool found = false;
+	DIR *d = NULL;
+	size_t r = 0;
+
+	for (r = 0; r < 2; r++) {
+		d = opendir(roots[r]);
+		if (!d)
+			return false;
+		while ((de = readdir(d)))
+			if (de->d_name[0] == '.' && strcmp(de->d_name, ".") &&
+			    strcmp(de->d_name, ".."))
+				found = true;
+		closedir(d);
+	}
+
+	return !found;
+}
+
+/* A rename to a name placed in the other root leaves one copy */
+static void rename_across(void)
+{
+	size_t n = in_root_idx[0];
+
+	use_roots();
+	CHECK(!fs_test_rename(in_root[0], in_root[1], true));
+	CHECK(gone(in_root[0]));
+	CHECK(roots_of(in_root[1]) == 2);
+	CHECK(matches(in_root[1], n, 100 + n));
+	CHECK(no_leftovers());
+}
+
+/* Writes an intent of a move of @src to @dst like fs_move() does */
+static void intent(size_t src_root, const char *src, size_t dst_root,
+		   const char *dst)
+{
+	char buf[2 * PATH_MAX] = { 0 };
+	size_t len = 0;
+	int fd = -1;
+
+	len = snprintf(buf, sizeof(buf), "%s.%s.tmp", roots[dst_root],
+		       dst) + 1;
+	path_in(src_root, src, buf + len, sizeof(buf) - len);
+	len += strlen(buf + len) + 1;
+
+	fd = open(ROOT0 ".move.test", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	CHECK(fd >= 0 && write(fd, buf, len) == (ssize_t)len);
+	close(fd);
+}
+
+static void copy(size_t src_root, const char *src, size_t dst_root,
+		 const char *dst)
+{
+	char from[PATH_MAX] = { 0 };
+	char to[PATH_MAX] = { 0 };
+	char buf[8192];
+	ssize_t r = 0;
+	int in = -1;
+	int out = -1;
+
+	path_in(src_root, src, from, sizeof(from));
+	path_in(dst_root, dst, to, sizeof(to));
+	in = open(from, O_RDONLY);
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	CHECK(in >= 0 && out >= 0);
+	r = read(in, buf, sizeof(buf));
+	CHECK(r > 0 && write(out, buf, r) == r);
+	close(in);
+	close(out);
+}
+
+/* Crashed after the copy was renamed into place, the source goes */
+static void crash_renamed(void)
+{
+	use_roots();
+	CHECK(fs_test_put(in_root[0], 2, 3000));
+	CHECK(!fs_test_remove(in_root[1]));
+	copy(0, in_root[0], 1, in_root[1]);
+	intent(0, in_root[0], 1, in_root[1]);
+}
+
+static void crash_renamed_check(void)
+{
+	use_roots();
+	CHECK(matches(in_root[1], 2, 3000));
+	CHECK(gone(in_root[0]));
+	CHECK(no_leftovers());
+}
+
+/* Crashed before the copy was renamed, the copy goes */
+static void crash_copied(void)
+{
+	char tmp[32] = { 0 };
+
+	use_roots();
+	CHECK(matches(in_root[1], 2, 3000));
+	snprintf(tmp, sizeof(tmp), ".%s.tmp", in_root[0]);
+	copy(1, in_root[1], 0, tmp);
+	intent(1, in_root[1], 0, in_root[0]);
+}
+
+static void crash_copied_check(void)
+{
+	char tmp[PATH_MAX] = { 0 };
+
+	use_roots();
+	CHECK(matches(in_root[1], 2, 3000));
+	CHECK(gone(in_root[0]));
+	snprintf(tmp, sizeof(tmp), "%s.%s.tmp", ROOT0, in_root[0]);
+	CHECK(access(tmp, F_OK));
+	CHECK(no_leftovers());
+}
+
+/* A copy left in a root it isn't placed in is removed with the file */
+static void remove_stray(void)
+{
+	use_roots();
+	CHECK(fs_test_put(in_root[0], 3, 10));
+	copy(0, in_root[0], 1, in_root[0]);
+	CHECK(roots_of(in_root[0]) == 3);
+	CHECK(matches(in_root[0], 3, 10));
+	CHECK(!fs_test_remove(in_root[0]));
+	CHECK(gone(in_root[0]));
+}
+
+int main(void)
+{
+	char name[16] = { 0 };
+	unsigned int mask = 0;
+	size_t n = 0;
+
+	fs_test_rm_tree(ROOT0);
+	fs_test_rm_tree(ROOT1);
+
+	/* The steps after use a file of stripe() from each root */
+	CHECK(fs_test_run(stripe));
+	for (n = 0; n < NUM_FILES; n++) {
+		snprintf(name, sizeof(name), "f%zu", n);
+		mask = roots_of(name);
+		if (mask == 1 || mask == 2)
+			in_root_idx[mask - 1] = n;
+	}
+	for (n = 0; n < 2; n++) {
+		snprintf(in_root[n], sizeof(in_root[n]), "f%zu",
+			 in_root_idx[n]);
+		if (roots_of(in_root[n]) != 1U << n) {
+			fprintf(stderr, "no file placed in root %zu\n", n);
+			return EXIT_FAILURE;
+		}
+	}
+	CHECK(fs_test_run(stripe_check));
+
+	CHECK(fs_test_run(rename_across));
+	CHECK(fs_test_run(crash_renamed));
+	CHECK(fs_test_run(crash_renamed_check));
+	CHECK(fs_test_run(crash_copied));
+	CHECK(fs_test_run(crash_copied_check));
+	CHECK(fs_test_run(remove_stray));
+
+	fs_test_rm_tree(ROOT0);
+	fs_test_rm_tree(ROOT1);
+
+	if (failures) {
+		fprintf(stderr, "%u checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
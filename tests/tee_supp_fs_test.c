@@ -0,0 +1,311 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <dirent.h>
+#include <ftw.h>
+#include <optee_msg_supplicant.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <teec_trace.h>
+#include <tee_supp_fs.h>
+#include <tee_supplicant.h>
+#include <unistd.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+#include "tee_supp_fs_test.h"
+
+#define FS_TEST_MAX	(64 * 1024)
+
+unsigned int failures;
+
+TEEC_Result (*fs_test_op)(size_t num_params, struct tee_ioctl_param *params);
+
+void _dprintf(const char *function, int line, int level, const char *prefix,
+	      const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)function;
+	(void)line;
+	(void)prefix;
+
+	if (level > TRACE_ERROR)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void teec_frec_log(uint16_t event, uint64_t a0, uint64_t a1, uint64_t a2)
+{
+	(void)event;
+	(void)a0;
+	(void)a1;
+	(void)a2;
+}
+
+void tee_supp_mutex_lock(pthread_mutex_t *mu)
+{
+	if (pthread_mutex_lock(mu))
+		abort();
+}
+
+void tee_supp_mutex_unlock(pthread_mutex_t *mu)
+{
+	if (pthread_mutex_unlock(mu))
+		abort();
+}
+
+bool tee_supp_param_is_value(struct tee_ioctl_param *param)
+{
+	switch (param->attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) {
+	case TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT:
+	case TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT:
+	case TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INOUT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* The shared memory "id" of a memref is the address of the test buffer */
+void *tee_supp_param_to_va(struct tee_ioctl_param *param)
+{
+	if (tee_supp_param_is_value(param) || !MEMREF_SHM_ID(param))
+		return NULL;
+
+	return (uint8_t *)(uintptr_t)MEMREF_SHM_ID(param) +
+	       MEMREF_SHM_OFFS(param);
+}
+
+static void set_value(struct tee_ioctl_param *param, uint64_t type,
+		      uint64_t a, uint64_t b, uint64_t c)
+{
+	param->attr = type;
+	param->a = a;
+	param->b = b;
+	param->c = c;
+}
+
+static void set_memref(struct tee_ioctl_param *param, uint64_t type,
+		       const void *buf, size_t len)
+{
+	param->attr = type;
+	MEMREF_SHM_OFFS(param) = 0;
+	MEMREF_SIZE(param) = len;
+	MEMREF_SHM_ID(param) = (uintptr_t)buf;
+}
+
+static TEEC_Result process(size_t num_params, struct tee_ioctl_param *params)
+{
+	if (fs_test_op)
+		return fs_test_op(num_params, params);
+
+	return tee_supp_fs_process(num_params, params);
+}
+
+static TEEC_Result name_op(uint32_t op, const char *name, int *fd)
+{
+	struct tee_ioctl_param params[3];
+	TEEC_Result res = TEEC_SUCCESS;
+
+	memset(params, 0, sizeof(params));
+	set_value(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, op, 0, 0);
+	set_memref(params + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, name,
+		   strlen(name) + 1);
+	set_value(params + 2, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT, 0, 0, 0);
+
+	res = process(3, params);
+	*fd = params[2].a;
+
+	return res;
+}
+
+TEEC_Result fs_test_open(const char *name, int *fd)
+{
+	return name_op(OPTEE_MRF_OPEN, name, fd);
+}
+
+TEEC_Result fs_test_create(const char *name, int *fd)
+{
+	return name_op(OPTEE_MRF_CREATE, name, fd);
+}
+
+TEEC_Result fs_test_close(int fd)
+{
+	struct tee_ioctl_param params[1];
+
+	memset(params, 0, sizeof(params));
+	set_value(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		  OPTEE_MRF_CLOSE, fd, 0);
+
+	return process(1, params);
+}
+
+TEEC_Result fs_test_read(int fd, size_t offs, void *buf, size_t *len)
+{
+	struct tee_ioctl_param params[2];
+	TEEC_Result res = TEEC_SUCCESS;
+
+	memset(params, 0, sizeof(params));
+	set_value(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		  OPTEE_MRF_READ, fd, offs);
+	set_memref(params + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT, buf,
+		   *len);
+
+	res = process(2, params);
+	*len = MEMREF_SIZE(params + 1);
+
+	return res;
+}
+
+TEEC_Result fs_test_write(int fd, size_t offs, const void *buf, size_t len)
+{
+	struct tee_ioctl_param params[2];
+
+	memset(params, 0, sizeof(params));
+	set_value(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		  OPTEE_MRF_WRITE, fd, offs);
+	set_memref(params + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, buf,
+		   len);
+
+	return process(2, params);
+}
+
+TEEC_Result fs_test_truncate(int fd, size_t len)
+{
+	struct tee_ioctl_param params[1];
+
+	memset(params, 0, sizeof(params));
+	set_value(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		  OPTEE_MRF_TRUNCATE, fd, len);
+
+	return process(1, params);
+}
+
+TEEC_Result fs_test_remove(const char *name)
+{
+	struct tee_ioctl_param params[2];
+
+	memset(params, 0, sizeof(params));
+	set_value(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		  OPTEE_MRF_REMOVE, 0, 0);
+	set_memref(params + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, name,
+		   strlen(name) + 1);
+
+	return process(2, params);
+}
+
+TEEC_Result fs_test_rename(const char *old, const char *new, bool overwrite)
+{
+	struct tee_ioctl_param params[3];
+
+	memset(params, 0, sizeof(params));
+	set_value(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+		  OPTEE_MRF_RENAME, overwrite, 0);
+	set_memref(params + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, old,
+		   strlen(old) + 1);
+	set_memref(params + 2, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, new,
+		   strlen(new) + 1);
+
+	return process(3, params);
+}
+
+void fs_test_pattern(void *buf, uint8_t seed, size_t len)
+{
+	uint8_t *b = buf;
+	size_t n = 0;
+
+	for (n = 0; n < len; n++)
+		b[n] = seed + n * 7 + n / 251;
+}
+
+bool fs_test_put(const char *name, uint8_t seed, size_t len)
+{
+	static uint8_t buf[FS_TEST_MAX];
+	bool ok = false;
+	int fd = -1;
+
+	if (len > sizeof(buf) || fs_test_create(name, &fd))
+		return false;
+	fs_test_pattern(buf, seed, len);
+	ok = !fs_test_write(fd, 0, buf, len);
+
+	return !fs_test_close(fd) && ok;
+}
+
+bool fs_test_equals(const char *name, const void *buf, size_t len)
+{
+	static uint8_t b[FS_TEST_MAX + 1];
+	size_t n = sizeof(b);
+	bool ok = false;
+	int fd = -1;
+
+	if (fs_test_open(name, &fd))
+		return false;
+	ok = !fs_test_read(fd, 0, b, &n) && n == len && !memcmp(b, buf, len);
+
+	return !fs_test_close(fd) && ok;
+}
+
+bool fs_test_run(void (*fn)(void))
+{
+	int status = 0;
+	pid_t pid = 0;
+
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0)
+		abort();
+	if (!pid) {
+		failures = 0;
+		fn();
+		_exit(failures ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) != pid)
+		abort();
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+
+	return remove(path);
+}
+
+void fs_test_rm_tree(const char *path)
+{
+	nftw(path, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int fs_test_count(const char *path)
+{
+	struct dirent *de = NULL;
+	DIR *d = opendir(path);
+	int n = 0;
+
+	if (!d)
+		return -1;
+	while ((de = readdir(d)))
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			n++;
+	closedir(d);
+
+	return n;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2022, Unikie
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef TEE_SUPP_FS_TEST_H
+#define TEE_SUPP_FS_TEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <tee_client_api.h>
+
+struct tee_ioctl_param;
+
+/*
+ * Helpers of the secure storage tests, which are built with the sources of
+ * tee-supplicant and the stubs in tee_supp_fs_test.c of what they use from
+ * the rest of it. Memrefs passed to the backends point to test memory.
+ */
+extern unsigned int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, \
+				#cond); \
+			failures++; \
+		} \
+	} while (0)
+
+/* Serves the requests below, tee_supp_fs_process() unless set */
+extern TEEC_Result (*fs_test_op)(size_t num_params,
+				 struct tee_ioctl_param *params);
+
+TEEC_Result fs_test_open(const char *name, int *fd);
+TEEC_Result fs_test_create(const char *name, int *fd);
+TEEC_Result fs_test_close(int fd);
+TEEC_Result fs_test_read(int fd, size_t offs, void *buf, size_t *len);
+TEEC_Result fs_test_write(int fd, size_t offs, const void *buf, size_t len);
+TEEC_Result fs_test_truncate(int fd, size_t len);
+TEEC_Result fs_test_remove(const char *name);
+TEEC_Result fs_test_rename(const char *old, const char *new, bool overwrite);
+
+/* Returns true if object @name holds exactly @len bytes of @buf */
+bool fs_test_equals(const char *name, const void *buf, size_t len);
+
+/* Writes @len bytes of pattern @seed to object @name, creating it */
+bool fs_test_put(const char *name, uint8_t seed, size_t len);
+
+/* Fills @buf with the pattern fs_test_put() writes */
+void fs_test_pattern(void *buf, uint8_t seed, size_t len);
+
+/*
+ * Runs @fn in a child process, so that each run starts from the state on
+ * disk like the supplicant does after a restart. Returns false if a check
+ * failed in it.
+ */
+bool fs_test_run(void (*fn)(void));
+
+/* Removes the tree at @path, if any */
+void fs_test_rm_tree(const char *path);
+
+/* Returns the number of entries of directory @path, -1 on error */
+int fs_test_count(const char *path);
+
+#endif /*TEE_SUPP_FS_TEST_H*/